@@ -18,10 +18,14 @@
 //
 // WARNING: PacketCompression works using a cache mechanism to avoid to send 
 // dictionary information and reducing the bandwidth needed. This mechanism works 
-// only in a peer-to-peer transmition. If you plan to use multicast packets or 
-// to have a single server with multiple client, the cache mechanism doesn't work
-// correctly because PacketCompression isn't able to determine the packet source.  
-// In this case you should disable caching calling PacketCompression(false)
+// only in a peer-to-peer transmition. Observer passes the proxy and the remote
+// handle of every message, so each peer gets its own cache and a server with
+// multiple clients works too. Above PACKET_MAX_PEERS caches, the least recently
+// used one idle for PACKET_PEER_LEASE secs is dropped. A sender forgets its own
+// dictionaries after half the lease, so even a one-way stream never references
+// a cache dropped by its receiver.
+// If you plan to use multicast packets or to call inflate/deflate without a peer
+// from many sources, you should disable caching calling PacketCompression(false)
 // WARNING: compression is a cpu-consuming process. Use only if you have a low 
 // bandwidth connectivity with your peer.
 //
@@ -30,21 +34,26 @@
 #include "Trace.h"
 #include "Logger.h"
 #include "Compression.h"
-#include "MergeSort.h"
 #include "Timer.h"
+#include "GeneralHashFunctions.h"
 #include <cmath>
+#include <cstring>
+#include <algorithm>
 #define SYMBOLS 256
+#define MAX_DICTIONARY 128	// Symbols of the biggest schema
 
-PacketCompression::PacketCompression(bool theUseCacheMechanism)
+PacketCompression::PacketCompression(bool theUseCacheMechanism,unsigned theMaxPeers,unsigned long theLease)
 {
 	TRACE("PacketCompression::PacketCompression - start")
 	itsUseCacheMechanism=theUseCacheMechanism;
-	stream_length=0;
-	shift_count=0;
-	accumulator=0;
-	bit_count=0;
+	itsMaxPeers=(theMaxPeers > 0) ? theMaxPeers : 1;
+	itsLease=theLease;
 	percent=0;
-	itsSendPeerReset=true;
+	itsContext=&itsSharedContext;
+	itsContext->itsSendPeerReset=false; // Receivers never use its dictionaries as a cache
+	reset();
+	itsContext=&itsDefaultContext;
+	itsContext->itsSendPeerReset=true;
 	reset();
 	TRACE("PacketCompression::PacketCompression - end")	
 }
@@ -52,123 +61,200 @@ PacketCompression::PacketCompression(bool theUseCacheMechanism)
 PacketCompression::~PacketCompression()
 {
 	TRACE("PacketCompression::~PacketCompression - start")	
-
+	for(map<PeerKey,Context*>::iterator i=itsPeers.begin(); i!=itsPeers.end(); ++i)
+		delete i->second;
 	TRACE("PacketCompression::~PacketCompression - end")	
 }
 
+PacketCompression::Context* PacketCompression::getContext(unsigned theProxy,unsigned theRemote)
+{
+	TRACE("PacketCompression::getContext - start")	
+	// A local peer is addressed by its own handle as proxy: the same on both directions
+	PeerKey aKey(theProxy,(theRemote==theProxy) ? 0 : theRemote);
+	map<PeerKey,Context*>::iterator i=itsPeers.find(aKey);
+	Context* aContext;
+
+	if(i!=itsPeers.end())
+	{
+		aContext=i->second;
+		itsLRU.splice(itsLRU.begin(),itsLRU,aContext->itsLRUPosition);
+	}
+	else
+	{
+		// A peer may still reference the dictionaries of a context in use:
+		// only the expired ones are evicted, above that the bound is exceeded
+		unsigned long aNow=Timer::time();
+		aContext=NULL;
+		while(itsPeers.size() >= itsMaxPeers && aNow - itsPeers[itsLRU.back()]->itsLastUse > itsLease)
+		{
+			TRACE("Evict least recently used peer")
+			map<PeerKey,Context*>::iterator anOld=itsPeers.find(itsLRU.back());
+			if(aContext==NULL)
+				aContext=anOld->second;
+			else
+				delete anOld->second;
+			itsPeers.erase(anOld);
+			itsLRU.pop_back();
+		}
+
+		if(aContext==NULL)
+			aContext=new Context;
+
+		itsContext=aContext;
+		itsContext->itsSendPeerReset=true; // The peer may still cache dictionaries of an evicted context
+		reset();
+		itsLRU.push_front(aKey);
+		aContext->itsLRUPosition=itsLRU.begin();
+		aContext->itsLastUse=aNow;
+		itsPeers[aKey]=aContext;
+	}
+
+	TRACE("PacketCompression::getContext - end")	
+	return aContext;
+}
+
+string PacketCompression::deflate(string& theBuffer)
+{
+	return deflate(theBuffer,&itsDefaultContext);
+}
+
+string PacketCompression::inflate(string& theBuffer)
+{
+	return inflate(theBuffer,&itsDefaultContext);
+}
+
+string PacketCompression::deflate(string& theBuffer,unsigned theProxy,unsigned theRemote)
+{
+	Context* aContext=getContext(theProxy,theRemote);
+	unsigned long aNow=Timer::time();
+	if(aNow - aContext->itsLastUse > itsLease/2)
+	{
+		TRACE("Forget dictionaries the peer may have dropped")
+		aContext->itsDeflateCacheIndex=0;
+		for(unsigned cnt=0; cnt < 8; cnt++)
+			aContext->itsDeflateCacheSchema[cnt]=0; // Never matches a compressed buffer
+	}
+	aContext->itsLastUse=aNow;
+	return deflate(theBuffer,aContext);
+}
+
+string PacketCompression::inflate(string& theBuffer,unsigned theProxy,unsigned theRemote)
+{
+	Context* aContext=getContext(theProxy,theRemote);
+	aContext->itsLastUse=Timer::time();
+	return inflate(theBuffer,aContext);
+}
+
+string PacketCompression::deflateShared(string& theBuffer)
+{
+	return deflate(theBuffer,&itsSharedContext);
+}
+
+string PacketCompression::inflateShared(string& theBuffer)
+{
+	return inflate(theBuffer,&itsSharedContext);
+}
+
 void PacketCompression::reset()
 {
 	TRACE("PacketCompression::reset - start")	
 
-	itsDeflateCacheIndex=0;
+	itsContext->itsDeflateCacheIndex=0;
 
 	for(unsigned cnt=0; cnt < 8; cnt++)
 	{
-		itsDeflateCacheSchema[cnt]=0;
-		itsInflateCacheSchema[cnt]=0;
-		itsDeflateCacheCheckBit[cnt]=0;
-		itsInflateCacheCheckBit[cnt]=0;
+		itsContext->itsDeflateCacheSchema[cnt]=0;
+		itsContext->itsInflateCacheSchema[cnt]=0;
+		itsContext->itsDeflateCacheCheckBit[cnt]=0;
+		itsContext->itsInflateCacheCheckBit[cnt]=0;
 	}	
 
 	for(unsigned cnt=0; cnt < 8; cnt++)
 		for(unsigned cnt1=0; cnt1 < 128; cnt1++)
 		{
-			itsDeflateCacheDictionary[cnt][cnt1]=0;
-			itsInflateCacheDictionary[cnt][cnt1]=0;
+			itsContext->itsDeflateCacheDictionary[cnt][cnt1]=0;
+			itsContext->itsInflateCacheDictionary[cnt][cnt1]=0;
 		}	
 
 	TRACE("PacketCompression::reset - end")	
 }
 
-void PacketCompression::evaluateDictionary(vector< pair<int,unsigned char> >& occurrence,unsigned* evaluator)
+// Four tables: consecutive equal bytes don't wait for the previous increment
+void PacketCompression::countSymbols(string& theBuffer,unsigned* theCount)
 {
-	TRACE("PacketCompression::evaluateDictionary - start")	
-
-	evaluator[0]=(1+0)*8;
-	evaluator[1]=(1+2)*8;
-	evaluator[2]=(1+4)*8;
-	evaluator[3]=(1+8)*8;
-	evaluator[4]=(1+16)*8;
-	evaluator[5]=(1+32)*8;
-	evaluator[6]=(1+64)*8;
-	evaluator[7]=(1+128)*8;
-
-	for(unsigned cnt=0;cnt < SYMBOLS; cnt++)
-	{
-		evaluator[0]+=occurrence[cnt].first * 8;	
-
-		if(cnt < 2)
-			evaluator[1]+=occurrence[cnt].first * 2;
-		else			
-			evaluator[1]+=occurrence[cnt].first * 9;
-
-		if(cnt < 4)
-			evaluator[2]+=occurrence[cnt].first * 3;
-		else			
-			evaluator[2]+=occurrence[cnt].first * 9;
-
-		if(cnt < 8)
-			evaluator[3]+=occurrence[cnt].first * 4;
-		else			
-			evaluator[3]+=occurrence[cnt].first * 9;
-
-		if(cnt < 16)
-			evaluator[4]+=occurrence[cnt].first * 5;
-		else			
-			evaluator[4]+=occurrence[cnt].first * 9;
-		
-		if(cnt < 32)
-			evaluator[5]+=occurrence[cnt].first * 6;
-		else			
-			evaluator[5]+=occurrence[cnt].first * 9;
-		
-		if(cnt < 64)
-			evaluator[6]+=occurrence[cnt].first * 7;
-		else			
-			evaluator[6]+=occurrence[cnt].first * 9;
-
-		if(cnt < 128)
-			evaluator[7]+=occurrence[cnt].first * 8;
-		else			
-			evaluator[7]+=occurrence[cnt].first * 9;
+	TRACE("PacketCompression::countSymbols - start")	
+	unsigned aCount[4][SYMBOLS];
+	memset(aCount,0,sizeof(aCount));
+
+	const unsigned char* aPtr=(const unsigned char*)theBuffer.data();
+	unsigned aLen=theBuffer.size();
+	unsigned cnt=0;
+	for(; cnt + 4 <= aLen; cnt+=4)
+	{
+		aCount[0][aPtr[cnt]]++;
+		aCount[1][aPtr[cnt+1]]++;
+		aCount[2][aPtr[cnt+2]]++;
+		aCount[3][aPtr[cnt+3]]++;
 	}
+	for(; cnt < aLen; cnt++)
+		aCount[0][aPtr[cnt]]++;
 
-	TRACE("PacketCompression::evaluateDictionary - end")	
+	for(unsigned sym=0; sym < SYMBOLS; sym++)
+		theCount[sym]=aCount[0][sym] + aCount[1][sym] + aCount[2][sym] + aCount[3][sym];
+	TRACE("PacketCompression::countSymbols - end")	
 }
 
-void PacketCompression::putBits(string& stream,unsigned int nb_bits,unsigned int data) 
+class SymbolOrder
 {
-	TRACE("PacketCompression::putBits - start")	
+protected:
+	unsigned* itsCount;
 
-	if (nb_bits==0)
-		return;
-
-	/* merge the input data and the accumulator */
-	accumulator |= (data << shift_count);
-	shift_count += nb_bits;
-	bit_count += nb_bits;
-
-	/* sends the bit accumulator, byte per byte */
-	while (shift_count >= 8) 
+public:
+	SymbolOrder(unsigned* theCount) : itsCount(theCount) {};
+	bool operator()(unsigned char x,unsigned char y) const
 	{
-		stream += (unsigned char)(accumulator & 0xff);
-		TRACE("Buffer size=" << stream.size())
-		accumulator >>= 8;
-		shift_count -= 8;
-	}
+		return itsCount[x] > itsCount[y] || (itsCount[x]==itsCount[y] && x < y);
+	};
+};
 
-	/* remove some eventual garbage */
-	accumulator &= (1U << shift_count) - 1;
-
-	TRACE("PacketCompression::putBits - end")	
+// The MAX_DICTIONARY most frequent symbols, by decreasing occurrences and then
+// by value. Only the symbols found in the buffer are sorted.
+void PacketCompression::rankSymbols(unsigned* theCount,unsigned char* theRanking)
+{
+	TRACE("PacketCompression::rankSymbols - start")	
+	unsigned char aFound[SYMBOLS];
+	unsigned aFoundLen=0;
+	for(unsigned sym=0; sym < SYMBOLS; sym++)
+		if(theCount[sym] > 0)
+			aFound[aFoundLen++]=sym;
+
+	unsigned aRanked=(aFoundLen < MAX_DICTIONARY) ? aFoundLen : MAX_DICTIONARY;
+	partial_sort(aFound,aFound+aRanked,aFound+aFoundLen,SymbolOrder(theCount));
+	memcpy(theRanking,aFound,aRanked);
+
+	for(unsigned sym=0; aRanked < MAX_DICTIONARY; sym++)
+		if(theCount[sym]==0)
+			theRanking[aRanked++]=sym;
+	TRACE("PacketCompression::rankSymbols - end")	
 }
 
-void PacketCompression::flush(string& stream)
+// Bits of the buffer for each schema: the dictionary, then 1+schema bits for
+// each symbol of the dictionary and 1+8 bits for the others
+void PacketCompression::evaluateDictionary(unsigned* theCount,unsigned char* theRanking,unsigned theLen,unsigned* evaluator)
 {
-	TRACE("PacketCompression::flush - start")	
-	if(shift_count > 0)
-		stream += (char)(accumulator & 0xff);
-	TRACE("PacketCompression::flush - end")	
+	TRACE("PacketCompression::evaluateDictionary - start")	
+	evaluator[0]=(1+0)*8 + theLen*8;
+
+	unsigned aTop=0;
+	unsigned aRank=0;
+	for(unsigned schema=1; schema < 8; schema++)
+	{
+		unsigned dictlen=1 << schema;
+		for(; aRank < dictlen; aRank++)
+			aTop+=theCount[theRanking[aRank]];
+		evaluator[schema]=(1+dictlen)*8 + aTop*(1+schema) + (theLen-aTop)*9;
+	}
+	TRACE("PacketCompression::evaluateDictionary - end")	
 }
 
 unsigned char PacketCompression::computeCheckBit(unsigned char theSchema,unsigned char* theArray)
@@ -194,34 +280,26 @@ unsigned char PacketCompression::computeCheckBit(unsigned char theSchema,unsigne
 	return ret;	
 }
 
-string PacketCompression::deflate(string& theBuffer)
+string PacketCompression::deflate(string& theBuffer,Context* theContext)
 {
 	TRACE("PacketCompression::deflate - start")	
+	itsContext=theContext;
 	DUMP("Original buffer",(char*)theBuffer.data(), theBuffer.size());
 	//TIME_POINT
 	
 	string ret;
 
-	vector< pair<int,unsigned char> > occurrence;
-	occurrence.resize(SYMBOLS);
-
-	TRACE("Init buffer")	
-	for(unsigned cnt=0;cnt < SYMBOLS; cnt++)
-	{
-		occurrence[cnt].first=0;	
-		occurrence[cnt].second=cnt;	
-	}
-
 	TRACE("Compute symbols occurrences")	
-	for(unsigned cnt=0;cnt < theBuffer.size(); cnt++)
-		occurrence[(unsigned char)theBuffer[cnt]].first++;	
+	unsigned occurrence[SYMBOLS];
+	countSymbols(theBuffer,occurrence);
 
-	TRACE("Quick sort symbols occurrences")	
-	MergeSort< vector< pair<int,unsigned char> > >(occurrence.begin(), occurrence.end() -1);
+	TRACE("Rank symbols occurrences")	
+	unsigned char ranking[MAX_DICTIONARY];
+	rankSymbols(occurrence,ranking);
 
 	TRACE("Evaluate dictionary dimension in bits")	
 	unsigned evaluator[8];
-	evaluateDictionary(occurrence,evaluator);
+	evaluateDictionary(occurrence,ranking,theBuffer.size(),evaluator);
 
 	TRACE("Find best dictionary dimension")	
 	unsigned char schema=0;
@@ -254,11 +332,8 @@ string PacketCompression::deflate(string& theBuffer)
 	{
 		TRACE("Start compression")	
 
-		struct _SymbolTranslation
-		{
-			bool compressed;
-			char symbol;
-		} translation[SYMBOLS];
+		unsigned short code[SYMBOLS];		// Flag bit followed by the symbol
+		unsigned char codelen[SYMBOLS];
 
 		unsigned dictlen=(unsigned)pow(2.0,(int)schema);
 		TRACE("Dictionary length=" << dictlen)
@@ -269,20 +344,20 @@ string PacketCompression::deflate(string& theBuffer)
 		bool cacheTest=false;
 		unsigned char cacheIndex=0;
 
-		if(itsUseCacheMechanism)
+		if(itsUseCacheMechanism && itsContext!=&itsSharedContext)
 		{
 			TRACE("Test current cache")
 			cacheTest=true;
 
 			for(unsigned cnt=0; cnt < 8; cnt++)
 			{			
-				if(schema==itsDeflateCacheSchema[cnt])
+				if(schema==itsContext->itsDeflateCacheSchema[cnt])
 				{
 					cacheTest=true;
 	
 					for(unsigned cnt1=0; cnt1 < dictlen; cnt1++)
 					{
-						if(occurrence[cnt1].second!=itsDeflateCacheDictionary[cnt][cnt1])
+						if(ranking[cnt1]!=itsContext->itsDeflateCacheDictionary[cnt][cnt1])
 						{
 							cacheTest=false;
 							break;
@@ -304,23 +379,19 @@ string PacketCompression::deflate(string& theBuffer)
 		TRACE("Reset translation array")
 		for(unsigned cnt=0; cnt < SYMBOLS; cnt++)
 		{
-			translation[cnt].compressed=false;
-			translation[cnt].symbol=0;
+			code[cnt]=cnt << 1;
+			codelen[cnt]=1+8;
 		}		
 
 		TRACE("Fill translation array with dictionary infos")
 		for(unsigned cnt=0; cnt < dictlen; cnt++)
 		{
-			unsigned char sym=occurrence[cnt].second;
-			translation[sym].compressed=true;
-			translation[sym].symbol=cnt;
+			unsigned char sym=ranking[cnt];
+			code[sym]=1 | (cnt << 1);
+			codelen[sym]=1+schema;
 		}		
 
 		TRACE("Set compression schema")
-		stream_length=0;
-		shift_count=0;
-		accumulator=0;
-		bit_count=(1+dictlen)*8;
 		
 		// !  7  !  6  !  5  !  4  !  3  !  2  !  1  !  0  !
 		// +-----+-----+-----+-----+-----+-----+-----+-----+
@@ -329,48 +400,40 @@ string PacketCompression::deflate(string& theBuffer)
 		
 		if(cacheTest==false)
 		{
-			ret=(unsigned char)(schema | ((itsSendPeerReset) ? 0x80 : 0x00) | ((itsDeflateCacheIndex & 0x07) << 4));
-			itsSendPeerReset=false;
+			ret=(unsigned char)(schema | ((itsContext->itsSendPeerReset) ? 0x80 : 0x00) | ((itsContext->itsDeflateCacheIndex & 0x07) << 4));
+			itsContext->itsSendPeerReset=false;
 			TRACE("Add dictionary")
 			for(unsigned cnt=0; cnt < dictlen; cnt++)
-				ret+=occurrence[cnt].second;	
+				ret+=ranking[cnt];	
 		}
 		else
 		{
-			ret=(unsigned char)(schema | 0x08 | ((cacheIndex & 0x07) << 4) | itsDeflateCacheCheckBit[cacheIndex]);
+			ret=(unsigned char)(schema | 0x08 | ((cacheIndex & 0x07) << 4) | itsContext->itsDeflateCacheCheckBit[cacheIndex]);
 			TRACE("Request peer to use cached dictionary")
 		}
 
 		TRACE("Create compressed buffer")
-		
+		unsigned header=ret.size();
+		unsigned databits=evaluator[schema] - (1+dictlen)*8;
+		ret.resize(header + databits/8 + 8);
+		BitWriter writer((unsigned char*)&ret[header]);
+		const unsigned char* src=(const unsigned char*)theBuffer.data();
 		for(unsigned cnt=0;cnt < theBuffer.size(); cnt++)
-		{
-			unsigned char sym=theBuffer[cnt];
-			if(translation[sym].compressed==false)
-			{
-				putBits(ret,1,0); 
-				putBits(ret,8,sym); 
-			}
-			else
-			{
-				putBits(ret,1,1); 
-				putBits(ret,schema,translation[sym].symbol); 
-			}
-		}
-		
-		flush(ret);
-		TRACE("Total bits in the buffer=" << bit_count)
+			writer.put(code[src[cnt]],codelen[src[cnt]]);
+
+		ret.resize(header + writer.flush());
+		TRACE("Total bits in the buffer=" << header*8 + databits)
 
 		if(cacheTest==false)
 		{
 			TRACE("Save cache")
-			itsDeflateCacheSchema[itsDeflateCacheIndex]=schema;
+			itsContext->itsDeflateCacheSchema[itsContext->itsDeflateCacheIndex]=schema;
 
 			for(unsigned cnt=0; cnt < dictlen; cnt++)
-				itsDeflateCacheDictionary[itsDeflateCacheIndex][cnt]=occurrence[cnt].second; // Save symbol
+				itsContext->itsDeflateCacheDictionary[itsContext->itsDeflateCacheIndex][cnt]=ranking[cnt]; // Save symbol
 			
-			itsDeflateCacheCheckBit[itsDeflateCacheIndex]=computeCheckBit(schema,&itsDeflateCacheDictionary[itsDeflateCacheIndex][0]);
-			itsDeflateCacheIndex= ++itsDeflateCacheIndex % 8;
+			itsContext->itsDeflateCacheCheckBit[itsContext->itsDeflateCacheIndex]=computeCheckBit(schema,&itsContext->itsDeflateCacheDictionary[itsContext->itsDeflateCacheIndex][0]);
+			itsContext->itsDeflateCacheIndex=(itsContext->itsDeflateCacheIndex+1) % 8;
 		}
 		else
 		{
@@ -385,49 +448,13 @@ string PacketCompression::deflate(string& theBuffer)
 	return ret;
 }
 
-unsigned int PacketCompression::getBits(string& stream,unsigned int nb_bits,bool& eof) 
-{
-	TRACE("PacketCompression::getBits - start")	
-
-	unsigned int result;
-	eof=false;
-
-	if (nb_bits==0) 
-	    return 0;
-
-	while (shift_count < nb_bits) 
-	{
-		if(stream_length>=stream.size())
-		{
-			eof=true;
-			TRACE("PacketCompression::getBits - Reached EOF")
-			return 0;			
-		}
-		
-		TRACE("Fetched value=" << (int)stream[stream_length] << " '" << (char)stream[stream_length] << "'")
-		accumulator |= (unsigned char)stream[stream_length++] << shift_count;
-		shift_count += 8;
-	}
-
-	result = accumulator & ((1U << nb_bits) - 1);
-	accumulator >>= nb_bits;
-	shift_count -= nb_bits;
-	bit_count += nb_bits;
-
-	TRACE("PacketCompression::getBits - end")	
-	return result;
-}
-
-string PacketCompression::inflate(string& theBuffer)
+string PacketCompression::inflate(string& theBuffer,Context* theContext)
 {
 	TRACE("PacketCompression::inflate - start")
+	itsContext=theContext;
 	//TIME_POINT
 		
 	string ret;
-	ret.reserve(theBuffer.size()*2);
-	stream_length=0;
-	shift_count=0;
-	accumulator=0;
 
 	if(theBuffer[0]=='0')
 	{
@@ -457,11 +484,11 @@ string PacketCompression::inflate(string& theBuffer)
 			reset();	
 		}
 		
-		bool testCache = (schema==itsInflateCacheSchema[cacheIndex]) && (checkBit==itsInflateCacheCheckBit[cacheIndex]);	
+		bool testCache = (schema==itsContext->itsInflateCacheSchema[cacheIndex]) && (checkBit==itsContext->itsInflateCacheCheckBit[cacheIndex]);	
 		
 		if(useCache==true && testCache==false)
 		{
-			itsSendPeerReset=true;
+			itsContext->itsSendPeerReset=true;
 			reset();
 			WARNING("Invalid buffer during inflating. Forcing peer cache to reset.");
 			TRACE("PacketCompression::inflate - end with error")	
@@ -471,74 +498,893 @@ string PacketCompression::inflate(string& theBuffer)
 		useCache= useCache && testCache;
 		TRACE("Cache=" << ((useCache) ? "Y" : "N"))	
 	
-		unsigned dictlen, bufsize;
+		unsigned dictlen=1 << schema;
+		unsigned start=(useCache) ? 1 : 1+dictlen;
+		if(theBuffer.size() < start)
+		{
+			WARNING("Invalid buffer during inflating")
+			TRACE("PacketCompression::inflate - end with error")	
+			return "";	
+		}
+
+		const unsigned char* dictionary=(useCache) ? itsContext->itsInflateCacheDictionary[cacheIndex] : (const unsigned char*)theBuffer.data()+1;
+
+		// Decoding table indexed by the next 9 bits: symbol and bits of its code
+		unsigned short decode[512];
+		for(unsigned cnt=0; cnt < 512; cnt+=2)
+		{
+			decode[cnt]=((1+8) << 8) | (cnt >> 1);
+			decode[cnt+1]=((1+schema) << 8) | dictionary[(cnt >> 1) & (dictlen-1)];
+		}
+
+		unsigned databits=(theBuffer.size()-start)*8;
+		ret.resize(databits/(1+schema) + 1);
+		unsigned char* out=(unsigned char*)&ret[0];
+		unsigned outlen=0;
+		BitReader reader((const unsigned char*)theBuffer.data()+start,theBuffer.size()-start);
+		for(;;)
+		{
+			unsigned short entry=decode[reader.peek() & 0x1FF];
+			if(!reader.skip(entry >> 8)) // Padding of the last byte
+				break;
+			out[outlen++]=(unsigned char)entry;
+		}
+		ret.resize(outlen);
+		TRACE("Total bits in the buffer=" << databits)
 		
 		if(useCache==false)
 		{
-			dictlen=(unsigned)pow(2.0,(int)schema);
-			bufsize=theBuffer.size()-dictlen-1;
-			stream_length=1+dictlen;
+			TRACE("Save cache")
+			itsContext->itsInflateCacheSchema[cacheIndex]=schema;
+
+			for(unsigned cnt=0; cnt < dictlen; cnt++)
+				itsContext->itsInflateCacheDictionary[cacheIndex][cnt]=theBuffer[cnt+1];
+
+			itsContext->itsInflateCacheCheckBit[cacheIndex]=computeCheckBit(schema,&itsContext->itsInflateCacheDictionary[cacheIndex][0]);
+		}		
+	}
+
+	//DISPLAY_ELAPSED			
+	TRACE("PacketCompression::inflate - end")	
+	return ret;
+}
+
+LZCompression::LZCompression()
+{
+	TRACE("LZCompression::LZCompression - start")
+	percent=0;
+	itsHead.resize(1 << LZ_HASH_BITS);
+	itsChain.resize(LZ_WINDOW);
+	TRACE("LZCompression::LZCompression - end")	
+}
+
+LZCompression::~LZCompression()
+{
+	TRACE("LZCompression::~LZCompression - start")	
+
+	TRACE("LZCompression::~LZCompression - end")	
+}
+
+static inline unsigned LZHash(const unsigned char* thePtr,unsigned theBits)
+{
+	unsigned aWord;
+	memcpy(&aWord,thePtr,sizeof(aWord));
+	return (aWord * 2654435761U) >> (32 - theBits);
+}
+
+// Lengths bigger than 14 are completed by bytes of 255 and a final byte < 255
+void LZCompression::putCount(string& theStream,unsigned theCount)
+{
+	for(; theCount >= 255; theCount-=255)
+		theStream+=(char)255;
+	theStream+=(char)theCount;
+}
+
+bool LZCompression::getCount(const unsigned char*& thePtr,const unsigned char* theEnd,unsigned& theCount)
+{
+	unsigned char aByte;
+	do
+	{
+		if(thePtr >= theEnd)
+			return false;
+		aByte=*thePtr++;
+		theCount+=aByte;
+	} while(aByte==255);
+	return true;
+}
+
+//   Token   : literal length (4 bits) | match length - LZ_MIN_MATCH (4 bits)
+//   [length]: when the literal length is 15
+//   Literals
+//   Offset  : 2 bytes, little endian (missing in the last sequence)
+//   [length]: when the match length is 15
+void LZCompression::putSequence(string& theStream,const unsigned char* theLiterals,unsigned theLiteralLen,unsigned theOffset,unsigned theMatchLen)
+{
+	unsigned aMatchCode=(theMatchLen > 0) ? theMatchLen - LZ_MIN_MATCH : 0;
+	unsigned char aToken=((theLiteralLen < 15) ? theLiteralLen : 15) << 4;
+	aToken|=(aMatchCode < 15) ? aMatchCode : 15;
+	theStream+=(char)aToken;
+
+	if(theLiteralLen >= 15)
+		putCount(theStream,theLiteralLen - 15);
+	theStream.append((const char*)theLiterals,theLiteralLen);
+
+	if(theMatchLen > 0)
+	{
+		theStream+=(char)(theOffset & 0xFF);
+		theStream+=(char)(theOffset >> 8);
+		if(aMatchCode >= 15)
+			putCount(theStream,aMatchCode - 15);
+	}
+}
+
+string LZCompression::deflate(string& theBuffer)
+{
+	TRACE("LZCompression::deflate - start")	
+	DUMP("Original buffer",(char*)theBuffer.data(), theBuffer.size());
+
+	unsigned aLen=theBuffer.size();
+	string ret;
+
+	if(aLen >= LZ_MIN_INPUT)
+	{
+		ret.reserve(aLen + aLen/255 + 16);
+		ret+='L';
+		for(unsigned i=0; i < 4; i++)
+			ret+=(char)((aLen >> (i*8)) & 0xFF);
+
+		compress((const unsigned char*)theBuffer.data(),0,aLen,NULL,ret);
+	}
+
+	if(aLen < LZ_MIN_INPUT || ret.size() > aLen)
+	{
+		TRACE("No compression")
+		ret="0";
+		ret+=theBuffer;
+	}
+
+	percent=(aLen > 0) ? (1 - (float)ret.size()/(float)aLen)*100 : 0;
+	TRACE("Compression=" << percent << "%")
+	DUMP("Compressed buffer",(char*)ret.data(), ret.size());
+	TRACE("LZCompression::deflate - end")	
+	return ret;
+}
+
+// Appends the sequences of theSrc[theStart..theEnd) to theStream. The bytes before
+// theStart are known by the peer too: matches can refer to them.
+void LZCompression::compress(const unsigned char* theSrc,unsigned theStart,unsigned theEnd,CompressionDictionary* theDictionary,string& theStream)
+{
+	const unsigned char* aSrc=theSrc;
+	unsigned aLen=theEnd;
+
+	// Small packets use a part of the table: it is cleared every time
+	unsigned aBits=8;
+	while(aBits < LZ_HASH_BITS && (1U << aBits) < theEnd-theStart)
+		aBits++;
+	fill(itsHead.begin(),itsHead.begin() + (1 << aBits),0);
+
+	unsigned anAnchor=theStart;
+	unsigned aPos=theStart;
+	while(aPos + LZ_MIN_MATCH <= aLen)
+	{
+		// Hash chain: most recent candidates first
+		unsigned aHash=LZHash(aSrc+aPos,aBits);
+		unsigned aCandidate=itsHead[aHash];
+		unsigned aBestLen=0;
+		unsigned aBestOffset=0;
+		unsigned aMaxLen=aLen - aPos;
+		for(unsigned aDepth=0; aCandidate > 0 && aDepth < LZ_CHAIN_DEPTH; aDepth++)
+		{
+			unsigned aMatch=aCandidate - 1;
+			if(aPos - aMatch >= LZ_WINDOW)
+				break;
+
+			if(aSrc[aMatch + aBestLen]==aSrc[aPos + aBestLen] && memcmp(aSrc+aMatch,aSrc+aPos,LZ_MIN_MATCH)==0)
+			{
+				unsigned aMatchLen=LZ_MIN_MATCH;
+				while(aMatchLen < aMaxLen && aSrc[aMatch+aMatchLen]==aSrc[aPos+aMatchLen])
+					aMatchLen++;
+
+				if(aMatchLen > aBestLen)
+				{
+					aBestLen=aMatchLen;
+					aBestOffset=aPos - aMatch;
+					if(aMatchLen==aMaxLen)
+						break;
+				}
+			}
+
+			unsigned aNext=itsChain[aMatch & (LZ_WINDOW-1)];
+			if(aNext >= aCandidate) // Overwritten by a newer position
+				break;
+			aCandidate=aNext;
+		}
+
+		if(theDictionary!=NULL && aBestLen < aMaxLen)
+			theDictionary->findMatch(aSrc,aPos,aMaxLen,aBestLen,aBestOffset);
+
+		itsChain[aPos & (LZ_WINDOW-1)]=itsHead[aHash];
+		itsHead[aHash]=aPos + 1;
+
+		if(aBestLen < LZ_MIN_MATCH)
+		{
+			aPos++;
+			continue;
+		}
+
+		putSequence(theStream,aSrc+anAnchor,aPos-anAnchor,aBestOffset,aBestLen);
+		unsigned anEnd=aPos + aBestLen;
+		for(aPos++; aPos < anEnd && aPos + LZ_MIN_MATCH <= aLen; aPos++)
+		{
+			aHash=LZHash(aSrc+aPos,aBits);
+			itsChain[aPos & (LZ_WINDOW-1)]=itsHead[aHash];
+			itsHead[aHash]=aPos + 1;
+		}
+		aPos=anEnd;
+		anAnchor=aPos;
+	}
+	putSequence(theStream,aSrc+anAnchor,aLen-anAnchor,0,0);
+}
+
+string LZCompression::inflate(string& theBuffer)
+{
+	TRACE("LZCompression::inflate - start")
+	if(theBuffer.size() > 0 && theBuffer[0]=='0')
+	{
+		DUMP("No compressed buffer",(char*)theBuffer.data(), theBuffer.size());
+		TRACE("LZCompression::inflate - end")
+		return theBuffer.substr(1);
+	}
+
+	if(theBuffer.size() < 6 || theBuffer[0]!='L')
+	{
+		WARNING("Invalid buffer during inflating")
+		TRACE("LZCompression::inflate - end with error")	
+		return "";
+	}
+
+	DUMP("Compressed buffer",(char*)theBuffer.data(), theBuffer.size());
+	const unsigned char* anIn=(const unsigned char*)theBuffer.data();
+	unsigned aLen=anIn[1] | (anIn[2] << 8) | (anIn[3] << 16) | (anIn[4] << 24);
+
+	if(aLen / 255 > theBuffer.size()) // More than the longest matches can expand
+	{
+		WARNING("Invalid buffer during inflating")
+		TRACE("LZCompression::inflate - end with error")	
+		return "";
+	}
+
+	// The match copy moves 8 bytes at a time and may write past the end
+	string ret;
+	ret.resize(aLen + 8);
+	if(!expand(anIn+5,anIn+theBuffer.size(),(unsigned char*)&ret[0],0,aLen))
+	{
+		WARNING("Invalid buffer during inflating")
+		TRACE("LZCompression::inflate - end with error")	
+		return "";
+	}
+
+	ret.resize(aLen);
+	TRACE("LZCompression::inflate - end")
+	return ret;
+}
+
+// Decodes the sequences from theIn into theOut[theStart..theEnd): matches can refer
+// to the bytes before theStart. theOut must have 8 spare bytes after theEnd.
+bool LZCompression::expand(const unsigned char* theIn,const unsigned char* theInEnd,unsigned char* theOut,unsigned theStart,unsigned theEnd)
+{
+	const unsigned char* anIn=theIn;
+	const unsigned char* anEnd=theInEnd;
+	unsigned char* anOut=theOut;
+	unsigned aLen=theEnd;
+	unsigned aPos=theStart;
+
+	for(;;)
+	{
+		if(anIn >= anEnd)
+			return false;
+
+		unsigned char aToken=*anIn++;
+		unsigned aLiteralLen=aToken >> 4;
+		if(aLiteralLen==15 && !getCount(anIn,anEnd,aLiteralLen))
+			return false;
+		if(aLiteralLen > (unsigned)(anEnd - anIn) || aLiteralLen > aLen - aPos)
+			return false;
+
+		memcpy(anOut+aPos,anIn,aLiteralLen);
+		anIn+=aLiteralLen;
+		aPos+=aLiteralLen;
+		if(anIn==anEnd) // Last sequence
+			break;
+
+		if(anEnd - anIn < 2)
+			return false;
+
+		unsigned anOffset=anIn[0] | (anIn[1] << 8);
+		anIn+=2;
+		unsigned aMatchLen=aToken & 0x0F;
+		if(aMatchLen==15 && !getCount(anIn,anEnd,aMatchLen))
+			return false;
+		aMatchLen+=LZ_MIN_MATCH;
+		if(anOffset==0 || anOffset > aPos || aMatchLen > aLen - aPos)
+			return false;
+
+		unsigned char* aDst=anOut + aPos;
+		const unsigned char* aRef=aDst - anOffset;
+		if(anOffset >= 8)
+		{
+			unsigned char* aStop=aDst + aMatchLen;
+			for(; aDst < aStop; aDst+=8, aRef+=8)
+				memcpy(aDst,aRef,8);
 		}
 		else
 		{
-			dictlen=(unsigned)pow(2.0,(int)itsInflateCacheSchema[cacheIndex]);
-			bufsize=theBuffer.size()-1;
-			stream_length=1;
+			for(unsigned i=0; i < aMatchLen; i++)
+				aDst[i]=aRef[i];
 		}
-		
-		bit_count=stream_length*8;
-		bool eof=false;
-	
-		while(!eof)
+		aPos+=aMatchLen;
+	}
+
+	return aPos==aLen;
+}
+
+CompressionDictionary::CompressionDictionary(const string& theContent,unsigned theID)
+{
+	TRACE("CompressionDictionary::CompressionDictionary - start")
+	// The end is kept: the trainer puts there the most useful segments
+	if(theContent.size() > DICTIONARY_MAX_SIZE)
+		itsContent=theContent.substr(theContent.size()-DICTIONARY_MAX_SIZE);
+	else
+		itsContent=theContent;
+
+	itsID=(theID!=0) ? theID : APHash(itsContent);
+	if(itsID==0)
+		itsID=1;
+	TRACE("Dictionary ID=" << itsID << " Size=" << itsContent.size())
+
+	itsBits=8;
+	while(itsBits < LZ_HASH_BITS && (1U << itsBits) < itsContent.size())
+		itsBits++;
+	itsHead.assign(1 << itsBits,0);
+	itsChain.assign(itsContent.size(),0);
+
+	const unsigned char* aSrc=(const unsigned char*)itsContent.data();
+	for(unsigned aPos=0; aPos + LZ_MIN_MATCH <= itsContent.size(); aPos++)
+	{
+		unsigned aHash=LZHash(aSrc+aPos,itsBits);
+		itsChain[aPos]=itsHead[aHash];
+		itsHead[aHash]=aPos + 1;
+	}
+	TRACE("CompressionDictionary::CompressionDictionary - end")
+}
+
+string CompressionDictionary::toString()
+{
+	string ret;
+	for(unsigned i=0; i < 4; i++)
+		ret+=(char)((itsID >> (i*8)) & 0xFF);
+	ret+=itsContent;
+	return ret;
+}
+
+CompressionDictionary* CompressionDictionary::fromString(const string& theBuffer)
+{
+	if(theBuffer.size() < 4)
+		return NULL;
+
+	const unsigned char* aPtr=(const unsigned char*)theBuffer.data();
+	unsigned anID=aPtr[0] | (aPtr[1] << 8) | (aPtr[2] << 16) | (aPtr[3] << 24);
+	return new CompressionDictionary(theBuffer.substr(4),anID);
+}
+
+// theSrc starts with the content of the dictionary
+void CompressionDictionary::findMatch(const unsigned char* theSrc,unsigned thePos,unsigned theMaxLen,unsigned& theBestLen,unsigned& theBestOffset)
+{
+	if(itsContent.size() < LZ_MIN_MATCH)
+		return;
+
+	unsigned aCandidate=itsHead[LZHash(theSrc+thePos,itsBits)];
+	for(unsigned aDepth=0; aCandidate > 0 && aDepth < LZ_CHAIN_DEPTH; aDepth++)
+	{
+		unsigned aMatch=aCandidate - 1;
+		if(thePos - aMatch >= LZ_WINDOW)
+			break;
+
+		if(theSrc[aMatch + theBestLen]==theSrc[thePos + theBestLen] && memcmp(theSrc+aMatch,theSrc+thePos,LZ_MIN_MATCH)==0)
 		{
-			unsigned char compressed=(unsigned char)getBits(theBuffer,1,eof);
-			if(eof)
-				break;
-	
-			TRACE("Compressed flag=" << (int)compressed)
-	
-			if(compressed==1)
+			unsigned aMatchLen=LZ_MIN_MATCH;
+			while(aMatchLen < theMaxLen && theSrc[aMatch+aMatchLen]==theSrc[thePos+aMatchLen])
+				aMatchLen++;
+
+			if(aMatchLen > theBestLen)
 			{
-				unsigned char sym=(unsigned char)getBits(theBuffer,schema,eof);
-				if(eof)
+				theBestLen=aMatchLen;
+				theBestOffset=thePos - aMatch;
+				if(aMatchLen==theMaxLen)
 					break;
-	
-				unsigned char dec;
-				
-				if(useCache==false)
-					dec=theBuffer[sym+1];
-				else
-					dec=itsInflateCacheDictionary[cacheIndex][sym];
-				
-				TRACE("Symbol=" << (int)sym << " Value=" << (int)dec << " '" << dec << "'")
-				ret+=dec; 			
 			}
-			else
+		}
+		aCandidate=itsChain[aMatch];
+	}
+}
+
+bool DictionaryTrainer::add(const string& theSample)
+{
+	if(itsSize >= DICTIONARY_MAX_TRAINING)
+		return false;
+
+	itsSamples.push_back(theSample);
+	itsSize+=theSample.size();
+	return true;
+}
+
+#define TRAINER_HASH_BITS 20
+
+static inline unsigned KmerHash(const unsigned char* thePtr)
+{
+	unsigned aWord[2];
+	memcpy(aWord,thePtr,sizeof(aWord));
+	return ((aWord[0] * 2654435761U) ^ (aWord[1] * 2246822519U)) >> (32 - TRAINER_HASH_BITS);
+}
+
+// Greedy: the segment whose k-mers appear in most samples is taken, then its
+// k-mers don't count any more, until the dictionary is full
+CompressionDictionary* DictionaryTrainer::train(unsigned theSize,unsigned theID)
+{
+	TRACE("DictionaryTrainer::train - start")
+	if(theSize > DICTIONARY_MAX_SIZE)
+		theSize=DICTIONARY_MAX_SIZE;
+
+	vector<unsigned> aFreq(1 << TRAINER_HASH_BITS,0);
+	vector<unsigned> aSeen(1 << TRAINER_HASH_BITS,0);
+	vector< vector<unsigned> > aKmers(itsSamples.size());
+
+	TRACE("Count the samples of each k-mer")
+	for(unsigned i=0; i < itsSamples.size(); i++)
+	{
+		const unsigned char* aPtr=(const unsigned char*)itsSamples[i].data();
+		unsigned aLen=itsSamples[i].size();
+		if(aLen < DICTIONARY_SEGMENT)
+			continue;
+
+		aKmers[i].resize(aLen - DICTIONARY_KMER + 1);
+		for(unsigned aPos=0; aPos + DICTIONARY_KMER <= aLen; aPos++)
+		{
+			unsigned aHash=KmerHash(aPtr+aPos);
+			aKmers[i][aPos]=aHash;
+			if(aSeen[aHash]!=i+1)
 			{
-				unsigned char sym=(unsigned char)getBits(theBuffer,8,eof);
-				if(eof)
+				aSeen[aHash]=i+1;
+				aFreq[aHash]++;
+			}
+		}
+	}
+
+	TRACE("Select segments")
+	const unsigned aWidth=DICTIONARY_SEGMENT - DICTIONARY_KMER + 1;
+	vector<string> aSegments;
+	for(unsigned aTotal=0; aTotal + DICTIONARY_SEGMENT <= theSize; aTotal+=DICTIONARY_SEGMENT)
+	{
+		unsigned long aBestScore=0;
+		unsigned aBestSample=0;
+		unsigned aBestPos=0;
+
+		for(unsigned i=0; i < aKmers.size(); i++)
+		{
+			vector<unsigned>& aList=aKmers[i];
+			if(aList.size() < aWidth)
+				continue;
+
+			// K-mers of a single sample aren't redundancy between packets
+			unsigned long aScore=0;
+			for(unsigned aPos=0; aPos < aWidth; aPos++)
+				aScore+=(aFreq[aList[aPos]] > 1) ? aFreq[aList[aPos]] : 0;
+
+			for(unsigned aPos=0; ; aPos++)
+			{
+				if(aScore > aBestScore)
+				{
+					aBestScore=aScore;
+					aBestSample=i;
+					aBestPos=aPos;
+				}
+
+				if(aPos + aWidth >= aList.size())
 					break;
-	
-				TRACE("Value=" << (int)sym << " '" << sym << "'") 			
-				ret+=sym;			
+				aScore-=(aFreq[aList[aPos]] > 1) ? aFreq[aList[aPos]] : 0;
+				aScore+=(aFreq[aList[aPos+aWidth]] > 1) ? aFreq[aList[aPos+aWidth]] : 0;
 			}
 		}
-		
-		TRACE("Total bits in the buffer=" << bit_count)
-		
-		if(useCache==false)
+
+		if(aBestScore==0)
+			break;
+
+		aSegments.push_back(itsSamples[aBestSample].substr(aBestPos,DICTIONARY_SEGMENT));
+		for(unsigned aPos=0; aPos < aWidth; aPos++)
+			aFreq[aKmers[aBestSample][aBestPos+aPos]]=0;
+	}
+
+	if(aSegments.size()==0)
+	{
+		TRACE("DictionaryTrainer::train - end with error")
+		return NULL;
+	}
+
+	TRACE("Most useful segments at the end, near to the packet")
+	string aContent;
+	for(unsigned i=aSegments.size(); i > 0; i--)
+		aContent+=aSegments[i-1];
+
+	TRACE("DictionaryTrainer::train - end")
+	return new CompressionDictionary(aContent,theID);
+}
+
+DictionaryCompression::DictionaryCompression(CompressionDictionary* theDictionary)
+{
+	TRACE("DictionaryCompression::DictionaryCompression - start")
+	itsDictionary=NULL;
+	setDictionary(theDictionary);
+	TRACE("DictionaryCompression::DictionaryCompression - end")
+}
+
+DictionaryCompression::~DictionaryCompression()
+{
+	TRACE("DictionaryCompression::~DictionaryCompression - start")
+	for(map<unsigned,CompressionDictionary*>::iterator i=itsDictionaries.begin(); i!=itsDictionaries.end(); ++i)
+		delete i->second;
+	TRACE("DictionaryCompression::~DictionaryCompression - end")
+}
+
+void DictionaryCompression::addDictionary(CompressionDictionary* theDictionary)
+{
+	TRACE("DictionaryCompression::addDictionary - start")
+	if(theDictionary==NULL)
+		return;
+
+	map<unsigned,CompressionDictionary*>::iterator i=itsDictionaries.find(theDictionary->getID());
+	if(i!=itsDictionaries.end() && i->second!=theDictionary)
+	{
+		if(itsDictionary==i->second)
+			itsDictionary=theDictionary;
+		delete i->second;
+	}
+	itsDictionaries[theDictionary->getID()]=theDictionary;
+	TRACE("DictionaryCompression::addDictionary - end")
+}
+
+void DictionaryCompression::setDictionary(CompressionDictionary* theDictionary)
+{
+	TRACE("DictionaryCompression::setDictionary - start")
+	addDictionary(theDictionary);
+	itsDictionary=theDictionary;
+	TRACE("DictionaryCompression::setDictionary - end")
+}
+
+//   'D'
+//   Dictionary ID: 4 bytes, little endian
+//   Length: 4 bytes, little endian
+//   Sequences of LZCompression: offsets can refer to the dictionary
+string DictionaryCompression::deflate(string& theBuffer)
+{
+	TRACE("DictionaryCompression::deflate - start")	
+	DUMP("Original buffer",(char*)theBuffer.data(), theBuffer.size());
+
+	if(itsDictionary==NULL)
+	{
+		TRACE("DictionaryCompression::deflate - end")	
+		return LZCompression::deflate(theBuffer);
+	}
+
+	unsigned aLen=theBuffer.size();
+	unsigned anID=itsDictionary->getID();
+	string ret;
+
+	if(aLen >= LZ_MIN_MATCH)
+	{
+		ret.reserve(aLen + aLen/255 + 16);
+		ret+='D';
+		for(unsigned i=0; i < 4; i++)
+			ret+=(char)((anID >> (i*8)) & 0xFF);
+		for(unsigned i=0; i < 4; i++)
+			ret+=(char)((aLen >> (i*8)) & 0xFF);
+
+		string aWindow=itsDictionary->getContent();
+		unsigned aStart=aWindow.size();
+		aWindow+=theBuffer;
+		compress((const unsigned char*)aWindow.data(),aStart,aStart+aLen,itsDictionary,ret);
+	}
+
+	if(aLen < LZ_MIN_MATCH || ret.size() > aLen)
+	{
+		TRACE("No compression")
+		ret="0";
+		ret+=theBuffer;
+	}
+
+	percent=(aLen > 0) ? (1 - (float)ret.size()/(float)aLen)*100 : 0;
+	TRACE("Compression=" << percent << "%")
+	DUMP("Compressed buffer",(char*)ret.data(), ret.size());
+	TRACE("DictionaryCompression::deflate - end")	
+	return ret;
+}
+
+string DictionaryCompression::inflate(string& theBuffer)
+{
+	TRACE("DictionaryCompression::inflate - start")
+	if(theBuffer.size()==0 || theBuffer[0]!='D')
+	{
+		TRACE("DictionaryCompression::inflate - end")
+		return LZCompression::inflate(theBuffer);
+	}
+
+	if(theBuffer.size() < 10)
+	{
+		WARNING("Invalid buffer during inflating")
+		TRACE("DictionaryCompression::inflate - end with error")	
+		return "";
+	}
+
+	DUMP("Compressed buffer",(char*)theBuffer.data(), theBuffer.size());
+	const unsigned char* anIn=(const unsigned char*)theBuffer.data();
+	unsigned anID=anIn[1] | (anIn[2] << 8) | (anIn[3] << 16) | (anIn[4] << 24);
+	unsigned aLen=anIn[5] | (anIn[6] << 8) | (anIn[7] << 16) | (anIn[8] << 24);
+
+	map<unsigned,CompressionDictionary*>::iterator i=itsDictionaries.find(anID);
+	if(i==itsDictionaries.end())
+	{
+		WARNING("Unknown dictionary during inflating")
+		TRACE("Dictionary ID=" << anID)
+		TRACE("DictionaryCompression::inflate - end with error")	
+		return "";
+	}
+
+	if(aLen / 255 > theBuffer.size()) // More than the longest matches can expand
+	{
+		WARNING("Invalid buffer during inflating")
+		TRACE("DictionaryCompression::inflate - end with error")	
+		return "";
+	}
+
+	// The match copy moves 8 bytes at a time and may write past the end
+	const string& aContent=i->second->getContent();
+	unsigned aStart=aContent.size();
+	string aWindow;
+	aWindow.resize(aStart + aLen + 8);
+	memcpy(&aWindow[0],aContent.data(),aStart);
+	if(!expand(anIn+9,anIn+theBuffer.size(),(unsigned char*)&aWindow[0],aStart,aStart+aLen))
+	{
+		WARNING("Invalid buffer during inflating")
+		TRACE("DictionaryCompression::inflate - end with error")	
+		return "";
+	}
+
+	TRACE("DictionaryCompression::inflate - end")
+	return aWindow.substr(aStart,aLen);
+}
+
+AdaptiveCompression::AdaptiveCompression(Compression* theCompression,unsigned theMinSize)
+{
+	TRACE("AdaptiveCompression::AdaptiveCompression - start")
+	itsCompression=theCompression;
+	itsMinSize=theMinSize;
+	itsDeflatedCnt=0;
+	itsBypassedCnt=0;
+	itsBytesIn=0;
+	itsBytesOut=0;
+	itsDeflateTime=0;
+	itsInflateTime=0;
+	TRACE("AdaptiveCompression::AdaptiveCompression - end")	
+}
+
+AdaptiveCompression::~AdaptiveCompression()
+{
+	TRACE("AdaptiveCompression::~AdaptiveCompression - start")
+	delete itsCompression;
+	TRACE("AdaptiveCompression::~AdaptiveCompression - end")	
+}
+
+AdaptiveCompression::Stream& AdaptiveCompression::getStream(unsigned theProxy,unsigned theRemote)
+{
+	pair<unsigned,unsigned> aKey(theProxy,(theRemote==theProxy) ? 0 : theRemote);
+	if(itsStreams.size() >= PACKET_MAX_PEERS && itsStreams.find(aKey)==itsStreams.end())
+	{
+		TRACE("Too many streams: learn them again")
+		itsStreams.clear();
+	}
+	return itsStreams[aKey];
+}
+
+// Order 0 entropy in bits/byte of up to ADAPTIVE_SAMPLE_CHUNKS chunks spread on the buffer
+float AdaptiveCompression::estimateEntropy(string& theBuffer)
+{
+	unsigned aCount[256];
+	memset(aCount,0,sizeof(aCount));
+	const unsigned char* aPtr=(const unsigned char*)theBuffer.data();
+	unsigned aSize=theBuffer.size();
+	unsigned aSamples=0;
+
+	if(aSize <= ADAPTIVE_SAMPLE_CHUNKS*ADAPTIVE_SAMPLE_CHUNK)
+	{
+		for(unsigned cnt=0; cnt < aSize; cnt++)
+			aCount[aPtr[cnt]]++;
+		aSamples=aSize;
+	}
+	else
+	{
+		unsigned aStep=(aSize-ADAPTIVE_SAMPLE_CHUNK)/(ADAPTIVE_SAMPLE_CHUNKS-1);
+		for(unsigned chunk=0; chunk < ADAPTIVE_SAMPLE_CHUNKS; chunk++)
+			for(unsigned cnt=0; cnt < ADAPTIVE_SAMPLE_CHUNK; cnt++)
+				aCount[aPtr[chunk*aStep+cnt]]++;
+		aSamples=ADAPTIVE_SAMPLE_CHUNKS*ADAPTIVE_SAMPLE_CHUNK;
+	}
+
+	if(aSamples==0)
+		return 0;
+
+	double aSum=0;
+	unsigned aSymbols=0;
+	for(unsigned cnt=0; cnt < 256; cnt++)
+	{
+		if(aCount[cnt] > 0)
 		{
-			TRACE("Save cache")
-			itsInflateCacheSchema[cacheIndex]=schema;
+			aSum+=aCount[cnt]*log((double)aCount[cnt]);
+			aSymbols++;
+		}
+	}
 
-			for(unsigned cnt=0; cnt < dictlen; cnt++)
-				itsInflateCacheDictionary[cacheIndex][cnt]=theBuffer[cnt+1];
+	// Miller-Madow correction: a small sample underestimates the entropy
+	double anEntropy=log((double)aSamples)-aSum/aSamples + (aSymbols-1)/(2.0*aSamples);
+	return (float)(anEntropy/log(2.0));
+}
 
-			itsInflateCacheCheckBit[cacheIndex]=computeCheckBit(schema,&itsInflateCacheDictionary[cacheIndex][0]);
-		}		
+bool AdaptiveCompression::isWorth(string& theBuffer,Stream& theStream)
+{
+	if(theBuffer.size() < itsMinSize)
+	{
+		TRACE("Buffer too small")
+		return false;
 	}
 
-	//DISPLAY_ELAPSED			
-	TRACE("PacketCompression::inflate - end")	
+	if(theStream.itsPause > 0)
+	{
+		TRACE("Compression paused for " << theStream.itsPause << " buffers")
+		theStream.itsPause--;
+		return false;
+	}
+
+	// N random bytes can't show more than log2(N) bits/byte
+	unsigned aSamples=(theBuffer.size() < ADAPTIVE_SAMPLE_CHUNKS*ADAPTIVE_SAMPLE_CHUNK) ? theBuffer.size() : ADAPTIVE_SAMPLE_CHUNKS*ADAPTIVE_SAMPLE_CHUNK;
+	float aRandomEntropy=(aSamples < 256) ? (float)(log((double)aSamples)/log(2.0)) : 8.0F;
+	float anEntropy=estimateEntropy(theBuffer);
+	TRACE("Entropy=" << anEntropy << " bits/byte")
+	return anEntropy <= aRandomEntropy-ADAPTIVE_ENTROPY_MARGIN;
+}
+
+void AdaptiveCompression::update(Stream& theStream,unsigned theSize,unsigned theCompressedSize)
+{
+	float aSaving=(1.0F-(float)theCompressedSize/(float)theSize)*100.0F;
+	if(theStream.itsFresh)
+	{
+		theStream.itsSaving=aSaving;
+		theStream.itsFresh=false;
+	}
+	else
+		theStream.itsSaving+=(aSaving-theStream.itsSaving)/8.0F;
+
+	TRACE("Saving=" << aSaving << "% Average=" << theStream.itsSaving << "%")
+	if(theStream.itsSaving < ADAPTIVE_MIN_SAVING)
+	{
+		TRACE("Compression doesn't pay: pause it")
+		theStream.itsPause=ADAPTIVE_PAUSE;
+		theStream.itsFresh=true;
+	}
+}
+
+string AdaptiveCompression::bypass(string& theBuffer)
+{
+	itsBypassedCnt++;
+	itsBytesIn+=theBuffer.size();
+	itsBytesOut+=theBuffer.size()+1;
+	string ret;
+	ret.reserve(theBuffer.size()+1);
+	ret='0';
+	ret+=theBuffer;
+	return ret;
+}
+
+string AdaptiveCompression::deflate(string& theBuffer)
+{
+	TRACE("AdaptiveCompression::deflate - start")
+	if(!isWorth(theBuffer,itsDefaultStream))
+	{
+		TRACE("AdaptiveCompression::deflate - end")
+		return bypass(theBuffer);
+	}
+
+	_TIMEVAL aStart=Timer::timeExt();
+	string ret=itsCompression->deflate(theBuffer);
+	_TIMEVAL anEnd=Timer::timeExt();
+	itsDeflateTime+=Timer::subtractMicrosecs(&aStart,&anEnd);
+	itsDeflatedCnt++;
+	itsBytesIn+=theBuffer.size();
+	itsBytesOut+=ret.size();
+	update(itsDefaultStream,theBuffer.size(),ret.size());
+	TRACE("AdaptiveCompression::deflate - end")
+	return ret;
+}
+
+string AdaptiveCompression::deflate(string& theBuffer,unsigned theProxy,unsigned theRemote)
+{
+	TRACE("AdaptiveCompression::deflate - start")
+	Stream& aStream=getStream(theProxy,theRemote);
+	if(!isWorth(theBuffer,aStream))
+	{
+		TRACE("AdaptiveCompression::deflate - end")
+		return bypass(theBuffer);
+	}
+
+	_TIMEVAL aStart=Timer::timeExt();
+	string ret=itsCompression->deflate(theBuffer,theProxy,theRemote);
+	_TIMEVAL anEnd=Timer::timeExt();
+	itsDeflateTime+=Timer::subtractMicrosecs(&aStart,&anEnd);
+	itsDeflatedCnt++;
+	itsBytesIn+=theBuffer.size();
+	itsBytesOut+=ret.size();
+	update(aStream,theBuffer.size(),ret.size());
+	TRACE("AdaptiveCompression::deflate - end")
+	return ret;
+}
+
+string AdaptiveCompression::deflateShared(string& theBuffer)
+{
+	TRACE("AdaptiveCompression::deflateShared - start")
+	if(!isWorth(theBuffer,itsDefaultStream))
+	{
+		TRACE("AdaptiveCompression::deflateShared - end")
+		return bypass(theBuffer);
+	}
+
+	_TIMEVAL aStart=Timer::timeExt();
+	string ret=itsCompression->deflateShared(theBuffer);
+	_TIMEVAL anEnd=Timer::timeExt();
+	itsDeflateTime+=Timer::subtractMicrosecs(&aStart,&anEnd);
+	itsDeflatedCnt++;
+	itsBytesIn+=theBuffer.size();
+	itsBytesOut+=ret.size();
+	update(itsDefaultStream,theBuffer.size(),ret.size());
+	TRACE("AdaptiveCompression::deflateShared - end")
+	return ret;
+}
+
+string AdaptiveCompression::inflate(string& theBuffer)
+{
+	TRACE("AdaptiveCompression::inflate - start")
+	_TIMEVAL aStart=Timer::timeExt();
+	string ret=itsCompression->inflate(theBuffer);
+	_TIMEVAL anEnd=Timer::timeExt();
+	itsInflateTime+=Timer::subtractMicrosecs(&aStart,&anEnd);
+	TRACE("AdaptiveCompression::inflate - end")
+	return ret;
+}
+
+string AdaptiveCompression::inflate(string& theBuffer,unsigned theProxy,unsigned theRemote)
+{
+	TRACE("AdaptiveCompression::inflate - start")
+	_TIMEVAL aStart=Timer::timeExt();
+	string ret=itsCompression->inflate(theBuffer,theProxy,theRemote);
+	_TIMEVAL anEnd=Timer::timeExt();
+	itsInflateTime+=Timer::subtractMicrosecs(&aStart,&anEnd);
+	TRACE("AdaptiveCompression::inflate - end")
+	return ret;
+}
+
+string AdaptiveCompression::inflateShared(string& theBuffer)
+{
+	TRACE("AdaptiveCompression::inflateShared - start")
+	_TIMEVAL aStart=Timer::timeExt();
+	string ret=itsCompression->inflateShared(theBuffer);
+	_TIMEVAL anEnd=Timer::timeExt();
+	itsInflateTime+=Timer::subtractMicrosecs(&aStart,&anEnd);
+	TRACE("AdaptiveCompression::inflateShared - end")
 	return ret;
 }
@@ -18,10 +18,16 @@
 //
 // WARNING: PacketCompression works using a cache mechanism to avoid to send 
 // dictionary information and reducing the bandwidth needed. This mechanism works 
-// only in a peer-to-peer transmition. If you plan to use multicast packets or 
-// to have a single server with multiple client, the cache mechanism doesn't work
-// correctly because PacketCompression isn't able to determine the packet source.  
-// In this case you should disable caching calling PacketCompression(false)
+// only in a peer-to-peer transmition. Observer passes the proxy and the remote
+// handle of every message, so each peer gets its own cache and a server with
+// multiple clients works too. Above PACKET_MAX_PEERS caches, the least recently
+// used one idle for PACKET_PEER_LEASE secs is dropped. A sender forgets its own
+// dictionaries after half the lease, so even a one-way stream never references
+// a cache dropped by its receiver.
+// Published messages, read by many peers, use inflateShared/deflateShared: they
+// carry their dictionary and leave the peer caches alone.
+// If you plan to use multicast packets or to call inflate/deflate without a peer
+// from many sources, you should disable caching calling PacketCompression(false)
 // WARNING: compression is a cpu-consuming process. Use only if you have a low 
 // bandwidth connectivity with your peer.
 //
@@ -29,51 +35,331 @@
 #ifndef __COMPRESSION__
 #define __COMPRESSION__
 
+#include <map>
+#include <list>
+using namespace std;
+
+#define PACKET_MAX_PEERS 64	// Dictionary caches kept by a PacketCompression
+#define PACKET_PEER_LEASE 60	// Secs a dictionary cache is kept after its last use
+
+#define ADAPTIVE_MIN_SIZE 64		// Smaller buffers are sent as they are
+#define ADAPTIVE_SAMPLE_CHUNKS 8	// Chunks sampled to estimate the entropy...
+#define ADAPTIVE_SAMPLE_CHUNK 64	// ...and their size
+#define ADAPTIVE_ENTROPY_MARGIN 1.0	// Bits/byte under the entropy of random data needed to deflate
+#define ADAPTIVE_MIN_SAVING 5.0		// Average % saved below which a stream stops deflating...
+#define ADAPTIVE_PAUSE 32			// ...for this number of buffers
+
 #include <vector>
 #include <string>
 
+#ifdef WIN32
+typedef unsigned __int64 BITWORD;
+#else
+typedef unsigned long long BITWORD;
+#endif
+
+// Packs codes LSB first into a buffer big enough for all of them, 32 bits at a time
+class BitWriter
+{
+protected:
+	unsigned char* itsStart;
+	unsigned char* itsPtr;
+	BITWORD itsAccumulator;
+	unsigned itsCount;		// Bits in the accumulator, always < 32 between calls
+
+public:
+	BitWriter(unsigned char* theBuffer) : itsStart(theBuffer), itsPtr(theBuffer), itsAccumulator(0), itsCount(0) {};
+
+	void put(unsigned theCode,unsigned theLen) // theLen <= 32
+	{
+		itsAccumulator|=(BITWORD)theCode << itsCount;
+		itsCount+=theLen;
+		if(itsCount >= 32)
+		{
+			itsPtr[0]=(unsigned char)itsAccumulator;
+			itsPtr[1]=(unsigned char)(itsAccumulator >> 8);
+			itsPtr[2]=(unsigned char)(itsAccumulator >> 16);
+			itsPtr[3]=(unsigned char)(itsAccumulator >> 24);
+			itsPtr+=4;
+			itsAccumulator>>=32;
+			itsCount-=32;
+		}
+	};
+
+	unsigned flush() // Pads the last byte with zeros and returns the bytes written
+	{
+		for(; itsCount > 0; itsCount=(itsCount > 8) ? itsCount-8 : 0)
+		{
+			*itsPtr++=(unsigned char)itsAccumulator;
+			itsAccumulator>>=8;
+		}
+		return itsPtr - itsStart;
+	};
+};
+
+// Reads back the codes of a BitWriter. peek() returns at least 32 bits, padded
+// with zeros past the end of the buffer.
+class BitReader
+{
+protected:
+	const unsigned char* itsPtr;
+	const unsigned char* itsEnd;
+	BITWORD itsAccumulator;
+	unsigned itsCount;		// Bits in the accumulator
+	unsigned long itsLeft;	// Bits not consumed yet
+
+public:
+	BitReader(const unsigned char* theBuffer,unsigned theLen) 
+	   : itsPtr(theBuffer), itsEnd(theBuffer+theLen), itsAccumulator(0), itsCount(0), itsLeft(theLen*8UL) { refill(); };
+
+	unsigned peek() { return (unsigned)itsAccumulator; };
+
+	bool skip(unsigned theLen) // false when less than theLen bits are left
+	{
+		if(theLen > itsLeft)
+			return false;
+		itsAccumulator>>=theLen;
+		itsCount-=theLen;
+		itsLeft-=theLen;
+		if(itsCount < 32)
+			refill();
+		return true;
+	};
+
+protected:
+	void refill()
+	{
+		if(itsEnd - itsPtr >= 4)
+		{
+			itsAccumulator|=(BITWORD)(itsPtr[0] | (itsPtr[1] << 8) | (itsPtr[2] << 16) | ((unsigned)itsPtr[3] << 24)) << itsCount;
+			itsPtr+=4;
+			itsCount+=32;
+		}
+		else
+		{
+			for(; itsPtr < itsEnd; itsCount+=8)
+				itsAccumulator|=(BITWORD)*itsPtr++ << itsCount;
+		}
+	};
+};
+
 class Compression
 {
 public:
+	virtual ~Compression() {};
 	virtual string inflate(string& theBuffer)=0;
 	virtual string deflate(string& theBuffer)=0;
+	// Stateful codecs keep a separate state for each proxy/remote handle pair
+	virtual string inflate(string& theBuffer,unsigned,unsigned) { return inflate(theBuffer); };
+	virtual string deflate(string& theBuffer,unsigned,unsigned) { return deflate(theBuffer); };
+	// Buffers read by many peers (e.g. published ones): no state is kept with any of them
+	virtual string inflateShared(string& theBuffer) { return inflate(theBuffer); };
+	virtual string deflateShared(string& theBuffer) { return deflate(theBuffer); };
 };
 
 class PacketCompression : public Compression
 {
 protected:
-	unsigned int stream_length; // number of bytes
-	unsigned int shift_count;   // number of bits in the accumulator
-	unsigned int accumulator;   // bit accumulator
-	unsigned int bit_count;
-	float percent;
+	typedef pair<unsigned,unsigned> PeerKey;
 
-	bool itsUseCacheMechanism;
-	bool itsSendPeerReset;
-	unsigned char itsDeflateCacheIndex;
-	unsigned char itsDeflateCacheSchema[8];
-	unsigned char itsDeflateCacheCheckBit[8];
-	unsigned char itsDeflateCacheDictionary[8][128];
+	// Dictionaries shared with a peer
+	class Context
+	{
+	public:
+		bool itsSendPeerReset;
+		unsigned char itsDeflateCacheIndex;
+		unsigned char itsDeflateCacheSchema[8];
+		unsigned char itsDeflateCacheCheckBit[8];
+		unsigned char itsDeflateCacheDictionary[8][128];
 
-	unsigned char itsInflateCacheSchema[8];
-	unsigned char itsInflateCacheCheckBit[8];
-	unsigned char itsInflateCacheDictionary[8][128];
+		unsigned char itsInflateCacheSchema[8];
+		unsigned char itsInflateCacheCheckBit[8];
+		unsigned char itsInflateCacheDictionary[8][128];
+		list<PeerKey>::iterator itsLRUPosition;
+		unsigned long itsLastUse;	// Secs
+	};
+
+	float percent;
+	bool itsUseCacheMechanism;
+	Context itsDefaultContext;	// Used without a peer
+	Context itsSharedContext;	// Used by inflateShared/deflateShared, never as a cache
+	Context* itsContext;		// Context of the current inflate/deflate
+	map<PeerKey,Context*> itsPeers;
+	list<PeerKey> itsLRU;		// Most recently used first
+	unsigned itsMaxPeers;
+	unsigned long itsLease;
 
 public:
-	PacketCompression(bool theUseCacheMechanism=true);
+	PacketCompression(bool theUseCacheMechanism=true,unsigned theMaxPeers=PACKET_MAX_PEERS,unsigned long theLease=PACKET_PEER_LEASE);
 	virtual ~PacketCompression();
 	virtual string inflate(string& theBuffer);
 	virtual string deflate(string& theBuffer);
+	virtual string inflate(string& theBuffer,unsigned theProxy,unsigned theRemote);
+	virtual string deflate(string& theBuffer,unsigned theProxy,unsigned theRemote);
+	virtual string inflateShared(string& theBuffer);
+	virtual string deflateShared(string& theBuffer);
 	virtual float getCompressionPercent() { return percent; };
+	virtual unsigned getPeerCount() { return itsPeers.size(); };
 	virtual const char* getName() { return "PacketCompression"; };
 	
 protected:
-	virtual void evaluateDictionary(vector< pair<int,unsigned char> >& occurrence,unsigned* evaluator);
-	virtual void putBits(string& stream,unsigned int nb_bits,unsigned int data);
-	virtual void flush(string& stream); 
-	virtual unsigned int getBits(string& stream,unsigned int nb_bits,bool& eof);
+	virtual Context* getContext(unsigned theProxy,unsigned theRemote);
+	virtual string inflate(string& theBuffer,Context* theContext);
+	virtual string deflate(string& theBuffer,Context* theContext);
+	virtual void countSymbols(string& theBuffer,unsigned* theCount);
+	virtual void rankSymbols(unsigned* theCount,unsigned char* theRanking);
+	virtual void evaluateDictionary(unsigned* theCount,unsigned char* theRanking,unsigned theLen,unsigned* evaluator);
 	virtual unsigned char computeCheckBit(unsigned char theSchema,unsigned char* theArray);	
 	virtual void reset();
 };
 
+#define LZ_HASH_BITS 15		// Max entries of the match finder hash table: 2^LZ_HASH_BITS
+#define LZ_WINDOW 65536		// Max distance of a match
+#define LZ_CHAIN_DEPTH 16		// Candidates compared for each position
+#define LZ_MIN_MATCH 4
+#define LZ_MIN_INPUT 16		// Shorter buffers are sent as they are
+
+class CompressionDictionary;
+
+// LZ77 codec: repeated substrings are replaced by (offset,length) references
+// to the previous 64KB. Each packet is self-contained, so it works with
+// multicast and with a server shared by many clients.
+class LZCompression : public Compression
+{
+protected:
+	vector<unsigned> itsHead;	// Last position+1 of each hash
+	vector<unsigned> itsChain;	// Previous position+1 with the same hash
+	float percent;
+
+public:
+	LZCompression();
+	virtual ~LZCompression();
+	virtual string inflate(string& theBuffer);
+	virtual string deflate(string& theBuffer);
+	virtual float getCompressionPercent() { return percent; };
+	virtual const char* getName() { return "LZCompression"; };
+
+protected:
+	virtual void putSequence(string& theStream,const unsigned char* theLiterals,unsigned theLiteralLen,unsigned theOffset,unsigned theMatchLen);
+	void putCount(string& theStream,unsigned theCount);
+	bool getCount(const unsigned char*& thePtr,const unsigned char* theEnd,unsigned& theCount);
+	void compress(const unsigned char* theSrc,unsigned theStart,unsigned theEnd,CompressionDictionary* theDictionary,string& theStream);
+	bool expand(const unsigned char* theIn,const unsigned char* theInEnd,unsigned char* theOut,unsigned theStart,unsigned theEnd);
+};
+
+#define DICTIONARY_SIZE 4096			// Default size of a trained dictionary
+#define DICTIONARY_MAX_SIZE 32768		// Dictionary and packet must fit LZ_WINDOW
+#define DICTIONARY_SEGMENT 32			// Bytes selected at a time by the trainer
+#define DICTIONARY_KMER 8				// Bytes compared by the trainer
+#define DICTIONARY_MAX_TRAINING 1048576	// Bytes of samples used by the trainer
+
+// Content primed in the match window of DictionaryCompression. The id goes in
+// every packet, so peers must load the same dictionaries. 
+class CompressionDictionary
+{
+protected:
+	unsigned itsID;
+	string itsContent;
+	unsigned itsBits;
+	vector<unsigned> itsHead;	// Last position+1 of each hash
+	vector<unsigned> itsChain;	// Previous position+1 with the same hash
+
+public:
+	CompressionDictionary(const string& theContent,unsigned theID=0); // 0: hash of the content
+	virtual ~CompressionDictionary() {};
+	unsigned getID() { return itsID; };
+	const string& getContent() { return itsContent; };
+	string toString();	// ID (4 bytes, little endian) and content
+	static CompressionDictionary* fromString(const string& theBuffer);
+	void findMatch(const unsigned char* theSrc,unsigned thePos,unsigned theMaxLen,unsigned& theBestLen,unsigned& theBestOffset);
+};
+
+// Builds a dictionary with the segments shared by most of the samples, e.g. the
+// property names of ListProperty messages.
+class DictionaryTrainer
+{
+protected:
+	vector<string> itsSamples;
+	unsigned long itsSize;
+
+public:
+	DictionaryTrainer() : itsSize(0) {};
+	virtual ~DictionaryTrainer() {};
+	virtual bool add(const string& theSample); // false when there are enough samples
+	unsigned getSampleCount() { return itsSamples.size(); };
+	virtual CompressionDictionary* train(unsigned theSize=DICTIONARY_SIZE,unsigned theID=0);
+};
+
+// LZCompression starting from a dictionary shared by the peers: small packets
+// find their redundancy in the dictionary. Packets of LZCompression and packets
+// of the other dictionaries added are inflated too.
+class DictionaryCompression : public LZCompression
+{
+protected:
+	CompressionDictionary* itsDictionary;	// Used to deflate
+	map<unsigned,CompressionDictionary*> itsDictionaries;
+
+public:
+	DictionaryCompression(CompressionDictionary* theDictionary);
+	virtual ~DictionaryCompression();
+	virtual void addDictionary(CompressionDictionary* theDictionary);
+	virtual void setDictionary(CompressionDictionary* theDictionary);
+	virtual string inflate(string& theBuffer);
+	virtual string deflate(string& theBuffer);
+	virtual const char* getName() { return "DictionaryCompression"; };
+};
+
+// Sends as they are the buffers that don't pay the cost of compressing them:
+// the small ones, the ones that look random (e.g. already compressed) and, for
+// each peer, all of them while the average saving stays under ADAPTIVE_MIN_SAVING.
+// The wrapped codec, deleted with this object, must inflate the buffers starting
+// with '0' as stored ones, like PacketCompression and LZCompression.
+class AdaptiveCompression : public Compression
+{
+protected:
+	class Stream
+	{
+	public:
+		Stream() : itsSaving(100.0F), itsPause(0), itsFresh(true) {};
+		float itsSaving;	// Moving average of the % saved
+		unsigned itsPause;	// Buffers still to send as they are
+		bool itsFresh;		// Next saving replaces the average
+	};
+
+	Compression* itsCompression;
+	unsigned itsMinSize;
+	Stream itsDefaultStream;	// Used without a peer
+	map<pair<unsigned,unsigned>,Stream> itsStreams;
+	unsigned long itsDeflatedCnt;
+	unsigned long itsBypassedCnt;
+	unsigned long itsBytesIn;
+	unsigned long itsBytesOut;
+	double itsDeflateTime;		// Microseconds spent in deflate and inflate
+	double itsInflateTime;
+
+public:
+	AdaptiveCompression(Compression* theCompression,unsigned theMinSize=ADAPTIVE_MIN_SIZE);
+	virtual ~AdaptiveCompression();
+	virtual string inflate(string& theBuffer);
+	virtual string deflate(string& theBuffer);
+	virtual string inflate(string& theBuffer,unsigned theProxy,unsigned theRemote);
+	virtual string deflate(string& theBuffer,unsigned theProxy,unsigned theRemote);
+	virtual string inflateShared(string& theBuffer);
+	virtual string deflateShared(string& theBuffer);
+	unsigned long getDeflatedCount() { return itsDeflatedCnt; };
+	unsigned long getBypassedCount() { return itsBypassedCnt; };
+	long getSavedBytes() { return (long)(itsBytesIn-itsBytesOut); };
+	double getDeflateTime() { return itsDeflateTime; };
+	double getInflateTime() { return itsInflateTime; };
+	virtual const char* getName() { return "AdaptiveCompression"; };
+
+	static float estimateEntropy(string& theBuffer);
+
+protected:
+	virtual Stream& getStream(unsigned theProxy,unsigned theRemote);
+	virtual bool isWorth(string& theBuffer,Stream& theStream);
+	virtual void update(Stream& theStream,unsigned theSize,unsigned theCompressedSize);
+	string bypass(string& theBuffer);
+};
+
 #endif
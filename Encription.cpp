@@ -23,15 +23,119 @@
 #include "Encription.h"
 #include "Thread.h"
 #include "GeneralHashFunctions.h"
+#include "MessageProxy.h"
+#ifdef WIN32
+#include <wincrypt.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #define R128SIZE 16
 #define R256SIZE 32
 
+unsigned Encription::getCodedSize(unsigned theSize)
+{
+	unsigned aBlockSize=getBlockSize();
+	return ((theSize+aBlockSize-1)/aBlockSize)*aBlockSize;
+}
+
+// The buffer grows at most once, to its padded size, then it is ciphered in place
+void Encription::codeInPlace(string& theBuffer)
+{
+	TRACE("Encription::codeInPlace - start")
+	unsigned aSize=getCodedSize(theBuffer.length());
+	if(aSize > 0)
+	{
+		if(theBuffer.capacity() < aSize)
+			theBuffer.reserve(aSize);
+		theBuffer.resize(aSize,'\0');
+		codeBlocks(&theBuffer[0],aSize); // Non const access: the buffer is not shared any more
+	}
+	TRACE("Encription::codeInPlace - end")
+}
+
+void Encription::decodeInPlace(string& theBuffer)
+{
+	TRACE("Encription::decodeInPlace - start")
+	unsigned aSize=getCodedSize(theBuffer.length());
+	if(aSize > 0)
+	{
+		if(theBuffer.capacity() < aSize)
+			theBuffer.reserve(aSize);
+		theBuffer.resize(aSize,'\0');
+		decodeBlocks(&theBuffer[0],aSize);
+	}
+	TRACE("Encription::decodeInPlace - end")
+}
+
+string Encription::code(string& theBuffer)
+{
+	TRACE("Encription::code - start")
+	string aReturnString;
+	aReturnString.reserve(getCodedSize(theBuffer.length()));
+	aReturnString.assign(theBuffer.data(),theBuffer.length());
+	codeInPlace(aReturnString);
+	TRACE("Encription::code - end")
+	return aReturnString;
+}
+
+string Encription::decode(string& theBuffer)
+{
+	TRACE("Encription::decode - start")
+	string aReturnString;
+	aReturnString.reserve(getCodedSize(theBuffer.length()));
+	aReturnString.assign(theBuffer.data(),theBuffer.length());
+	decodeInPlace(aReturnString);
+	TRACE("Encription::decode - end")
+	return aReturnString;
+}
+
+// Counter blocks are built and coded CTR_BATCH bytes at a time
+void Encription::xorCounters(char* theBuffer,unsigned theSize,const byte* theNonce,unsigned int theCounter)
+{
+	TRACE("Encription::xorCounters - start")
+	unsigned aBlockSize=getBlockSize();
+	unsigned long aStream[CTR_BATCH/sizeof(unsigned long)];
+	byte* aBytes=(byte*)aStream;
+
+	for(unsigned aPos=0; aPos < theSize; aPos+=CTR_BATCH)
+	{
+		unsigned aLen=(theSize-aPos < CTR_BATCH) ? theSize-aPos : CTR_BATCH;
+		unsigned aBlocks=(aLen+aBlockSize-1)/aBlockSize;
+		memset(aBytes,0,aBlocks*aBlockSize);
+		for(unsigned cnt=0; cnt < aBlocks; cnt++, theCounter++)
+		{
+			byte* aBlock=aBytes+cnt*aBlockSize;
+			memcpy(aBlock,theNonce,12);
+			aBlock[12]=(byte)(theCounter >> 24);
+			aBlock[13]=(byte)(theCounter >> 16);
+			aBlock[14]=(byte)(theCounter >> 8);
+			aBlock[15]=(byte)theCounter;
+		}
+		codeBlocks((char*)aBytes,aBlocks*aBlockSize);
+
+		char* aPtr=theBuffer+aPos;
+		unsigned aWords=aLen/sizeof(unsigned long);
+		for(unsigned cnt=0; cnt < aWords; cnt++)
+		{
+			unsigned long aWord;
+			memcpy(&aWord,aPtr+cnt*sizeof(unsigned long),sizeof(unsigned long));
+			aWord^=aStream[cnt];
+			memcpy(aPtr+cnt*sizeof(unsigned long),&aWord,sizeof(unsigned long));
+		}
+		for(unsigned cnt=aWords*sizeof(unsigned long); cnt < aLen; cnt++)
+			aPtr[cnt]^=aBytes[cnt];
+	}
+	TRACE("Encription::xorCounters - end")
+}
+
 Rijndael128::Rijndael128()
 {
 	TRACE("Rijndael128::Rijndael128 - start")
 	byte aKey[]="sixtyfourbit.org";
-	rijndael_128_LTX__mcrypt_set_key(&itsRI, &aKey[0], R128SIZE);
+	setKey(&aKey[0]);
 	TRACE("Rijndael128::Rijndael128 - end")
 }
 
@@ -41,64 +145,64 @@ Rijndael128::Rijndael128(string theKey)
 	if(theKey.length()!=R128SIZE)
 		throw ThreadException("Rijndael128:Key size not allowed");
 	
-	rijndael_128_LTX__mcrypt_set_key(&itsRI, (byte*)theKey.data(), R128SIZE);
+	setKey((byte*)theKey.data());
 	TRACE("Rijndael128::Rijndael128 - end")
 }
 
-string Rijndael128::code(string& theBuffer)
+void Rijndael128::setKey(byte* theKey)
 {
-	TRACE("Rijndael128::code - start")
-	string aReturnString;
-	int blkcnt=theBuffer.length()/R128SIZE;
-	int rem=theBuffer.length()%R128SIZE;
-	byte* ptr=(byte*)theBuffer.data();
-	byte aBuffer[R128SIZE];
+	TRACE("Rijndael128::setKey - start")
+	rijndael_128_LTX__mcrypt_set_key(&itsRI, theKey, R128SIZE);
+	itsAccelerated=rijndael_128_aesni_supported() && rijndael_128_aesni_set_key(&itsAESNI, theKey, R128SIZE)==0;
+	TRACE("AES-NI=" << itsAccelerated)
+	TRACE("Rijndael128::setKey - end")
+}
 
-	for(int cnt=0; cnt < blkcnt; cnt++)	
-	{
-		memcpy(aBuffer,ptr+cnt*R128SIZE,R128SIZE);	
-		rijndael_128_LTX__mcrypt_encrypt(&itsRI,&aBuffer[0]);
-		aReturnString.append((const char*)&aBuffer[0],R128SIZE);
-	}
-	
-	if(rem>0)
-	{
-		memset(aBuffer,0,R128SIZE);
-		memcpy(aBuffer,ptr+blkcnt*R128SIZE,rem);	
-		rijndael_128_LTX__mcrypt_encrypt(&itsRI,&aBuffer[0]);
-		aReturnString.append((const char*)&aBuffer[0],R128SIZE);
-	}
-	
-	TRACE("Rijndael128::code - end")
-	return aReturnString;
+void Rijndael128::setAccelerated(bool theFlag)
+{
+	TRACE("Rijndael128::setAccelerated - start")
+	itsAccelerated=theFlag && rijndael_128_aesni_supported();
+	TRACE("Rijndael128::setAccelerated - end")
 }
 
-string Rijndael128::decode(string& theBuffer)
+void Rijndael128::codeBlocks(char* theBuffer,unsigned theSize)
 {
-	TRACE("Rijndael128::decode - start")
-	string aReturnString;
-	int blkcnt=theBuffer.length()/R128SIZE;
-	int rem=theBuffer.length()%R128SIZE;
-	byte* ptr=(byte*)theBuffer.data();
-	byte aBuffer[R128SIZE];
+	TRACE("Rijndael128::codeBlocks - start")
+	int blkcnt=theSize/R128SIZE;
+	byte* ptr=(byte*)theBuffer;
 
-	for(int cnt=0; cnt < blkcnt; cnt++)	
-	{
-		memcpy(aBuffer,ptr+cnt*R128SIZE,R128SIZE);	
-		rijndael_128_LTX__mcrypt_decrypt(&itsRI,&aBuffer[0]);
-		aReturnString.append((const char*)&aBuffer[0],R128SIZE);
-	}
+	if(itsAccelerated)
+		rijndael_128_aesni_encrypt(&itsAESNI,ptr,blkcnt);
+	else
+		for(int cnt=0; cnt < blkcnt; cnt++)	
+			rijndael_128_LTX__mcrypt_encrypt(&itsRI,ptr+cnt*R128SIZE);
 	
-	if(rem>0)
-	{
-		memset(aBuffer,0,R128SIZE);
-		memcpy(aBuffer,ptr+blkcnt*R128SIZE,rem);	
-		rijndael_128_LTX__mcrypt_decrypt(&itsRI,&aBuffer[0]);
-		aReturnString.append((const char*)&aBuffer[0],R128SIZE);
-	}
+	TRACE("Rijndael128::codeBlocks - end")
+}
+
+void Rijndael128::decodeBlocks(char* theBuffer,unsigned theSize)
+{
+	TRACE("Rijndael128::decodeBlocks - start")
+	int blkcnt=theSize/R128SIZE;
+	byte* ptr=(byte*)theBuffer;
+
+	if(itsAccelerated)
+		rijndael_128_aesni_decrypt(&itsAESNI,ptr,blkcnt);
+	else
+		for(int cnt=0; cnt < blkcnt; cnt++)	
+			rijndael_128_LTX__mcrypt_decrypt(&itsRI,ptr+cnt*R128SIZE);
 	
-	TRACE("Rijndael128::decode - end")
-	return aReturnString;
+	TRACE("Rijndael128::decodeBlocks - end")
+}
+
+void Rijndael128::xorCounters(char* theBuffer,unsigned theSize,const byte* theNonce,unsigned int theCounter)
+{
+	TRACE("Rijndael128::xorCounters - start")
+	if(itsAccelerated)
+		rijndael_128_aesni_ctr(&itsAESNI,theNonce,theCounter,(byte*)theBuffer,theSize);
+	else
+		Encription::xorCounters(theBuffer,theSize,theNonce,theCounter);
+	TRACE("Rijndael128::xorCounters - end")
 }
 
 Rijndael256::Rijndael256()
@@ -106,6 +210,7 @@ Rijndael256::Rijndael256()
 	TRACE("Rijndael256::Rijndael256 - start")
 	byte aKey[]="SuperKal1Frag1lySp1keSp1ral1d0s0";
 	rijndael_256_LTX__mcrypt_set_key(&itsRI, &aKey[0], R256SIZE);
+	itsAccelerated=true;
 	TRACE("Rijndael256::Rijndael256 - end")
 }
 
@@ -118,63 +223,284 @@ Rijndael256::Rijndael256(string theKey)
 	//BUFFER((char*)theKey.c_str(),theKey.size())
 	
 	rijndael_256_LTX__mcrypt_set_key(&itsRI, (byte*)theKey.data(), R256SIZE);
+	itsAccelerated=true;
 	TRACE("Rijndael256::Rijndael256 - end")
 }
 
-string Rijndael256::code(string& theBuffer)
+void Rijndael256::codeBlocks(char* theBuffer,unsigned theSize)
 {
-	TRACE("Rijndael256::code - start")
-	string aReturnString;
-	int blkcnt=theBuffer.length()/R256SIZE;
-	int rem=theBuffer.length()%R256SIZE;
-	byte* ptr=(byte*)theBuffer.data();
-	byte aBuffer[R256SIZE];
+	TRACE("Rijndael256::codeBlocks - start")
+	int blkcnt=theSize/R256SIZE;
+	byte* ptr=(byte*)theBuffer;
+
+	if(itsAccelerated)
+		rijndael_256_LTX__mcrypt_encrypt_blocks(&itsRI,ptr,blkcnt);
+	else
+		for(int cnt=0; cnt < blkcnt; cnt++)	
+			rijndael_256_LTX__mcrypt_encrypt(&itsRI,ptr+cnt*R256SIZE);
+	
+	TRACE("Rijndael256::codeBlocks - end")
+}
+
+void Rijndael256::decodeBlocks(char* theBuffer,unsigned theSize)
+{
+	TRACE("Rijndael256::decodeBlocks - start")
+	int blkcnt=theSize/R256SIZE;
+	byte* ptr=(byte*)theBuffer;
 
-	for(int cnt=0; cnt < blkcnt; cnt++)	
+	if(itsAccelerated)
+		rijndael_256_LTX__mcrypt_decrypt_blocks(&itsRI,ptr,blkcnt);
+	else
+		for(int cnt=0; cnt < blkcnt; cnt++)	
+			rijndael_256_LTX__mcrypt_decrypt(&itsRI,ptr+cnt*R256SIZE);
+	
+	TRACE("Rijndael256::decodeBlocks - end")
+}
+
+CounterMode::Semaphore::Semaphore()
+{
+#ifdef WIN32
+	itsHandle=CreateSemaphore(NULL,0,0x7FFFFFFF,NULL);
+	if(itsHandle==NULL)
+#else
+	if(sem_init(&itsHandle,0,0)!=0)
+#endif
+		throw ThreadException("CounterMode:Fail to create a semaphore");
+}
+
+CounterMode::Semaphore::~Semaphore()
+{
+#ifdef WIN32
+	CloseHandle(itsHandle);
+#else
+	sem_destroy(&itsHandle);
+#endif
+}
+
+void CounterMode::Semaphore::post()
+{
+#ifdef WIN32
+	ReleaseSemaphore(itsHandle,1,NULL);
+#else
+	sem_post(&itsHandle);
+#endif
+}
+
+void CounterMode::Semaphore::wait()
+{
+#ifdef WIN32
+	WaitForSingleObject(itsHandle,INFINITE);
+#else
+	while(sem_wait(&itsHandle)!=0 && errno==EINTR);
+#endif
+}
+
+CounterMode::Worker::Worker(const char* theName,CounterMode* theOwner)
+			:Thread(theName), itsOwner(theOwner), itsStopFlag(false)
+{
+	TRACE("CounterMode::Worker::Worker - start")
+	start();
+	TRACE("CounterMode::Worker::Worker - end")
+}
+
+CounterMode::Worker::~Worker()
+{
+	TRACE("CounterMode::Worker::~Worker - start")
+	shutdown();
+	TRACE("CounterMode::Worker::~Worker - end")
+}
+
+void CounterMode::Worker::post(char* theBuffer,unsigned theSize,const byte* theNonce,unsigned theFirstBlock)
+{
+	TRACE("CounterMode::Worker::post - start")
+	itsBuffer=theBuffer;
+	itsSize=theSize;
+	itsNonce=theNonce;
+	itsFirstBlock=theFirstBlock;
+	itsStart.post();
+	TRACE("CounterMode::Worker::post - end")
+}
+
+void CounterMode::Worker::shutdown()
+{
+	TRACE("CounterMode::Worker::shutdown - start")
+	if(!itsStopFlag)
 	{
-		memcpy(aBuffer,ptr+cnt*R256SIZE,R256SIZE);	
-		rijndael_256_LTX__mcrypt_encrypt(&itsRI,&aBuffer[0]);
-		aReturnString.append((const char*)&aBuffer[0],R256SIZE);
+		itsStopFlag=true;
+		itsStart.post();
+		while(!isRunning()) // stop() is a no-op before the thread is up
+			Thread::sleep(1);
+		stop(false);
 	}
-	
-	if(rem>0)
+	TRACE("CounterMode::Worker::shutdown - end")
+}
+
+void CounterMode::Worker::run()
+{
+	TRACE("CounterMode::Worker::run - start")
+	while(true)
 	{
-		memset(aBuffer,0,R256SIZE);
-		memcpy(aBuffer,ptr+blkcnt*R256SIZE,rem);	
-		rijndael_256_LTX__mcrypt_encrypt(&itsRI,&aBuffer[0]);
-		aReturnString.append((const char*)&aBuffer[0],R256SIZE);
+		itsStart.wait();
+		if(itsStopFlag)
+			break;
+		
+		itsOwner->apply(itsBuffer,itsSize,itsNonce,itsFirstBlock);
+		itsOwner->itsDone.post();
 	}
-	
-	TRACE("Rijndael256::code - end")
-	return aReturnString;
+	TRACE("CounterMode::Worker::run - end")
 }
 
-string Rijndael256::decode(string& theBuffer)
+CounterMode::CounterMode(Encription* theCipher,unsigned theThreads,unsigned theThreshold)
+			:itsCipher(theCipher), itsMutex("CounterMode"), itsThreshold(theThreshold), itsSequence(0)
 {
-	TRACE("Rijndael256::decode - start")
-	string aReturnString;
-	int blkcnt=theBuffer.length()/R256SIZE;
-	int rem=theBuffer.length()%R256SIZE;
-	byte* ptr=(byte*)theBuffer.data();
-	byte aBuffer[R256SIZE];
+	TRACE("CounterMode::CounterMode - start")
+	if(theCipher==NULL || theCipher->getBlockSize() < CTR_NONCE || CTR_BATCH % theCipher->getBlockSize()!=0)
+		throw ThreadException("CounterMode:Block cipher not allowed");
 
-	for(int cnt=0; cnt < blkcnt; cnt++)	
+	// Nonces must not repeat under the same key: a random prefix per instance
+	// and a message sequence, the block counter runs in the last 32 bits
+	if(!newPrefix())
+		throw ThreadException("CounterMode:No random source for the nonce");
+
+	if(theThreads==0)
 	{
-		memcpy(aBuffer,ptr+cnt*R256SIZE,R256SIZE);	
-		rijndael_256_LTX__mcrypt_decrypt(&itsRI,&aBuffer[0]);
-		aReturnString.append((const char*)&aBuffer[0],R256SIZE);
+		theThreads=MessageProxyFactory::getCPUCount();
+		if(theThreads > CTR_THREADS)
+			theThreads=CTR_THREADS;
 	}
+
+	for(unsigned cnt=1; cnt < theThreads; cnt++)
+		itsWorkers.push_back(new Worker("CounterModeWorker",this));
+	TRACE("Threads=" << getThreads())
+	TRACE("CounterMode::CounterMode - end")
+}
+
+CounterMode::~CounterMode()
+{
+	TRACE("CounterMode::~CounterMode - start")
+	for(unsigned cnt=0; cnt < itsWorkers.size(); cnt++)
+		delete itsWorkers[cnt];
+	delete itsCipher;
+	TRACE("CounterMode::~CounterMode - end")
+}
+
+void CounterMode::decodeInPlace(string& theBuffer)
+{
+	TRACE("CounterMode::decodeInPlace - start")
+	if(theBuffer.length() < CTR_NONCE)
+		throw ThreadException("CounterMode:Nonce missing");
 	
-	if(rem>0)
+	decodeBlocks(&theBuffer[0],theBuffer.length());
+	theBuffer.resize(theBuffer.length()-CTR_NONCE);
+	TRACE("CounterMode::decodeInPlace - end")
+}
+
+void CounterMode::codeBlocks(char* theBuffer,unsigned theSize)
+{
+	TRACE("CounterMode::codeBlocks - start")
+	byte* aNonce=(byte*)theBuffer+theSize-CTR_NONCE;
+	nextNonce(aNonce);
+	process(theBuffer,theSize-CTR_NONCE,aNonce);
+	TRACE("CounterMode::codeBlocks - end")
+}
+
+void CounterMode::decodeBlocks(char* theBuffer,unsigned theSize)
+{
+	TRACE("CounterMode::decodeBlocks - start")
+	process(theBuffer,theSize-CTR_NONCE,(byte*)theBuffer+theSize-CTR_NONCE);
+	TRACE("CounterMode::decodeBlocks - end")
+}
+
+// 8 random bytes of the OS mixed with the process id, the sequence restarts
+bool CounterMode::newPrefix()
+{
+	TRACE("CounterMode::newPrefix - start")
+	bool ret=false;
+#ifdef WIN32
+	HCRYPTPROV aProvider;
+	if(CryptAcquireContext(&aProvider,NULL,NULL,PROV_RSA_FULL,CRYPT_VERIFYCONTEXT))
+	{
+		ret=(CryptGenRandom(aProvider,sizeof(itsPrefix),itsPrefix)!=0);
+		CryptReleaseContext(aProvider,0);
+	}
+	unsigned long aPid=GetCurrentProcessId();
+#else
+	int aFile=open("/dev/urandom",O_RDONLY);
+	if(aFile>=0)
+	{
+		ret=(::read(aFile,itsPrefix,sizeof(itsPrefix))==sizeof(itsPrefix));
+		close(aFile);
+	}
+	unsigned long aPid=getpid();
+#endif
+	for(unsigned cnt=0; cnt < 4; cnt++)
+		itsPrefix[cnt]^=(byte)(aPid >> (24-8*cnt));
+	itsSequence=0;
+	TRACE("CounterMode::newPrefix - end")
+	return ret;
+}
+
+void CounterMode::nextNonce(byte* theNonce)
+{
+	TRACE("CounterMode::nextNonce - start")
+	itsMutex.wait();
+	if(itsSequence==0xFFFFFFFF && !newPrefix()) // A new prefix before the sequence wraps
 	{
-		memset(aBuffer,0,R256SIZE);
-		memcpy(aBuffer,ptr+blkcnt*R256SIZE,rem);	
-		rijndael_256_LTX__mcrypt_decrypt(&itsRI,&aBuffer[0]);
-		aReturnString.append((const char*)&aBuffer[0],R256SIZE);
+		itsMutex.release();
+		throw ThreadException("CounterMode:No random source for the nonce");
 	}
+	unsigned aSequence=itsSequence++;
+	memcpy(theNonce,itsPrefix,8);
+	itsMutex.release();
+
+	for(unsigned cnt=0; cnt < 4; cnt++)
+	{
+		theNonce[8+cnt]=(byte)(aSequence >> (24-8*cnt));
+		theNonce[12+cnt]=0;
+	}
+	TRACE("CounterMode::nextNonce - end")
+}
+
+// Below the threshold the caller does everything, otherwise each thread gets 
+// a slice aligned on the keystream batches
+void CounterMode::process(char* theBuffer,unsigned theSize,const byte* theNonce)
+{
+	TRACE("CounterMode::process - start")
+	if(theSize < itsThreshold || itsWorkers.empty())
+	{
+		apply(theBuffer,theSize,theNonce,0);
+		TRACE("CounterMode::process - end")
+		return;
+	}
+
+	unsigned aBlockSize=itsCipher->getBlockSize();
+	unsigned aSlice=(theSize+itsWorkers.size())/(itsWorkers.size()+1);
+	aSlice=((aSlice+CTR_BATCH-1)/CTR_BATCH)*CTR_BATCH;
+
+	itsMutex.wait();
+	unsigned aPosted=0;
+	for(unsigned cnt=0; cnt < itsWorkers.size() && (cnt+1)*aSlice < theSize; cnt++, aPosted++)
+	{
+		unsigned aStart=(cnt+1)*aSlice;
+		unsigned aSize=(theSize-aStart < aSlice) ? theSize-aStart : aSlice;
+		itsWorkers[cnt]->post(theBuffer+aStart,aSize,theNonce,aStart/aBlockSize);
+	}
+	apply(theBuffer,(theSize < aSlice) ? theSize : aSlice,theNonce,0);
 	
-	TRACE("Rijndael256::decode - end")
-	return aReturnString;
+	for(unsigned cnt=0; cnt < aPosted; cnt++)
+		itsDone.wait();
+	itsMutex.release();
+	TRACE("CounterMode::process - end")
+}
+
+// XOR of theBuffer with the keystream from block theFirstBlock on
+void CounterMode::apply(char* theBuffer,unsigned theSize,const byte* theNonce,unsigned theFirstBlock)
+{
+	TRACE("CounterMode::apply - start")
+	unsigned int aCounter=((unsigned int)theNonce[12] << 24) | ((unsigned int)theNonce[13] << 16)
+						 | ((unsigned int)theNonce[14] << 8) | theNonce[15];
+	itsCipher->xorCounters(theBuffer,theSize,theNonce,aCounter+theFirstBlock);
+	TRACE("CounterMode::apply - end")
 }
 
 string Encription::generateKey128(string theString)
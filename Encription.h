@@ -21,13 +21,32 @@
 #define __ENCRIPTION__
 
 #include "rijndael.h"
+#include "Thread.h"
 #include <string>
+#include <vector>
+#ifndef WIN32
+#include <semaphore.h>
+#endif
 
 class Encription
 {
 public:
-	virtual string code(string& theBuffer)=0;
-	virtual string decode(string& theBuffer)=0;
+	virtual ~Encription() {};
+	virtual string code(string& theBuffer);
+	virtual string decode(string& theBuffer);
+
+	// Buffer API: a coded buffer is zero padded to getCodedSize() and 
+	// ciphered in place, without other allocations
+	virtual unsigned getBlockSize()=0;
+	virtual unsigned getCodedSize(unsigned theSize);
+	virtual void codeInPlace(string& theBuffer);
+	virtual void decodeInPlace(string& theBuffer);
+	virtual void codeBlocks(char* theBuffer,unsigned theSize)=0; // theSize multiple of getBlockSize()
+	virtual void decodeBlocks(char* theBuffer,unsigned theSize)=0;
+
+	// Counter mode: XOR of theBuffer with the coded counter blocks, i.e. 12 bytes 
+	// of theNonce, the 32 bits big endian counter from theCounter on, zeros up to the block size
+	virtual void xorCounters(char* theBuffer,unsigned theSize,const byte* theNonce,unsigned int theCounter);
 	
 	static string generateKey128(string theString);
 	static string generateKey256(string theString);
@@ -36,30 +55,118 @@ protected:
 	static string toString(unsigned int theValue);	
 };
 
+// Uses AES-NI when the CPU supports it, else the portable rijndael-128.c
 class Rijndael128 : public Encription
 {
 protected:
 	RI itsRI;
+	RI_AESNI itsAESNI;
+	bool itsAccelerated;
 
 public:
 	Rijndael128();
 	Rijndael128(string theKey);
 	virtual ~Rijndael128() {};
-	virtual string code(string& theBuffer);
-	virtual string decode(string& theBuffer);
+	virtual unsigned getBlockSize() { return 16; };
+	virtual void codeBlocks(char* theBuffer,unsigned theSize);
+	virtual void decodeBlocks(char* theBuffer,unsigned theSize);
+	virtual void xorCounters(char* theBuffer,unsigned theSize,const byte* theNonce,unsigned int theCounter);
+	bool isAccelerated() { return itsAccelerated; };
+	void setAccelerated(bool theFlag);
+
+protected:
+	void setKey(byte* theKey);
 };
 
+// Uses the unrolled T-table kernels of rijndael-256.c, else its reference functions
 class Rijndael256 : public Encription
 {
 protected:
 	RI itsRI;
+	bool itsAccelerated;
 
 public:
 	Rijndael256();
 	Rijndael256(string theKey);
 	virtual ~Rijndael256() {};
-	virtual string code(string& theBuffer);
-	virtual string decode(string& theBuffer);
+	virtual unsigned getBlockSize() { return 32; };
+	virtual void codeBlocks(char* theBuffer,unsigned theSize);
+	virtual void decodeBlocks(char* theBuffer,unsigned theSize);
+	bool isAccelerated() { return itsAccelerated; };
+	void setAccelerated(bool theFlag) { itsAccelerated=theFlag; };
+};
+
+#define CTR_NONCE 16			// Bytes of nonce appended to every coded buffer
+#define CTR_THREADS 4			// Threads sharing a big buffer, the caller included
+#define CTR_PARALLEL_SIZE 65536	// Smaller buffers are ciphered by the caller only
+#define CTR_BATCH 512			// Keystream bytes produced by one call of the block cipher
+
+// Counter mode on top of a block cipher (e.g. Rijndael128): the keystream blocks
+// are independent, so a big buffer is split among a small pool of workers.
+// A coded buffer keeps its size and carries its nonce in the last CTR_NONCE bytes.
+class CounterMode : public Encription
+{
+protected:
+	class Semaphore
+	{
+	protected:
+#ifdef WIN32
+		HANDLE itsHandle;
+#else
+		sem_t itsHandle;
+#endif
+
+	public:
+		Semaphore();
+		~Semaphore();
+		void post();
+		void wait();
+	};
+
+	class Worker : public Thread
+	{
+	protected:
+		CounterMode* itsOwner;
+		Semaphore itsStart;
+		bool itsStopFlag;
+		char* itsBuffer;
+		unsigned itsSize;
+		const byte* itsNonce;
+		unsigned itsFirstBlock;
+
+	public:
+		Worker(const char* theName,CounterMode* theOwner);
+		virtual ~Worker();
+		void post(char* theBuffer,unsigned theSize,const byte* theNonce,unsigned theFirstBlock);
+		void shutdown();
+
+	protected:
+		virtual void run();
+	};
+
+	Encription* itsCipher;
+	vector<Worker*> itsWorkers;
+	Semaphore itsDone;
+	Thread itsMutex;	// Guards the workers and the nonce sequence
+	unsigned itsThreshold;
+	byte itsPrefix[8];
+	unsigned itsSequence;
+
+public:
+	CounterMode(Encription* theCipher,unsigned theThreads=0,unsigned theThreshold=CTR_PARALLEL_SIZE); // 0: up to CTR_THREADS, one per CPU
+	virtual ~CounterMode();
+	virtual unsigned getBlockSize() { return 1; };
+	virtual unsigned getCodedSize(unsigned theSize) { return theSize+CTR_NONCE; };
+	virtual void decodeInPlace(string& theBuffer);
+	virtual void codeBlocks(char* theBuffer,unsigned theSize); // theSize includes the nonce
+	virtual void decodeBlocks(char* theBuffer,unsigned theSize);
+	unsigned getThreads() { return itsWorkers.size()+1; };
+
+protected:
+	bool newPrefix();
+	void nextNonce(byte* theNonce);
+	void process(char* theBuffer,unsigned theSize,const byte* theNonce);
+	void apply(char* theBuffer,unsigned theSize,const byte* theNonce,unsigned theFirstBlock);
 };
 
 #ifdef WIN32
@@ -71,6 +178,13 @@ extern "C"
         int rijndael_256_LTX__mcrypt_set_key(RI * rinst, byte * key, int nk);
         void rijndael_256_LTX__mcrypt_encrypt(RI * rinst, byte * buff);
         void rijndael_256_LTX__mcrypt_decrypt(RI * rinst, byte * buff);
+        void rijndael_256_LTX__mcrypt_encrypt_blocks(RI * rinst, byte * buff, int blocks);
+        void rijndael_256_LTX__mcrypt_decrypt_blocks(RI * rinst, byte * buff, int blocks);
+        int rijndael_128_aesni_supported(void);
+        int rijndael_128_aesni_set_key(RI_AESNI * rinst, byte * key, int nk);
+        void rijndael_128_aesni_encrypt(RI_AESNI * rinst, byte * buff, int blocks);
+        void rijndael_128_aesni_decrypt(RI_AESNI * rinst, byte * buff, int blocks);
+        void rijndael_128_aesni_ctr(RI_AESNI * rinst, const byte * nonce, word32 counter, byte * buff, int len);
 }
 #endif
 
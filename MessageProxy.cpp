@@ -25,40 +25,87 @@ using namespace std;
 #include "Trace.h"
 #include "Logger.h"
 #include "GeneralHashFunctions.h"
+#ifndef WIN32
+#include <unistd.h>
+#endif
 
-#define SYNCVAL 0xbeef
+#define SYNCVAL 0xbeef		// Protocol version 1 frames
+#define SYNCVAL2 0xbef2		// Protocol version 2 frames
+#define SYNCVAL3 0xbef3		// Protocol version 3 frames: network messages carry a deadline
+#define HELLO_MAGIC 0x514d
 #define MAX_CONNECTIONS 100
 
+EncodedFrame* EncodedFrame::attach()
+{
+#ifdef WIN32
+	InterlockedIncrement(&itsRefCount);
+#else
+	__sync_add_and_fetch(&itsRefCount,1);
+#endif
+	return this;
+}
+
+void EncodedFrame::detach()
+{
+#ifdef WIN32
+	if(InterlockedDecrement(&itsRefCount)==0)
+#else
+	if(__sync_sub_and_fetch(&itsRefCount,1)==0)
+#endif
+		delete this;
+}
+
 NetworkMessage::NetworkMessage(NetworkMessage& o) // ++ v1.5
 	   		   :Message("NetworkMessage")
 {
 	itsTopic=o.itsTopic;
+	itsBuffer.reserve(o.itsBuffer.capacity()); // Keeps the room for the padding
 	itsBuffer=o.itsBuffer;
 	itsTarget=o.itsTarget;	
 	itsSender=o.itsSender;
+	itsRemoteSender=o.itsRemoteSender;
 	itsSeqNum=o.itsSeqNum;
+	itsNarrowFlag=o.itsNarrowFlag;
+	itsDeadlineFlag=o.itsDeadlineFlag;
+	itsDeadline=o.itsDeadline;
 	itsUnsolicitedFlag=o.itsUnsolicitedFlag;
 	itsBroadcastFlag=o.itsBroadcastFlag;
+	itsMulticastFlag=o.itsMulticastFlag;
+	itsFrame=(o.itsFrame!=NULL) ? o.itsFrame->attach() : NULL;
 } 
 
 NetworkMessage::NetworkMessage(char* theBuffer, unsigned short theLen) 
 	   		   :Message("NetworkMessage"), 
-	    	    itsTarget(0), itsRemoteSender(0), itsSeqNum(0), 
-	    	    itsUnsolicitedFlag(false), itsBroadcastFlag(false)
+	    	    itsTarget(0), itsRemoteSender(0), itsSeqNum(0), itsNarrowFlag(false), itsDeadlineFlag(false),
+	    	    itsUnsolicitedFlag(false), itsBroadcastFlag(false), itsMulticastFlag(false), itsFrame(NULL)
 {
 	if(theLen > 0xFFFF - sizeof(NetworkMessage::NetworkMessageHeader))
 		throw ThreadException("NetworkMessage is exceding permitted size");
 	itsBuffer.assign(theBuffer,theLen);
 }
 
-NetworkMessage::NetworkMessage(string theBuffer) 
+NetworkMessage::NetworkMessage(const string& theBuffer,Encription* theEncr) 
 	   		   :Message("NetworkMessage"), 
-	    	    itsTarget(0), itsRemoteSender(0),itsSeqNum(0), 
-	    	    itsUnsolicitedFlag(false), itsBroadcastFlag(false)
+	    	    itsTarget(0), itsRemoteSender(0),itsSeqNum(0), itsNarrowFlag(false), itsDeadlineFlag(false),
+	    	    itsUnsolicitedFlag(false), itsBroadcastFlag(false), itsMulticastFlag(false), itsFrame(NULL)
 {
 	if(theBuffer.length() > 0xFFFF - sizeof(NetworkMessage::NetworkMessageHeader))
 		throw ThreadException("NetworkMessage is exceding permitted size");
-	itsBuffer=theBuffer;
+	reserve(theBuffer.length(),theEncr);
+	itsBuffer.assign(theBuffer.data(),theBuffer.length());
+}
+
+// Allocates once the room for theSize bytes coded by theEncr: then code() works in place
+void NetworkMessage::reserve(unsigned theSize,Encription* theEncr)
+{
+	if(theEncr!=NULL)
+		theSize=theEncr->getCodedSize(theSize);
+
+	if(itsBuffer.capacity() < theSize)
+	{
+		itsBuffer.erase();
+		itsBuffer.reserve(theSize);
+	}
 }
 
 string NetworkMessage::toString()
@@ -71,13 +118,66 @@ string NetworkMessage::toString()
 	anHeader.seqnum=itsSeqNum; // ++ v1.1
 	anHeader.buflen=itsBuffer.length();
 	anHeader.topiclen=itsTopic.length(); // ++ v1.5
+	anHeader.deadline=0;
+	if(itsDeadlineFlag)
+	{
+		long aLeft=getTimeLeft();
+		anHeader.deadline=(aLeft > 0) ? aLeft : 1;
+	}
 	string aBuffer;
+	aBuffer.reserve(sizeof(anHeader)+itsTopic.length()+itsBuffer.length());
 	aBuffer.assign((char*)&anHeader,sizeof(anHeader));
 	aBuffer+=itsTopic; // ++ v1.5
 	aBuffer+=itsBuffer;
 	return aBuffer;	
 }
 
+unsigned int NetworkMessage::getSequenceNumber(unsigned int theLatest)
+{
+	if(!itsNarrowFlag)
+		return itsSeqNum;
+
+	return theLatest - (unsigned short)(theLatest - itsSeqNum);
+}
+
+void NetworkMessage::setDeadline(long theTimeout)
+{
+	thaw();
+	itsDeadlineFlag=(theTimeout > 0);
+	if(itsDeadlineFlag)
+		itsDeadline=Timer::addMillisecs(Timer::timeExt(),theTimeout);
+}
+
+long NetworkMessage::getTimeLeft()
+{
+	if(!itsDeadlineFlag)
+		return 0;
+
+	_TIMEVAL aNow=Timer::timeExt();
+	long aLeft=Timer::subtractMillisecs(&aNow,&itsDeadline);
+	return (aLeft > 0) ? aLeft : 0;
+}
+
+const string& NetworkMessage::freeze()
+{
+	if(itsFrame!=NULL && itsFrame->getSender()!=itsSender) // Sender changed after the encoding
+		thaw();
+
+	if(itsFrame==NULL)
+		itsFrame=new EncodedFrame(toString(),itsSender);
+
+	return itsFrame->get();
+}
+
+void NetworkMessage::thaw()
+{
+	if(itsFrame!=NULL)
+	{
+		itsFrame->detach();
+		itsFrame=NULL;
+	}
+}
+
 void NetworkMessage::toStream(ostream& theStream)
 {
 	theStream.write(itsBuffer.c_str(),itsBuffer.length());
@@ -85,26 +185,46 @@ void NetworkMessage::toStream(ostream& theStream)
 
 void NetworkMessage::code(Encription* theEncr) 
 {	
-	itsBuffer=theEncr->code(itsBuffer);
+	thaw();
+	theEncr->codeInPlace(itsBuffer);
 }
 
 void NetworkMessage::decode(Encription* theEncr)
 {
-	itsBuffer=theEncr->decode(itsBuffer);
+	thaw();
+	theEncr->decodeInPlace(itsBuffer);
 }
 
 void NetworkMessage::inflate(Compression* theCompr) 
 {	
-	itsBuffer=theCompr->inflate(itsBuffer);
+	thaw();
+	itsBuffer=theCompr->inflateShared(itsBuffer);
+}
+
+void NetworkMessage::deflate(Compression* theCompr,Encription* theEncr)
+{
+	thaw();
+	string aBuffer=theCompr->deflateShared(itsBuffer);
+	reserve(aBuffer.length(),theEncr);
+	itsBuffer.assign(aBuffer.data(),aBuffer.length()); // Within the capacity of the plain buffer
+}
+
+void NetworkMessage::inflate(Compression* theCompr,MQHANDLE theProxy,MQHANDLE theRemote) 
+{	
+	thaw();
+	itsBuffer=theCompr->inflate(itsBuffer,theProxy,theRemote);
 }
 
-void NetworkMessage::deflate(Compression* theCompr)
+void NetworkMessage::deflate(Compression* theCompr,MQHANDLE theProxy,MQHANDLE theRemote,Encription* theEncr)
 {
-	itsBuffer=theCompr->deflate(itsBuffer);
+	thaw();
+	string aBuffer=theCompr->deflate(itsBuffer,theProxy,theRemote);
+	reserve(aBuffer.length(),theEncr);
+	itsBuffer.assign(aBuffer.data(),aBuffer.length());
 }
 
-PingRequestMessage::PingRequestMessage(MQHANDLE theSenderID) 
-	   		  	   :Message("PingRequestMessage")
+PingRequestMessage::PingRequestMessage(MQHANDLE theSenderID,unsigned short theVersion) 
+	   		  	   :Message("PingRequestMessage"), itsVersion(theVersion)
 {
 	itsSender=theSenderID;
 }	   		  
@@ -115,6 +235,13 @@ string PingRequestMessage::toString()
 	anHeader.sender=itsSender;
 	string aBuffer;
 	aBuffer.assign((char*)&anHeader,sizeof(anHeader));
+	if(itsVersion>0)
+	{
+		Hello aHello;
+		aHello.magic=HELLO_MAGIC;
+		aHello.version=itsVersion;
+		aBuffer.append((char*)&aHello,sizeof(aHello));
+	}
 	return aBuffer;	
 }
 
@@ -192,6 +319,7 @@ Observer::Observer(const char* theName)
 	itsEncription=NULL;
 	itsCompression=NULL;
 	itsLastMessageProxy=0;
+	itsExpiredCnt=0;
 	TRACE("Observer::Observer - end")
 }
 
@@ -225,7 +353,7 @@ void Observer::post(MQHANDLE theTarget,NetworkMessage* theMessage)
 {
 	TRACE("Observer::post(static) - start")
 	if(itsCompression!=NULL)
-		theMessage->deflate(itsCompression);
+		theMessage->deflate(itsCompression,theTarget,theMessage->getTarget(),itsEncription); // Dictionaries cached per peer
 
 	if(itsEncription!=NULL)
 		theMessage->code(itsEncription);	
@@ -234,19 +362,23 @@ void Observer::post(MQHANDLE theTarget,NetworkMessage* theMessage)
 	TRACE("Observer::post(static) - end")
 }
 
-void Observer::publish(string theTopic,string theMessage)
+// Multicast only: MulticastPublisher sends it, the peers of the proxies don't get it
+void Observer::publish(string theTopic,string theMessage,bool theMulticastOnly)
 {
 	TRACE("Observer::publish - start")
-	NetworkMessage* aMessage=new NetworkMessage(theMessage);
+	NetworkMessage* aMessage=new NetworkMessage(theMessage,itsEncription);
 	aMessage->setBroadcasting();
+	if(theMulticastOnly)
+		aMessage->setMulticast();
 	aMessage->setTopic(theTopic);
 	aMessage->setSender(getID());
 	if(itsCompression!=NULL)
-		aMessage->deflate(itsCompression);
+		aMessage->deflate(itsCompression,itsEncription);
 
 	if(itsEncription!=NULL)
 		aMessage->code(itsEncription);	
 
+	aMessage->freeze(); // Every proxy will send the same bytes
 	MessageQueue::broadcast(aMessage);
 	TRACE("Observer::publish - end")
 }
@@ -283,7 +415,7 @@ void Observer::onMessage(Message* theMessage)
 			{
 				TRACE("Call onUnsolicited")
 				if(itsEncription!=NULL)	aRequest->decode(itsEncription);
-				if(itsCompression!=NULL) aRequest->inflate(itsCompression);
+				if(itsCompression!=NULL) aRequest->inflate(itsCompression,aRequest->getSender(),aRequest->getRemoteSender());
 				onUnsolicited(aRequest);	
 			}		
 			else if(aRequest->isBroadcasting())
@@ -306,15 +438,22 @@ void Observer::onMessage(Message* theMessage)
 				if(fire==true)
 				{
 					if(itsEncription!=NULL)	aRequest->decode(itsEncription);
-					if(itsCompression!=NULL) aRequest->inflate(itsCompression);
+					if(itsCompression!=NULL) aRequest->inflate(itsCompression); // Deflated once for all the subscribers
 					onBroadcast(aRequest);	
 				}
 			}		
 			else
 			{
 				TRACE("Call onNetworkMessage")
+				if(aRequest->isExpired())
+				{
+					TRACE("Request expired. Dropped!")
+					itsExpiredCnt++;
+					return;
+				}
+
 				if(itsEncription!=NULL)	aRequest->decode(itsEncription);
-				if(itsCompression!=NULL) aRequest->inflate(itsCompression);
+				if(itsCompression!=NULL) aRequest->inflate(itsCompression,aRequest->getSender(),aRequest->getRemoteSender());
 				NetworkMessage* aReply=onRequest(aRequest);
 				if(aReply!=NULL)
 				{
@@ -373,20 +512,35 @@ void Observer::encodeProperties(ListProperty& theProperties,string& theBuffer)
 	TRACE("Observer::encodeProperties - end")
 }
 
+unsigned MessageProxy::itsFlowWindow=0;
+
 MessageProxy::MessageProxy(const char* theName)
-			 :MessageQueue(theName)
+			 :MessageQueue(theName), itsFlowMutex(theName)
 {
 	TRACE("MessageProxy constructor - start")
 	TRACE("Name=" << theName)
 	itsSocket=NULL;
+	itsPeerVersion=1;
+	itsNegotiated=true;
+	initFlowControl();
 	TRACE("MessageProxy constructor - end")
 }
 
 MessageProxy::MessageProxy(const char* theName,Socket* theSocket)
-			 :MessageQueue(theName), itsSocket(theSocket)
+			 :MessageQueue(theName), itsSocket(theSocket), itsFlowMutex(theName)
 {
 	TRACE("MessageProxy constructor - start")
 	TRACE("Name=" << theName)
+	itsPeerVersion=1; // Until the hello of the peer
+	itsNegotiated=false;
+	initFlowControl();
+
+	// The hello is the first frame on the wire: the peer knows our version before
+	// any handle of ours reaches it
+	PingRequestMessage aHello(0,MQ_PROTOCOL_VERSION);
+	send(&aHello);
+	itsHelloTime=Timer::timeExt();
+	Timer::postToDefaultTimer(new Wakeup(this,HELLO_TIMEOUT,false));
 	
 #ifdef WIN32	
 	DWORD tid = 0;	
@@ -417,14 +571,34 @@ MessageProxy::~MessageProxy()
 		pthread_join(m_hThreadRx,NULL);
 #endif
 	}
-	
+
+	for(list<Message*>::iterator i=itsHeld.begin(); i!=itsHeld.end(); ++i)
+		delete *i;
+	itsHeld.clear();
+
+	for(list<Message*>::iterator i=itsWaiting.begin(); i!=itsWaiting.end(); ++i)
+		delete *i;
+	itsWaiting.clear();
 	TRACE("MessageProxy destructor - end")	
 }
 
+void MessageProxy::initFlowControl()
+{
+	itsFlowActive=false;
+	itsCredits=0;
+	itsStallCnt=0;
+	itsHeldCnt=0;
+	itsWindow=itsFlowWindow;
+	itsOwed=0;
+	itsCongested=0;
+	itsRetryArmed=false;
+	itsWithheldCnt=0;
+}
+
 string MessageProxy::getConnectionAddress(MQHANDLE theCaller,int& thePort)
 {
 	TRACE("MessageProxy::getConnectionAddress - start")
-	char anAddr[20];
+	char anAddr[128];
 	string aName=getName();
 	istrstream aStream(aName.c_str(),aName.size());
 	aStream.ignore(sizeof(MESSAGEPROXYHEADER)-1);
@@ -438,8 +612,193 @@ void MessageProxy::onMessage(Message* theMessage)
 {	
 	TRACE("MessageProxy::onMessage - start")
 	TRACE("Thread name=" << getName())
-	header anHeader;
-	anHeader.sync=SYNCVAL;
+	if(!itsNegotiated && !waitForPeer(theMessage))
+	{
+		TRACE("MessageProxy::onMessage - end")
+		return;
+	}
+
+	while(!itsWaiting.empty())
+	{
+		Message* aMessage=itsWaiting.front();
+		itsWaiting.pop_front();
+		dispatch(aMessage);
+		delete aMessage;
+	}
+
+	dispatch(theMessage);
+	TRACE("MessageProxy::onMessage - end")
+}
+
+void MessageProxy::dispatch(Message* theMessage)
+{	
+	TRACE("MessageProxy::dispatch - start")
+	if(theMessage->is("CreditMessage"))
+		onCredit((CreditMessage*)theMessage);
+	else if(theMessage->is("Wakeup"))
+		checkCongestion();
+	else if(theMessage->is("NetworkMessage") && ((NetworkMessage*)theMessage)->isExpired())
+	{
+		TRACE("Message expired. Dropped!") // Before it takes a credit
+	}
+	else if(theMessage->is("NetworkMessage") && ((NetworkMessage*)theMessage)->isMulticast())
+	{
+		TRACE("Multicast only. Not sent to the peer")
+	}
+	else if(itsFlowActive && theMessage->is("NetworkMessage") && (itsCredits==0 || !itsHeld.empty()))
+	{
+		TRACE("No credits: network message held")
+		if(itsHeld.empty())
+			itsStallCnt++;
+		itsHeld.push_back(theMessage->clone());
+		itsHeldCnt++;
+	}
+	else
+	{
+		if(itsFlowActive && theMessage->is("NetworkMessage"))
+			itsCredits--;
+		send(theMessage);
+	}
+	TRACE("MessageProxy::dispatch - end")
+}
+
+// Frames wait for the version of the peer: a newer peer sends its hello as the
+// first frame, an old one never does. Sent narrow, handles lose their generation.
+// Messages are queued until the hello arrives or the Wakeup armed on connection
+// gives up. Returns false when theMessage is queued.
+bool MessageProxy::waitForPeer(Message* theMessage)
+{
+	TRACE("MessageProxy::waitForPeer - start")
+	if(theMessage->is("Wakeup"))
+	{
+		_TIMEVAL aNow=Timer::timeExt();
+		long aLeft=HELLO_TIMEOUT - Timer::subtractMillisecs(&itsHelloTime,&aNow);
+		if(aLeft <= 0)
+		{
+			WARNING("No hello from the peer: protocol version 1 assumed")
+			itsNegotiated=true;
+			TRACE("MessageProxy::waitForPeer - end")
+			return true;
+		}
+
+		// A flow control retry or an early Wakeup: the hello may still come
+		Timer::postToDefaultTimer(new Wakeup(this,aLeft,false));
+	}
+
+	TRACE("Message waits for the hello of the peer")
+	Message* aMessage=theMessage->clone();
+	if(aMessage!=NULL)
+		itsWaiting.push_back(aMessage);
+	else
+		WARNING("Message can't wait for the hello of the peer. Dropped!")
+	TRACE("MessageProxy::waitForPeer - end")
+	return false;
+}
+
+void MessageProxy::onCredit(CreditMessage* theMessage)
+{
+	TRACE("MessageProxy::onCredit - start")
+	if(theMessage->isGrant())
+		send(theMessage);
+	else
+	{
+		TRACE("Credits granted by the peer=" << theMessage->getCredits())
+		itsFlowActive=true;
+		itsCredits+=theMessage->getCredits();
+		while(itsCredits>0 && !itsHeld.empty())
+		{
+			Message* aMessage=itsHeld.front();
+			itsHeld.pop_front();
+			if(((NetworkMessage*)aMessage)->isExpired())
+			{
+				TRACE("Held message expired. Dropped!")
+			}
+			else
+			{
+				itsCredits--;
+				send(aMessage);
+			}
+			delete aMessage;
+		}
+	}
+	TRACE("MessageProxy::onCredit - end")
+}
+
+void MessageProxy::consumeCredit(MQHANDLE theTarget)
+{
+	TRACE("MessageProxy::consumeCredit - start")
+	MessageQueue* aQueue=(theTarget!=0) ? lookup(theTarget) : NULL;
+	bool aFullFlag=(aQueue!=NULL && aQueue->getQueueSize() >= (int)itsWindow);
+	unsigned long aGrant=0;
+	unsigned long aBatch=(itsWindow>=4) ? itsWindow/4 : 1;
+
+	itsFlowMutex.wait();
+	itsOwed++;
+	if(aFullFlag && itsCongested==0)
+	{
+		itsCongested=theTarget;
+		itsWithheldCnt++;
+	}
+
+	if(itsCongested==0 && itsOwed>=aBatch)
+	{
+		aGrant=itsOwed;
+		itsOwed=0;
+	}
+
+	bool anArmFlag=(itsCongested!=0 && !itsRetryArmed);
+	if(anArmFlag)
+		itsRetryArmed=true;
+	itsFlowMutex.release();
+
+	if(aGrant>0)
+		post(new CreditMessage(aGrant,true));
+
+	if(anArmFlag)
+		Timer::postToDefaultTimer(new Wakeup(this,FLOW_RETRY_TIME,false));
+	TRACE("MessageProxy::consumeCredit - end")
+}
+
+void MessageProxy::checkCongestion()
+{
+	TRACE("MessageProxy::checkCongestion - start")
+	unsigned long aGrant=0;
+	itsFlowMutex.wait();
+	itsRetryArmed=false;
+	if(itsCongested!=0)
+	{
+		MessageQueue* aQueue=lookup(itsCongested);
+		if(aQueue==NULL || aQueue->getQueueSize() < (int)itsWindow/2)
+			itsCongested=0;
+	}
+
+	if(itsCongested==0 && itsOwed>0)
+	{
+		aGrant=itsOwed;
+		itsOwed=0;
+	}
+
+	bool anArmFlag=(itsCongested!=0);
+	if(anArmFlag)
+		itsRetryArmed=true;
+	itsFlowMutex.release();
+
+	if(aGrant>0)
+	{
+		CreditMessage aMessage(aGrant,true);
+		send(&aMessage);
+	}
+
+	if(anArmFlag)
+		Timer::postToDefaultTimer(new Wakeup(this,FLOW_RETRY_TIME,false));
+	TRACE("MessageProxy::checkCongestion - end")
+}
+
+void MessageProxy::send(Message* theMessage)
+{	
+	TRACE("MessageProxy::send - start")
+	header2 anHeader;
+	anHeader.sync=SYNCVAL3;
 		
 	TRACE("Message=" << theMessage->getClass())
 
@@ -477,14 +836,26 @@ void MessageProxy::onMessage(Message* theMessage)
 			anHeader.type=MQ_PROXY_PING_REPLY;
 			anHeader.target=((PingReplyMessage*)theMessage)->getTarget();
 		}
+		else if(theMessage->is("CreditMessage"))
+		{
+			if(itsPeerVersion < 2)
+			{
+				TRACE("Peer without flow control. Credits not sent")
+				return;
+			}
+			anHeader.type=MQ_PROXY_CREDIT;
+			anHeader.target=0;
+		}
 		else
 		{
 			WARNING("Message not allowed. Skipped!")
 			return;
 		}	
 	
-		string aBuffer=theMessage->toString();
-		int aLen=aBuffer.length();
+		string aBuffer;
+		const string& aBody=(theMessage->is("NetworkMessage")) ? 
+							((NetworkMessage*)theMessage)->freeze() : (aBuffer=theMessage->toString());
+		int aLen=aBody.length();
 		if(aLen + sizeof(NetworkMessage::NetworkMessageHeader) > 0xFFFF) // ++ v1.5
 		{
 			WARNING("Message too long. Dropped!")
@@ -496,13 +867,33 @@ void MessageProxy::onMessage(Message* theMessage)
 		TRACE("Target=" << anHeader.target)
 		TRACE("MsgLen=" << anHeader.msglen)
 	
-		if(anHeader.msglen>0)
+		if(anHeader.msglen>0 && itsPeerVersion>=3)
+		{
+			DUMP("Tx header",(char*)&anHeader,sizeof(header2));
+			DUMP("Tx buffer",(char*)aBody.data(),aBody.length());
+			itsSocket->SendBytes(string((char*)&anHeader,sizeof(header2)),aBody);
+		}
+		else if(anHeader.msglen>0 && itsPeerVersion==2)
+		{
+			anHeader.sync=SYNCVAL2;
+			string aBody2=dropDeadline(anHeader.type,aBody);
+			anHeader.msglen=aBody2.length();
+			DUMP("Tx header",(char*)&anHeader,sizeof(header2));
+			DUMP("Tx buffer",(char*)aBody2.data(),aBody2.length());
+			itsSocket->SendBytes(string((char*)&anHeader,sizeof(header2)),aBody2);
+		}
+		else if(anHeader.msglen>0)
 		{
-			DUMP("Tx header",(char*)&anHeader,sizeof(header));
+			header anHeader1;
+			anHeader1.sync=SYNCVAL;
+			anHeader1.type=anHeader.type;
+			anHeader1.target=(unsigned short)anHeader.target;
+			string aBody1=narrow(anHeader.type,aBody);
+			anHeader1.msglen=aBody1.length();
+			DUMP("Tx header",(char*)&anHeader1,sizeof(header));
 			//itsSocket->SendBuffer(&anHeader,sizeof(header));
-			aBuffer=string((char*)&anHeader,sizeof(header))+aBuffer;
-			DUMP("Tx buffer",(char*)aBuffer.data(),aBuffer.length());
-			itsSocket->SendBytes(aBuffer);
+			DUMP("Tx buffer",(char*)aBody1.data(),aBody1.length());
+			itsSocket->SendBytes(string((char*)&anHeader1,sizeof(header)),aBody1);
 			//BUFFER((char*)&anHeader,sizeof(header))
 		}
 		else
@@ -519,7 +910,83 @@ void MessageProxy::onMessage(Message* theMessage)
 		CRITICAL("Unhandled exception")
 	}
 	
-	TRACE("MessageProxy::onMessage - end")
+	TRACE("MessageProxy::send - end")
+}
+
+// Version 1 image of a frame body, for peers without the hello
+string MessageProxy::narrow(unsigned short theType,const string& theBody)
+{
+	TRACE("MessageProxy::narrow - start")
+	string aBody;
+	if((theType==MQ_PROXY_MESSAGE || theType==MQ_PROXY_UNSOLICITED || theType==MQ_PROXY_BROADCAST) && 
+	   theBody.length() >= sizeof(NetworkMessage::NetworkMessageHeader))
+	{
+		NetworkMessage::NetworkMessageHeader anHeader;
+		memcpy(&anHeader,theBody.data(),sizeof(anHeader));
+		NetworkMessage::NetworkMessageHeader1 anHeader1;
+		anHeader1.sender=(unsigned short)anHeader.sender;
+		anHeader1.seqnum=(unsigned short)anHeader.seqnum;
+		anHeader1.topiclen=anHeader.topiclen;
+		anHeader1.buflen=anHeader.buflen;
+		aBody.assign((char*)&anHeader1,sizeof(anHeader1));
+		aBody.append(theBody,sizeof(anHeader),string::npos);
+	}
+	else if(theType==MQ_PROXY_LOOKUP_REQUEST && theBody.length() >= sizeof(LookupRequestMessage::LookupRequest))
+	{
+		LookupRequestMessage::LookupRequest anHeader;
+		memcpy(&anHeader,theBody.data(),sizeof(anHeader));
+		LookupRequestMessage::LookupRequest1 anHeader1;
+		anHeader1.sender=(unsigned short)anHeader.sender;
+		anHeader1.namelen=anHeader.namelen;
+		aBody.assign((char*)&anHeader1,sizeof(anHeader1));
+		aBody.append(theBody,sizeof(anHeader),string::npos);
+	}
+	else if(theType==MQ_PROXY_LOOKUP_REPLY && theBody.length() >= sizeof(LookupReplyMessage::LookupReply))
+	{
+		LookupReplyMessage::LookupReply aReply;
+		memcpy(&aReply,theBody.data(),sizeof(aReply));
+		LookupReplyMessage::LookupReply1 aReply1;
+		aReply1.fail=aReply.fail;
+		aReply1.handle=(unsigned short)aReply.handle;
+		aBody.assign((char*)&aReply1,sizeof(aReply1));
+	}
+	else if(theType==MQ_PROXY_PING_REQUEST && theBody.length() >= sizeof(PingRequestMessage::PingRequest))
+	{
+		PingRequestMessage::PingRequest aPing;
+		memcpy(&aPing,theBody.data(),sizeof(aPing));
+		PingRequestMessage::PingRequest1 aPing1;
+		aPing1.sender=(unsigned short)aPing.sender;
+		aBody.assign((char*)&aPing1,sizeof(aPing1));
+		aBody.append(theBody,sizeof(aPing),string::npos);
+	}
+	else
+		aBody=theBody;
+	TRACE("MessageProxy::narrow - end")
+	return aBody;
+}
+
+// Protocol version 2 network messages have no deadline
+string MessageProxy::dropDeadline(unsigned short theType,const string& theBody)
+{
+	TRACE("MessageProxy::dropDeadline - start")
+	string aBody;
+	if((theType==MQ_PROXY_MESSAGE || theType==MQ_PROXY_UNSOLICITED || theType==MQ_PROXY_BROADCAST) && 
+	   theBody.length() >= sizeof(NetworkMessage::NetworkMessageHeader))
+	{
+		NetworkMessage::NetworkMessageHeader anHeader;
+		memcpy(&anHeader,theBody.data(),sizeof(anHeader));
+		NetworkMessage::NetworkMessageHeader2 anHeader2;
+		anHeader2.sender=anHeader.sender;
+		anHeader2.seqnum=anHeader.seqnum;
+		anHeader2.topiclen=anHeader.topiclen;
+		anHeader2.buflen=anHeader.buflen;
+		aBody.assign((char*)&anHeader2,sizeof(anHeader2));
+		aBody.append(theBody,sizeof(anHeader),string::npos);
+	}
+	else
+		aBody=theBody;
+	TRACE("MessageProxy::dropDeadline - end")
+	return aBody;
 }
 
 void MessageProxy::receive()
@@ -528,6 +995,9 @@ void MessageProxy::receive()
 	TRACE("Thread name=" << getName())
 	
 	char* aBuffer=new char[0x10000];
+
+	if(itsWindow>0)
+		post(new CreditMessage(itsWindow,true)); // Initial grant to the peer
 	
 	while (true) 
 	{
@@ -536,20 +1006,44 @@ void MessageProxy::receive()
 			TESTCANCEL		
 			TRACE("Wait a message")
 
-			header anHeader;
-			if(itsSocket->ReceiveBuffer(&anHeader,sizeof(header))==false)
+			header anHeader1;
+			if(itsSocket->ReceiveBuffer(&anHeader1,sizeof(header))==false)
 			{
 				WARNING("Socket Rx returns an error")
 				break;
 			}
+
+			header2 anHeader;
+			bool aWideFlag=(anHeader1.sync==SYNCVAL2 || anHeader1.sync==SYNCVAL3);
+			memcpy(&anHeader,&anHeader1,sizeof(header));
+			if(aWideFlag)
+			{
+				if(itsSocket->ReceiveBuffer((char*)&anHeader+sizeof(header),sizeof(header2)-sizeof(header))==false)
+				{
+					WARNING("Socket Rx returns an error")
+					break;
+				}
+			}
+			else if(anHeader1.sync==SYNCVAL)
+			{
+				anHeader.target=anHeader1.target;
+				if(anHeader.target!=0)
+					anHeader.target=widen(anHeader.target);
+				anHeader.msglen=anHeader1.msglen;
+			}
 	
 			TESTCANCEL		
-			DUMP("Rx header",(char*)&anHeader,sizeof(header));
+			DUMP("Rx header",(char*)&anHeader1,sizeof(header));
 	
-			if(anHeader.sync==SYNCVAL)
+			if(anHeader.sync==SYNCVAL || aWideFlag)
 			{
 				TRACE("Valid sync")
 				TRACE("Message lenght=" << anHeader.msglen)
+				if(anHeader.msglen > 0xFFFF)
+				{
+					WARNING("Buffer overflow detected. Drop connection!")
+					break;	
+				}
 	
 				if(anHeader.msglen>0)
 					if(itsSocket->ReceiveBuffer(aBuffer,anHeader.msglen)==false)
@@ -566,29 +1060,53 @@ void MessageProxy::receive()
 				if(anHeader.type==MQ_PROXY_MESSAGE || anHeader.type==MQ_PROXY_UNSOLICITED || anHeader.type==MQ_PROXY_BROADCAST) // ++v1.5
 				{
 					TRACE("type==MQ_PROXY_MESSAGE OR MQ_PROXY_UNSOLICITED OR MQ_PROXY_BROADCAST")
-					NetworkMessage::NetworkMessageHeader* aNMHeader=(NetworkMessage::NetworkMessageHeader*)aBuffer;
-					if((aNMHeader->topiclen > 0xFFFF - sizeof(aNMHeader) - aNMHeader->buflen) || // ++ v1.5
-					   (aNMHeader->buflen > 0xFFFF - sizeof(aNMHeader) - aNMHeader->topiclen)) 
+					NetworkMessage::NetworkMessageHeader aNMHeader;
+					unsigned aHeaderLen;
+					if(anHeader.sync==SYNCVAL3)
+					{
+						aHeaderLen=sizeof(NetworkMessage::NetworkMessageHeader);
+						memcpy(&aNMHeader,aBuffer,aHeaderLen);
+					}
+					else if(aWideFlag)
+					{
+						NetworkMessage::NetworkMessageHeader2* aNMHeader2=(NetworkMessage::NetworkMessageHeader2*)aBuffer;
+						aHeaderLen=sizeof(NetworkMessage::NetworkMessageHeader2);
+						aNMHeader.sender=aNMHeader2->sender;
+						aNMHeader.seqnum=aNMHeader2->seqnum;
+						aNMHeader.topiclen=aNMHeader2->topiclen;
+						aNMHeader.buflen=aNMHeader2->buflen;
+						aNMHeader.deadline=0;
+					}
+					else
+					{
+						NetworkMessage::NetworkMessageHeader1* aNMHeader1=(NetworkMessage::NetworkMessageHeader1*)aBuffer;
+						aHeaderLen=sizeof(NetworkMessage::NetworkMessageHeader1);
+						aNMHeader.sender=aNMHeader1->sender;
+						aNMHeader.seqnum=aNMHeader1->seqnum;
+						aNMHeader.topiclen=aNMHeader1->topiclen;
+						aNMHeader.buflen=aNMHeader1->buflen;
+						aNMHeader.deadline=0;
+					}
+
+					if(aHeaderLen + aNMHeader.topiclen + aNMHeader.buflen > anHeader.msglen) // ++ v1.5
 					{
 						WARNING("Buffer overflow detected. Drop connection!")
 						break;	
 					}
 					
-					DUMP("NetworkMessage Rx header",(char*)aNMHeader,sizeof(NetworkMessage::NetworkMessageHeader));
-					TRACE("Sender=" << aNMHeader->sender)
-					TRACE("Sequence=" << aNMHeader->seqnum)
-					TRACE("Topic lenght=" << aNMHeader->topiclen) // ++ v1.5
-					TRACE("Buffer lenght=" << aNMHeader->buflen)
-
-					//BUFFER((char*)aNMHeader,sizeof(NetworkMessage::NetworkMessageHeader));
-
-					char* aTopic=aBuffer+sizeof(NetworkMessage::NetworkMessageHeader); // ++ v1.5
-					char* aBufPtr=aTopic+aNMHeader->topiclen;
+					DUMP("NetworkMessage Rx header",aBuffer,aHeaderLen);
+					TRACE("Sender=" << aNMHeader.sender)
+					TRACE("Sequence=" << aNMHeader.seqnum)
+					TRACE("Topic lenght=" << aNMHeader.topiclen) // ++ v1.5
+					TRACE("Buffer lenght=" << aNMHeader.buflen)
+
+					char* aTopic=aBuffer+aHeaderLen; // ++ v1.5
+					char* aBufPtr=aTopic+aNMHeader.topiclen;
 					
-					NetworkMessage* aNetworkMessage=new NetworkMessage(aBufPtr,aNMHeader->buflen);
+					NetworkMessage* aNetworkMessage=new NetworkMessage(aBufPtr,aNMHeader.buflen);
 
-					if(aNMHeader->topiclen>0) // ++ v1.5
-						aNetworkMessage->setTopic(aTopic,aNMHeader->topiclen); 
+					if(aNMHeader.topiclen>0) // ++ v1.5
+						aNetworkMessage->setTopic(aTopic,aNMHeader.topiclen); 
 	
 					if(anHeader.type==MQ_PROXY_UNSOLICITED)
 						aNetworkMessage->setUnsolicited();					
@@ -596,12 +1114,16 @@ void MessageProxy::receive()
 						aNetworkMessage->setBroadcasting();
 	
 					aNetworkMessage->setSender(getID()); // v1.5
-					aNetworkMessage->setRemoteSender(aNMHeader->sender); // v1.5
+					aNetworkMessage->setRemoteSender(aNMHeader.sender); // v1.5
 					aNetworkMessage->setTarget(anHeader.target);				
-					aNetworkMessage->setSequenceNumber(aNMHeader->seqnum); // ++  v1.1
+					aNetworkMessage->setSequenceNumber(aNMHeader.seqnum); // ++  v1.1
+					aNetworkMessage->setDeadline(aNMHeader.deadline); // Time left: clocks of the hosts may differ
+					if(!aWideFlag)
+						aNetworkMessage->setNarrow();
 					
 					if(anHeader.type==MQ_PROXY_BROADCAST)
 					{
+						aNetworkMessage->freeze(); // Relayed unchanged by other proxies
 						broadcast(aNetworkMessage);
 						TRACE("Message broadcasted")
 					}
@@ -610,37 +1132,54 @@ void MessageProxy::receive()
 						post(anHeader.target,aNetworkMessage);
 						TRACE("Message delivered")
 					}
+
+					if(itsWindow>0)
+						consumeCredit((anHeader.type==MQ_PROXY_BROADCAST) ? 0 : anHeader.target);
 				}
 				else if(anHeader.type==MQ_PROXY_LOOKUP_REQUEST)
 				{
 					TRACE("type==MQ_PROXY_LOOKUP_REQUEST")
-					LookupRequestMessage::LookupRequest* aLookup=(LookupRequestMessage::LookupRequest*)aBuffer;
-					if(aLookup->namelen > 0xFFFF - sizeof(aLookup))
+					LookupRequestMessage::LookupRequest aLookup;
+					unsigned aHeaderLen;
+					if(aWideFlag)
+					{
+						aHeaderLen=sizeof(LookupRequestMessage::LookupRequest);
+						memcpy(&aLookup,aBuffer,aHeaderLen);
+					}
+					else
+					{
+						LookupRequestMessage::LookupRequest1* aLookup1=(LookupRequestMessage::LookupRequest1*)aBuffer;
+						aHeaderLen=sizeof(LookupRequestMessage::LookupRequest1);
+						aLookup.sender=aLookup1->sender;
+						aLookup.namelen=aLookup1->namelen;
+					}
+
+					if(aHeaderLen + aLookup.namelen > anHeader.msglen)
 					{
 						WARNING("Buffer overflow detected. Drop connection!")
 						break;	
 					}
 	
-					DUMP("Lookup Rx header",(char*)aLookup,sizeof(aLookup));
-					const char* aNamePtr=aBuffer+sizeof(LookupRequestMessage::LookupRequest);
+					DUMP("Lookup Rx header",aBuffer,aHeaderLen);
+					const char* aNamePtr=aBuffer+aHeaderLen;
 					string aName;
-					aName.assign(aNamePtr,aLookup->namelen);
+					aName.assign(aNamePtr,aLookup.namelen);
 					
 					MQHANDLE anHandle;
 					if(lookup(aName.c_str(),anHandle))
 					{
 						TRACE("Lookup of " << aName.c_str() << " ok")
-						TRACE("Sender=" << aLookup->sender)
+						TRACE("Sender=" << aLookup.sender)
 						TRACE("Handle=" << anHandle)
-						LookupReplyMessage* aMessage=new LookupReplyMessage(aLookup->sender,anHandle); // ++ v1.5
+						LookupReplyMessage* aMessage=new LookupReplyMessage(aLookup.sender,anHandle); // ++ v1.5
 						aMessage->setSender(getID()); // ++ v1.5
 						post(aMessage);	// v1.5
 					}
 					else
 					{
 						TRACE("Lookup failed")
-						TRACE("Sender=" << aLookup->sender)
-						LookupReplyMessage* aMessage=new LookupReplyMessage(aLookup->sender); // ++ v1.5
+						TRACE("Sender=" << aLookup.sender)
+						LookupReplyMessage* aMessage=new LookupReplyMessage(aLookup.sender); // ++ v1.5
 						aMessage->setSender(getID()); // ++ v1.5
 						post(aMessage);	// v1.5
 					}
@@ -648,25 +1187,55 @@ void MessageProxy::receive()
 				else if(anHeader.type==MQ_PROXY_LOOKUP_REPLY)
 				{
 					TRACE("type==MQ_PROXY_LOOKUP_REPLY")
-					LookupReplyMessage::LookupReply* aLookup=(LookupReplyMessage::LookupReply*)aBuffer;
+					LookupReplyMessage::LookupReply aLookup;
+					if(aWideFlag)
+						memcpy(&aLookup,aBuffer,sizeof(aLookup));
+					else
+					{
+						LookupReplyMessage::LookupReply1* aLookup1=(LookupReplyMessage::LookupReply1*)aBuffer;
+						aLookup.fail=aLookup1->fail;
+						aLookup.handle=aLookup1->handle;
+					}
 					LookupReplyMessage* aReply;
 	
-					if(aLookup->fail)
+					if(aLookup.fail)
 						aReply=new LookupReplyMessage();
 					else
-						aReply=new LookupReplyMessage(*aLookup);				
+						aReply=new LookupReplyMessage(aLookup);				
 	
 					aReply->setSender(getID());
+					MessageProxyFactory::onLookupReply(getName(),getID(),anHeader.target,aReply);
 					post(anHeader.target,aReply);				
 					TRACE("Lookup delivered")
 				}
 				else if(anHeader.type==MQ_PROXY_PING_REQUEST)
 				{
 					TRACE("type==MQ_PROXY_PING_REQUEST")
-					PingRequestMessage::PingRequest* aPing=(PingRequestMessage::PingRequest*)aBuffer;
-					PingReplyMessage* aMessage=new PingReplyMessage(aPing->sender);
-					aMessage->setSender(getID()); // ++ v1.5
-					post(aMessage);	// v1.5
+					unsigned aHeaderLen=(aWideFlag) ? sizeof(PingRequestMessage::PingRequest) : sizeof(PingRequestMessage::PingRequest1);
+					MQHANDLE aSender=(aWideFlag) ? ((PingRequestMessage::PingRequest*)aBuffer)->sender :
+												   ((PingRequestMessage::PingRequest1*)aBuffer)->sender;
+					PingRequestMessage::Hello* aHello=(PingRequestMessage::Hello*)(aBuffer+aHeaderLen);
+					if(aSender==0 && anHeader.msglen >= aHeaderLen+sizeof(PingRequestMessage::Hello) && aHello->magic==HELLO_MAGIC)
+					{
+						itsPeerVersion=(aHello->version < MQ_PROTOCOL_VERSION) ? aHello->version : MQ_PROTOCOL_VERSION;
+						TRACE("Peer protocol version=" << itsPeerVersion)
+						itsNegotiated=true;
+						post(new Wakeup(this,0,false)); // Sends the messages waiting for the hello
+					}
+					else
+					{
+						PingReplyMessage* aMessage=new PingReplyMessage(aSender);
+						aMessage->setSender(getID()); // ++ v1.5
+						post(aMessage);	// v1.5
+					}
+				}
+				else if(anHeader.type==MQ_PROXY_CREDIT)
+				{
+					TRACE("type==MQ_PROXY_CREDIT")
+					unsigned int aCredits=0;
+					if(anHeader.msglen>=sizeof(aCredits))
+						memcpy(&aCredits,aBuffer,sizeof(aCredits));
+					post(new CreditMessage(aCredits,false));
 				}
 				else if(anHeader.type==MQ_PROXY_PING_REPLY)
 				{
@@ -704,6 +1273,7 @@ void MessageProxy::receive()
   	TRACE("Close socket and stop also Tx tread")
 
 	delete [] aBuffer;			
+	itsNegotiated=true;
 	Thread::stop(false);
   	itsSocket->Close();
   	
@@ -713,6 +1283,7 @@ void MessageProxy::receive()
 }
 
 Thread MessageProxyFactory::itsMutex("MessageProxyFactoryMutex");
+map<string,MessageProxyFactory::LookupEntry> MessageProxyFactory::itsLookupCache;
 
 void MessageProxyFactory::ping(const char* theHost, unsigned thePort,
 							   MessageQueue* theSourceQueue)
@@ -727,12 +1298,131 @@ void MessageProxyFactory::lookupAt(const char* theHost, unsigned thePort,
 								   const char* theRemoteQueueName,MessageQueue* theSourceQueue)
 {
 	TRACE("MessageFactory::lookupAt(static) - start")
-	LookupRequestMessage* aMessage=new LookupRequestMessage(theRemoteQueueName,theSourceQueue->getID());
-    MessageProxyFactory::post(theHost,thePort,aMessage,theSourceQueue->getID());
+	string aKey=getProxyName(theHost,thePort)+theRemoteQueueName;
+	MQHANDLE aSource=theSourceQueue->getID();
+	unsigned long aTime=Timer::time();
+
+	itsMutex.wait();
+	map<string,LookupEntry>::iterator i=itsLookupCache.find(aKey);
+	if(i!=itsLookupCache.end())
+	{
+		LookupEntry& anEntry=i->second;
+		if(anEntry.proxy!=0)
+		{
+			if(aTime - anEntry.time < LOOKUP_CACHE_TTL && MessageQueue::isStillAvailable(anEntry.proxy))
+			{
+				TRACE("Lookup cache hit")
+				LookupReplyMessage* aReply=new LookupReplyMessage(aSource,anEntry.handle);
+				aReply->setSender(anEntry.proxy);
+				itsMutex.release();
+				Decoupler::deferredPost(aSource,aReply);
+				TRACE("MessageFactory::lookupAt(static) - end")
+				return;
+			}
+
+			itsLookupCache.erase(i); // Expired or connection lost
+		}
+		else if(aTime - anEntry.time < LOOKUP_PENDING_TIMEOUT)
+		{
+			TRACE("Lookup already in progress")
+			anEntry.waiters.push_back(aSource);
+			itsMutex.release();
+			TRACE("MessageFactory::lookupAt(static) - end")
+			return;
+		}
+	}
+
+	// New lookup, or a pending one sent again together with its waiters
+	LookupEntry& anEntry=itsLookupCache[aKey];
+	anEntry.proxy=0;
+	anEntry.handle=0;
+	anEntry.time=aTime;
+	anEntry.waiters.insert(anEntry.waiters.begin(),aSource);
+	itsMutex.release();
+
+	LookupRequestMessage* aMessage=new LookupRequestMessage(theRemoteQueueName,aSource);
+    if(!MessageProxyFactory::post(theHost,thePort,aMessage,aSource))
+    {
+		// The source has already been notified by post
+		itsMutex.wait();
+		i=itsLookupCache.find(aKey);
+		if(i!=itsLookupCache.end() && i->second.proxy==0)
+		{
+			vector<MQHANDLE>& aWaiters=i->second.waiters;
+			for(unsigned j=0; j < aWaiters.size(); j++)
+				if(aWaiters[j]!=aSource)
+					Decoupler::deferredPost(aWaiters[j],new LookupReplyMessage());
+			itsLookupCache.erase(i);
+		}
+		itsMutex.release();
+    }
 	TRACE("MessageFactory::lookupAt(static) - end")
 }
 
-void MessageProxyFactory::post(const char* theHost, unsigned thePort,Message* theMessage,MQHANDLE theSender)
+void MessageProxyFactory::invalidateLookup(const char* theHost, unsigned thePort,const char* theRemoteQueueName)
+{
+	TRACE("MessageFactory::invalidateLookup(static) - start")
+	itsMutex.wait();
+	map<string,LookupEntry>::iterator i=itsLookupCache.find(getProxyName(theHost,thePort)+theRemoteQueueName);
+	if(i!=itsLookupCache.end() && i->second.proxy!=0)
+		itsLookupCache.erase(i);
+	itsMutex.release();
+	TRACE("MessageFactory::invalidateLookup(static) - end")
+}
+
+void MessageProxyFactory::onLookupReply(const char* theProxyName,MQHANDLE theProxy,MQHANDLE theTarget,LookupReplyMessage* theReply)
+{
+	TRACE("MessageFactory::onLookupReply(static) - start")
+	// Replies come back in the order of the requests: the oldest pending
+	// lookup sent by theTarget on this proxy is the one answered
+	string aPrefix=theProxyName;
+	itsMutex.wait();
+	map<string,LookupEntry>::iterator aFound=itsLookupCache.end();
+	for(map<string,LookupEntry>::iterator i=itsLookupCache.lower_bound(aPrefix); 
+	    i!=itsLookupCache.end() && i->first.compare(0,aPrefix.size(),aPrefix)==0; ++i)
+	{
+		LookupEntry& anEntry=i->second;
+		if(anEntry.proxy==0 && !anEntry.waiters.empty() && anEntry.waiters[0]==theTarget &&
+		   (aFound==itsLookupCache.end() || anEntry.time < aFound->second.time))
+			aFound=i;
+	}
+
+	if(aFound!=itsLookupCache.end())
+	{
+		vector<MQHANDLE>& aWaiters=aFound->second.waiters;
+		for(unsigned j=1; j < aWaiters.size(); j++)
+		{
+			LookupReplyMessage* aReply=theReply->isFailed() ? new LookupReplyMessage() : 
+								       new LookupReplyMessage(aWaiters[j],theReply->getHandle());
+			aReply->setSender(theProxy);
+			MessageQueue::post(aWaiters[j],aReply);
+		}
+
+		if(theReply->isFailed())
+			itsLookupCache.erase(aFound);
+		else
+		{
+			aFound->second.proxy=theProxy;
+			aFound->second.handle=theReply->getHandle();
+			aFound->second.time=Timer::time();
+			aWaiters.clear();
+		}
+	}
+	itsMutex.release();
+	TRACE("MessageFactory::onLookupReply(static) - end")
+}
+
+string MessageProxyFactory::getProxyName(const char* theHost, unsigned thePort)
+{
+	ostrstream aStream;
+	aStream << MESSAGEPROXYHEADER << theHost << "," << thePort << ")" << ends;
+	char* aName=aStream.str();
+	string ret=aName;
+	delete [] aName;
+	return ret;
+}
+
+bool MessageProxyFactory::post(const char* theHost, unsigned thePort,Message* theMessage,MQHANDLE theSender)
 {
 	TRACE("MessageFactory::post(static) - start")
 	ostrstream aStream;
@@ -758,7 +1448,12 @@ void MessageProxyFactory::post(const char* theHost, unsigned thePort,Message* th
 		
 		try
 		{
-			aSocket=new SocketClient(string(theHost),thePort);
+#ifndef WIN32
+			if(string(theHost).compare(0,sizeof(LOCALSOCKETPREFIX)-1,LOCALSOCKETPREFIX)==0)
+				aSocket=new LocalSocketClient(string(theHost+sizeof(LOCALSOCKETPREFIX)-1));
+			else
+#endif
+				aSocket=new SocketClient(string(theHost),thePort);
 			TRACE("New client connection created")
 			aProxy=new MessageProxy(aName,aSocket);
 			aProxy->post(theMessage);
@@ -781,29 +1476,82 @@ void MessageProxyFactory::post(const char* theHost, unsigned thePort,Message* th
 			itsMutex.release();
 			string aMsg=string("Fail to create new server connection: ") + exc.getMessage();
 			LOG(aMsg.c_str())
-			return;
+			return false;
 		}
 	}
 
 	itsMutex.release();  // ++ v1.5
 	delete[] aName;		
 	TRACE("MessageFactory::post(static) - end")
+	return true;
 }
 
 MessageProxyFactory::MessageProxyFactory(const char* theName,int theSocket)
 	  				:Thread(theName), SocketServer(theSocket,MAX_CONNECTIONS),
-	  				 itsCount(0), itsPort(theSocket)
+	  				 itsCount(0), itsPort(theSocket), itsParent(NULL)
+{
+	TRACE("MessageProxyFactory::MessageProxyFactory - start")
+	start();
+	TRACE("MessageProxyFactory::MessageProxyFactory - end")
+}
+
+MessageProxyFactory::MessageProxyFactory(const char* theName,int theSocket,unsigned theAcceptors)
+	  				:Thread(theName), SocketServer(theSocket,MAX_CONNECTIONS,BlockingSocket,NULL,theAcceptors!=1),
+	  				 itsCount(0), itsPort(theSocket), itsParent(NULL)
+{
+	TRACE("MessageProxyFactory::MessageProxyFactory - start")
+	if(theAcceptors==0)
+		theAcceptors=getCPUCount();
+
+	try
+	{
+		for(unsigned i=1; i < theAcceptors; i++)
+			itsAcceptors.push_back(new MessageProxyFactory(theName,this,i));
+	}
+	catch(Exception& exc)
+	{
+		string aMsg=string("Fail to create acceptor: ") + exc.getMessage();
+		WARNING(aMsg.c_str())
+	}
+
+	start();
+	bindToCore(0);
+	TRACE("MessageProxyFactory::MessageProxyFactory - end")
+}
+
+MessageProxyFactory::MessageProxyFactory(const char* theName,MessageProxyFactory* theParent,unsigned theCpu)
+	  				:Thread(theName), SocketServer(theParent->itsPort,MAX_CONNECTIONS,BlockingSocket,NULL,true),
+	  				 itsCount(0), itsPort(theParent->itsPort), itsParent(theParent)
 {
 	TRACE("MessageProxyFactory::MessageProxyFactory - start")
 	start();
+	bindToCore(theCpu);
 	TRACE("MessageProxyFactory::MessageProxyFactory - end")
 }
 	
+#ifndef WIN32
+MessageProxyFactory::MessageProxyFactory(const char* theName,const char* thePath)
+	  				:Thread(theName), SocketServer(thePath,MAX_CONNECTIONS),
+	  				 itsCount(0), itsPort(0), itsParent(NULL)
+{
+	TRACE("MessageProxyFactory::MessageProxyFactory - start")
+	start();
+	TRACE("MessageProxyFactory::MessageProxyFactory - end")
+}
+#endif
+	
 MessageProxyFactory::~MessageProxyFactory() 
 {	
 	TRACE("MessageProxyFactory::~MessageProxyFactory - start")
+	for(unsigned i=0; i < itsAcceptors.size(); i++)
+		delete itsAcceptors[i];
+
 	Close(); //Close socket
 	stop(false); //Wait exit of MessageProxyFactory::run  
+#ifndef WIN32
+	if(isLocal())
+		unlink(itsPath.c_str());
+#endif
 	TRACE("MessageProxyFactory::~MessageProxyFactory - end")
 }
 
@@ -821,25 +1569,31 @@ void MessageProxyFactory::run()
 		MessageProxy* aProxy=NULL;		
 		try
 		{
-		    char aValue[10];
+		    char aValue[24];
 		    aSocket=Accept();
 		    string anAddr=address();
 		    unsigned short aPort=port();
+		    unsigned long anId=aPort;
+		    if(isLocal()) 
+		    	anId=itsCount+1; // Local peers have no port: keep proxy names unique
 
 		    ostrstream aMsgStream(aValue,sizeof(aValue));
-		    aMsgStream << aPort << ends;
+		    aMsgStream << anId << ends;
 
 		    string aMsg=string("Connected to ")+anAddr+string(":")+aValue;
 		    LOG(aMsg.c_str())
 		    itsCount++;
 		    ostrstream aStream;
-		    aStream << MESSAGEPROXYHEADER << anAddr << "," << aPort << ")" << ends; 
+		    aStream << MESSAGEPROXYHEADER << anAddr << "," << anId << ")" << ends; 
 			char* aName=aStream.str();
 		    aProxy=new MessageProxy(aName,aSocket);
 		    TRACE(aName << " proxy started")
 		    delete [] aName;
 		    
-		    onNewConnection(anAddr,aPort);
+		    if(itsParent!=NULL)
+		    	itsParent->onNewConnection(anAddr,aPort);
+		    else
+		    	onNewConnection(anAddr,aPort);
 		}
 		catch(Exception& exc)
 		{
@@ -856,6 +1610,33 @@ void MessageProxyFactory::run()
 	TRACE("MessageProxyFactory::run - end")		
 }
 
+void MessageProxyFactory::bindToCore(unsigned theCpu)
+{
+	TRACE("MessageProxyFactory::bindToCore - start")
+	try
+	{
+		setAffinity(theCpu % getCPUCount());
+	}
+	catch(ThreadException& exc)
+	{
+		string aMsg=string("Acceptor not bound to a core: ") + exc.getMessage();
+		WARNING(aMsg.c_str())
+	}
+	TRACE("MessageProxyFactory::bindToCore - end")
+}
+
+unsigned MessageProxyFactory::getCPUCount()
+{
+#ifdef WIN32
+	SYSTEM_INFO anInfo;
+	GetSystemInfo(&anInfo);
+	return anInfo.dwNumberOfProcessors;
+#else
+	long aCount=sysconf(_SC_NPROCESSORS_ONLN);
+	return (aCount > 0) ? (unsigned)aCount : 1;
+#endif
+}
+
 string MessageProxyFactory::getUniqueNetID()
 {
 	TRACE("MessageProxyFactory::getUniqueNetID - start")		
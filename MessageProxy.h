@@ -36,8 +36,15 @@
 #endif
 
 #include <vector>
+#include <map>
+#include <list>
 
 #define MESSAGEPROXYHEADER "MessageProxy("
+#define LOOKUP_CACHE_TTL 60			// secs a remote handle is reused without a new lookup
+#define LOOKUP_PENDING_TIMEOUT 5	// secs before a lookup without reply is sent again
+#define FLOW_RETRY_TIME 10			// ms between two checks of a congested queue
+#define MQ_PROTOCOL_VERSION 3		// 1: 16 bits handles and sequence numbers, 2: 32 bits, 3: deadlines
+#define HELLO_TIMEOUT 1000			// ms a new connection waits for the hello of the peer
 
 enum NetworkMessages
 {
@@ -47,7 +54,30 @@ enum NetworkMessages
 	MQ_PROXY_PING_REQUEST,
 	MQ_PROXY_PING_REPLY,	
 	MQ_PROXY_UNSOLICITED,
-	MQ_PROXY_BROADCAST	
+	MQ_PROXY_BROADCAST,
+	MQ_PROXY_CREDIT
+};
+
+// Immutable wire image of a NetworkMessage. It is shared, by reference counting,
+// among all the copies of a message fanned out to several proxies.
+class EncodedFrame
+{
+protected:
+	string itsBuffer;
+	MQHANDLE itsSender;
+#ifdef WIN32
+	LONG volatile itsRefCount;
+#else
+	long volatile itsRefCount;
+#endif
+
+public:
+	EncodedFrame(const string& theBuffer,MQHANDLE theSender) 
+	   : itsBuffer(theBuffer), itsSender(theSender), itsRefCount(1) {};
+	const string& get() { return itsBuffer; };
+	MQHANDLE getSender() { return itsSender; };
+	EncodedFrame* attach();
+	void detach();
 };
 
 class NetworkMessage : public Message
@@ -56,48 +86,87 @@ public:
 	typedef struct NetwokMessageStruct
 	{
 		MQHANDLE sender;
-		unsigned short seqnum; 
+		unsigned int seqnum; 
 		unsigned short topiclen;
 		unsigned short buflen;	
+		unsigned int deadline;	// ms left when sent, 0 for none
 	} NetworkMessageHeader;	
+
+	typedef struct NetwokMessage2Struct // Protocol version 2
+	{
+		MQHANDLE sender;
+		unsigned int seqnum; 
+		unsigned short topiclen;
+		unsigned short buflen;	
+	} NetworkMessageHeader2;	
+
+	typedef struct NetwokMessage1Struct // Protocol version 1
+	{
+		unsigned short sender;
+		unsigned short seqnum; 
+		unsigned short topiclen;
+		unsigned short buflen;	
+	} NetworkMessageHeader1;	
 	
 protected:
 	string itsTopic;
 	string itsBuffer;
 	MQHANDLE itsTarget;	
 	MQHANDLE itsRemoteSender;
-	unsigned short itsSeqNum;
+	unsigned int itsSeqNum;
+	bool itsNarrowFlag;		// Received from a peer with 16 bits sequence numbers
+	bool itsDeadlineFlag;
+	_TIMEVAL itsDeadline;	// Local time the sender stops waiting for the reply
 	bool itsUnsolicitedFlag;
 	bool itsBroadcastFlag;
+	bool itsMulticastFlag;	// Broadcast left to the multicast groups: proxies don't send it
+	EncodedFrame* itsFrame;
 	
 public:
 	NetworkMessage(NetworkMessage& o);
 	NetworkMessage(char* theBuffer, unsigned short theLen); 
-	NetworkMessage(string theBuffer);
-	virtual ~NetworkMessage() {};
+	NetworkMessage(const string& theBuffer,Encription* theEncr=NULL); // Room reserved for the padding of theEncr
+	virtual ~NetworkMessage() { thaw(); };
 	virtual Message* clone() { return new NetworkMessage(*this); };
 	
 	string getTopic() { return itsTopic; };
-	void setTopic(string theTopic) { itsTopic=theTopic; };
-	void setTopic(const char* theTopic) { itsTopic=theTopic; };  
-	void setTopic(char* theTopic,int len) { itsTopic.assign(theTopic,len); };
+	void setTopic(string theTopic) { thaw(); itsTopic=theTopic; };
+	void setTopic(const char* theTopic) { thaw(); itsTopic=theTopic; };  
+	void setTopic(char* theTopic,int len) { thaw(); itsTopic.assign(theTopic,len); };
 	void setRemoteSender(MQHANDLE theHandle) { itsRemoteSender=theHandle; }; 
 	MQHANDLE getRemoteSender() { return itsRemoteSender; }; 
 	void setTarget(MQHANDLE theHandle) { itsTarget=theHandle; };
 	MQHANDLE getTarget() { return itsTarget; };
-	void setSequenceNumber(unsigned short theSequence) { itsSeqNum=theSequence; }; 
-	unsigned short getSequenceNumber() { return itsSeqNum; }; 
+	void setSequenceNumber(unsigned int theSequence) { thaw(); itsSeqNum=theSequence; }; 
+	unsigned int getSequenceNumber() { return itsSeqNum; }; 
+	unsigned int getSequenceNumber(unsigned int theLatest); // Widened to the closest one not after theLatest
+	bool isNarrow() { return itsNarrowFlag; };
+	void setNarrow() { itsNarrowFlag=true; };
+	void setDeadline(long theTimeout);	// ms from now, 0 removes the deadline
+	bool hasDeadline() { return itsDeadlineFlag; };
+	_TIMEVAL* getDeadline() { return &itsDeadline; };
+	long getTimeLeft();		// ms, 0 when expired
+	bool isExpired() { return itsDeadlineFlag && getTimeLeft()==0; };
 	bool isUnsolicited() { return itsUnsolicitedFlag; };
 	void setUnsolicited() { itsUnsolicitedFlag=true; };
 	bool isBroadcasting() { return itsBroadcastFlag; };
 	void setBroadcasting() { itsBroadcastFlag=true; };
+	bool isMulticast() { return itsMulticastFlag; };
+	void setMulticast() { itsMulticastFlag=true; };
 	string get() { return itsBuffer; };
 	virtual string toString(); 
+	virtual const string& freeze();	// Encode once: clones share the same frame
+	virtual void thaw();
 	virtual void toStream(ostream& theStream);
 	virtual void code(Encription* theEncr);
 	virtual void decode(Encription* theEncr);
-	virtual void inflate(Compression* theCompr);
-	virtual void deflate(Compression* theCompr);
+	virtual void inflate(Compression* theCompr);	// Without a peer: shared by all the receivers
+	virtual void deflate(Compression* theCompr,Encription* theEncr=NULL);
+	virtual void inflate(Compression* theCompr,MQHANDLE theProxy,MQHANDLE theRemote);
+	virtual void deflate(Compression* theCompr,MQHANDLE theProxy,MQHANDLE theRemote,Encription* theEncr=NULL);
+
+protected:
+	void reserve(unsigned theSize,Encription* theEncr);
 };
 
 class PingRequestMessage : public Message
@@ -107,10 +176,26 @@ public:
 	{
 		MQHANDLE sender;
 	} PingRequest;	
+
+	typedef struct PingRequest1Struct // Protocol version 1
+	{
+		unsigned short sender;
+	} PingRequest1;	
+
+	// Appended to a version 1 ping without sender: old peers ignore it
+	typedef struct HelloStruct
+	{
+		unsigned short magic;
+		unsigned short version;
+	} Hello;
+
+protected:
+	unsigned short itsVersion;	// Protocol version announced, 0 for a plain ping
 			
 public:
-	PingRequestMessage(MQHANDLE theSenderID);
+	PingRequestMessage(MQHANDLE theSenderID,unsigned short theVersion=0);
 	virtual ~PingRequestMessage() {};
+	virtual Message* clone() { return new PingRequestMessage(*this); };
 	virtual string toString();
 };
 
@@ -122,6 +207,7 @@ protected:
 public:
 	PingReplyMessage(MQHANDLE theTarget);
 	virtual ~PingReplyMessage() {};
+	virtual Message* clone() { return new PingReplyMessage(*this); };
 	virtual MQHANDLE getTarget() { return itsTarget; };
 };
 
@@ -133,6 +219,12 @@ public:
 		MQHANDLE sender;
 		unsigned short namelen;	
 	} LookupRequest;	
+
+	typedef struct LookupRequest1Struct // Protocol version 1
+	{
+		unsigned short sender;
+		unsigned short namelen;	
+	} LookupRequest1;	
 	
 protected:
 	string itsNameToLookup;
@@ -140,6 +232,7 @@ protected:
 public:
 	LookupRequestMessage(const char* theName,MQHANDLE theSenderID);
 	virtual ~LookupRequestMessage() {};
+	virtual Message* clone() { return new LookupRequestMessage(*this); };
 	virtual string toString();
 	virtual string getTarget () { return itsNameToLookup; };
 };
@@ -153,6 +246,12 @@ public:
 		MQHANDLE handle;
 	} LookupReply;	
 
+	typedef struct Lookup1Struct // Protocol version 1
+	{
+		bool fail;
+		unsigned short handle;
+	} LookupReply1;	
+
 protected:
 	
 	LookupReply itsBuffer;
@@ -164,6 +263,7 @@ public:
 	LookupReplyMessage(MQHANDLE theTarget,MQHANDLE theHandle);
 	LookupReplyMessage(LookupReply& theReply);
 	virtual ~LookupReplyMessage() {};
+	virtual Message* clone() { return new LookupReplyMessage(*this); };
 	virtual string toString();
 	virtual bool isFailed() { return itsBuffer.fail; };
 	virtual MQHANDLE getHandle() { return itsBuffer.handle; };
@@ -178,16 +278,18 @@ protected:
 	vector<string> itsTopicList;
 	MQHANDLE itsLastMessageProxy;
 	string itsLastReceivedTopic;
+	unsigned long itsExpiredCnt;
 	
 public:
 	Observer(const char* theName);
 	virtual ~Observer();
 	virtual void setEncription(Encription* theEncr);
 	virtual void setCompression(Compression* theCompr);
+	unsigned long getExpiredCount() { return itsExpiredCnt; };	// Requests dropped past their deadline
 
 protected:
 	virtual void post(MQHANDLE theTarget,NetworkMessage* theMessage);
-	virtual void publish(string theTopic,string theMessage); // ++ v1.5
+	virtual void publish(string theTopic,string theMessage,bool theMulticastOnly=false); // ++ v1.5
 	virtual void subscribe(string theTopic) { itsTopicList.push_back(theTopic); }; // ++ v1.5
 
 	virtual void onMessage(Message* theMessage);
@@ -204,18 +306,67 @@ protected:
 	virtual void encodeProperties(ListProperty& theProperties,string& theBuffer);
 };
 
+// Credits for network messages: granted by the receiver of a connection,
+// or to be granted to the peer when itsGrantFlag is set
+class CreditMessage : public Message
+{
+protected:
+	unsigned int itsCredits;
+	bool itsGrantFlag;
+
+public:
+	CreditMessage(unsigned int theCredits,bool theGrantFlag) 
+	   : Message("CreditMessage"), itsCredits(theCredits), itsGrantFlag(theGrantFlag) {};
+	virtual ~CreditMessage() {};
+	virtual Message* clone() { return new CreditMessage(*this); };
+	virtual string toString() { return string((char*)&itsCredits,sizeof(itsCredits)); };
+	unsigned int getCredits() { return itsCredits; };
+	bool isGrant() { return itsGrantFlag; };
+};
+
 class MessageProxy : public MessageQueue
 {
 protected:
 	Socket* itsSocket;
+
+	// Credit based flow control, enabled by the receiver of a connection.
+	// The sender holds network messages when the peer's credits run out.
+	// There is no negotiation: a process grants credits only after setFlowControl,
+	// so enable it on both peers. Peers of protocol version 1 never get credits.
+	static unsigned itsFlowWindow;
+	bool itsFlowActive;			// The peer grants credits
+	unsigned long itsCredits;	// Network messages the peer can still accept
+	list<Message*> itsHeld;
+	unsigned long itsStallCnt;
+	unsigned long itsHeldCnt;
+
+	Thread itsFlowMutex;		// Receiver side, shared with the Rx thread
+	unsigned itsWindow;
+	unsigned long itsOwed;		// Network messages received and not yet granted back
+	MQHANDLE itsCongested;		// Queue over the window: credits are withheld
+	bool itsRetryArmed;
+	unsigned long itsWithheldCnt;
 	
-	typedef struct PacketHeaderStruct
+	typedef struct PacketHeaderStruct // Protocol version 1
 	{
 		unsigned short sync;
 		unsigned short type;		
 		unsigned short target;
 		unsigned short msglen;
 	} header;
+
+	typedef struct PacketHeader2Struct
+	{
+		unsigned short sync;
+		unsigned short type;		
+		MQHANDLE target;
+		unsigned int msglen;
+	} header2;
+
+	int volatile itsPeerVersion;	// Set by the peer's hello, frames are sent in this version
+	bool volatile itsNegotiated;	// Peer's hello received, or given up after HELLO_TIMEOUT
+	_TIMEVAL itsHelloTime;			// Connection time
+	list<Message*> itsWaiting;		// Messages waiting for the version of the peer
 	
 #ifdef WIN32	
 	unsigned long* m_hThreadRx;
@@ -229,29 +380,71 @@ public:
 	virtual ~MessageProxy();
 	virtual void receive();
 	virtual string getConnectionAddress(MQHANDLE theCaller,int& thePort);
+	static void setFlowControl(unsigned theWindow) { itsFlowWindow=theWindow; }; // 0 disables it
+	bool isFlowControlled() { return itsFlowActive; };
+	unsigned long getCredits() { return itsCredits; };
+	unsigned long getStallCount() { return itsStallCnt; };		// Times the peer pushed back
+	unsigned long getHeldCount() { return itsHeldCnt; };		// Messages held for lack of credits
+	unsigned long getWithheldCount() { return itsWithheldCnt; };	// Times the peer was pushed back
+	int getPeerVersion() { return itsPeerVersion; };
 
 protected:
 	virtual void onMessage(Message* theMessage);
+	virtual void onCredit(CreditMessage* theMessage);
+	virtual void send(Message* theMessage);
+	virtual void consumeCredit(MQHANDLE theTarget);
+	virtual void checkCongestion();
+	void initFlowControl();
+	bool waitForPeer(Message* theMessage);
+	void dispatch(Message* theMessage);
+	string narrow(unsigned short theType,const string& theBody);
+	string dropDeadline(unsigned short theType,const string& theBody);
 };
 
 class MessageProxyFactory : public Thread, protected SocketServer
 {
 protected:
-	unsigned long itsCount;
+	unsigned long itsCount;		// Accepted connections: names the proxies of local peers
 	unsigned itsPort;
+	MessageProxyFactory* itsParent;
+	vector<MessageProxyFactory*> itsAcceptors;
 	static Thread itsMutex;  // ++ v1.5
 
+	// Remote handles already found by lookupAt, keyed by proxy and queue name
+	typedef struct LookupEntryStruct
+	{
+		MQHANDLE proxy;				// 0 while the lookup is pending
+		MQHANDLE handle;
+		unsigned long time;			// Timer::time() of the request, then of the reply
+		vector<MQHANDLE> waiters;	// The first one is the sender of the pending request
+	} LookupEntry;
+
+	static map<string,LookupEntry> itsLookupCache;
+
 public:
 	MessageProxyFactory(const char* theFactoryName,int theSocket);
+	// Listens with theAcceptors SO_REUSEPORT sockets, each accepted by its own
+	// thread bound to a core (0 means one per core). onNewConnection can then be
+	// called concurrently.
+	MessageProxyFactory(const char* theFactoryName,int theSocket,unsigned theAcceptors);
+#ifndef WIN32
+	MessageProxyFactory(const char* theFactoryName,const char* thePath);
+#endif
 	~MessageProxyFactory();
 	static void ping(const char* theHost, unsigned thePort,MessageQueue* theSourceQueue);
 	static void lookupAt(const char* theHost, unsigned thePort,
 						 const char* theRemoteQueueName,MessageQueue* theSourceQueue);
+	static void invalidateLookup(const char* theHost, unsigned thePort,const char* theRemoteQueueName);
+	static void onLookupReply(const char* theProxyName,MQHANDLE theProxy,MQHANDLE theTarget,LookupReplyMessage* theReply);
 	static string getUniqueNetID();
+	static unsigned getCPUCount();
+	static string getProxyName(const char* theHost, unsigned thePort); // Queue name of the proxy to theHost
 	
 protected:
+	MessageProxyFactory(const char* theFactoryName,MessageProxyFactory* theParent,unsigned theCpu);
 	void run();
-	static void post(const char* theHost, unsigned thePort,Message* theMessage,MQHANDLE theSender);
+	void bindToCore(unsigned theCpu);
+	static bool post(const char* theHost, unsigned thePort,Message* theMessage,MQHANDLE theSender);
 	virtual void onNewConnection(string theAddress,unsigned short thePort) {};
 };
 
@@ -72,6 +72,16 @@ MessageQueue* MessageQueue::lookup(MQHANDLE theID)
 	return ret;
 }
 
+MQHANDLE MessageQueue::widen(MQHANDLE theHandle)
+{
+	TRACE("MessageQueue::widen(static) - start")
+	MQHANDLE ret=theHandle;
+	if(itsRegistry!=NULL)
+		ret=itsRegistry->widen(theHandle);
+	TRACE("MessageQueue::widen(static) - end")
+	return ret;
+}
+
 bool MessageQueue::isStillAvailable(MQHANDLE theTarget)
 {
 	TRACE("MessageQueue::isStillAvailable(static) - start")
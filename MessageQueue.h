@@ -62,6 +62,7 @@ public:
 	MessageQueue(const char* theThreadName);
 	virtual ~MessageQueue();
 	MQHANDLE getID() { return itsID; };
+	int getQueueSize() { return elements(); };
 	void setID(MQHANDLE theID) { itsID=theID; };
 	void flush();
 	virtual void post(Message* theMessage);	
@@ -73,6 +74,7 @@ public:
 	static bool lookup(const char* theName,MQHANDLE& theID);
 	static MessageQueue* lookup(MQHANDLE theID);	
 	static bool isStillAvailable(MQHANDLE theTarget);
+	static MQHANDLE widen(MQHANDLE theHandle);
 	static void waitForCompletion();
 	static void dump();
 	
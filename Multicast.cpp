@@ -0,0 +1,446 @@
+///////////////////////////////////////////////////////////////////////////////
+// MQ4CPP - Message queuing for C++
+// Copyright (C) 2004-2007  Riccardo Pompeo (Italy)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#define SILENT
+#include "Multicast.h"
+#include "Trace.h"
+#include "Logger.h"
+#include "GeneralHashFunctions.h"
+#include <strstream>
+#ifndef WIN32
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+
+#define MULTICAST_SYNC 0xcafe
+
+MulticastPublisher::MulticastPublisher(const char* theName,const char* theGroup,int thePort,
+									   const char* theIP,unsigned theHistorySize)
+		   		   :MessageQueue(theName),
+		   		    itsSeqNum(0), itsSentCnt(0), itsRetransmittedCnt(0), itsUnrecoverableCnt(0)
+{
+	TRACE("MulticastPublisher::MulticastPublisher - start")
+	if(theHistorySize==0)
+		throw ThreadException("MulticastPublisher: history size must be greater than zero");
+
+	itsHistory.resize(theHistorySize);
+
+	// Let subscribers detect a restart: the host ID is mixed with the start
+	// time and the process, which change on every run
+	_TIMEVAL aNow=Timer::timeExt();
+#ifdef WIN32
+	unsigned long aPid=GetCurrentProcessId();
+#else
+	unsigned long aPid=getpid();
+#endif
+	string aSeed=MessageProxyFactory::getUniqueNetID();
+	aSeed+=string((char*)&aNow,sizeof(aNow));
+	aSeed+=string((char*)&aPid,sizeof(aPid));
+	itsSession=APHash(aSeed);
+	TRACE("Session=" << itsSession)
+	itsSocket=new DatagramSocket(theGroup,thePort,false,theIP);
+	itsLastSent=Timer::timeExt();
+	SCHEDULE(this,MULTICAST_POLL_TIME);
+	TRACE("MulticastPublisher::MulticastPublisher - end")
+}
+
+MulticastPublisher::~MulticastPublisher()
+{
+	TRACE("MulticastPublisher::~MulticastPublisher - start")
+	stop(false);
+	delete itsSocket;
+	TRACE("MulticastPublisher::~MulticastPublisher - end")
+}
+
+void MulticastPublisher::onMessage(Message* theMessage)
+{
+	TRACE("MulticastPublisher::onMessage - start")
+
+	try
+	{
+		if(theMessage->is("Wakeup"))
+		{
+			poll();
+		}
+		else if(theMessage->is("NetworkMessage"))
+		{
+			NetworkMessage* aMessage=(NetworkMessage*)theMessage;
+
+			// Messages coming from the network were already published by their origin
+			if(aMessage->isBroadcasting() && aMessage->getRemoteSender()==0)
+			{
+				bool enabled=(itsTopicList.size()==0);
+				for(vector<string>::iterator i = itsTopicList.begin(); i < itsTopicList.end(); ++i)
+				{
+					if(*i==aMessage->getTopic())
+						enabled=true;
+				}
+
+				if(enabled)
+					send(aMessage);
+			}
+		}
+	}
+	catch(Exception& ex)
+	{
+		WARNING(ex.getMessage().c_str())
+	}
+	catch(...)
+	{
+		CRITICAL("Unhandled exception")
+	}
+
+	TRACE("MulticastPublisher::onMessage - end")
+}
+
+void MulticastPublisher::send(NetworkMessage* theMessage)
+{
+	TRACE("MulticastPublisher::send - start")
+	const string& aPayload=theMessage->freeze(); // Shared with the proxies serving the same message
+	if(aPayload.length() + sizeof(MulticastHeader) > MULTICAST_MAXDATAGRAM)
+	{
+		WARNING("Message too long for a datagram. Dropped!")
+		return;
+	}
+
+	MulticastHeader anHeader;
+	anHeader.sync=MULTICAST_SYNC;
+	anHeader.type=MQ_MCAST_DATA;
+	anHeader.session=itsSession;
+	anHeader.seqnum=itsSeqNum;
+	anHeader.count=0;
+
+	string& aDatagram=itsHistory[itsSeqNum % itsHistory.size()];
+	aDatagram.assign((char*)&anHeader,sizeof(anHeader));
+	aDatagram+=aPayload;
+	itsSocket->SendTo(aDatagram);
+	TRACE("Sent datagram n." << itsSeqNum)
+
+	itsSeqNum++;
+	itsSentCnt++;
+	itsLastSent=Timer::timeExt();
+	TRACE("MulticastPublisher::send - end")
+}
+
+void MulticastPublisher::onNack(MulticastHeader* theHeader)
+{
+	TRACE("MulticastPublisher::onNack - start")
+	TRACE("First=" << theHeader->seqnum << " Count=" << theHeader->count)
+	unsigned int aCount=theHeader->count;
+	if(aCount > MULTICAST_NACK_MAX)
+		aCount=MULTICAST_NACK_MAX;
+
+	for(unsigned int i=0; i < aCount; i++)
+	{
+		unsigned int aSeqNum=theHeader->seqnum + i;
+		int anAge=(int)(itsSeqNum - aSeqNum);
+		if(anAge <= 0) // Not yet sent
+			break;
+
+		if((unsigned)anAge > itsHistory.size())
+		{
+			itsUnrecoverableCnt++;
+			continue;
+		}
+
+		itsSocket->SendTo(itsHistory[aSeqNum % itsHistory.size()]);
+		itsRetransmittedCnt++;
+	}
+
+	TRACE("MulticastPublisher::onNack - end")
+}
+
+void MulticastPublisher::poll()
+{
+	TRACE("MulticastPublisher::poll - start")
+	string aBuffer;
+	sockaddr_in anAddress;
+	while(itsSocket->ReceiveFrom(aBuffer,anAddress,0))
+	{
+		if(aBuffer.length() < sizeof(MulticastHeader))
+			continue;
+
+		MulticastHeader anHeader;
+		memcpy(&anHeader,aBuffer.data(),sizeof(anHeader));
+		if(anHeader.sync==MULTICAST_SYNC && anHeader.type==MQ_MCAST_NACK && anHeader.session==itsSession)
+			onNack(&anHeader);
+	}
+
+	// Heartbeats carry the next sequence number, so subscribers detect the loss of the last datagrams
+	_TIMEVAL now=Timer::timeExt();
+	if(Timer::subtractMillisecs(&itsLastSent,&now) >= MULTICAST_HEARTBEAT)
+	{
+		MulticastHeader anHeader;
+		anHeader.sync=MULTICAST_SYNC;
+		anHeader.type=MQ_MCAST_HEARTBEAT;
+		anHeader.session=itsSession;
+		anHeader.seqnum=itsSeqNum;
+		anHeader.count=0;
+		itsSocket->SendTo(string((char*)&anHeader,sizeof(anHeader)));
+		itsLastSent=now;
+	}
+	TRACE("MulticastPublisher::poll - end")
+}
+
+MulticastSubscriber::MulticastSubscriber(const char* theName,const char* theGroup,int thePort,const char* theIP)
+				    :Thread(theName), itsDeliveredCnt(0), itsNackCnt(0), itsLostCnt(0)
+{
+	TRACE("MulticastSubscriber::MulticastSubscriber - start")
+	itsSocket=new DatagramSocket(theGroup,thePort,true,theIP);
+	start();
+	TRACE("MulticastSubscriber::MulticastSubscriber - end")
+}
+
+MulticastSubscriber::~MulticastSubscriber()
+{
+	TRACE("MulticastSubscriber::~MulticastSubscriber - start")
+	stop(false);
+	for(map<string,Source*>::iterator i = itsSources.begin(); i != itsSources.end(); ++i)
+		delete i->second;
+	delete itsSocket;
+	TRACE("MulticastSubscriber::~MulticastSubscriber - end")
+}
+
+void MulticastSubscriber::run()
+{
+	TRACE("MulticastSubscriber::run - start")
+
+	while(true)
+	{
+		TESTCANCEL
+		if(Thread::isShuttingDown())
+			break;
+
+		try
+		{
+			string aBuffer;
+			sockaddr_in anAddress;
+			if(itsSocket->ReceiveFrom(aBuffer,anAddress,MULTICAST_POLL_TIME) &&
+			   aBuffer.length() >= sizeof(MulticastHeader))
+			{
+				MulticastHeader anHeader;
+				memcpy(&anHeader,aBuffer.data(),sizeof(anHeader));
+				if(anHeader.sync==MULTICAST_SYNC && onDatagram(&anHeader))
+				{
+					if(anHeader.type==MQ_MCAST_DATA)
+					{
+						Source* aSource=findSource(anAddress,&anHeader);
+						aBuffer.erase(0,sizeof(MulticastHeader));
+						onData(aSource,&anHeader,aBuffer);
+					}
+					else if(anHeader.type==MQ_MCAST_HEARTBEAT)
+					{
+						Source* aSource=findSource(anAddress,&anHeader);
+						onHeartbeat(aSource,&anHeader);
+					}
+				}
+			}
+
+			for(map<string,Source*>::iterator i = itsSources.begin(); i != itsSources.end(); ++i)
+				checkGaps(i->second);
+		}
+		catch(Exception& ex)
+		{
+			WARNING(ex.getMessage().c_str())
+		}
+		catch(...)
+		{
+			CRITICAL("Unhandled exception")
+		}
+	}
+
+	TRACE("MulticastSubscriber::run - end")
+}
+
+MulticastSubscriber::Source* MulticastSubscriber::findSource(sockaddr_in& theAddress,MulticastHeader* theHeader)
+{
+	TRACE("MulticastSubscriber::findSource - start")
+	char aValue[10];
+	ostrstream aStream(aValue,sizeof(aValue));
+	aStream << ntohs(theAddress.sin_port) << ends;
+	string aKey=string(inet_ntoa(theAddress.sin_addr))+string(":")+aValue;
+
+	Source* aSource;
+	map<string,Source*>::iterator i=itsSources.find(aKey);
+	if(i==itsSources.end())
+	{
+		aSource=new Source();
+		aSource->itsAddress=theAddress;
+		aSource->itsSession=theHeader->session+1; // Forces the initialization below
+		itsSources[aKey]=aSource;
+		LOG((string("New multicast source ")+aKey).c_str())
+	}
+	else
+		aSource=i->second;
+
+	if(aSource->itsSession!=theHeader->session)
+	{
+		// New publisher or restarted one: start from the current sequence
+		aSource->itsSession=theHeader->session;
+		aSource->itsExpected=theHeader->seqnum;
+		aSource->itsHighest=theHeader->seqnum;
+		aSource->itsPending.clear();
+		aSource->itsRetry=0;
+	}
+
+	TRACE("MulticastSubscriber::findSource - end")
+	return aSource;
+}
+
+void MulticastSubscriber::onData(Source* theSource,MulticastHeader* theHeader,string& theBuffer)
+{
+	TRACE("MulticastSubscriber::onData - start")
+	unsigned int aSeqNum=theHeader->seqnum;
+	TRACE("Received datagram n." << aSeqNum)
+
+	if((int)(aSeqNum - theSource->itsExpected) < 0)
+	{
+		TRACE("Duplicated datagram. Skipped!")
+		return;
+	}
+
+	if((int)(aSeqNum + 1 - theSource->itsHighest) > 0)
+		theSource->itsHighest=aSeqNum + 1;
+
+	if(aSeqNum==theSource->itsExpected)
+	{
+		deliver(theBuffer);
+		theSource->itsExpected++;
+		theSource->itsRetry=0;
+
+		map<unsigned int,string>::iterator i=theSource->itsPending.begin();
+		while(i!=theSource->itsPending.end() && i->first==theSource->itsExpected)
+		{
+			deliver(i->second);
+			theSource->itsPending.erase(i++);
+			theSource->itsExpected++;
+		}
+	}
+	else if(theSource->itsPending.size() < MULTICAST_HISTORY)
+	{
+		theSource->itsPending[aSeqNum]=theBuffer;
+	}
+
+	TRACE("MulticastSubscriber::onData - end")
+}
+
+void MulticastSubscriber::onHeartbeat(Source* theSource,MulticastHeader* theHeader)
+{
+	TRACE("MulticastSubscriber::onHeartbeat - start")
+	if((int)(theHeader->seqnum - theSource->itsHighest) > 0)
+		theSource->itsHighest=theHeader->seqnum;
+	TRACE("MulticastSubscriber::onHeartbeat - end")
+}
+
+void MulticastSubscriber::checkGaps(Source* theSource)
+{
+	TRACE("MulticastSubscriber::checkGaps - start")
+	if(theSource->itsExpected==theSource->itsHighest)
+		return;
+
+	_TIMEVAL now=Timer::timeExt();
+	if(theSource->itsRetry > 0 && Timer::subtractMillisecs(&theSource->itsLastNack,&now) < MULTICAST_NACK_TIME)
+		return;
+
+	if(theSource->itsRetry >= MULTICAST_NACK_RETRY)
+	{
+		// Gap not recovered: skip it and go on with the datagrams already received
+		unsigned int aNext=theSource->itsPending.empty() ? theSource->itsHighest : theSource->itsPending.begin()->first;
+		itsLostCnt+=aNext - theSource->itsExpected;
+		WARNING("Multicast datagrams lost")
+		theSource->itsExpected=aNext;
+		theSource->itsRetry=0;
+
+		map<unsigned int,string>::iterator i=theSource->itsPending.begin();
+		while(i!=theSource->itsPending.end() && i->first==theSource->itsExpected)
+		{
+			deliver(i->second);
+			theSource->itsPending.erase(i++);
+			theSource->itsExpected++;
+		}
+		return;
+	}
+
+	sendNack(theSource);
+	theSource->itsRetry++;
+	theSource->itsLastNack=now;
+	TRACE("MulticastSubscriber::checkGaps - end")
+}
+
+void MulticastSubscriber::sendNack(Source* theSource)
+{
+	TRACE("MulticastSubscriber::sendNack - start")
+	unsigned int aNext=theSource->itsPending.empty() ? theSource->itsHighest : theSource->itsPending.begin()->first;
+
+	MulticastHeader anHeader;
+	anHeader.sync=MULTICAST_SYNC;
+	anHeader.type=MQ_MCAST_NACK;
+	anHeader.session=theSource->itsSession;
+	anHeader.seqnum=theSource->itsExpected;
+	anHeader.count=aNext - theSource->itsExpected;
+	if(anHeader.count > MULTICAST_NACK_MAX)
+		anHeader.count=MULTICAST_NACK_MAX;
+
+	TRACE("NACK first=" << anHeader.seqnum << " count=" << anHeader.count)
+	itsSocket->SendTo(string((char*)&anHeader,sizeof(anHeader)),theSource->itsAddress);
+	itsNackCnt++;
+	TRACE("MulticastSubscriber::sendNack - end")
+}
+
+void MulticastSubscriber::deliver(string& thePayload)
+{
+	TRACE("MulticastSubscriber::deliver - start")
+	if(thePayload.length() < sizeof(NetworkMessage::NetworkMessageHeader))
+	{
+		WARNING("Invalid multicast payload. Skipped!")
+		return;
+	}
+
+	NetworkMessage::NetworkMessageHeader aNMHeader;
+	memcpy(&aNMHeader,thePayload.data(),sizeof(aNMHeader));
+	if(sizeof(aNMHeader) + aNMHeader.topiclen + aNMHeader.buflen > thePayload.length())
+	{
+		WARNING("Buffer overflow detected. Skipped!")
+		return;
+	}
+
+	string aTopic=thePayload.substr(sizeof(aNMHeader),aNMHeader.topiclen);
+	if(itsTopicList.size()>0)
+	{
+		bool enabled=false;
+		for(vector<string>::iterator i = itsTopicList.begin(); i < itsTopicList.end(); ++i)
+		{
+			if(*i==aTopic)
+				enabled=true;
+		}
+
+		if(!enabled)
+			return;
+	}
+
+	NetworkMessage* aMessage=new NetworkMessage(thePayload.substr(sizeof(aNMHeader)+aNMHeader.topiclen,aNMHeader.buflen));
+	aMessage->setTopic(aTopic);
+	aMessage->setBroadcasting();
+	aMessage->setMulticast(); // The other hosts of the group got it too: proxies don't relay it
+	aMessage->setRemoteSender(aNMHeader.sender);
+	aMessage->setSequenceNumber(aNMHeader.seqnum);
+	MessageQueue::broadcast(aMessage);
+	itsDeliveredCnt++;
+	TRACE("MulticastSubscriber::deliver - end")
+}
@@ -0,0 +1,127 @@
+///////////////////////////////////////////////////////////////////////////////
+// MQ4CPP - Message queuing for C++
+// Copyright (C) 2004-2007  Riccardo Pompeo (Italy)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef __MULTICAST__
+#define __MULTICAST__
+
+#include "MessageProxy.h"
+#include "Timer.h"
+#include <vector>
+#include <map>
+using namespace std;
+
+#define MULTICAST_HISTORY 1024		// Datagrams kept by the publisher for retransmission
+#define MULTICAST_MAXDATAGRAM 65000	// Bigger NetworkMessages are dropped
+#define MULTICAST_POLL_TIME 10		// ms between two polls of the NACK channel
+#define MULTICAST_HEARTBEAT 200		// ms of silence before a heartbeat is sent
+#define MULTICAST_NACK_TIME 50		// ms between two NACKs for the same gap
+#define MULTICAST_NACK_RETRY 5		// NACKs sent before a gap is declared lost
+#define MULTICAST_NACK_MAX 256		// Max datagrams requested by a single NACK
+
+enum MulticastMessages
+{
+	MQ_MCAST_DATA=1,
+	MQ_MCAST_NACK,
+	MQ_MCAST_HEARTBEAT
+};
+
+typedef struct MulticastHeaderStruct
+{
+	unsigned short sync;
+	unsigned short type;
+	unsigned int session;
+	unsigned int seqnum;	// DATA: datagram sequence, HEARTBEAT: next sequence, NACK: first missing
+	unsigned int count;		// NACK: number of missing datagrams
+} MulticastHeader;
+
+// Publishes on a multicast group every broadcast NetworkMessage generated locally
+// (e.g. by Observer::publish), whatever the number of subscribers. Proxies send
+// them to their peers too, unless published with Observer::publish(...,true).
+class MulticastPublisher : public MessageQueue
+{
+protected:
+	DatagramSocket* itsSocket;
+	vector<string> itsHistory;
+	vector<string> itsTopicList;
+	unsigned int itsSession;
+	unsigned int itsSeqNum;
+	_TIMEVAL itsLastSent;
+	unsigned long itsSentCnt;
+	unsigned long itsRetransmittedCnt;
+	unsigned long itsUnrecoverableCnt;
+
+public:
+	MulticastPublisher(const char* theName,const char* theGroup,int thePort,const char* theIP=NULL,unsigned theHistorySize=MULTICAST_HISTORY);
+	virtual ~MulticastPublisher();
+	virtual void addTopic(string theTopic) { itsTopicList.push_back(theTopic); };
+	unsigned long getSentCount() { return itsSentCnt; };
+	unsigned long getRetransmittedCount() { return itsRetransmittedCnt; };
+	unsigned long getUnrecoverableCount() { return itsUnrecoverableCnt; };
+
+protected:
+	virtual void onMessage(Message* theMessage);
+	virtual void send(NetworkMessage* theMessage);
+	virtual void onNack(MulticastHeader* theHeader);
+	virtual void poll();
+};
+
+// Receives the datagrams of a multicast group and broadcasts them locally as
+// NetworkMessages. Gaps are recovered with NACKs to the publisher.
+class MulticastSubscriber : public Thread
+{
+protected:
+	class Source
+	{
+	public:
+		sockaddr_in itsAddress;
+		unsigned int itsSession;
+		unsigned int itsExpected;	// Next sequence to deliver
+		unsigned int itsHighest;	// Next sequence known to be sent
+		map<unsigned int,string> itsPending;
+		_TIMEVAL itsLastNack;
+		unsigned itsRetry;
+	};
+
+	DatagramSocket* itsSocket;
+	map<string,Source*> itsSources;
+	vector<string> itsTopicList;
+	unsigned long itsDeliveredCnt;
+	unsigned long itsNackCnt;
+	unsigned long itsLostCnt;
+
+public:
+	MulticastSubscriber(const char* theName,const char* theGroup,int thePort,const char* theIP=NULL);
+	virtual ~MulticastSubscriber();
+	virtual void subscribe(string theTopic) { itsTopicList.push_back(theTopic); };
+	unsigned long getDeliveredCount() { return itsDeliveredCnt; };
+	unsigned long getNackCount() { return itsNackCnt; };
+	unsigned long getLostCount() { return itsLostCnt; };
+
+protected:
+	virtual void run();
+	virtual bool onDatagram(MulticastHeader* theHeader) { return true; }; // Return false to drop it
+	virtual void onData(Source* theSource,MulticastHeader* theHeader,string& theBuffer);
+	virtual void onHeartbeat(Source* theSource,MulticastHeader* theHeader);
+	virtual void checkGaps(Source* theSource);
+	virtual void sendNack(Source* theSource);
+	virtual void deliver(string& thePayload);
+	Source* findSource(sockaddr_in& theAddress,MulticastHeader* theHeader);
+};
+
+#endif
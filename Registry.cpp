@@ -26,6 +26,8 @@ Registry::Registry(const char* theName) : Thread(theName)
 {
 	TRACE("Registry::Registry - start")
 	itsNextHandleAvailable=1; //v1.5
+	itsNarrowCount=0;
+	itsNextWideSlot=MQ_NARROW_SLOTS+1;
 	start();
 	setPriority(Thread::P_LOWEST);
 	TRACE("Registry::Registry - end")
@@ -77,22 +79,59 @@ void Registry::run()
 }
 
 // ++ v1.1
+// Slots reachable by old peers are used first, round robin. Wider slots are
+// used only when all of them are taken.
 MQHANDLE Registry::findID()
 {
-	for(int cnt=1;cnt <= 0xFFFF; cnt++, itsNextHandleAvailable++)
+	unsigned aSlot=0;
+	if(itsNarrowCount < MQ_NARROW_SLOTS)
 	{
-		if(itsNextHandleAvailable==0) // ++ v1.5
-			itsNextHandleAvailable=1;
-		
-		if(at(itsNextHandleAvailable)==NULL)
+		for(int cnt=1;cnt <= MQ_NARROW_SLOTS; cnt++, itsNextHandleAvailable++)
 		{
-			MQHANDLE anHandle=itsNextHandleAvailable++;			
-			return anHandle;
-		} 		
-	}	
-	
-	throw ThreadException("Registry::findID - no more handles available");
-	return 0;
+			if(itsNextHandleAvailable==0 || itsNextHandleAvailable > MQ_NARROW_SLOTS) // ++ v1.5
+				itsNextHandleAvailable=1;
+			
+			if(at(itsNextHandleAvailable)==NULL)
+			{
+				aSlot=itsNextHandleAvailable++;
+				itsNarrowCount++;
+				break;
+			} 		
+		}	
+	}
+	else if(!itsFreeWideSlots.empty())
+	{
+		aSlot=itsFreeWideSlots.front();
+		itsFreeWideSlots.pop_front();
+	}
+	else if(itsNextWideSlot <= MQ_SLOT_MASK)
+		aSlot=itsNextWideSlot++;
+
+	if(aSlot==0)
+		throw ThreadException("Registry::findID - no more handles available");
+
+	if(aSlot >= itsGenerations.size())
+		itsGenerations.resize(aSlot+1,0);
+	return (MQHANDLE)itsGenerations[aSlot] << MQ_SLOT_BITS | aSlot;
+}
+
+void Registry::freeID(MQHANDLE theID)
+{
+	unsigned aSlot=MQ_SLOT(theID);
+	if(unset(aSlot)==NULL)
+		return;
+
+	itsGenerations[aSlot]++; // Next queue in this slot gets a new handle
+	if(aSlot <= MQ_NARROW_SLOTS)
+		itsNarrowCount--;
+	else
+		itsFreeWideSlots.push_back(aSlot);
+}
+
+MessageQueue* Registry::find(MQHANDLE theID)
+{
+	MessageQueue* aQueue=(MessageQueue*)at(MQ_SLOT(theID));
+	return (aQueue!=NULL && aQueue->getID()==theID) ? aQueue : NULL;
 }
 
 void Registry::add(MessageQueue* theQueue)
@@ -108,7 +147,7 @@ void Registry::add(MessageQueue* theQueue)
 	wait(); //++v1.4
 	MQHANDLE aNewID=findID(); // ++ v1.1
 	theQueue->setID(aNewID); // ++ v1.1
-	set(aNewID,theQueue); // ++ v1.1
+	set(MQ_SLOT(aNewID),theQueue); // ++ v1.1
 	push(theQueue);
 	release(); //++v1.4 
 	TRACE("Registry::add - end")
@@ -124,18 +163,19 @@ bool Registry::lookup(const char* theName,MQHANDLE& theID)
 		return false;
 	}
 
+	wait();  //++v1.4
 	itsFoundID=0;
 	itsAction=Registry::LOOKUP;
 	itsFoundFlag=false;
 	itsQueueToLookup=theName;
-	wait();  //++v1.4
 	forEach();
-	release();  //++v1.4
 	theID=itsFoundID;
+	bool aFoundFlag=itsFoundFlag;
+	release();  //++v1.4
 	TRACE("Returned handle=" << theID)
-	TRACE(((itsFoundFlag) ? "Found" : "Not found"))
+	TRACE(((aFoundFlag) ? "Found" : "Not found"))
 	TRACE("Registry::lookup - end")
-	return itsFoundFlag;
+	return aFoundFlag;
 }
 
 MessageQueue* Registry::lookup(MQHANDLE theID)
@@ -148,18 +188,13 @@ MessageQueue* Registry::lookup(MQHANDLE theID)
 		return NULL;
 	}
 	
-	itsAction=Registry::LOOKUP1;
-	itsFoundFlag=false;
-	itsIDToFind=theID;	
-	itsMessageQueue=NULL;
-
 	wait();  //++v1.4
-	forEach();
+	MessageQueue* aQueue=find(theID);
 	release();  //++v1.4
 
-	TRACE(((itsFoundFlag) ? "Found" : "Not found"))
+	TRACE(((aQueue!=NULL) ? "Found" : "Not found"))
 	TRACE("Registry::lookup - end")
-	return itsMessageQueue;
+	return aQueue;
 }
 
 bool Registry::isStillAvailable(MQHANDLE theTarget)
@@ -174,7 +209,7 @@ bool Registry::isStillAvailable(MQHANDLE theTarget)
 
 	bool ret=false;
 	wait();  //++v1.4
-	MessageQueue* aQueue=(MessageQueue*)at(theTarget);
+	MessageQueue* aQueue=find(theTarget);
 	release();  //++v1.4
 	if(aQueue!=0)
 	{
@@ -204,9 +239,9 @@ void Registry::remove(MessageQueue* theQueue)
 		return;
 	}
 
+	wait();  //++v1.4
 	itsAction=Registry::REMOVE;
 	itsMessageQueue=theQueue;
-	wait();  //++v1.4
 	forEach();
 	release();  //++v1.4
 	TRACE("Registry::remove - end")
@@ -222,7 +257,7 @@ void Registry::post(MQHANDLE theTarget,Message* theMessage)
 	}
 	
 	wait();  //++v1.4
-	MessageQueue* aQueue=(MessageQueue*)at(theTarget);
+	MessageQueue* aQueue=find(theTarget);
 	release();  //++v1.4
 	if(aQueue!=0)
 		aQueue->post(theMessage);
@@ -238,21 +273,37 @@ void Registry::broadcast(Message* theMessage)
 		return;
 	}
 
+	wait();  //++v1.4
 	itsAction=Registry::BROADCAST;
 	itsMessage=theMessage;
-	wait();  //++v1.4
 	forEach();
 	release();  //++v1.4
 	delete theMessage;
 	TRACE("Registry::broadcast - end")
 }
 
+// Handles of old peers have no generation: the current queue of the slot is
+// assumed, as those peers always did.
+MQHANDLE Registry::widen(MQHANDLE theHandle)
+{
+	TRACE("Registry::widen - start")
+	if(isShuttingDown())
+		return theHandle;
+
+	wait();
+	MessageQueue* aQueue=(MessageQueue*)at(MQ_SLOT(theHandle));
+	MQHANDLE ret=(aQueue!=NULL) ? aQueue->getID() : theHandle;
+	release();
+	TRACE("Registry::widen - end")
+	return ret;
+}
+
 void Registry::dump()
 {
 	TRACE("Registry::dump - start")
 	LOG("Start of registry dump:")
-	itsAction=Registry::DUMP;
 	wait();
+	itsAction=Registry::DUMP;
 	forEach();
 	release();
 	LOG("End of dump")
@@ -271,7 +322,7 @@ bool Registry::onIteration(LinkedElement* theElement)
 		case Registry::REMOVE:
 			if(itsMessageQueue==aQueue)
 			{
-				unset(aQueue->getID());
+				freeID(aQueue->getID());
 				TRACE(aQueue->getName() << " removed from registry")
 				theElement->remove();
 				delete theElement;
@@ -298,16 +349,6 @@ bool Registry::onIteration(LinkedElement* theElement)
 			}
 			break;
 
-		case Registry::LOOKUP1:
-			if(aQueue->getID()==itsIDToFind)
-			{
-				itsFoundFlag=true;
-				ret=false;
-				itsMessageQueue=aQueue;
-				TRACE(aQueue->getName() << " found with ID=" << aQueue->getID())
-			}
-			break;
-
 
 		case Registry::GARBAGE_COLLECTION:
 			if(!aQueue->isRunning())
@@ -315,7 +356,7 @@ bool Registry::onIteration(LinkedElement* theElement)
 				string msg=string("Thread ")+aQueue->getName()+string(" not running. Removed from registry.");
 				WARNING(msg.c_str())
 				TRACE(aQueue->getName() << " not running. Removed from registry")
-				unset(aQueue->getID());
+				freeID(aQueue->getID());
 				theElement->remove();
 				delete theElement;
 				itsElementCount--;
@@ -23,22 +23,36 @@
 #include "Vector.h"
 #include "LinkedList.h"
 #include "Thread.h"
+#include <vector>
+#include <deque>
+using namespace std;
 
 class MessageQueue;
 class Message;
-typedef unsigned short MQHANDLE;
+
+// Slot of the queue in the registry and, in the high byte, the generation of
+// the slot: a handle kept after its queue is gone never reaches the next queue
+// registered in the same slot.
+typedef unsigned int MQHANDLE;
+#define MQ_SLOT_BITS 24
+#define MQ_SLOT_MASK 0xFFFFFF
+#define MQ_SLOT(h) ((h) & MQ_SLOT_MASK)
+#define MQ_NARROW_SLOTS 0xFFFF	// Slots reachable by peers with 16 bits handles
 
 class Registry : protected Vector, protected LinkedList, protected Thread
 {
 protected:
-	enum Action { REMOVE, BROADCAST, LOOKUP, LOOKUP1, GARBAGE_COLLECTION, DUMP } itsAction; 
+	enum Action { REMOVE, BROADCAST, LOOKUP, GARBAGE_COLLECTION, DUMP } itsAction; 
 	MessageQueue* itsMessageQueue;
 	Message* itsMessage;
 	string itsQueueToLookup;
 	MQHANDLE itsFoundID;
-	MQHANDLE itsIDToFind;
 	bool itsFoundFlag;
 	unsigned itsNextHandleAvailable; //++ v1.1
+	unsigned itsNarrowCount;		// Slots in use up to MQ_NARROW_SLOTS
+	unsigned itsNextWideSlot;
+	deque<unsigned> itsFreeWideSlots;
+	vector<unsigned char> itsGenerations;
 
 public:	
 	Registry(const char* theName);		
@@ -50,6 +64,7 @@ public:
 	bool lookup(const char* theName,MQHANDLE& theID);
 	bool isStillAvailable(MQHANDLE theTarget);
 	MessageQueue* lookup(MQHANDLE theID);
+	MQHANDLE widen(MQHANDLE theHandle);
 	void dump();
 	
 protected:
@@ -57,6 +72,8 @@ protected:
 	virtual bool onIteration(LinkedElement* theElement);
 	virtual void deleteObject(void* theObject); //++ v1.5
 	virtual MQHANDLE findID();
+	virtual void freeID(MQHANDLE theID);
+	MessageQueue* find(MQHANDLE theID);
 };
 
 #endif
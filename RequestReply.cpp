@@ -20,8 +20,10 @@
 #define SILENT
 #include "RequestReply.h"
 #include "Logger.h"
+#include "GeneralHashFunctions.h"
 #include <string>
 #include <strstream>
+#include <algorithm>
 using namespace std;
 #define REMOTE_OK "OK:"
 #define REMOTE_EXCEPTION "EXCEPTION:"
@@ -29,6 +31,47 @@ using namespace std;
 #define RETRYMAX 5
 #define RETRYLOOKUP 3
 
+map<string,Client::Flight> Client::itsFlights;
+Thread Client::itsFlightMutex("FlightMutex");
+
+LatencyStats::LatencyStats()
+{
+	itsAverage=0;
+	itsCount=0;
+	itsNext=0;
+}
+
+void LatencyStats::add(long theRTT)
+{
+	TRACE("LatencyStats::add - start")
+	if(itsCount==0)
+		itsAverage=(float)theRTT;
+	else
+		itsAverage+=((float)theRTT-itsAverage)/8;
+
+	if(itsSamples.size() < LATENCY_SAMPLES)
+		itsSamples.push_back(theRTT);
+	else
+		itsSamples[itsNext]=theRTT;
+
+	itsNext=(itsNext+1) % LATENCY_SAMPLES;
+	itsCount++;
+	TRACE("LatencyStats::add - end")
+}
+
+long LatencyStats::getPercentile(unsigned thePercent)
+{
+	TRACE("LatencyStats::getPercentile - start")
+	if(itsSamples.empty())
+		return 0;
+
+	vector<long> aSamples(itsSamples);
+	unsigned anIndex=(aSamples.size()-1)*thePercent/100;
+	nth_element(aSamples.begin(),aSamples.begin()+anIndex,aSamples.end());
+	TRACE("LatencyStats::getPercentile - end")
+	return aSamples[anIndex];
+}
+
 Client::Client(const char* theName, const char* theTarget) 
 	   :Observer(theName)
 {
@@ -45,6 +88,24 @@ Client::Client(const char* theName, const char* theTarget)
 	itsSendTime=0;
 	itsFailoverCnt=0;
 	itsRetryCount=0;
+	itsPrimary.host=itsHost;
+	itsPrimary.port=itsPort;
+	itsHedging=false;
+	itsHedgeDelay=0;
+	itsHedgeEndpoint=0;
+	itsHedgeProxy=0;
+	itsHedgeServer=0;
+	itsHedgeSeq=itsMsgCnt-1;
+	itsHedgeSent=false;
+	itsHedgeRetryCount=0;
+	itsHedgeCnt=0;
+	itsHedgeWinCnt=0;
+	itsLateFlag=false;
+	itsLateSeq=0;
+	itsLateEndpoint=0;
+	itsLateProxy=0;
+	itsSingleFlight=false;
+	itsFollower=false;
 
 	bool res=MessageQueue::lookup(theTarget,itsProxy);
 	if(!res)
@@ -61,8 +122,8 @@ Client::Client(const char* theName, const char* theHost,int thePort, const char*
 	   :Observer(theName)
 {
 	TRACE("Client::Client - start")
-	TRACE("Queue name=" << getName())
-	itsProxy=0;
+	TRACE("Queue name=" << getName())
+	itsProxy=0;
 	itsServer=0;
 	itsMsgCnt=0;
 	itsHost=theHost;
@@ -73,6 +134,24 @@ Client::Client(const char* theName, const char* theHost,int thePort, const char*
 	itsSendTime=0;
 	itsFailoverCnt=0;
 	itsRetryCount=0; 
+	itsPrimary.host=itsHost;
+	itsPrimary.port=itsPort;
+	itsHedging=false;
+	itsHedgeDelay=0;
+	itsHedgeEndpoint=0;
+	itsHedgeProxy=0;
+	itsHedgeServer=0;
+	itsHedgeSeq=itsMsgCnt-1;
+	itsHedgeSent=false;
+	itsHedgeRetryCount=0;
+	itsHedgeCnt=0;
+	itsHedgeWinCnt=0;
+	itsLateFlag=false;
+	itsLateSeq=0;
+	itsLateEndpoint=0;
+	itsLateProxy=0;
+	itsSingleFlight=false;
+	itsFollower=false;
 	SCHEDULE(this,500);
 	lookup();
 	TRACE("Client::Client - end")
@@ -81,6 +160,7 @@ Client::Client(const char* theName, const char* theHost,int thePort, const char*
 Client::~Client() 
 {
 	TRACE("Client::~Client - start")
+	endFlight(FlightReplyMessage::RETRY,""); // Followers send their own request
 	if(itsMessage!=NULL)
 		delete itsMessage;
 
@@ -105,15 +185,15 @@ bool Client::isConnected()
 {
 	wait();
 	TRACE("Client::isConnected - start")
-	bool ret=false;
-
-	if(itsConnected==false && itsProxy==0) // Never connected
+	bool ret=false;
+
+	if(itsConnected==false && itsProxy==0) // Never connected
 		ret=true; // Allow the client to estabilish the connection
-	else if(itsConnected==true && isStillAvailable(itsProxy)) // Continue to be connected
+	else if(itsConnected==true && isStillAvailable(itsProxy)) // Continue to be connected
 		ret=true; 
-	else
-		ret=false; // Connection lost
-
+	else
+		ret=false; // Connection lost
+
 	release();
 	TRACE("Client::isConnected - end")
 	return ret; 
@@ -140,81 +220,173 @@ void Client::addFailoverHost(char* theHost,int thePort)
 	TRACE("Client::addFailoverHost - end")
 }
 
+void Client::setHedging(bool theFlag,long theDelay)
+{
+	wait();
+	TRACE("Client::setHedging - start")
+	itsHedging=theFlag;
+	itsHedgeDelay=theDelay;
+	if(itsHedging && itsHedgeServer==0)
+		lookupHedge();
+	release();
+	TRACE("Client::setHedging - end")
+}
+
+LatencyStats* Client::getLatency(unsigned theEndpoint)
+{
+	return (theEndpoint <= itsFailoverList.size()) ? &getEntry(theEndpoint)->latency : NULL;
+}
+
+Client::FailoverEntry* Client::getEntry(unsigned theEndpoint)
+{
+	return (theEndpoint==0) ? &itsPrimary : itsFailoverList[theEndpoint-1];
+}
+
+unsigned Client::selectEndpoint(unsigned theExcluded)
+{
+	TRACE("Client::selectEndpoint - start")
+	// Lowest average round trip time; endpoints never used come first
+	unsigned aCount=itsFailoverList.size()+1;
+	unsigned aBest=theExcluded;
+	float aBestRTT=0;
+	for(unsigned i=1; i < aCount; i++)
+	{
+		unsigned anEndpoint=(theExcluded+i) % aCount;
+		float aRTT=getEntry(anEndpoint)->latency.getAverage();
+		if(aBest==theExcluded || aRTT < aBestRTT)
+		{
+			aBest=anEndpoint;
+			aBestRTT=aRTT;
+		}
+	}
+	TRACE("Client::selectEndpoint - end")
+	return aBest;
+}
+
+bool Client::isProxyOf(unsigned theEndpoint,MQHANDLE theProxy)
+{
+	TRACE("Client::isProxyOf - start")
+	MessageQueue* aQueue=MessageQueue::lookup(theProxy);
+	if(aQueue==NULL)
+		return false;
+
+	FailoverEntry* anEntry=getEntry(theEndpoint);
+	bool ret=(MessageProxyFactory::getProxyName(anEntry->host.c_str(),anEntry->port).compare(aQueue->getName())==0);
+	TRACE("Client::isProxyOf - end")
+	return ret;
+}
+
 void Client::lookup(bool findHost)
 {
 	TRACE("Client::lookup - start")
 	itsRetryCount=0;
 
-	if(itsFailoverList.empty())
+	if(findHost==true && !itsFailoverList.empty())
 	{
-		TRACE("Start lookup default host")
-		if(itsHost.size()==0)
+		// The endpoint given up is charged with a timeout
+		FailoverEntry* aLost=getEntry(itsFailoverCnt);
+		aLost->latency.add(REMOTE_TIMEOUT*1000);
+		if(aLost->host.size()>0)
+			MessageProxyFactory::invalidateLookup(aLost->host.c_str(),aLost->port,itsTarget.c_str());
+
+		if(itsHedgeServer!=0 && isStillAvailable(itsHedgeProxy))
 		{
-			bool res=MessageQueue::lookup(itsTarget.c_str(),itsProxy);
-			if(res)
-			{
-				itsServer=itsProxy;
-				itsConnected=true;
-			}
-		}
-		else
-		{	
-			MessageProxyFactory::lookupAt(itsHost.c_str(),itsPort,itsTarget.c_str(),this);
+			WARNING("Switch to the hedging endpoint")
+			itsFailoverCnt=itsHedgeEndpoint;
+			itsProxy=itsHedgeProxy;
+			itsServer=itsHedgeServer;
+			itsHedgeServer=0;
+			itsConnected=true;
+			if(itsMessage!=NULL)
+				postToProxy();
+			TRACE("Client::lookup - end")
+			return;
 		}
+
+		itsFailoverCnt=selectEndpoint(itsFailoverCnt);
+		if(itsHedgeEndpoint==itsFailoverCnt)
+			itsHedgeServer=0;
 	}
-	else
+		
+	if(itsFailoverCnt==0 && itsHost.size()==0)
 	{
-		if(findHost==true)
+		TRACE("Start lookup default host")
+		bool res=MessageQueue::lookup(itsTarget.c_str(),itsProxy);
+		if(res)
 		{
-			++itsFailoverCnt;
-			if(itsFailoverCnt > itsFailoverList.size())
-				itsFailoverCnt=0;
+			itsServer=itsProxy;
+			itsConnected=true;
 		}
-		
+	}
+	else
+	{
 		if(itsFailoverCnt==0)
 		{
 			TRACE("Start lookup default host")
-			if(itsHost.size()==0)
-			{
-				bool res=MessageQueue::lookup(itsTarget.c_str(),itsProxy);
-				if(res)
-				{
-					itsServer=itsProxy;
-					itsConnected=true;
-				}
-			}
-			else
-			{	
-				MessageProxyFactory::lookupAt(itsHost.c_str(),itsPort,itsTarget.c_str(),this);
-			}
 		}
 		else
 		{
 			WARNING("Start to lookup an alternative host")
-			FailoverEntry* anEntry=itsFailoverList[itsFailoverCnt-1];
-			MessageProxyFactory::lookupAt(anEntry->host.c_str(),anEntry->port,itsTarget.c_str(),this);						
 		}
+
+		FailoverEntry* anEntry=getEntry(itsFailoverCnt);
+		MessageProxyFactory::lookupAt(anEntry->host.c_str(),anEntry->port,itsTarget.c_str(),this);						
 	}
 	TRACE("Client::lookup - end")
 }
 
+void Client::lookupHedge()
+{
+	TRACE("Client::lookupHedge - start")
+	itsHedgeServer=0;
+	itsHedgeRetryCount=0;
+	if(itsHedging && itsConnected && !itsFailoverList.empty())
+	{
+		itsHedgeEndpoint=selectEndpoint(itsFailoverCnt);
+		if(itsHedgeEndpoint==0 && itsHost.size()==0)
+		{
+			if(MessageQueue::lookup(itsTarget.c_str(),itsHedgeProxy))
+				itsHedgeServer=itsHedgeProxy;
+		}
+		else
+		{
+			FailoverEntry* anEntry=getEntry(itsHedgeEndpoint);
+			MessageProxyFactory::lookupAt(anEntry->host.c_str(),anEntry->port,itsTarget.c_str(),this);
+		}
+	}
+	TRACE("Client::lookupHedge - end")
+}
+
 void Client::onLookup(LookupReplyMessage* theMessage)
 {
 	TRACE("Client::onLookup - start")
-	itsRetryCount=0;
-	
-	if(itsConnected==false && !theMessage->isFailed())
+	if(itsHedging && itsHedgeServer==0 && itsHedgeEndpoint!=itsFailoverCnt && 
+	   !theMessage->isFailed() && isProxyOf(itsHedgeEndpoint,theMessage->getSender()))
 	{
-		itsRetryCount=0;		
-		itsServer=theMessage->getHandle();
-		itsProxy=theMessage->getSender();
-		itsConnected=true;
-		LOG("Remote thread lookup ok.")	
-
-		if(itsMessage!=NULL)
+		itsHedgeServer=theMessage->getHandle();
+		itsHedgeProxy=theMessage->getSender();
+		LOG("Hedging thread lookup ok.")	
+	}
+	else
+	{
+		itsRetryCount=0;
+	
+		if(itsConnected==false && !theMessage->isFailed())
 		{
-			LOG("Transmition of queued message")	
-			postToProxy();
+			itsRetryCount=0;		
+			itsServer=theMessage->getHandle();
+			itsProxy=theMessage->getSender();
+			itsConnected=true;
+			LOG("Remote thread lookup ok.")	
+
+			if(itsMessage!=NULL && !itsFollower)
+			{
+				LOG("Transmition of queued message")	
+				postToProxy();
+			}
+
+			if(itsHedging && itsHedgeServer==0)
+				lookupHedge();
 		}
 	}
 	TRACE("Client::onLookup - end")
@@ -223,6 +395,24 @@ void Client::onLookup(LookupReplyMessage* theMessage)
 void Client::onWakeup(Wakeup* theMessage)
 {
 	TRACE("Client::onWakeup - start")
+	if(!theMessage->repeat())
+	{
+		// Hedging timer of the request still pending
+		if(itsMessage!=NULL && itsHedgeSeq==itsMsgCnt && !itsHedgeSent)
+			postHedge();
+		TRACE("Client::onWakeup - end")
+		return;
+	}
+
+	if(itsHedging && itsConnected)
+	{
+		if(itsHedgeServer!=0 && !isStillAvailable(itsHedgeProxy))
+			itsHedgeServer=0;
+
+		if(itsHedgeServer==0 && ++itsHedgeRetryCount>RETRYLOOKUP)
+			lookupHedge();
+	}
+
 	if(itsConnected==false || (itsConnected==true && !isStillAvailable(itsProxy)))
 	{
 		itsConnected=false;	
@@ -232,6 +422,7 @@ void Client::onWakeup(Wakeup* theMessage)
 			WARNING("Lost peer connection")
 			if(itsMessage!=NULL)
 			{	
+				endFlight(FlightReplyMessage::FAIL,"Lost connection");
 				reset();
 				fail("Lost connection");
 			}
@@ -248,12 +439,14 @@ void Client::onWakeup(Wakeup* theMessage)
 		if(++itsRetryCount>RETRYMAX) // ++ v1.2
 		{
 			WARNING("Peer timeout")	
+			endFlight(FlightReplyMessage::FAIL,"Timeout");
 			reset();
 			fail("Timeout");
 		}
 		else
 		{
 			WARNING("Try to retransmit last message")	
+			itsFollower=false; // Don't wait any longer for the leader of the flight
 			postToProxy();
 		}
 	}
@@ -265,17 +458,121 @@ void Client::postToProxy()
 	TRACE("Client::postToProxy - start")
 	if(itsMessage!=NULL) // ++ v1.5
 	{
+		itsMessage->setDeadline(REMOTE_TIMEOUT*1000); // Retransmitted afterwards: this copy is useless
 		NetworkMessage* aMessage=(NetworkMessage*)itsMessage->clone(); //++ v1.5
 		aMessage->setSender(getID());
 		aMessage->setTarget(itsServer);
 		aMessage->setTopic(itsTopic);
 		itsSendTime=Timer::time();
+		itsSendTimeExt=Timer::timeExt();
 		post(itsProxy,aMessage);
+
+		if(itsHedging && itsHedgeSeq!=itsMsgCnt)
+		{
+			itsHedgeSeq=itsMsgCnt;
+			itsHedgeSent=false;
+			Timer::postToDefaultTimer(new Wakeup(this,getHedgeDelay(),false));
+		}
 	}
 	TRACE("Client::postToProxy - end")
 }
 
-bool Client::sendMessage(string theBuffer) //++v1.4
+long Client::getHedgeDelay()
+{
+	if(itsHedgeDelay>0)
+		return itsHedgeDelay;
+
+	LatencyStats& aStats=getEntry(itsFailoverCnt)->latency;
+	if(aStats.getCount() < LATENCY_MIN_SAMPLES)
+		return HEDGE_DEFAULT_DELAY;
+
+	long aDelay=aStats.getPercentile(95);
+	return (aDelay < HEDGE_MIN_DELAY) ? HEDGE_MIN_DELAY : aDelay;
+}
+
+void Client::postHedge()
+{
+	TRACE("Client::postHedge - start")
+	if(itsHedgeServer!=0 && itsHedgeProxy!=itsProxy && isStillAvailable(itsHedgeProxy))
+	{
+		NetworkMessage* aMessage=(NetworkMessage*)itsMessage->clone();
+		aMessage->setSender(getID());
+		aMessage->setTarget(itsHedgeServer);
+		aMessage->setTopic(itsTopic);
+		itsHedgeTime=Timer::timeExt();
+		itsHedgeSent=true;
+		itsHedgeCnt++;
+		post(itsHedgeProxy,aMessage);
+	}
+	TRACE("Client::postHedge - end")
+}
+
+void Client::onReply(MQHANDLE theProxy)
+{
+	TRACE("Client::onReply - start")
+	_TIMEVAL aTime=Timer::timeExt();
+
+	if(itsHedgeSent && itsHedgeSeq==itsMsgCnt && theProxy==itsHedgeProxy && itsHedgeProxy!=itsProxy)
+	{
+		// The duplicate won: the original request is still running
+		LatencyStats& aHedge=getEntry(itsHedgeEndpoint)->latency;
+		aHedge.add(Timer::subtractMillisecs(&itsHedgeTime,&aTime));
+		itsHedgeWinCnt++;
+
+		if(itsLateFlag)
+		{
+			TRACE("Previous outrun request never replied: charged with its time so far")
+			getEntry(itsLateEndpoint)->latency.add(Timer::subtractMillisecs(&itsLateTime,&aTime));
+		}
+
+		itsLateFlag=true;
+		itsLateSeq=itsMsgCnt;
+		itsLateEndpoint=itsFailoverCnt;
+		itsLateProxy=itsProxy;
+		itsLateTime=itsSendTimeExt;
+		switchToFaster();
+	}
+	else
+		getEntry(itsFailoverCnt)->latency.add(Timer::subtractMillisecs(&itsSendTimeExt,&aTime));
+	TRACE("Client::onReply - end")
+}
+
+void Client::onLateReply()
+{
+	TRACE("Client::onLateReply - start")
+	_TIMEVAL aTime=Timer::timeExt();
+	itsLateFlag=false;
+	getEntry(itsLateEndpoint)->latency.add(Timer::subtractMillisecs(&itsLateTime,&aTime));
+	if(itsLateEndpoint==itsFailoverCnt)
+		switchToFaster();
+	TRACE("Client::onLateReply - end")
+}
+
+// The hedging endpoint takes over when it is twice as fast
+void Client::switchToFaster()
+{
+	TRACE("Client::switchToFaster - start")
+	LatencyStats& anActive=getEntry(itsFailoverCnt)->latency;
+	LatencyStats& aHedge=getEntry(itsHedgeEndpoint)->latency;
+
+	if(itsHedgeServer!=0 && itsHedgeProxy!=itsProxy && isStillAvailable(itsHedgeProxy) &&
+	   aHedge.getCount() > 0 && aHedge.getAverage()*2 < anActive.getAverage())
+	{
+		LOG("Switch to the faster endpoint")
+		unsigned anEndpoint=itsFailoverCnt;
+		itsFailoverCnt=itsHedgeEndpoint;
+		itsHedgeEndpoint=anEndpoint;
+		MQHANDLE aProxy=itsProxy;
+		itsProxy=itsHedgeProxy;
+		itsHedgeProxy=aProxy;
+		MQHANDLE aServer=itsServer;
+		itsServer=itsHedgeServer;
+		itsHedgeServer=aServer;
+	}
+	TRACE("Client::switchToFaster - end")
+}
+
+bool Client::sendMessage(const string& theBuffer) //++v1.4
 {
 	TRACE("Client::sendMessage - start")
 	wait();
@@ -285,18 +582,24 @@ bool Client::sendMessage(string theBuffer) //++v1.4
 	return ret;
 }
 
-bool Client::send(string theBuffer)
+bool Client::send(const string& theBuffer)
 {
 	TRACE("Client::send - start")
 	bool ret=false;
 	if(itsMessage==NULL)
 	{
-		itsMessage=new NetworkMessage(theBuffer);
+		itsMessage=new NetworkMessage(theBuffer,itsEncription); // Coded in place by post()
 		itsMessage->setSender(getID());
 		itsMessage->setSequenceNumber(itsMsgCnt);
 		itsMessage->setTopic(itsTopic);
+		itsFollower=false;
 
-		if(itsConnected==true && isStillAvailable(itsProxy))
+		if(itsSingleFlight && joinFlight())
+		{
+			TRACE("Wait for the reply of an identical request")
+			itsSendTime=Timer::time();
+		}
+		else if(itsConnected==true && isStillAvailable(itsProxy))
 		{
 			TRACE("Already connected. Immediate posting.")
 			postToProxy();
@@ -315,8 +618,9 @@ bool Client::send(string theBuffer)
 NetworkMessage* Client::onRequest(NetworkMessage* theMessage)
 {
 	TRACE("Client::onRequest - start")
-	if(theMessage->getSequenceNumber()==itsMsgCnt)
+	if(theMessage->getSequenceNumber(itsMsgCnt)==itsMsgCnt)
 	{
+		onReply(theMessage->getSender());
 		reset(); // ++ v1.2		
 		string response=theMessage->get();
 		if(response.substr(0,sizeof(REMOTE_OK)-1).compare(REMOTE_OK)==0)
@@ -324,6 +628,7 @@ NetworkMessage* Client::onRequest(NetworkMessage* theMessage)
 			TRACE("Service OK")
 			delete itsMessage;
 			itsMessage=NULL;
+			endFlight(FlightReplyMessage::SUCCESS,response.substr(sizeof(REMOTE_OK)-1,string::npos));
 			success(response.substr(sizeof(REMOTE_OK)-1,string::npos));
 		}
 		else if(response.substr(0,sizeof(REMOTE_EXCEPTION)-1).compare(REMOTE_EXCEPTION)==0)
@@ -331,6 +636,7 @@ NetworkMessage* Client::onRequest(NetworkMessage* theMessage)
 			WARNING((string("Service Error/Exception='")+ response + string("'")).c_str())
 			delete itsMessage;
 			itsMessage=NULL;
+			endFlight(FlightReplyMessage::FAIL,response.substr(sizeof(REMOTE_EXCEPTION)-1,string::npos));
 			fail(response.substr(sizeof(REMOTE_EXCEPTION)-1,string::npos));
 		}
 		else
@@ -338,6 +644,15 @@ NetworkMessage* Client::onRequest(NetworkMessage* theMessage)
 			WARNING("Client::onRequest: skipped message with bad message header")	
 		}				
 	}
+	else if(itsLateFlag && theMessage->getSender()==itsLateProxy && theMessage->getSequenceNumber(itsMsgCnt)==itsLateSeq)
+	{
+		TRACE("Late reply of a request outrun by its hedge")
+		onLateReply();
+	}
+	else if(itsHedging && theMessage->getSequenceNumber(itsMsgCnt)+1==itsMsgCnt)
+	{
+		TRACE("Late reply of a hedged request skipped")	
+	}	
 	else
 	{
 		WARNING("Client::onRequest: skipped message with bad sequence number")	
@@ -346,6 +661,84 @@ NetworkMessage* Client::onRequest(NetworkMessage* theMessage)
 	return NULL; // No reply
 }
 
+bool Client::joinFlight()
+{
+	TRACE("Client::joinFlight - start")
+	ostrstream aStream;
+	aStream << itsHost.c_str() << ":" << itsPort << "/" << itsTarget.c_str() << "#" << itsTopic.c_str() << "\n" << ends;
+	char* aString=aStream.str();
+	string aKey=string(aString) + itsMessage->get();
+	delete [] aString;
+
+	bool ret=false;
+	itsFlightMutex.wait();
+	map<string,Flight>::iterator i=itsFlights.find(aKey);
+	if(i!=itsFlights.end() && i->second.leader!=getID() && itsConnected && isStillAvailable(i->second.leader))
+	{
+		i->second.followers.push_back(pair<MQHANDLE,unsigned int>(getID(),itsMsgCnt));
+		itsFollower=true;
+		ret=true;
+	}
+	else
+	{
+		// Followers of a vanished leader get the reply of this request
+		itsFlights[aKey].leader=getID();
+		itsFlightKey=aKey;
+	}
+	itsFlightMutex.release();
+	TRACE("Client::joinFlight - end")
+	return ret;
+}
+
+void Client::endFlight(FlightReplyMessage::Result theResult,string theBuffer)
+{
+	TRACE("Client::endFlight - start")
+	if(itsFlightKey.size()==0)
+		return;
+
+	vector< pair<MQHANDLE,unsigned int> > aFollowers;
+	itsFlightMutex.wait();
+	map<string,Flight>::iterator i=itsFlights.find(itsFlightKey);
+	if(i!=itsFlights.end() && i->second.leader==getID())
+	{
+		aFollowers.swap(i->second.followers);
+		itsFlights.erase(i);
+	}
+	itsFlightMutex.release();
+	itsFlightKey.erase();
+
+	for(unsigned n=0; n < aFollowers.size(); n++)
+		MessageQueue::post(aFollowers[n].first,new FlightReplyMessage(theResult,theBuffer,aFollowers[n].second));
+	TRACE("Client::endFlight - end")
+}
+
+void Client::onLocal(Message* theMessage)
+{
+	TRACE("Client::onLocal - start")
+	if(theMessage->is("FlightReplyMessage"))
+	{
+		FlightReplyMessage* aReply=(FlightReplyMessage*)theMessage;
+		if(itsMessage!=NULL && aReply->itsSeq==itsMsgCnt)
+		{
+			if(aReply->itsResult==FlightReplyMessage::RETRY)
+			{
+				if(itsFollower && itsConnected)
+					postToProxy();
+				itsFollower=false;
+			}
+			else
+			{
+				reset();
+				if(aReply->itsResult==FlightReplyMessage::SUCCESS)
+					success(aReply->itsBuffer);
+				else
+					fail(aReply->itsBuffer);
+			}
+		}
+	}
+	TRACE("Client::onLocal - end")
+}
+
 void Client::reset() // ++ v1.2
 {
 	TRACE("Client::reset - start")
@@ -357,9 +750,280 @@ void Client::reset() // ++ v1.2
 	TRACE("Client::reset - end")
 }
 
-Server::Server(const char* theName) : Observer(theName)
+AsyncGather::AsyncGather(unsigned theExpected) 
+	 : itsMutex("AsyncGather"), itsReplies(theExpected), itsErrors(theExpected), itsFailed(theExpected,false), itsCount(0)
+{
+}
+
+void AsyncGather::onSuccess(unsigned theTag,string theBuffer)
+{
+	TRACE("AsyncGather::onSuccess - start")
+	done(theTag,theBuffer,false);
+	TRACE("AsyncGather::onSuccess - end")
+}
+
+void AsyncGather::onFail(unsigned theTag,string theError)
+{
+	TRACE("AsyncGather::onFail - start")
+	done(theTag,theError,true);
+	TRACE("AsyncGather::onFail - end")
+}
+
+void AsyncGather::done(unsigned theTag,string& theBuffer,bool theFailFlag)
+{
+	TRACE("AsyncGather::done - start")
+	if(theTag >= itsReplies.size())
+	{
+		LOG("AsyncGather::done : unexpected tag")
+		return;
+	}
+
+	itsMutex.wait();
+	if(theFailFlag)
+		itsErrors[theTag]=theBuffer;
+	else
+		itsReplies[theTag]=theBuffer;
+	itsFailed[theTag]=theFailFlag;
+	bool aLast=(++itsCount==itsReplies.size());
+	itsMutex.release();
+
+	if(aLast)
+		onComplete();
+	TRACE("AsyncGather::done - end")
+}
+
+bool AsyncGather::isComplete()
+{
+	itsMutex.wait();
+	bool ret=(itsCount>=itsReplies.size());
+	itsMutex.release();
+	return ret;
+}
+
+bool AsyncGather::isFailed(unsigned theTag)
+{
+	itsMutex.wait();
+	bool ret=itsFailed[theTag];
+	itsMutex.release();
+	return ret;
+}
+
+bool AsyncGather::wait(long theTimeout)
+{
+	TRACE("AsyncGather::wait - start")
+	_TIMEVAL aStart=Timer::timeExt();
+	while(!isComplete())
+	{
+		_TIMEVAL aNow=Timer::timeExt();
+		if((theTimeout>0 && Timer::subtractMillisecs(&aStart,&aNow) >= theTimeout) || Thread::isShuttingDown())
+			break;
+		Thread::sleep(1);
+	}
+	TRACE("AsyncGather::wait - end")
+	return isComplete();
+}
+
+string AsyncGather::get(unsigned theTag)
+{
+	TRACE("AsyncGather::get - start")
+	if(!wait())
+		throw ThreadException("Request not completed");
+
+	if(isFailed(theTag))
+		throw ThreadException(itsErrors[theTag]);
+	TRACE("AsyncGather::get - end")
+	return itsReplies[theTag];
+}
+
+AsyncClient::AsyncClient(const char* theName, const char* theTarget) 
+	   :Client(theName,theTarget), itsAsyncSeq(0)
+{
+	TRACE("AsyncClient::AsyncClient - start")
+	TRACE("AsyncClient::AsyncClient - end")
+}
+
+AsyncClient::AsyncClient(const char* theName, const char* theHost,int thePort, const char* theTarget) 
+	   :Client(theName,theHost,thePort,theTarget), itsAsyncSeq(0)
+{
+	TRACE("AsyncClient::AsyncClient - start")
+	TRACE("AsyncClient::AsyncClient - end")
+}
+
+AsyncClient::~AsyncClient()
+{
+	TRACE("AsyncClient::~AsyncClient - start")
+	for(map<unsigned int,PendingRequest>::iterator i=itsPending.begin(); i!=itsPending.end(); ++i)
+	{
+		if(!isShuttingDown())
+			i->second.handler->onFail(i->second.tag,"Client closed");
+		delete i->second.request;
+	}
+	itsPending.clear();
+	TRACE("AsyncClient::~AsyncClient - end")
+}
+
+void AsyncClient::request(string theBuffer,AsyncHandler* theHandler,unsigned theTag)
+{
+	TRACE("AsyncClient::request - start")
+	MessageQueue::post(new AsyncMessage(theBuffer,theHandler,theTag)); // Sent by the client thread
+	TRACE("AsyncClient::request - end")
+}
+
+void AsyncClient::onLocal(Message* theMessage)
+{
+	TRACE("AsyncClient::onLocal - start")
+	if(!theMessage->is("AsyncMessage"))
+	{
+		Client::onLocal(theMessage);
+		return;
+	}
+
+	AsyncMessage* aMessage=(AsyncMessage*)theMessage;
+	if(itsPending.size() >= 0xFFFF)
+	{
+		aMessage->itsHandler->onFail(aMessage->itsTag,"Too many pending requests");
+		TRACE("AsyncClient::onLocal - end")
+		return;
+	}
+
+	while(itsPending.find(itsAsyncSeq)!=itsPending.end())
+		itsAsyncSeq++;
+
+	PendingRequest& aRequest=itsPending[itsAsyncSeq];
+	aRequest.request=new NetworkMessage(aMessage->itsBuffer,itsEncription);
+	aRequest.request->setSequenceNumber(itsAsyncSeq);
+	aRequest.handler=aMessage->itsHandler;
+	aRequest.tag=aMessage->itsTag;
+	aRequest.sent=false;
+	aRequest.sendtime=Timer::time();
+	aRequest.retry=0;
+
+	if(itsConnected==true && isStillAvailable(itsProxy))
+		postRequest(itsAsyncSeq,aRequest);
+	itsAsyncSeq++;
+	TRACE("AsyncClient::onLocal - end")
+}
+
+void AsyncClient::postRequest(unsigned int theSeq,PendingRequest& theRequest)
+{
+	TRACE("AsyncClient::postRequest - start")
+	theRequest.request->setDeadline(REMOTE_TIMEOUT*1000);
+	NetworkMessage* aMessage=(NetworkMessage*)theRequest.request->clone();
+	aMessage->setSender(getID());
+	aMessage->setTarget(itsServer);
+	aMessage->setTopic(itsTopic);
+	theRequest.sent=true;
+	theRequest.sendtime=Timer::time();
+	theRequest.sendtimeext=Timer::timeExt();
+	post(itsProxy,aMessage);
+	TRACE("AsyncClient::postRequest - end")
+}
+
+void AsyncClient::flush()
+{
+	TRACE("AsyncClient::flush - start")
+	for(map<unsigned int,PendingRequest>::iterator i=itsPending.begin(); i!=itsPending.end(); ++i)
+		if(!i->second.sent)
+			postRequest(i->first,i->second);
+	TRACE("AsyncClient::flush - end")
+}
+
+void AsyncClient::onLookup(LookupReplyMessage* theMessage)
+{
+	TRACE("AsyncClient::onLookup - start")
+	Client::onLookup(theMessage);
+	if(itsConnected)
+		flush();
+	TRACE("AsyncClient::onLookup - end")
+}
+
+void AsyncClient::onWakeup(Wakeup* theMessage)
+{
+	TRACE("AsyncClient::onWakeup - start")
+	Client::onWakeup(theMessage);
+	if(!theMessage->repeat())
+		return;
+
+	bool aConnected=(itsConnected==true && isStillAvailable(itsProxy));
+	map<unsigned int,PendingRequest>::iterator i=itsPending.begin();
+	while(i!=itsPending.end())
+	{
+		PendingRequest& aRequest=i->second;
+		bool aRetry=false;
+		if(aConnected && !aRequest.sent)
+		{
+			aRequest.retry=0;
+			postRequest(i->first,aRequest);
+		}
+		else if(!aConnected) // Same pace as Client: one retry for each wakeup
+			aRetry=true;
+		else if(Timer::time() - aRequest.sendtime > REMOTE_TIMEOUT)
+			aRetry=true;
+
+		if(aRetry && ++aRequest.retry > RETRYMAX)
+		{
+			WARNING((aConnected) ? "Peer timeout" : "Lost peer connection")
+			AsyncHandler* aHandler=aRequest.handler;
+			unsigned aTag=aRequest.tag;
+			delete aRequest.request;
+			itsPending.erase(i++);
+			aHandler->onFail(aTag,(aConnected) ? "Timeout" : "Lost connection");
+			continue;
+		}
+
+		if(aRetry && aConnected)
+		{
+			WARNING("Try to retransmit a pending request")	
+			postRequest(i->first,aRequest);
+		}
+		++i;
+	}
+	TRACE("AsyncClient::onWakeup - end")
+}
+
+NetworkMessage* AsyncClient::onRequest(NetworkMessage* theMessage)
+{
+	TRACE("AsyncClient::onRequest - start")
+	map<unsigned int,PendingRequest>::iterator i=itsPending.find(theMessage->getSequenceNumber(itsAsyncSeq-1));
+	if(i==itsPending.end() || !i->second.sent)
+	{
+		TRACE("Late or duplicated reply skipped")	
+		TRACE("AsyncClient::onRequest - end")
+		return NULL;
+	}
+
+	PendingRequest aRequest=i->second;
+	itsPending.erase(i);
+	delete aRequest.request;
+
+	_TIMEVAL aTime=Timer::timeExt();
+	getEntry(itsFailoverCnt)->latency.add(Timer::subtractMillisecs(&aRequest.sendtimeext,&aTime));
+	itsRetryCount=0;
+
+	string response=theMessage->get();
+	if(response.substr(0,sizeof(REMOTE_OK)-1).compare(REMOTE_OK)==0)
+		aRequest.handler->onSuccess(aRequest.tag,response.substr(sizeof(REMOTE_OK)-1,string::npos));
+	else if(response.substr(0,sizeof(REMOTE_EXCEPTION)-1).compare(REMOTE_EXCEPTION)==0)
+	{
+		WARNING((string("Service Error/Exception='")+ response + string("'")).c_str())
+		aRequest.handler->onFail(aRequest.tag,response.substr(sizeof(REMOTE_EXCEPTION)-1,string::npos));
+	}
+	else
+	{
+		WARNING("AsyncClient::onRequest: bad message header")	
+		aRequest.handler->onFail(aRequest.tag,"Bad reply");
+	}
+	TRACE("AsyncClient::onRequest - end")
+	return NULL; // No reply
+}
+
+Server::Server(const char* theName) : Observer(theName), itsCacheMutex("ServerCache")
 {
 	TRACE("Server::Server - start")
+	itsCacheTTL=0;
+	itsCacheMaxBytes=REPLY_CACHE_SIZE;
+	itsCacheBytes=0;
+	itsCacheHitCnt=0;
 
 	TRACE("Server::Server - end")
 }
@@ -379,31 +1043,351 @@ NetworkMessage* Server::onRequest(NetworkMessage* theMessage)
 	
 	try
 	{
+		string aRequest=theMessage->get();
+		string aReply;
+		if(!findReply(aRequest,aReply))
+		{
+			aReply=service(aRequest);
+			storeReply(aRequest,aReply);
+		}
 		TRACE("Service completed with success")
-		string aBuffer=string(REMOTE_OK) + service(theMessage->get());
-		aMessage=new NetworkMessage(aBuffer);
+		aMessage=new NetworkMessage(string(REMOTE_OK) + aReply,itsEncription);
 	}
 	catch(Exception& exc)
 	{
 		WARNING((string("Exception=") +  exc.getMessage()).c_str())
-		ostrstream aStream;
-		aStream << REMOTE_EXCEPTION << exc.getMessage().c_str() << ends;
-		char* aString=aStream.str();
-		int aLen=strlen(aString)+1;
-		aMessage=new NetworkMessage(aString,aLen);
-		delete [] aString;
+		aMessage=remoteException(exc.getMessage().c_str());
 	}
 	catch(...)
 	{
 		CRITICAL("Service returns unhandled exception")
-		ostrstream aStream;
-		aStream << REMOTE_EXCEPTION << "Unhandled exception" << ends;
-		char* aString=aStream.str();
-		int aLen=strlen(aString)+1;
-		aMessage=new NetworkMessage(aString,aLen);
-		delete [] aString;
+		aMessage=remoteException("Unhandled exception");
 	}
 	TRACE("Server::onRequest - end")
 	return aMessage; // Send reply message
 }
 
+void Server::setReplyCache(unsigned long theTTL,unsigned long theMaxBytes)
+{
+	TRACE("Server::setReplyCache - start")
+	itsCacheMutex.wait();
+	itsCacheTTL=theTTL;
+	itsCacheMaxBytes=theMaxBytes;
+	while(!itsReplyLRU.empty() && (itsCacheTTL==0 || itsCacheBytes > itsCacheMaxBytes))
+		removeReply(itsReplyCache.find(itsReplyLRU.back()));
+	itsCacheMutex.release();
+	TRACE("Server::setReplyCache - end")
+}
+
+bool Server::findReply(string& theRequest,string& theReply)
+{
+	TRACE("Server::findReply - start")
+	if(itsCacheTTL==0)
+		return false;
+
+	bool ret=false;
+	itsCacheMutex.wait();
+	map<unsigned int,ReplyCacheEntry>::iterator i=itsReplyCache.find(DJBHash(theRequest));
+	if(i!=itsReplyCache.end())
+	{
+		if(Timer::time() - i->second.time > itsCacheTTL)
+			removeReply(i);
+		else if(i->second.request==theRequest)
+		{
+			itsReplyLRU.splice(itsReplyLRU.begin(),itsReplyLRU,i->second.lru);
+			theReply=i->second.reply;
+			itsCacheHitCnt++;
+			ret=true;
+		}
+	}
+	itsCacheMutex.release();
+	TRACE("Server::findReply - end")
+	return ret;
+}
+
+void Server::storeReply(string& theRequest,string& theReply)
+{
+	TRACE("Server::storeReply - start")
+	unsigned long aSize=theRequest.size()+theReply.size();
+	if(itsCacheTTL==0 || aSize > itsCacheMaxBytes)
+		return;
+
+	unsigned int aKey=DJBHash(theRequest);
+	itsCacheMutex.wait();
+	map<unsigned int,ReplyCacheEntry>::iterator i=itsReplyCache.find(aKey);
+	if(i!=itsReplyCache.end())
+		removeReply(i);
+
+	while(!itsReplyLRU.empty() && itsCacheBytes+aSize > itsCacheMaxBytes)
+		removeReply(itsReplyCache.find(itsReplyLRU.back()));
+
+	ReplyCacheEntry& anEntry=itsReplyCache[aKey];
+	anEntry.request=theRequest;
+	anEntry.reply=theReply;
+	anEntry.time=Timer::time();
+	itsReplyLRU.push_front(aKey);
+	anEntry.lru=itsReplyLRU.begin();
+	itsCacheBytes+=aSize;
+	itsCacheMutex.release();
+	TRACE("Server::storeReply - end")
+}
+
+void Server::removeReply(map<unsigned int,ReplyCacheEntry>::iterator theEntry)
+{
+	itsCacheBytes-=theEntry->second.request.size()+theEntry->second.reply.size();
+	itsReplyLRU.erase(theEntry->second.lru);
+	itsReplyCache.erase(theEntry);
+}
+
+NetworkMessage* Server::remoteException(const char* theReason)
+{
+	TRACE("Server::remoteException - start")
+	ostrstream aStream;
+	aStream << REMOTE_EXCEPTION << theReason << ends;
+	char* aString=aStream.str();
+	int aLen=strlen(aString)+1;
+	NetworkMessage* aMessage=new NetworkMessage(aString,aLen);
+	delete [] aString;
+	TRACE("Server::remoteException - end")
+	return aMessage;
+}
+
+ParallelServer::Worker::Worker(const char* theName,ParallelServer* theServer,unsigned theIndex)
+	 : MessageQueue(theName), itsServer(theServer), itsServerID(theServer->getID()), itsIndex(theIndex), itsMutex(theName)
+{
+	TRACE("ParallelServer::Worker::Worker - start")
+	TRACE("ParallelServer::Worker::Worker - end")
+}
+
+ParallelServer::Worker::~Worker()
+{
+	TRACE("ParallelServer::Worker::~Worker - start")
+	itsMutex.wait();
+	if(itsServer!=NULL) // Deleted by the registry before the server
+		itsServer->itsWorkers[itsIndex]=NULL;
+	itsServer=NULL;
+	itsMutex.release();
+	TRACE("ParallelServer::Worker::~Worker - end")
+}
+
+void ParallelServer::Worker::detach()
+{
+	TRACE("ParallelServer::Worker::detach - start")
+	itsMutex.wait();
+	itsServer=NULL;
+	itsMutex.release();
+	TRACE("ParallelServer::Worker::detach - end")
+}
+
+void ParallelServer::Worker::onMessage(Message* theMessage)
+{
+	TRACE("ParallelServer::Worker::onMessage - start")
+	if(!theMessage->is("ParallelJob"))
+		return;
+
+	Job* aJob=(Job*)theMessage;
+	Job* aDone=new Job(aJob->itsRequest,aJob->itsWorker);
+	aJob->itsRequest=NULL; // Handed over to the reply
+
+	itsMutex.wait();
+	if(itsServer!=NULL && !aDone->itsRequest->isExpired()) // Queued too long: the client gave up
+		aDone->itsReply=itsServer->Server::onRequest(aDone->itsRequest);
+	itsMutex.release();
+
+	MessageQueue::post(itsServerID,aDone);
+	TRACE("ParallelServer::Worker::onMessage - end")
+}
+
+ParallelServer::ParallelServer(const char* theName,unsigned theWorkers,unsigned long theMaxQueue,bool theOrdered)
+	 : Server(theName), itsOutstanding(0), itsMaxQueue(theMaxQueue), itsRejectedCnt(0), itsOrdered(theOrdered), itsEDF(false)
+{
+	TRACE("ParallelServer::ParallelServer - start")
+	if(theWorkers==0)
+		theWorkers=MessageProxyFactory::getCPUCount();
+
+	for(unsigned i=0; i < theWorkers; i++)
+	{
+		ostrstream aStream;
+		aStream << theName << "#" << i << ends;
+		char* aName=aStream.str();
+		itsWorkers.push_back(new Worker(aName,this,i));
+		itsQueued.push_back(0);
+		delete [] aName;
+	}
+	TRACE("ParallelServer::ParallelServer - end")
+}
+
+ParallelServer::~ParallelServer()
+{
+	TRACE("ParallelServer::~ParallelServer - start")
+	for(multimap<_TIMEVAL,Job*,DeadlineOrder>::iterator j=itsEDFQueue.begin(); j!=itsEDFQueue.end(); ++j)
+		delete j->second;
+	for(list<Job*>::iterator k=itsBackLog.begin(); k!=itsBackLog.end(); ++k)
+		delete *k;
+
+	for(unsigned i=0; i < itsWorkers.size(); i++)
+	{
+		if(itsWorkers[i]==NULL)
+			continue;
+		else if(isShuttingDown()) // The registry owns and deletes every queue
+			itsWorkers[i]->detach();
+		else
+			delete itsWorkers[i];
+	}
+	TRACE("ParallelServer::~ParallelServer - end")
+}
+
+unsigned ParallelServer::selectWorker(NetworkMessage* theMessage)
+{
+	TRACE("ParallelServer::selectWorker - start")
+	unsigned aWorker=0;
+	if(itsOrdered)
+	{
+		// Requests of the same client are served in order by the same worker
+		unsigned long aKey=(unsigned long)theMessage->getSender()*2654435761UL ^ (unsigned long)theMessage->getRemoteSender();
+		aWorker=(unsigned)(aKey % itsWorkers.size());
+	}
+	else
+	{
+		for(unsigned i=1; i < itsWorkers.size(); i++)
+			if(itsQueued[i] < itsQueued[aWorker])
+				aWorker=i;
+	}
+	TRACE("ParallelServer::selectWorker - end")
+	return aWorker;
+}
+
+NetworkMessage* ParallelServer::onRequest(NetworkMessage* theMessage)
+{
+	TRACE("ParallelServer::onRequest - start")
+	if(itsCacheTTL>0)
+	{
+		// Cached replies don't need a worker
+		string aRequest=theMessage->get();
+		string aReply;
+		if(findReply(aRequest,aReply))
+		{
+			TRACE("ParallelServer::onRequest - end")
+			return new NetworkMessage(string(REMOTE_OK) + aReply,itsEncription);
+		}
+	}
+
+	if(itsOutstanding >= itsMaxQueue)
+		shed();
+
+	if(itsOutstanding >= itsMaxQueue)
+	{
+		itsRejectedCnt++;
+		TRACE("ParallelServer::onRequest - end")
+		return remoteException("Server busy");
+	}
+
+	if(itsEDF && !itsOrdered)
+	{
+		Job* aJob=new Job((NetworkMessage*)theMessage->clone(),0);
+		if(theMessage->hasDeadline())
+			itsEDFQueue.insert(pair<const _TIMEVAL,Job*>(*theMessage->getDeadline(),aJob));
+		else
+			itsBackLog.push_back(aJob);
+		itsOutstanding++;
+		dispatch();
+		TRACE("ParallelServer::onRequest - end")
+		return NULL; // The reply is sent by onLocal
+	}
+
+	unsigned aWorker=selectWorker(theMessage);
+	itsQueued[aWorker]++;
+	itsOutstanding++;
+	itsWorkers[aWorker]->post(new Job((NetworkMessage*)theMessage->clone(),aWorker));
+	TRACE("ParallelServer::onRequest - end")
+	return NULL; // The reply is sent by onLocal
+}
+
+void ParallelServer::onLocal(Message* theMessage)
+{
+	TRACE("ParallelServer::onLocal - start")
+	if(!theMessage->is("ParallelJob"))
+		return;
+
+	Job* aJob=(Job*)theMessage;
+	itsQueued[aJob->itsWorker]--;
+	itsOutstanding--;
+
+	NetworkMessage* aRequest=aJob->itsRequest;
+	NetworkMessage* aReply=aJob->itsReply;
+	aJob->itsReply=NULL;
+	if(aReply!=NULL)
+	{
+		aReply->setSender(getID());
+		aReply->setTarget(aRequest->getRemoteSender());
+		aReply->setSequenceNumber(aRequest->getSequenceNumber());
+		post(aRequest->getSender(),aReply);
+	}
+	else
+		itsExpiredCnt++;
+
+	dispatch();
+	TRACE("ParallelServer::onLocal - end")
+}
+
+bool ParallelServer::DeadlineOrder::operator()(const _TIMEVAL& x,const _TIMEVAL& y) const
+{
+#ifdef WIN32
+	return (x.time < y.time) || (x.time==y.time && x.millitm < y.millitm);
+#else
+	return (x.tv_sec < y.tv_sec) || (x.tv_sec==y.tv_sec && x.tv_usec < y.tv_usec);
+#endif
+}
+
+void ParallelServer::dispatch()
+{
+	TRACE("ParallelServer::dispatch - start")
+	for(unsigned i=0; i < itsWorkers.size() && (!itsEDFQueue.empty() || !itsBackLog.empty()); i++)
+	{
+		if(itsQueued[i] > 0)
+			continue;
+
+		Job* aJob=NULL;
+		while(aJob==NULL && !itsEDFQueue.empty())
+		{
+			aJob=itsEDFQueue.begin()->second;
+			itsEDFQueue.erase(itsEDFQueue.begin());
+			if(aJob->itsRequest->isExpired())
+			{
+				TRACE("Request expired. Dropped!")
+				delete aJob;
+				aJob=NULL;
+				itsOutstanding--;
+				itsExpiredCnt++;
+			}
+		}
+
+		if(aJob==NULL)
+		{
+			if(itsBackLog.empty())
+				break;
+			aJob=itsBackLog.front();
+			itsBackLog.pop_front();
+		}
+
+		aJob->itsWorker=i;
+		itsQueued[i]++;
+		itsWorkers[i]->post(aJob);
+	}
+	TRACE("ParallelServer::dispatch - end")
+}
+
+// Expired requests are the first to go when the server is full
+void ParallelServer::shed()
+{
+	TRACE("ParallelServer::shed - start")
+	while(!itsEDFQueue.empty() && itsEDFQueue.begin()->second->itsRequest->isExpired())
+	{
+		delete itsEDFQueue.begin()->second;
+		itsEDFQueue.erase(itsEDFQueue.begin());
+		itsOutstanding--;
+		itsExpiredCnt++;
+	}
+	TRACE("ParallelServer::shed - end")
+}
+
@@ -21,16 +21,43 @@
 #define __REQUESTREPLY__
 
 #include "MessageProxy.h"
+#include "Timer.h"
 #include <vector>
+#include <map>
+#include <list>
 using namespace std;
 
+#define LATENCY_SAMPLES 64			// Round trip times kept by an endpoint for the percentiles
+#define LATENCY_MIN_SAMPLES 16		// Round trip times needed before the percentiles are used
+#define HEDGE_MIN_DELAY 10			// ms
+#define HEDGE_DEFAULT_DELAY 200		// ms, until the percentile is known
+#define PARALLEL_MAX_QUEUE 1024		// Requests accepted by a ParallelServer before failing fast
+#define REPLY_CACHE_SIZE 1048576		// Bytes of replies kept by a Server reply cache
+
+// Round trip times of the requests served by an endpoint
+class LatencyStats
+{
+protected:
+	float itsAverage;			// EWMA, ms
+	unsigned long itsCount;
+	vector<long> itsSamples;	// Last LATENCY_SAMPLES round trip times
+	unsigned itsNext;
+
+public:
+	LatencyStats();
+	void add(long theRTT);
+	float getAverage() { return itsAverage; };
+	unsigned long getCount() { return itsCount; };
+	long getPercentile(unsigned thePercent);
+};
+
 class Client : public Observer
 {
 protected:
 	bool itsConnected;
 	MQHANDLE itsProxy;	
 	MQHANDLE itsServer;
-	unsigned short itsMsgCnt;
+	unsigned int itsMsgCnt;
 	string itsHost;
 	int itsPort; 
 	string itsTarget; //v1.5
@@ -43,23 +70,77 @@ protected:
 	{
 		string host;
 		int port;
+		LatencyStats latency;
 	} FailoverEntry; 
 
+	FailoverEntry itsPrimary;
 	std::vector<FailoverEntry*> itsFailoverList;
-	unsigned itsFailoverCnt;
+	unsigned itsFailoverCnt;	// Endpoint in use: 0 is the primary one
+	_TIMEVAL itsSendTimeExt;
+
+	bool itsHedging;			// Duplicate slow requests to a second endpoint
+	long itsHedgeDelay;			// 0 means p95 of the endpoint in use
+	unsigned itsHedgeEndpoint;
+	MQHANDLE itsHedgeProxy;	
+	MQHANDLE itsHedgeServer;
+	unsigned int itsHedgeSeq;	// Request the hedging timer was started for
+	bool itsHedgeSent;
+	_TIMEVAL itsHedgeTime;
+	int itsHedgeRetryCount;
+	unsigned long itsHedgeCnt;
+	unsigned long itsHedgeWinCnt;
+
+	// Request outrun by its hedge: its round trip is taken when its own reply arrives
+	bool itsLateFlag;
+	unsigned int itsLateSeq;
+	unsigned itsLateEndpoint;
+	MQHANDLE itsLateProxy;
+	_TIMEVAL itsLateTime;
+
+	// Single-flight: identical requests of the process share one round trip
+	class FlightReplyMessage : public Message
+	{
+	public:
+		enum Result { SUCCESS, FAIL, RETRY };
+		Result itsResult;
+		string itsBuffer;
+		unsigned int itsSeq;	// Request of the follower
+
+		FlightReplyMessage(Result theResult,string& theBuffer,unsigned int theSeq)
+		   : Message("FlightReplyMessage"), itsResult(theResult), itsBuffer(theBuffer), itsSeq(theSeq) {};
+		virtual ~FlightReplyMessage() {};
+	};
+
+	typedef struct FlightStruct
+	{
+		MQHANDLE leader;
+		vector< pair<MQHANDLE,unsigned int> > followers;
+	} Flight;
+
+	static map<string,Flight> itsFlights;
+	static Thread itsFlightMutex;
+	bool itsSingleFlight;
+	bool itsFollower;		// The pending request waits for another Client
+	string itsFlightKey;	// Set while leading a flight
 
 public:
 	Client(const char* theName, const char* theTarget);
 	Client(const char* theName, const char* theHost,int thePort, const char* theTarget);
 	virtual ~Client();
 	virtual void addFailoverHost(char* theHost,int thePort);
-	virtual bool sendMessage(string theBuffer);
+	virtual bool sendMessage(const string& theBuffer);
 	virtual bool test(const char* theHost,int thePort, const char* theTarget);
 	virtual bool isConnected();
 	virtual void setTopic(const char* theTopic);
+	virtual void setHedging(bool theFlag,long theDelay=0);
+	virtual void setSingleFlight(bool theFlag) { itsSingleFlight=theFlag; };
+	LatencyStats* getLatency(unsigned theEndpoint);	// 0 is the primary endpoint
+	unsigned getEndpoint() { return itsFailoverCnt; };
+	unsigned long getHedgeCount() { return itsHedgeCnt; };
+	unsigned long getHedgeWinCount() { return itsHedgeWinCnt; };
 		 
 protected:
-	virtual bool send(string theBuffer); 
+	virtual bool send(const string& theBuffer); 
 
 	virtual void onLookup(LookupReplyMessage* theMessage);
 	virtual NetworkMessage* onRequest(NetworkMessage* theMessage);
@@ -71,17 +152,211 @@ protected:
 	virtual void lookup(bool findHost=false);
 	virtual void postToProxy();
 	virtual void reset();		
+
+	FailoverEntry* getEntry(unsigned theEndpoint);
+	unsigned selectEndpoint(unsigned theExcluded);
+	bool isProxyOf(unsigned theEndpoint,MQHANDLE theProxy);
+	long getHedgeDelay();
+	virtual void lookupHedge();
+	virtual void postHedge();
+	virtual void onReply(MQHANDLE theProxy);
+	virtual void onLateReply();
+	void switchToFaster();
+	virtual void onLocal(Message* theMessage);
+	bool joinFlight();
+	void endFlight(FlightReplyMessage::Result theResult,string theBuffer);
+};
+
+// Completion of an asynchronous request, called on the AsyncClient thread
+class AsyncHandler
+{
+public:
+	virtual ~AsyncHandler() {};
+	virtual void onSuccess(unsigned theTag,string theBuffer)=0;
+	virtual void onFail(unsigned theTag,string theError)=0;
+};
+
+// Collects the replies of theExpected requests tagged 0..theExpected-1, even
+// when they are spread over several AsyncClients (scatter/gather).
+// Don't wait() on the thread of an AsyncClient it is waiting for.
+class AsyncGather : public AsyncHandler
+{
+protected:
+	Thread itsMutex;
+	vector<string> itsReplies;
+	vector<string> itsErrors;
+	vector<bool> itsFailed;
+	unsigned itsCount;
+
+public:
+	AsyncGather(unsigned theExpected=1);
+	virtual ~AsyncGather() {};
+	virtual void onSuccess(unsigned theTag,string theBuffer);
+	virtual void onFail(unsigned theTag,string theError);
+	bool isComplete();
+	bool isFailed(unsigned theTag);
+	bool wait(long theTimeout=0);	// ms, 0 waits until every request completes
+	string get(unsigned theTag=0);	// Throws ThreadException if the request failed
+	string getError(unsigned theTag) { return itsErrors[theTag]; };
+
+protected:
+	virtual void onComplete() {};	// Called once, by the thread of the last reply
+	void done(unsigned theTag,string& theBuffer,bool theFailFlag);
+};
+
+// Client with many outstanding requests, matched by sequence number on the
+// same proxy. request() can be called by any thread; handlers are called by
+// the AsyncClient thread. Hedging is not used by asynchronous requests.
+class AsyncClient : public Client
+{
+protected:
+	class AsyncMessage : public Message
+	{
+	public:
+		string itsBuffer;
+		AsyncHandler* itsHandler;
+		unsigned itsTag;
+
+		AsyncMessage(string& theBuffer,AsyncHandler* theHandler,unsigned theTag)
+		   : Message("AsyncMessage"), itsBuffer(theBuffer), itsHandler(theHandler), itsTag(theTag) {};
+		virtual ~AsyncMessage() {};
+	};
+
+	typedef struct PendingRequestStruct
+	{
+		NetworkMessage* request;
+		AsyncHandler* handler;
+		unsigned tag;
+		bool sent;
+		unsigned long sendtime;
+		_TIMEVAL sendtimeext;
+		int retry;
+	} PendingRequest;
+
+	map<unsigned int,PendingRequest> itsPending;
+	unsigned int itsAsyncSeq;
+
+public:
+	AsyncClient(const char* theName, const char* theTarget);
+	AsyncClient(const char* theName, const char* theHost,int thePort, const char* theTarget);
+	virtual ~AsyncClient();
+	virtual void request(string theBuffer,AsyncHandler* theHandler,unsigned theTag=0);
+	unsigned getPending() { return itsPending.size(); };
+
+protected:
+	virtual void onLocal(Message* theMessage);
+	virtual NetworkMessage* onRequest(NetworkMessage* theMessage);
+	virtual void onLookup(LookupReplyMessage* theMessage);
+	virtual void onWakeup(Wakeup* theMessage);
+	virtual void success(string) {};
+	virtual void fail(string) {};
+	virtual void postRequest(unsigned int theSeq,PendingRequest& theRequest);
+	virtual void flush();
 };
 
 class Server : public Observer
 {
+protected:
+	typedef struct ReplyCacheEntryStruct
+	{
+		string request;
+		string reply;
+		unsigned long time;
+		list<unsigned int>::iterator lru;
+	} ReplyCacheEntry;
+
+	// Successful replies of idempotent services, keyed by the request hash
+	map<unsigned int,ReplyCacheEntry> itsReplyCache;
+	list<unsigned int> itsReplyLRU;	// Most recently used first
+	Thread itsCacheMutex;
+	unsigned long itsCacheTTL;		// secs, 0 disables the cache
+	unsigned long itsCacheMaxBytes;
+	unsigned long itsCacheBytes;
+	unsigned long itsCacheHitCnt;
+
 public:
 	Server(const char* theName);
 	virtual ~Server();
+	virtual void setReplyCache(unsigned long theTTL,unsigned long theMaxBytes=REPLY_CACHE_SIZE);
+	unsigned long getCacheHitCount() { return itsCacheHitCnt; };
 
 protected:
 	virtual NetworkMessage* onRequest(NetworkMessage* theMessage);
 	virtual string service(string theBuffer)=0;
+	static NetworkMessage* remoteException(const char* theReason);
+	bool findReply(string& theRequest,string& theReply);
+	void storeReply(string& theRequest,string& theReply);
+	void removeReply(map<unsigned int,ReplyCacheEntry>::iterator theEntry);
+};
+
+// Server running service() on a pool of worker threads. service() must be
+// thread safe. Replies are sent back by the Server thread, so encryption and
+// compression are never shared with the workers.
+// With earliest-deadline-first, requests wait in the server until a worker is
+// idle and the most urgent one is served first; expired ones are dropped.
+// Requests without deadline come after them. Not used in ordered mode.
+class ParallelServer : public Server
+{
+protected:
+	class DeadlineOrder
+	{
+	public:
+		bool operator()(const _TIMEVAL& x,const _TIMEVAL& y) const;
+	};
+
+	class Job : public Message
+	{
+	public:
+		NetworkMessage* itsRequest;
+		NetworkMessage* itsReply;
+		unsigned itsWorker;
+
+		Job(NetworkMessage* theRequest,unsigned theWorker)
+		   : Message("ParallelJob"), itsRequest(theRequest), itsReply(NULL), itsWorker(theWorker) {};
+		virtual ~Job() { delete itsRequest; delete itsReply; };
+	};
+
+	class Worker : public MessageQueue
+	{
+	protected:
+		ParallelServer* itsServer;
+		MQHANDLE itsServerID;
+		unsigned itsIndex;
+		Thread itsMutex;	// Held while service() runs
+
+	public:
+		Worker(const char* theName,ParallelServer* theServer,unsigned theIndex);
+		virtual ~Worker();
+		void detach();
+
+	protected:
+		virtual void onMessage(Message* theMessage);
+	};
+
+	vector<Worker*> itsWorkers;
+	vector<unsigned long> itsQueued;	// Jobs dispatched to each worker and not yet replied
+	unsigned long itsOutstanding;
+	unsigned long itsMaxQueue;
+	unsigned long itsRejectedCnt;
+	bool itsOrdered;
+	bool itsEDF;
+	multimap<_TIMEVAL,Job*,DeadlineOrder> itsEDFQueue;	// Jobs waiting for an idle worker
+	list<Job*> itsBackLog;								// Same, without deadline
+
+public:
+	ParallelServer(const char* theName,unsigned theWorkers=0,unsigned long theMaxQueue=PARALLEL_MAX_QUEUE,bool theOrdered=false);
+	virtual ~ParallelServer();
+	unsigned getWorkers() { return itsWorkers.size(); };
+	unsigned long getOutstanding() { return itsOutstanding; };
+	unsigned long getRejectedCount() { return itsRejectedCnt; };
+	void setEarliestDeadlineFirst(bool theFlag) { itsEDF=theFlag; };
+
+protected:
+	virtual NetworkMessage* onRequest(NetworkMessage* theMessage);
+	virtual void onLocal(Message* theMessage);
+	virtual unsigned selectWorker(NetworkMessage* theMessage);
+	virtual void dispatch();
+	void shed();
 };
 
 #endif
@@ -20,8 +20,10 @@
 #define SILENT
 #include "Router.h"
 #include "Logger.h"
+#include "GeneralHashFunctions.h"
 #include <string>
 #include <strstream>
+#include <algorithm>
 using namespace std;
 
 //#define DISPLAY_TRAFFIC
@@ -35,6 +37,387 @@ using namespace std;
 #define DISPLAYB2S
 #endif
 
+RoutingTable::RoutingTable(long theExpiration,unsigned theCapacity)
+{
+	TRACE("RoutingTable::RoutingTable - start")
+	unsigned aCapacity=16;
+	while(aCapacity < theCapacity)
+		aCapacity <<= 1;
+
+	itsSlots.assign(aCapacity,-1);
+	itsMask=aCapacity-1;
+	itsSize=0;
+	itsHead=itsTail=itsFree=-1;
+	itsExpiration=theExpiration;
+	itsEvictedCnt=0;
+	itsExpiredCnt=0;
+	TRACE("RoutingTable::RoutingTable - end")
+}
+
+RoutingTable::RoutingSession* RoutingTable::insert(unsigned int theKey,MQHANDLE theServer)
+{
+	TRACE("RoutingTable::insert - start")
+	expire();
+
+	int aSlot=find(theKey);
+	if(aSlot>=0)
+	{
+		// Sequence number wrapped while the old request was still pending
+		erase(aSlot);
+		itsEvictedCnt++;
+	}
+
+	if((itsSize+1)*2 > itsSlots.size())
+		grow();
+
+	int aNode=itsFree;
+	if(aNode>=0)
+		itsFree=itsNodes[aNode].next;
+	else
+	{
+		aNode=itsNodes.size();
+		itsNodes.push_back(RoutingNode());
+	}
+
+	RoutingNode& aRoutingNode=itsNodes[aNode];
+	aRoutingNode.key=theKey;
+	aRoutingNode.prev=itsTail;
+	aRoutingNode.next=-1;
+	if(itsTail>=0)
+		itsNodes[itsTail].next=aNode;
+	else
+		itsHead=aNode;
+	itsTail=aNode;
+
+	unsigned i=hash(theKey);
+	while(itsSlots[i]>=0)
+		i=(i+1) & itsMask;
+	itsSlots[i]=aNode;
+	itsSize++;
+
+	RoutingSession& aSession=aRoutingNode.session;
+	aSession.proxy=0;
+	aSession.client=0;
+	aSession.server=theServer;
+	aSession.seqnum=0;
+	aSession.time=Timer::timeExt();
+	if(theServer!=0)
+		itsOutstanding[theServer]++;
+	TRACE("RoutingTable::insert - end")
+	return &aSession;
+}
+
+bool RoutingTable::remove(unsigned int theKey,RoutingSession& theSession)
+{
+	TRACE("RoutingTable::remove - start")
+	expire();
+
+	int aSlot=find(theKey);
+	if(aSlot<0)
+	{
+		TRACE("RoutingTable::remove - end")
+		return false;
+	}
+
+	theSession=itsNodes[itsSlots[aSlot]].session;
+	erase(aSlot);
+	TRACE("RoutingTable::remove - end")
+	return true;
+}
+
+bool RoutingTable::findServer(MQHANDLE theServer,RoutingSession& theSession)
+{
+	TRACE("RoutingTable::findServer - start")
+	for(int aNode=itsHead; aNode>=0; aNode=itsNodes[aNode].next)
+	{
+		if(itsNodes[aNode].session.server==theServer)
+		{
+			theSession=itsNodes[aNode].session;
+			TRACE("RoutingTable::findServer - end")
+			return true;
+		}
+	}
+
+	TRACE("RoutingTable::findServer - end")
+	return false;
+}
+
+unsigned RoutingTable::getOutstanding(MQHANDLE theServer)
+{
+	map<MQHANDLE,unsigned>::iterator i=itsOutstanding.find(theServer);
+	return (i!=itsOutstanding.end()) ? i->second : 0;
+}
+
+void RoutingTable::expire()
+{
+	TRACE("RoutingTable::expire - start")
+	if(itsHead>=0)
+	{
+		_TIMEVAL current=Timer::timeExt();
+		while(itsHead>=0 && Timer::subtractMillisecs(&itsNodes[itsHead].session.time,&current) >= itsExpiration)
+		{
+			erase(find(itsNodes[itsHead].key));
+			itsExpiredCnt++;
+		}
+	}
+	TRACE("RoutingTable::expire - end")
+}
+
+int RoutingTable::find(unsigned int theKey)
+{
+	for(unsigned i=hash(theKey); itsSlots[i]>=0; i=(i+1) & itsMask)
+		if(itsNodes[itsSlots[i]].key==theKey)
+			return i;
+
+	return -1;
+}
+
+void RoutingTable::erase(int theSlot)
+{
+	int aNode=itsSlots[theSlot];
+	RoutingNode& aRoutingNode=itsNodes[aNode];
+	if(aRoutingNode.prev>=0)
+		itsNodes[aRoutingNode.prev].next=aRoutingNode.next;
+	else
+		itsHead=aRoutingNode.next;
+	if(aRoutingNode.next>=0)
+		itsNodes[aRoutingNode.next].prev=aRoutingNode.prev;
+	else
+		itsTail=aRoutingNode.prev;
+	aRoutingNode.next=itsFree;
+	itsFree=aNode;
+	itsSize--;
+
+	MQHANDLE aServer=aRoutingNode.session.server;
+	if(aServer!=0 && --itsOutstanding[aServer]==0)
+		itsOutstanding.erase(aServer);
+
+	// Backward shift deletion: no tombstones left behind
+	unsigned i=theSlot;
+	unsigned j=i;
+	for(;;)
+	{
+		itsSlots[i]=-1;
+		for(;;)
+		{
+			j=(j+1) & itsMask;
+			if(itsSlots[j]<0)
+				return;
+
+			unsigned k=hash(itsNodes[itsSlots[j]].key);
+			if((i<=j) ? (i<k && k<=j) : (i<k || k<=j))
+				continue;
+
+			break;
+		}
+		itsSlots[i]=itsSlots[j];
+		i=j;
+	}
+}
+
+void RoutingTable::grow()
+{
+	TRACE("RoutingTable::grow - start")
+	itsSlots.assign(itsSlots.size()*2,-1);
+	itsMask=itsSlots.size()-1;
+	for(int aNode=itsHead; aNode>=0; aNode=itsNodes[aNode].next)
+	{
+		unsigned i=hash(itsNodes[aNode].key);
+		while(itsSlots[i]>=0)
+			i=(i+1) & itsMask;
+		itsSlots[i]=aNode;
+	}
+	TRACE("RoutingTable::grow - end")
+}
+
+static unsigned int mix(unsigned int theValue)
+{
+	theValue ^= theValue >> 16;
+	theValue *= 0x85ebca6bU;
+	theValue ^= theValue >> 13;
+	theValue *= 0xc2b2ae35U;
+	theValue ^= theValue >> 16;
+	return theValue;
+}
+
+TopicPool::TopicPool(const string& theTopic,unsigned int theHash)
+		 :itsTopic(theTopic), itsHash(theHash), itsPolicy(RoundRobin), itsNext(0)
+{
+}
+
+bool TopicPool::add(MQHANDLE theTarget)
+{
+	TRACE("TopicPool::add - start")
+	for(unsigned i=0; i < itsTargets.size(); i++)
+		if(itsTargets[i]==theTarget)
+			return false;
+
+	itsTargets.push_back(theTarget);
+	buildRing();
+	TRACE("TopicPool::add - end")
+	return true;
+}
+
+bool TopicPool::remove(MQHANDLE theTarget)
+{
+	TRACE("TopicPool::remove - start")
+	for(vector<MQHANDLE>::iterator i = itsTargets.begin(); i < itsTargets.end(); ++i)
+	{
+		if(*i==theTarget)
+		{
+			itsTargets.erase(i);
+			buildRing();
+			TRACE("TopicPool::remove - end")
+			return true;
+		}
+	}
+
+	TRACE("TopicPool::remove - end")
+	return false;
+}
+
+MQHANDLE TopicPool::select(RoutingTable& theSessions,unsigned int theKey)
+{
+	TRACE("TopicPool::select - start")
+	MQHANDLE aTarget=0;
+	if(itsTargets.size()==1)
+		aTarget=itsTargets[0];
+	else if(itsTargets.size()>1)
+	{
+		switch(itsPolicy)
+		{
+			case LeastOutstanding:
+			{
+				// Ties are broken round robin
+				unsigned aMin=0xffffffff;
+				for(unsigned i=0; i < itsTargets.size(); i++)
+				{
+					MQHANDLE aCandidate=itsTargets[(itsNext+i) % itsTargets.size()];
+					unsigned aCount=theSessions.getOutstanding(aCandidate);
+					if(aCount < aMin)
+					{
+						aMin=aCount;
+						aTarget=aCandidate;
+					}
+				}
+				itsNext++;
+				break;
+			}
+			case ConsistentHash:
+			{
+				pair<unsigned int,MQHANDLE> aPoint(mix(theKey),0);
+				vector< pair<unsigned int,MQHANDLE> >::iterator i=lower_bound(itsRing.begin(),itsRing.end(),aPoint);
+				if(i==itsRing.end())
+					i=itsRing.begin();
+				aTarget=i->second;
+				break;
+			}
+			default:
+				aTarget=itsTargets[itsNext++ % itsTargets.size()];
+		}
+	}
+
+	TRACE("TopicPool::select - end")
+	return aTarget;
+}
+
+void TopicPool::buildRing()
+{
+	TRACE("TopicPool::buildRing - start")
+	// The points of a target do not depend on the others: adding or removing
+	// a target moves only the keys that fall on its points
+	itsRing.clear();
+	for(unsigned i=0; i < itsTargets.size(); i++)
+		for(unsigned j=0; j < CONSISTENT_HASH_POINTS; j++)
+			itsRing.push_back(pair<unsigned int,MQHANDLE>(mix((itsTargets[i] << 8) ^ j ^ 0x9e3779b9U),itsTargets[i]));
+
+	sort(itsRing.begin(),itsRing.end());
+	TRACE("TopicPool::buildRing - end")
+}
+
+TopicTable::TopicTable()
+{
+	itsBuckets.resize(16);
+	itsSize=0;
+}
+
+TopicTable::~TopicTable()
+{
+	clear();
+}
+
+TopicPool* TopicTable::find(const string& theTopic)
+{
+	TRACE("TopicTable::find - start")
+	unsigned int anHash=DJBHash(theTopic);
+	vector<TopicPool*>& aBucket=itsBuckets[anHash & (itsBuckets.size()-1)];
+	for(unsigned i=0; i < aBucket.size(); i++)
+	{
+		if(aBucket[i]->itsHash==anHash && aBucket[i]->itsTopic==theTopic)
+		{
+			TRACE("TopicTable::find - end")
+			return aBucket[i];
+		}
+	}
+
+	TRACE("TopicTable::find - end")
+	return NULL;
+}
+
+TopicPool* TopicTable::add(const string& theTopic)
+{
+	TRACE("TopicTable::add - start")
+	TopicPool* aPool=find(theTopic);
+	if(aPool==NULL)
+	{
+		if(itsSize >= itsBuckets.size())
+			grow();
+
+		unsigned int anHash=DJBHash(theTopic);
+		aPool=new TopicPool(theTopic,anHash);
+		itsBuckets[anHash & (itsBuckets.size()-1)].push_back(aPool);
+		itsSize++;
+	}
+
+	TRACE("TopicTable::add - end")
+	return aPool;
+}
+
+void TopicTable::remove(MQHANDLE theTarget)
+{
+	TRACE("TopicTable::remove - start")
+	for(unsigned i=0; i < itsBuckets.size(); i++)
+		for(unsigned j=0; j < itsBuckets[i].size(); j++)
+			itsBuckets[i][j]->remove(theTarget);
+	TRACE("TopicTable::remove - end")
+}
+
+void TopicTable::clear()
+{
+	TRACE("TopicTable::clear - start")
+	for(unsigned i=0; i < itsBuckets.size(); i++)
+	{
+		for(unsigned j=0; j < itsBuckets[i].size(); j++)
+			delete itsBuckets[i][j];
+		itsBuckets[i].clear();
+	}
+
+	itsSize=0;
+	TRACE("TopicTable::clear - end")
+}
+
+void TopicTable::grow()
+{
+	TRACE("TopicTable::grow - start")
+	vector< vector<TopicPool*> > aBuckets(itsBuckets.size()*2);
+	for(unsigned i=0; i < itsBuckets.size(); i++)
+		for(unsigned j=0; j < itsBuckets[i].size(); j++)
+			aBuckets[itsBuckets[i][j]->itsHash & (aBuckets.size()-1)].push_back(itsBuckets[i][j]);
+
+	itsBuckets.swap(aBuckets);
+	TRACE("TopicTable::grow - end")
+}
+
 RemoteRouter::RemoteRouter(const char* theName, const char* theHost,int thePort, const char* theTarget) 
 	   :MessageQueue(theName)
 {
@@ -47,14 +430,7 @@ RemoteRouter::RemoteRouter(const char* theName, const char* theHost,int thePort,
 	itsPort=thePort;
 	itsTarget=theTarget;
 	itsConnected=false;
-	
-	for(int i=0; i < MAXSESSIONS; i++)
-	{
-		itsSessions[i].proxy=0;
-		itsSessions[i].client=0;
-		itsSessions[i].seqnum=0;
-	}
-	
+		
 	SCHEDULE(this,5000);
 	MessageProxyFactory::lookupAt(itsHost.c_str(),itsPort,itsTarget.c_str(),this);			
 	TRACE("RemoteRouter::RemoteRouter - end")
@@ -118,27 +494,21 @@ void RemoteRouter::onMessage(Message* theMessage)
 				TRACE("Handling message from server")
 				DISPLAYS2C
 
-				int anIndex=aRequest->getSequenceNumber() % MAXSESSIONS;
-				if(itsSessions[anIndex].proxy!=0 && isStillAvailable(itsSessions[anIndex].proxy))
+				RoutingTable::RoutingSession aSession;
+				if(itsSessions.remove(aRequest->getSequenceNumber(itsSeqNum-1),aSession) && isStillAvailable(aSession.proxy))
 				{
-					_TIMEVAL current=Timer::timeExt();
-					long elapsed=Timer::subtractMillisecs(&itsSessions[anIndex].time,&current);
-
-					if(elapsed < SESSION_EXPIRATION_TIME)
-					{
-						NetworkMessage* aReply=(NetworkMessage*)aRequest->clone();
-						aReply->setSender(getID());
-						aReply->setRemoteSender(0);
-						aReply->setTarget(itsSessions[anIndex].client);
-						aReply->setSequenceNumber(itsSessions[anIndex].seqnum);
-						post(itsSessions[anIndex].proxy,aReply); 
-					}
-
-					itsSessions[anIndex].proxy=0;
-					itsSessions[anIndex].client=0;
-					itsSessions[anIndex].seqnum=0;
+					NetworkMessage* aReply=(NetworkMessage*)aRequest->clone();
+					aReply->setSender(getID());
+					aReply->setRemoteSender(0);
+					aReply->setTarget(aSession.client);
+					aReply->setSequenceNumber(aSession.seqnum);
+					post(aSession.proxy,aReply); 
 				}
 			}
+			else if(aRequest->isExpired())
+			{
+				TRACE("Request expired. Dropped!")
+			}
 			else if(!aRequest->isBroadcasting() && !isShuttingDown())
 			{
 				TRACE("Handling message from client")
@@ -146,17 +516,16 @@ void RemoteRouter::onMessage(Message* theMessage)
 				{
 					DISPLAYC2S
 					
-					unsigned short anIndex=itsSeqNum % MAXSESSIONS;					
-					itsSessions[anIndex].proxy=aRequest->getSender();
-					itsSessions[anIndex].client=aRequest->getRemoteSender();
-					itsSessions[anIndex].seqnum=aRequest->getSequenceNumber();
-					itsSessions[anIndex].time=Timer::timeExt();
-
 					NetworkMessage* aNewRequest=(NetworkMessage*)aRequest->clone();
 					aNewRequest->setSender(getID());
 					aNewRequest->setRemoteSender(0);
 					aNewRequest->setTarget(itsServer);
 					aNewRequest->setSequenceNumber(itsSeqNum);
+
+					RoutingTable::RoutingSession* aSession=itsSessions.insert(aNewRequest->getSequenceNumber());
+					aSession->proxy=aRequest->getSender();
+					aSession->client=aRequest->getRemoteSender();
+					aSession->seqnum=aRequest->getSequenceNumber();
 					post(itsProxy,aNewRequest);
 
 					itsSeqNum++;
@@ -185,13 +554,6 @@ LocalRouter::LocalRouter(const char* theName, const char* theTarget)
 	if(!lookup(theTarget,itsServer))
 		throw ThreadException("Lookup of local service failed");
 	
-	for(int i=0; i < MAXSESSIONS; i++)
-	{
-		itsSessions[i].proxy=0;
-		itsSessions[i].client=0;
-		itsSessions[i].seqnum=0;
-	}
-
 	TRACE("LocalRouter::LocalRouter - end")
 }
 	
@@ -216,45 +578,37 @@ void LocalRouter::onMessage(Message* theMessage)
 			if(itsServer==aRequest->getSender() && aRequest->getRemoteSender()==0 && !aRequest->isBroadcasting())
 			{
 				TRACE("Handling message from server")	
-				int anIndex=aRequest->getSequenceNumber() % MAXSESSIONS;
-				if(itsSessions[anIndex].proxy!=0 && isStillAvailable(itsSessions[anIndex].proxy))
+				RoutingTable::RoutingSession aSession;
+				if(itsSessions.remove(aRequest->getSequenceNumber(itsSeqNum-1),aSession) && isStillAvailable(aSession.proxy))
 				{
 					DISPLAYS2C
-
-					_TIMEVAL current=Timer::timeExt();
-					long elapsed=Timer::subtractMillisecs(&itsSessions[anIndex].time,&current);
-
-					if(elapsed < SESSION_EXPIRATION_TIME)
-					{
-						NetworkMessage* aReply=(NetworkMessage*)aRequest->clone();
-						aReply->setSender(getID());
-						aReply->setRemoteSender(0);
-						aReply->setTarget(itsSessions[anIndex].client);
-						aReply->setSequenceNumber(itsSessions[anIndex].seqnum);
-						post(itsSessions[anIndex].proxy,aReply); 
-					}
-
-					itsSessions[anIndex].proxy=0;
-					itsSessions[anIndex].client=0;
-					itsSessions[anIndex].seqnum=0;
+					NetworkMessage* aReply=(NetworkMessage*)aRequest->clone();
+					aReply->setSender(getID());
+					aReply->setRemoteSender(0);
+					aReply->setTarget(aSession.client);
+					aReply->setSequenceNumber(aSession.seqnum);
+					post(aSession.proxy,aReply); 
 				}
 			}
+			else if(aRequest->isExpired())
+			{
+				TRACE("Request expired. Dropped!")
+			}
 			else if (!aRequest->isBroadcasting() && !isShuttingDown())
 			{
 				TRACE("Handling message from client")
 				DISPLAYC2S
 
-				unsigned short anIndex=itsSeqNum % MAXSESSIONS;					
-				itsSessions[anIndex].proxy=aRequest->getSender();
-				itsSessions[anIndex].client=aRequest->getRemoteSender();
-				itsSessions[anIndex].seqnum=aRequest->getSequenceNumber();
-				itsSessions[anIndex].time=Timer::timeExt();
-
 				NetworkMessage* aNewRequest=(NetworkMessage*)aRequest->clone();
 				aNewRequest->setSender(getID());
 				aNewRequest->setRemoteSender(getID());
 				aNewRequest->setTarget(itsServer);
 				aNewRequest->setSequenceNumber(itsSeqNum);
+
+				RoutingTable::RoutingSession* aSession=itsSessions.insert(aNewRequest->getSequenceNumber());
+				aSession->proxy=aRequest->getSender();
+				aSession->client=aRequest->getRemoteSender();
+				aSession->seqnum=aRequest->getSequenceNumber();
 				post(itsServer,aNewRequest);
 
 				itsSeqNum++;
@@ -273,19 +627,12 @@ void LocalRouter::onMessage(Message* theMessage)
 	TRACE("LocalRouter::onMessage - end")
 }
 
-Switch::Switch(const char* theName) : MessageProxy(theName)  
+Switch::Switch(const char* theName) : MessageProxy(theName), itsSessionMutex("SwitchSessionMutex")
 {
 	TRACE("Switch::Switch - start")
 	itsActiveRouter=NULL;
 	itsSeqNum=0;
-	
-	for(int i=0; i < MAXSESSIONS; i++)
-	{
-		itsSessions[i].proxy=0;
-		itsSessions[i].client=0;
-		itsSessions[i].seqnum=0;
-	}
-	
+		
 	TRACE("Switch::Switch - end")	
 }
 
@@ -330,6 +677,9 @@ MQHANDLE Switch::addRouting(const char* theHost,int thePort, const char* theTarg
 		RemoteRouter* aRouter=new RemoteRouter(aName.c_str(),theHost,thePort,theTarget);
 		itsRouters.push_back(aRouter);	
 		anHandle=aRouter->getID();
+		itsSessionMutex.wait();
+		itsRouterIDs.insert(anHandle);
+		itsSessionMutex.release();
 		if(itsActiveRouter==NULL) itsActiveRouter=aRouter;
 	}
 
@@ -365,6 +715,9 @@ MQHANDLE Switch::addRouting(const char* theTarget)
 		LocalRouter* aRouter=new LocalRouter(aName.c_str(),theTarget);
 		itsRouters.push_back(aRouter);	
 		anHandle=aRouter->getID();
+		itsSessionMutex.wait();
+		itsRouterIDs.insert(anHandle);
+		itsSessionMutex.release();
 		if(itsActiveRouter==NULL) itsActiveRouter=aRouter;
 	}
 	release();	
@@ -381,6 +734,9 @@ MQHANDLE Switch::addRouting(MessageQueue* theTarget)
 	{
 		itsRouters.push_back(theTarget);	
 		anHandle=theTarget->getID();
+		itsSessionMutex.wait();
+		itsRouterIDs.insert(anHandle);
+		itsSessionMutex.release();
 		if(itsActiveRouter==NULL) itsActiveRouter=theTarget;
 	}
 	release();	
@@ -392,41 +748,25 @@ void Switch::addRouting(const char* theTopic,MQHANDLE theHandle)
 {
 	TRACE("Switch::addRouting - start")
 	wait();
-
-	bool found=false;
-	if(itsMapping.size()>0)
+	itsSessionMutex.wait();
+	if(itsRouterIDs.count(theHandle)>0 && itsTopics.add(theTopic)->add(theHandle))
 	{
-		for(vector< pair<string,MQHANDLE> >::iterator i = itsMapping.begin(); i < itsMapping.end(); ++i)
-		{
-			pair<string,MQHANDLE> aPair=*i;
-			if(aPair.first.compare(theTopic)==0 && aPair.second==theHandle)
-			{
-				found=true;
-				break;
-			}
-		}
-	}
-	
-	if(!found && itsRouters.size()>0)
-	{
-		for(vector<MessageQueue*>::iterator i = itsRouters.begin(); i < itsRouters.end(); ++i)
-		{
-			MessageQueue* aQueue=*i;
-			if(aQueue->getID()==theHandle)
-			{
-				pair<string,MQHANDLE> aPair;
-				aPair.first=theTopic;
-				aPair.second=theHandle;
-				itsMapping.push_back(aPair);
-				TRACE("Mapping rule added")
-				break;
-			}
-		}
+		TRACE("Mapping rule added")
 	}
+	itsSessionMutex.release();
 	release();	
 	TRACE("Switch::addRouting - end")	
 }
 
+void Switch::setBalancing(const char* theTopic,BalancingPolicy thePolicy)
+{
+	TRACE("Switch::setBalancing - start")
+	itsSessionMutex.wait();
+	itsTopics.add(theTopic)->itsPolicy=thePolicy;
+	itsSessionMutex.release();
+	TRACE("Switch::setBalancing - end")	
+}
+
 void Switch::resetRouting()
 {
 	TRACE("Switch::resetRouting - start")
@@ -445,7 +785,10 @@ void Switch::resetRouting()
 
 	itsRouters.clear();
 	itsActiveRouter=NULL;
-	itsMapping.clear();
+	itsSessionMutex.wait();
+	itsRouterIDs.clear();
+	itsTopics.clear();
+	itsSessionMutex.release();
 	release();	
 	TRACE("Switch::resetRouting - end")	
 }
@@ -464,6 +807,10 @@ void Switch::removeRouting(MQHANDLE theHandle)
 				aQueue->shutdown();
 				itsRouters.erase(i);
 				if(itsActiveRouter==aQueue) itsActiveRouter=NULL;
+				itsSessionMutex.wait();
+				itsRouterIDs.erase(theHandle);
+				itsTopics.remove(theHandle);
+				itsSessionMutex.release();
 				TRACE("Router removed")
 				break;
 			}
@@ -535,95 +882,81 @@ void Switch::onMessage(Message* theMessage)
 	{
 		NetworkMessage* aRequest=(NetworkMessage*)theMessage;
 		
-		bool found=false;
-		if(itsRouters.size()>0)
-		{
-			for(vector<MessageQueue*>::iterator i = itsRouters.begin(); i < itsRouters.end(); ++i)
-			{
-				MessageQueue* aQueue=*i;
-				if(aQueue->getID()==aRequest->getSender())
-				{
-					found=true;
-					break;
-				}
-			}		
-		}
+		itsSessionMutex.wait();
+		bool found=itsRouterIDs.count(aRequest->getSender())>0;
+		itsSessionMutex.release();
 		
 		if(found && aRequest->getRemoteSender()==0 && !aRequest->isBroadcasting())
 		{
 			TRACE("Handling message from server")	
-			int anIndex=aRequest->getSequenceNumber() % MAXSESSIONS;
-			if(itsSessions[anIndex].proxy!=0 && isStillAvailable(itsSessions[anIndex].proxy))
-			{
-				_TIMEVAL current=Timer::timeExt();
-				long elapsed=Timer::subtractMillisecs(&itsSessions[anIndex].time,&current);
-
-				if(elapsed < SESSION_EXPIRATION_TIME)
-				{
-					NetworkMessage* aReply=(NetworkMessage*)aRequest->clone();
-					aReply->setSender(getID());
-					aReply->setRemoteSender(0);
-					aReply->setTarget(itsSessions[anIndex].client);
-					aReply->setSequenceNumber(itsSessions[anIndex].seqnum);
-					post(itsSessions[anIndex].proxy,aReply); 
-				}
+			RoutingTable::RoutingSession aSession;
+			itsSessionMutex.wait();
+			bool aFound=itsSessions.remove(aRequest->getSequenceNumber(itsSeqNum-1),aSession);
+			itsSessionMutex.release();
 
-				itsSessions[anIndex].proxy=0;
-				itsSessions[anIndex].client=0;
-				itsSessions[anIndex].server=0;
-				itsSessions[anIndex].seqnum=0;
+			if(aFound && isStillAvailable(aSession.proxy))
+			{
+				NetworkMessage* aReply=(NetworkMessage*)aRequest->clone();
+				aReply->setSender(getID());
+				aReply->setRemoteSender(0);
+				aReply->setTarget(aSession.client);
+				aReply->setSequenceNumber(aSession.seqnum);
+				post(aSession.proxy,aReply); 
 			}
 		}
+		else if(!found && aRequest->isExpired())
+		{
+			TRACE("Request expired. Dropped!")
+		}
 		else if (!found && !aRequest->isBroadcasting() && !isShuttingDown())
 		{
 			TRACE("Handling message from client")	
 
 			bool fired=false;
-			if(itsMapping.size()>0)
+			if(itsTopics.size()>0)
 			{
-				for(vector< pair<string,MQHANDLE> >::iterator i = itsMapping.begin(); i < itsMapping.end(); ++i)
+				itsSessionMutex.wait();
+				TopicPool* aPool=itsTopics.find(aRequest->getTopic());
+				MQHANDLE aTarget=(aPool!=NULL) ? aPool->select(itsSessions,getRequestKey(aRequest)) : 0;
+				itsSessionMutex.release();
+
+				if(aTarget!=0)
 				{
-					pair<string,MQHANDLE> aPair=*i;
-					
-					if(aPair.first.compare(aRequest->getTopic())==0)
-					{
-						unsigned short anIndex=itsSeqNum % MAXSESSIONS;					
-						itsSessions[anIndex].proxy=aRequest->getSender();
-						itsSessions[anIndex].client=aRequest->getRemoteSender();
-						itsSessions[anIndex].seqnum=aRequest->getSequenceNumber();
-						itsSessions[anIndex].server=aPair.second;
-						itsSessions[anIndex].time=Timer::timeExt();
-		
-						NetworkMessage* aNewRequest=(NetworkMessage*)aRequest->clone();
-						aNewRequest->setSender(getID());
-						aNewRequest->setRemoteSender(getID());
-						aNewRequest->setTarget(aPair.second);
-						aNewRequest->setSequenceNumber(itsSeqNum);
-						post(aPair.second,aNewRequest);
-						itsSeqNum++;
-						fired=true;
-						TRACE("Sent message with topic=" << aRequest->getTopic())
-						break;
-					}
-				}		
+					NetworkMessage* aNewRequest=(NetworkMessage*)aRequest->clone();
+					aNewRequest->setSender(getID());
+					aNewRequest->setRemoteSender(getID());
+					aNewRequest->setTarget(aTarget);
+					aNewRequest->setSequenceNumber(itsSeqNum);
+
+					itsSessionMutex.wait();
+					RoutingTable::RoutingSession* aSession=itsSessions.insert(aNewRequest->getSequenceNumber(),aTarget);
+					aSession->proxy=aRequest->getSender();
+					aSession->client=aRequest->getRemoteSender();
+					aSession->seqnum=aRequest->getSequenceNumber();
+					itsSessionMutex.release();
+					post(aTarget,aNewRequest);
+					itsSeqNum++;
+					fired=true;
+					TRACE("Sent message with topic=" << aRequest->getTopic())
+				}
 			}
 			
 			if(!fired && itsActiveRouter!=NULL)
 			{
 	
-				unsigned short anIndex=itsSeqNum % MAXSESSIONS;					
-				itsSessions[anIndex].proxy=aRequest->getSender();
-				itsSessions[anIndex].client=aRequest->getRemoteSender();
-				itsSessions[anIndex].server=itsActiveRouter->getID();
-				itsSessions[anIndex].seqnum=aRequest->getSequenceNumber();
-				itsSessions[anIndex].time=Timer::timeExt();
-
 				NetworkMessage* aNewRequest=(NetworkMessage*)aRequest->clone();
 				if(itsTopic.size()>0) aNewRequest->setTopic(itsTopic);
 				aNewRequest->setSender(getID());
 				aNewRequest->setRemoteSender(getID());
 				aNewRequest->setTarget(itsActiveRouter->getID());
 				aNewRequest->setSequenceNumber(itsSeqNum);
+
+				itsSessionMutex.wait();
+				RoutingTable::RoutingSession* aSession=itsSessions.insert(aNewRequest->getSequenceNumber(),itsActiveRouter->getID());
+				aSession->proxy=aRequest->getSender();
+				aSession->client=aRequest->getRemoteSender();
+				aSession->seqnum=aRequest->getSequenceNumber();
+				itsSessionMutex.release();
 				itsActiveRouter->post(aNewRequest);
 				itsSeqNum++;
 			}
@@ -633,6 +966,12 @@ void Switch::onMessage(Message* theMessage)
 	TRACE("Switch::onMessage - end")
 }
 
+unsigned int Switch::getRequestKey(NetworkMessage* theMessage)
+{
+	// Requests of the same client stick to the same target
+	return (theMessage->getSender() << 16) ^ theMessage->getRemoteSender();
+}
+
 string Switch::getConnectionAddress(MQHANDLE theCaller,int& thePort)
 {
 	TRACE("Switch::getConnectionAddress - start")
@@ -641,19 +980,20 @@ string Switch::getConnectionAddress(MQHANDLE theCaller,int& thePort)
 
 	if(!isShuttingDown())
 	{
-		for(unsigned i=0; i < MAXSESSIONS; i++)
+		RoutingTable::RoutingSession aSession;
+		itsSessionMutex.wait();
+		bool aFound=itsSessions.findServer(theCaller,aSession);
+		itsSessionMutex.release();
+
+		if(aFound)
 		{
-			if(itsSessions[i].server==theCaller)
-			{
-				MessageQueue* aQueue=lookup(itsSessions[i].proxy);
-				if(aQueue!=NULL)
-				{	
-					if(string(aQueue->getName()).compare(MESSAGEPROXYHEADER)>=0)
-					{
-						MessageProxy* aProxy=(MessageProxy*)aQueue;
-						addr=aProxy->getConnectionAddress(getID(),thePort);					
-						break;	
-					}
+			MessageQueue* aQueue=lookup(aSession.proxy);
+			if(aQueue!=NULL)
+			{	
+				if(string(aQueue->getName()).compare(MESSAGEPROXYHEADER)>=0)
+				{
+					MessageProxy* aProxy=(MessageProxy*)aQueue;
+					addr=aProxy->getConnectionAddress(getID(),thePort);					
 				}
 			}
 		}
@@ -685,7 +1025,7 @@ void LocalhostRouter::onMessage(Message* theMessage)
 	if(theMessage->is("NetworkMessage") && !isShuttingDown())
 	{
 		NetworkMessage* aMessage=(NetworkMessage*)theMessage;
-		if(!aMessage->isBroadcasting())
+		if(!aMessage->isBroadcasting() && !aMessage->isExpired())
 		{				
 			NetworkMessage* aNetworkMessage=(NetworkMessage*)aMessage->clone();
 			aNetworkMessage->setSender(getID());
@@ -24,10 +24,70 @@
 #include "Vector.h"
 #include "Timer.h"
 #include <vector>
+#include <set>
+#include <map>
 using namespace std;
-#define MAXSESSIONS 256
+#define MAXSESSIONS 256	// Initial capacity of a RoutingTable
 #define SESSION_EXPIRATION_TIME 10000
 
+// Requests forwarded by a router and still waiting for the reply, keyed by the
+// sequence number given by the router. Open addressing table grown on demand;
+// the sessions are also linked in deadline order, so the expired ones are
+// dropped from the head without scanning the table.
+class RoutingTable
+{
+public:
+	typedef struct _RoutingSession
+	{
+		MQHANDLE proxy;	
+		MQHANDLE client;
+		MQHANDLE server;
+		unsigned int seqnum;	
+		_TIMEVAL time;		
+	} RoutingSession;
+
+protected:
+	typedef struct _RoutingNode
+	{
+		unsigned int key;
+		int prev;
+		int next;
+		RoutingSession session;
+	} RoutingNode;
+
+	vector<int> itsSlots;		// Node index or -1
+	vector<RoutingNode> itsNodes;
+	unsigned itsMask;
+	unsigned itsSize;
+	int itsHead;				// Oldest session
+	int itsTail;				// Newest session
+	int itsFree;
+	long itsExpiration;
+	unsigned long itsEvictedCnt;
+	unsigned long itsExpiredCnt;
+	map<MQHANDLE,unsigned> itsOutstanding;	// Pending sessions of each server
+
+public:
+	RoutingTable(long theExpiration=SESSION_EXPIRATION_TIME,unsigned theCapacity=MAXSESSIONS);
+	~RoutingTable() {};
+
+	// The returned session is valid up to the next call
+	RoutingSession* insert(unsigned int theKey,MQHANDLE theServer=0);
+	bool remove(unsigned int theKey,RoutingSession& theSession);
+	bool findServer(MQHANDLE theServer,RoutingSession& theSession);
+	void expire();
+	unsigned size() { return itsSize; };
+	unsigned getOutstanding(MQHANDLE theServer);
+	unsigned long getEvictedCount() { return itsEvictedCnt; };
+	unsigned long getExpiredCount() { return itsExpiredCnt; };
+
+protected:
+	int find(unsigned int theKey);
+	void erase(int theSlot);
+	void grow();
+	unsigned hash(unsigned int theKey) { return (theKey * 2654435761U) & itsMask; };
+};
+
 class RemoteRouter : public MessageQueue
 {
 protected:
@@ -38,20 +98,13 @@ protected:
 	int itsPort; 
 	string itsTarget; 
 
-	typedef struct _RoutingSession
-	{
-		MQHANDLE proxy;	
-		MQHANDLE client;
-		unsigned short seqnum;
-		_TIMEVAL time;		
-	} RoutingSession;
-
 	unsigned int itsSeqNum;
-	RoutingSession itsSessions[MAXSESSIONS];
+	RoutingTable itsSessions;
 	
 public:
 	RemoteRouter(const char* theName, const char* theHost,int thePort, const char* theTarget);
 	virtual ~RemoteRouter();
+	RoutingTable& getSessions() { return itsSessions; };
 		 
 protected:
 	virtual void onMessage(Message* theMessage);
@@ -64,55 +117,92 @@ class LocalRouter : public MessageQueue
 protected:
 	MQHANDLE itsServer;
 
-	typedef struct _RoutingSession
-	{
-		MQHANDLE proxy;	
-		MQHANDLE client;
-		unsigned short seqnum;	
-		_TIMEVAL time;		
-	} RoutingSession;
-
 	unsigned int itsSeqNum;
-	RoutingSession itsSessions[MAXSESSIONS];
+	RoutingTable itsSessions;
 
 public:
 	LocalRouter(const char* theName, const char* theTarget);
 	virtual ~LocalRouter();
+	RoutingTable& getSessions() { return itsSessions; };
 		 
 protected:
 	virtual void onMessage(Message* theMessage);
 }; 
 
+#define CONSISTENT_HASH_POINTS 64	// Points of each target on a consistent hashing ring
+
+enum BalancingPolicy
+{
+	RoundRobin=0,
+	LeastOutstanding,	// Target with less sessions pending in the RoutingTable
+	ConsistentHash		// Target chosen on a ring by the request key
+};
+
+// Targets serving a topic of a Switch
+class TopicPool
+{
+public:
+	string itsTopic;
+	unsigned int itsHash;
+	vector<MQHANDLE> itsTargets;
+	BalancingPolicy itsPolicy;
+	unsigned itsNext;
+	vector< pair<unsigned int,MQHANDLE> > itsRing;
+
+	TopicPool(const string& theTopic,unsigned int theHash);
+	bool add(MQHANDLE theTarget);
+	bool remove(MQHANDLE theTarget);
+	MQHANDLE select(RoutingTable& theSessions,unsigned int theKey);
+
+protected:
+	void buildRing();
+};
+
+// Topics of a Switch, chained hash table
+class TopicTable
+{
+protected:
+	vector< vector<TopicPool*> > itsBuckets;
+	unsigned itsSize;
+
+public:
+	TopicTable();
+	~TopicTable();
+	TopicPool* find(const string& theTopic);
+	TopicPool* add(const string& theTopic);
+	void remove(MQHANDLE theTarget);
+	void clear();
+	unsigned size() { return itsSize; };
+
+protected:
+	void grow();
+};
+
 class Switch : public MessageProxy
 {
 protected:
 	vector<MessageQueue*> itsRouters;
+	set<MQHANDLE> itsRouterIDs;
 	MessageQueue* itsActiveRouter;
-	vector< pair<string,MQHANDLE> > itsMapping;
+	TopicTable itsTopics;
 	vector<string> itsAlias;
 	string itsTopic;
 
-	typedef struct _RoutingSession
-	{
-		MQHANDLE proxy;	
-		MQHANDLE client;
-		MQHANDLE server;
-		unsigned short seqnum;	
-		_TIMEVAL time;		
-	} RoutingSession;
-
 	unsigned int itsSeqNum;
-	RoutingSession itsSessions[MAXSESSIONS];
+	RoutingTable itsSessions;
+	Thread itsSessionMutex;
 	
 public:
 	Switch(const char* theName);
 	virtual void addAlias(const char* theName);
 	virtual ~Switch();
+	RoutingTable& getSessions() { return itsSessions; };
 
 	virtual MQHANDLE addRouting(const char* theHost,int thePort, const char* theTarget);
 	virtual MQHANDLE addRouting(const char* theTarget);
 	virtual MQHANDLE addRouting(MessageQueue* theTarget);
-	virtual void addRouting(const char* theTopic,MQHANDLE theHandle);
+	virtual void addRouting(const char* theTopic,MQHANDLE theHandle); // More handles on a topic make a pool
+	virtual void setBalancing(const char* theTopic,BalancingPolicy thePolicy);
 	virtual void removeRouting(MQHANDLE theHandle);
 	virtual void resetRouting();
 	virtual void activate(MQHANDLE theHandle,const char* theTopic="");
@@ -122,6 +212,7 @@ public:
 protected:
 	virtual void onMessage(Message* theMessage);
 	virtual void receive() {};
+	virtual unsigned int getRequestKey(NetworkMessage* theMessage);
 };
 
 #define LOCALHOST "__internal__"
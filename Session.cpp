@@ -36,7 +36,7 @@ ReplicationHost::~ReplicationHost()
 	TRACE("ReplicationHost::~ReplicationHost - end")	
 }
 
-bool ReplicationHost::send(string theBuffer)
+bool ReplicationHost::send(const string& theBuffer)
 { 	
 	TRACE("ReplicationHost::send - start")	
 	bool ret=Client::send(theBuffer);
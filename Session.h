@@ -39,7 +39,7 @@ public:
 	ReplicationHost(const char* theName, const char* theHost,int thePort, const char* theTarget);
 	virtual ~ReplicationHost();
 	ClientState state() { return itsState; };
-	virtual bool send(string theBuffer); 	
+	virtual bool send(const string& theBuffer); 	
 	
 protected:
 	virtual void success(string theBuffer);
@@ -33,6 +33,14 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __linux__
+#define ACCEPT(s,a,l) accept4(s,a,l,SOCK_CLOEXEC)
+#else
+#define ACCEPT(s,a,l) accept(s,a,l)
+#endif
 #define TIMEVAL struct timeval
 #define inaddrr(x) (*(struct in_addr *) &ifr->x[sizeof sa.sin_port])
 #define IFRSIZE   ((int)(size * sizeof (struct ifreq)))
@@ -396,6 +404,46 @@ void Socket::SendBytes(const std::string& s)
   TRACE("Socket::SendBytes - end")
 }
 
+void Socket::SendBytes(const std::string& theHeader,const std::string& theBody) 
+{
+  TRACE("Socket::SendBytes - start")
+  size_t total=theHeader.length()+theBody.length();
+  int rv;
+
+#ifdef WIN32
+  WSABUF bufs[2];
+  bufs[0].buf=(char*)theHeader.data();
+  bufs[0].len=theHeader.length();
+  bufs[1].buf=(char*)theBody.data();
+  bufs[1].len=theBody.length();
+  DWORD sent=0;
+  rv=(WSASend(s_,bufs,2,&sent,0,NULL,NULL)==0) ? (int)sent : -1;
+#else
+  struct iovec bufs[2];
+  bufs[0].iov_base=(void*)theHeader.data();
+  bufs[0].iov_len=theHeader.length();
+  bufs[1].iov_base=(void*)theBody.data();
+  bufs[1].iov_len=theBody.length();
+  rv=writev(s_,bufs,2);
+#endif
+
+  // Complete a short write with plain sends
+  while(rv >= 0 && (size_t)rv < total)
+  {
+    size_t off=rv;
+    int ret;
+    if(off < theHeader.length())
+      ret=send(s_,theHeader.data()+off,theHeader.length()-off,0);
+    else
+      ret=send(s_,theBody.data()+off-theHeader.length(),total-off,0);
+
+    if(ret <= 0)
+      break;
+    rv+=ret;
+  }
+  TRACE("Socket::SendBytes - end")
+}
+
 void Socket::SendBuffer(void* theBuffer,int theLen) 
 {
   TRACE("Socket::SendBuffer - start")
@@ -403,7 +451,7 @@ void Socket::SendBuffer(void* theBuffer,int theLen)
   TRACE("Socket::SendBuffer - end")
 }
 
-SocketServer::SocketServer(int port, int connections, TypeSocket type, const char* theIP) 
+SocketServer::SocketServer(int port, int connections, TypeSocket type, const char* theIP, bool theReusePort) 
 {
   TRACE("SocketServer::SocketServer - start")
 
@@ -422,7 +470,11 @@ SocketServer::SocketServer(int port, int connections, TypeSocket type, const cha
 #endif
   }
 
+#ifdef SOCK_CLOEXEC
+  s_ = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+#else
   s_ = socket(AF_INET, SOCK_STREAM, 0);
+#endif
 #ifdef WIN32
   if (s_ == INVALID_SOCKET) 
     throw SocketException("SocketServer: socket returns error");
@@ -442,6 +494,22 @@ SocketServer::SocketServer(int port, int connections, TypeSocket type, const cha
 
   TRACE("Socket=" << s_)
 
+  if(theReusePort)
+  {
+#ifdef SO_REUSEPORT
+    // Several listening sockets on the same port: the kernel balances the connections
+    int on=1;
+    if(setsockopt(s_, SOL_SOCKET, SO_REUSEPORT, (const char*)&on, sizeof(on)) < 0)
+    {
+      Close();
+      throw SocketException("SocketServer: SO_REUSEPORT not supported");
+    }
+#else
+    Close();
+    throw SocketException("SocketServer: SO_REUSEPORT not supported");
+#endif
+  }
+
   /* bind the socket to the internet address */
   int retbind=bind(s_, (sockaddr *)&sa, sizeof(sockaddr_in));
 #ifdef WIN32
@@ -463,10 +531,49 @@ SocketServer::SocketServer(int port, int connections, TypeSocket type, const cha
   TRACE("SocketServer::SocketServer - end")
 }
 
+#ifndef WIN32
+SocketServer::SocketServer(const char* thePath, int connections) 
+{
+  TRACE("SocketServer::SocketServer - start")
+  TRACE("Path=" << thePath)
+
+  sockaddr_un sa;
+  memset(&sa, 0, sizeof(sa));
+  if(strlen(thePath) >= sizeof(sa.sun_path))
+    throw SocketException("SocketServer: local socket path too long");
+
+  sa.sun_family = AF_UNIX;
+  strncpy(sa.sun_path, thePath, sizeof(sa.sun_path)-1);
+  itsPath=thePath;
+
+  close(s_); // Release the AF_INET socket opened by Socket()
+  s_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s_ < 0)
+  {
+  	TRACE("socket error=" << errno)
+    throw SocketException("SocketServer: socket returns error");
+  }
+
+  TRACE("Socket=" << s_)
+
+  unlink(thePath); // Remove a stale socket file left by a previous run
+  int retbind=bind(s_, (sockaddr *)&sa, sizeof(sockaddr_un));
+  if (retbind < 0) 
+  {
+	TRACE("bind return error=" << errno)
+	shutdown(s_,SHUT_RDWR);
+    throw SocketException("SocketServer: bind returns error");
+  }
+  
+  listen(s_, connections);                               
+  TRACE("SocketServer::SocketServer - end")
+}
+#endif
+
 Socket* SocketServer::Accept() 
 {
   TRACE("SocketServer::Accept - start")
-  SOCKET new_sock;
+  SOCKET new_sock = -1;
     
 #ifdef WIN32 
   int len = sizeof(struct sockaddr); 	
@@ -507,7 +614,7 @@ Socket* SocketServer::Accept()
 	
 	  if(FD_ISSET(s_, &read_set))
 	  {
-	     new_sock = accept(s_, &itsSocketAddr, &len);
+	     new_sock = ACCEPT(s_, &itsSocketAddr, &len);
 	     break;
 	  } 
   }
@@ -527,12 +634,16 @@ Socket* SocketServer::Accept()
 
 string SocketServer::address() 
 {
+  if(isLocal())
+    return LOCALSOCKETPREFIX+itsPath;
   return inet_ntoa(((struct sockaddr_in*)&itsSocketAddr)->sin_addr);
 }
 
 unsigned short SocketServer::port()
 {
   TRACE("SocketServer::port - start")
+  if(isLocal())
+    return 0; // AF_UNIX peers have no port
   unsigned short ret=(itsSocketAddr.sa_data[0]<<8)+itsSocketAddr.sa_data[1];
   TRACE("SocketServer::port - end")
   return ret;
@@ -574,6 +685,153 @@ SocketClient::SocketClient(const std::string& host, int port) : Socket()
   TRACE("SocketClient::SocketClient - end")
 }
 
+#ifndef WIN32
+LocalSocketClient::LocalSocketClient(const std::string& path) : Socket(socket(AF_UNIX,SOCK_STREAM,0)) 
+{
+  TRACE("LocalSocketClient::LocalSocketClient - start")
+  TRACE("Path=" << path)
+
+  if (s_ < 0) 
+  {
+  	TRACE("socket return=" << s_)
+    throw SocketException("LocalSocketClient: socket returns error");
+  }
+
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  if(path.size() >= sizeof(addr.sun_path))
+    throw SocketException("LocalSocketClient: path too long");
+
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+
+  if (::connect(s_, (sockaddr *) &addr, sizeof(sockaddr_un))) 
+  {
+	TRACE("connect return error")
+    throw SocketException("LocalSocketClient: connect returns error");
+  }
+  TRACE("LocalSocketClient::LocalSocketClient - end")
+}
+#endif
+
+DatagramSocket::DatagramSocket(const char* theGroup, int thePort, bool theJoinFlag, const char* theIP) 
+              : Socket(socket(AF_INET,SOCK_DGRAM,0))
+{
+  TRACE("DatagramSocket::DatagramSocket - start")
+  TRACE("Group=" << theGroup << " Port=" << thePort)
+
+#ifdef WIN32
+  if (s_ == INVALID_SOCKET)
+    throw SocketException("DatagramSocket: socket returns error");
+#else
+  if (s_ < 0) 
+  {
+  	TRACE("socket return=" << s_)
+    throw SocketException("DatagramSocket: socket returns error");
+  }
+#endif
+
+  memset(&itsGroupAddr, 0, sizeof(itsGroupAddr));
+  itsGroupAddr.sin_family = AF_INET;
+  itsGroupAddr.sin_port = htons(thePort);
+  itsGroupAddr.sin_addr.s_addr = inet_addr(theGroup);
+  if (itsGroupAddr.sin_addr.s_addr == INADDR_NONE)
+    throw SocketException("DatagramSocket: invalid group address");
+
+  in_addr anInterface;
+  anInterface.s_addr = (theIP==NULL) ? htonl(INADDR_ANY) : inet_addr(theIP);
+
+  sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  if(theJoinFlag)
+  {
+    // Several subscribers on the same host share the group port
+    int on = 1;
+    setsockopt(s_, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+    sa.sin_port = htons(thePort);
+  }
+  else
+    sa.sin_port = 0; // Ephemeral port: it is the unicast address NACKs come back to
+
+  if (bind(s_, (sockaddr *)&sa, sizeof(sockaddr_in)) < 0) 
+  {
+	TRACE("bind return error=" << errno)
+    throw SocketException("DatagramSocket: bind returns error");
+  }
+
+  if(theJoinFlag)
+  {
+    ip_mreq mreq;
+    mreq.imr_multiaddr = itsGroupAddr.sin_addr;
+    mreq.imr_interface = anInterface;
+    if (setsockopt(s_, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&mreq, sizeof(mreq)) < 0)
+    {
+	  TRACE("setsockopt return error=" << errno)
+      throw SocketException("DatagramSocket: unable to join multicast group");
+    }
+  }
+
+  if(theIP!=NULL)
+    setsockopt(s_, IPPROTO_IP, IP_MULTICAST_IF, (const char*)&anInterface, sizeof(anInterface));
+
+  unsigned char loop = 1; // Keep loopback delivery so publisher and subscribers may share a host
+  setsockopt(s_, IPPROTO_IP, IP_MULTICAST_LOOP, (const char*)&loop, sizeof(loop));
+
+  TRACE("DatagramSocket::DatagramSocket - end")
+}
+
+void DatagramSocket::SendTo(const std::string& theBuffer) 
+{
+  TRACE("DatagramSocket::SendTo - start")
+  sendto(s_,theBuffer.data(),theBuffer.length(),0,(sockaddr*)&itsGroupAddr,sizeof(sockaddr_in));
+  TRACE("DatagramSocket::SendTo - end")
+}
+
+void DatagramSocket::SendTo(const std::string& theBuffer, const sockaddr_in& theAddress) 
+{
+  TRACE("DatagramSocket::SendTo - start")
+  sendto(s_,theBuffer.data(),theBuffer.length(),0,(sockaddr*)&theAddress,sizeof(sockaddr_in));
+  TRACE("DatagramSocket::SendTo - end")
+}
+
+bool DatagramSocket::ReceiveFrom(std::string& theBuffer, sockaddr_in& theAddress, long theTimeout) 
+{
+  TRACE("DatagramSocket::ReceiveFrom - start")
+  if(s_ < 0)
+    return false;
+
+  fd_set fds;
+  FD_ZERO(&fds);
+  FD_SET(s_,&fds);
+
+  TIMEVAL tval;
+  tval.tv_sec  = theTimeout / 1000;
+  tval.tv_usec = (theTimeout % 1000) * 1000;
+
+  if (select (s_+1, &fds, (fd_set*) 0, (fd_set*) 0, &tval) <= 0) 
+    return false;
+
+  char buf[0x10000];
+#ifdef WIN32
+  int len = sizeof(sockaddr_in);
+#else
+  socklen_t len = sizeof(sockaddr_in);
+#endif
+  int rv = recvfrom(s_, buf, sizeof(buf), 0, (sockaddr*)&theAddress, &len);
+  if (rv <= 0)
+  {
+	TRACE("recvfrom returns error=" << rv)
+    return false;
+  }
+
+  theBuffer.assign(buf, rv);
+  TRACE("DatagramSocket::ReceiveFrom - end")
+  return true;
+}
+
 SocketSelect::SocketSelect(Socket const * const s1, Socket const * const s2, TypeSocket type) 
 {
   FD_ZERO(&fds_);
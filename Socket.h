@@ -39,6 +39,9 @@ typedef int SOCKET;
 
 enum TypeSocket {BlockingSocket, NonBlockingSocket};
 
+// Host prefix used to address a local (AF_UNIX) stream socket, e.g. "unix:/tmp/mq4cpp.sock"
+#define LOCALSOCKETPREFIX "unix:"
+
 class NetAdapter
 {
 protected:
@@ -102,6 +105,9 @@ public:
   // because SendBytes does not modify the std::string passed 
   // (in contrast to SendLine).
   void SendBytes(const std::string&);
+
+  // Gather write of a header and a body without joining them in a new buffer
+  void SendBytes(const std::string& theHeader,const std::string& theBody);
   
   static vector<NetAdapter>* getAdapters();
 
@@ -128,17 +134,43 @@ public:
   SocketClient(const std::string& host, int port);
 };
 
+#ifndef WIN32
+class LocalSocketClient : public Socket 
+{
+public:
+  LocalSocketClient(const std::string& path);
+};
+#endif
+
+class DatagramSocket : public Socket 
+{
+protected:
+  sockaddr_in itsGroupAddr;
+
+public:
+  DatagramSocket(const char* theGroup, int thePort, bool theJoinFlag, const char* theIP=NULL);
+
+  void SendTo(const std::string& theBuffer);
+  void SendTo(const std::string& theBuffer, const sockaddr_in& theAddress);
+  bool ReceiveFrom(std::string& theBuffer, sockaddr_in& theAddress, long theTimeout);
+};
+
 class SocketServer : public Socket 
 {
 protected:
   struct sockaddr itsSocketAddr;
+  string itsPath;
 	
 public:
-  SocketServer(int port, int connections, TypeSocket type=BlockingSocket, const char* theIP=NULL);
+  SocketServer(int port, int connections, TypeSocket type=BlockingSocket, const char* theIP=NULL, bool theReusePort=false);
+#ifndef WIN32
+  SocketServer(const char* thePath, int connections);
+#endif
 
   Socket* Accept();
   string address(); 
   unsigned short port();   
+  bool isLocal() { return itsPath.size()>0; };
 };
 
 class SocketSelect 
@@ -35,6 +35,9 @@ const int Thread::P_CRITICAL = THREAD_PRIORITY_TIME_CRITICAL;
 #define ASSIGN_PTR(dest,val)  InterlockedExchangePointer(&dest,val)
 #else
 #include <sys/time.h>
+#if defined(__GLIBC__) && defined(_GNU_SOURCE) && !defined(HAVE_PTHREAD_SETAFFINITY_NP)
+#define HAVE_PTHREAD_SETAFFINITY_NP
+#endif
 const int Thread::P_ABOVE_NORMAL = 0;
 const int Thread::P_BELOW_NORMAL = 1;
 const int Thread::P_HIGHEST = 2;
@@ -234,7 +237,10 @@ void Thread::stop(bool cancel)
 		if(cancel==true)
 			pthread_cancel(m_hThread);
 		else
+		{
+			resume(); // A suspended thread sees the stop now, not at the next timeout
 			pthread_join(m_hThread,NULL);
+		}
 
 		TRACE("Thread cleanup")			
 		pthread_mutex_destroy(&m_hSuspendMutex);
@@ -21,6 +21,7 @@
 #include "Logger.h"
 #include "Timer.h"
 #include <time.h>
+#include <cstring>
 
 Timer* Timer::itsDefaultTimer=NULL;
 
@@ -194,6 +195,33 @@ long Timer::subtractMillisecs(_TIMEVAL* x,_TIMEVAL* y)
 	return res;
 }
 
+long Timer::subtractMicrosecs(_TIMEVAL* x,_TIMEVAL* y)
+{
+#ifdef WIN32
+	long elapse_micro=(y->millitm - x->millitm)*1000L;
+	long elapse_sec=y->time - x->time;
+#else
+	long elapse_micro=y->tv_usec - x->tv_usec;
+	long elapse_sec=y->tv_sec - x->tv_sec;
+#endif
+
+	return elapse_sec * 1000000L + elapse_micro;
+}
+
+_TIMEVAL Timer::addMillisecs(_TIMEVAL theTime,long theMillisecs)
+{
+#ifdef WIN32
+	long aMilli=theTime.millitm + theMillisecs;
+	theTime.time+=aMilli/1000;
+	theTime.millitm=(unsigned short)(aMilli%1000);
+#else
+	long aMicro=theTime.tv_usec + (theMillisecs%1000)*1000L;
+	theTime.tv_sec+=theMillisecs/1000 + aMicro/1000000L;
+	theTime.tv_usec=aMicro%1000000L;
+#endif
+	return theTime;
+}
+
 Timer::Timer() 
       :Thread("DefaultTimer")
 {
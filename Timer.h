@@ -32,6 +32,15 @@
 #define _TIMEDIFF struct timeval
 #endif
 
+// CPU cycle counter used by the benchmarks, not defined on other CPUs
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CYCLES() __rdtsc()
+#elif defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define CYCLES() __rdtsc()
+#endif
+
 class Wakeup : public Message
 {
 protected:
@@ -79,6 +88,8 @@ public:
 	static unsigned long time();
 	static _TIMEVAL timeExt();
 	static long subtractMillisecs(_TIMEVAL* x,_TIMEVAL* y);
+	static long subtractMicrosecs(_TIMEVAL* x,_TIMEVAL* y);
+	static _TIMEVAL addMillisecs(_TIMEVAL theTime,long theMillisecs);
 };
 
 #define SCHEDULE(queue,time) \
@@ -46,11 +46,11 @@ Vector::~Vector()
 	TRACE("Vector::~Vector - end")
 }
 
-void Vector::set(unsigned short thePosition,void* theObject)
+void Vector::set(unsigned int thePosition,void* theObject)
 {
 	TRACE("Vector::set - start")
-	unsigned short high=thePosition >> 8;
-	unsigned short low=thePosition & 0xff;
+	unsigned int high=(thePosition >> VECBLKBITS) & (VECBLKSIZE-1);
+	unsigned int low=thePosition & (VECBLKSIZE-1);
 	void** block;
 	
 	if(itsArray[high]==0)
@@ -69,11 +69,11 @@ void Vector::set(unsigned short thePosition,void* theObject)
 	TRACE("Vector::set - end")
 }
 
-void* Vector::at(unsigned short thePosition)
+void* Vector::at(unsigned int thePosition)
 {
 	TRACE("Vector::at - start")
-	unsigned short high=thePosition >> 8;
-	unsigned short low=thePosition & 0xff;
+	unsigned int high=(thePosition >> VECBLKBITS) & (VECBLKSIZE-1);
+	unsigned int low=thePosition & (VECBLKSIZE-1);
 
 	if(itsArray[high]!=0)
 	{
@@ -86,11 +86,11 @@ void* Vector::at(unsigned short thePosition)
 	return 0;	
 }
 
-void* Vector::unset(unsigned short thePosition)
+void* Vector::unset(unsigned int thePosition)
 {
 	TRACE("Vector::unset - start")
-	unsigned short high=thePosition >> 8;
-	unsigned short low=thePosition & 0xff;
+	unsigned int high=(thePosition >> VECBLKBITS) & (VECBLKSIZE-1);
+	unsigned int low=thePosition & (VECBLKSIZE-1);
 	void* obj=0;
 
 	if(itsArray[high]!=0)
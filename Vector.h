@@ -20,7 +20,8 @@
 #ifndef __VECTOR__
 #define __VECTOR__
 
-#define VECBLKSIZE 256
+#define VECBLKBITS 12
+#define VECBLKSIZE (1 << VECBLKBITS)	// Positions up to 2^24-1 in two levels
 
 class Vector
 {
@@ -30,9 +31,9 @@ protected:
 public:
 	Vector();
 	~Vector();
-	void set(unsigned short thePosition,void* theObject);
-	void* at(unsigned short thePosition);
-	void* unset(unsigned short thePosition);
+	void set(unsigned int thePosition,void* theObject);
+	void* at(unsigned int thePosition);
+	void* unset(unsigned int thePosition);
 };
 
 #endif
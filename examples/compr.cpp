@@ -20,61 +20,265 @@
 #include "Logger.h"
 #include "Timer.h"
 #include "Compression.h"
+#include "Properties.h"
+#include <strstream>
 #define PCKSIZE 65535
 #define CACHE true
 #define MASK 0x1F
 #define ITERATIONS 1000
+#define BENCHMARK_PCKSIZE 256	// PACKETSIZE of benchmark.cpp
+#define SENDERS 8
+#define RECEIVER_PEERS 2	// Dictionary caches kept by the receiver
+#define LEASE 2				// Secs
 
-int main(int argv,char* argc[])
+// Random symbols of a small alphabet
+string randomPayload(unsigned theSize)
 {
-	DISPLAY("MQ4CPP compr.cpp")
-	DISPLAY("This example shows how packet compression works")
+	string original;
+	original.reserve(theSize);
+	for(unsigned cnt=0; cnt < theSize ; cnt++)
+		original += (unsigned char)(rand() & MASK);
+	return original;
+}
+
+// Payload sent by benchmark.cpp
+string benchmarkPayload(unsigned theSize)
+{
+	string original;
+	original.reserve(theSize);
+	for(unsigned cnt=0; cnt < theSize ; cnt++)
+		original += (unsigned char)(cnt & 0x07);
+	return original;
+}
+
+// Already compressed data
+string noisePayload(unsigned theSize)
+{
+	string original;
+	original.reserve(theSize);
+	for(unsigned cnt=0; cnt < theSize ; cnt++)
+		original += (unsigned char)(rand() & 0xFF);
+	return original;
+}
+
+// Records with repeated field names
+string recordPayload(unsigned theSize)
+{
+	static const char* names[]={ "alpha", "bravo", "charlie", "delta", "echo" };
+	string original;
+	original.reserve(theSize+128);
+	while(original.size() < theSize)
+	{
+		char buffer[128];
+		ostrstream aStream(buffer,sizeof(buffer));
+		aStream << "{\"id\":" << rand() % 100000 << ",\"name\":\"" << names[rand() % 5] 
+				<< "\",\"status\":\"" << ((rand() & 1) ? "active" : "idle") 
+				<< "\",\"value\":" << rand() % 1000 << "}," << ends;
+		original+=buffer;
+	}
+	original.resize(theSize);
+	return original;
+}
 
-	_TIMEVAL startTime;	
-	_TIMEVAL endTime;	
-	PacketCompression compression(CACHE);
+// Properties written by MessageStorer around a record of theSize bytes
+string storerPayload(unsigned theSize)
+{
+	ListProperty aList;
+	StringProperty* aSource=new StringProperty("Source");
+	aSource->set((rand() & 1) ? "MyStorer" : "MyClient");
+	aList.add(aSource);
+	LongIntProperty* aTimestamp=new LongIntProperty("Timestamp");
+	aTimestamp->set(1190000000 + rand() % 100000);
+	aList.add(aTimestamp);
+	StringProperty* anHost=new StringProperty("Host");
+	anHost->set("localhost");
+	aList.add(anHost);
+	ShortIntProperty* aPort=new ShortIntProperty("Port");
+	aPort->set(9000 + rand() % 4);
+	aList.add(aPort);
+	StringProperty* aService=new StringProperty("Service");
+	aService->set("MyServer");
+	aList.add(aService);
+	StringProperty* aMsg=new StringProperty("Message");
+	aMsg->set(recordPayload(theSize));
+	aList.add(aMsg);
+
+	ostrstream aStream;
+	aList.serialize(aStream);
+	string original(aStream.str(),aStream.pcount());
+	aStream.freeze(false);
+	return original;
+}
+
+bool test(Compression& theCompression,const char* theCodecName,const char* thePayloadName,string (*thePayload)(unsigned),unsigned theSize,unsigned theIterations)
+{
 	unsigned int bytesCompressed=0;
 	unsigned int bytesDecompressed=0;
-	startTime=Timer::timeExt();
+	vector<string> originals;
+	for(unsigned i=0; i < theIterations; i++)
+		originals.push_back(thePayload(theSize));
 	
-	for(int i=0; i < ITERATIONS; i++)
+	_TIMEVAL startTime=Timer::timeExt();
+	for(unsigned i=0; i < theIterations; i++)
 	{
-		string original;
-		original.reserve(PCKSIZE);
-
-		for(int cnt=0; cnt < PCKSIZE ; cnt++)
-			original += (unsigned char)(rand() & MASK);
-		
 		try
 		{
-			string compressed=compression.deflate(original);	
+			string compressed=theCompression.deflate(originals[i]);	
 			bytesCompressed+=compressed.size();
-			string decompressed=compression.inflate(compressed);
+			string decompressed=theCompression.inflate(compressed);
 			bytesDecompressed+=decompressed.size();
 
-			if(decompressed.compare(original)!=0)
+			if(decompressed.compare(originals[i])!=0)
 			{
 				DISPLAY("Test NOK " << i << " Size=" << decompressed.size())
-				DISPLAY("Original='" << original << "'")
-				DISPLAY("Decompre='" << decompressed << "'")
-				exit(-1);
+				return false;
 			}
 		}
 		catch(...)
 		{
 			DISPLAY("Unhandled exception")	
-			exit(-1);
+			return false;
 		}
 	}
-	
-	endTime=Timer::timeExt();
+	_TIMEVAL endTime=Timer::timeExt();
 	long deltaTime=Timer::subtractMillisecs(&startTime,&endTime);
-	DISPLAY("Elapsed=" << deltaTime << " ms")
+
+	if(deltaTime==0)
+		deltaTime=1;
 	float comprRatio=(1-(float)bytesCompressed/(float)bytesDecompressed)*100.0;
-	DISPLAY("Compression=" << comprRatio << "%")
-	float packetspersecond=(float)ITERATIONS/((float)deltaTime/1000.0);
-	DISPLAY("Compression+decompression per seconds=" << packetspersecond)
-	float duration=(float)deltaTime/(float)ITERATIONS;
-	DISPLAY("Compression+decompression duration=" << duration << " ms")
-	return 0;
+	float rate=(float)bytesDecompressed/1048576.0/((float)deltaTime/1000.0);
+	DISPLAY(thePayloadName << " " << theCodecName << ": Compression=" << comprRatio 
+			<< "% Compression+decompression=" << rate << " MB/s")
+	return true;
+}
+
+// Time spent by deflate() alone
+void deflateSpeed(Compression& theCompression,const char* theCodecName,const char* thePayloadName,string (*thePayload)(unsigned),unsigned theSize,unsigned theIterations)
+{
+	string original=thePayload(theSize);
+	unsigned long bytesCompressed=0;
+#ifdef CYCLES
+	unsigned long long aStart=CYCLES();
+	for(unsigned i=0; i < theIterations; i++)
+		bytesCompressed+=theCompression.deflate(original).size();
+	unsigned long long anEnd=CYCLES();
+	double cyclesPerByte=(double)(anEnd-aStart)/((double)theSize*theIterations);
+	DISPLAY(thePayloadName << " " << theCodecName << ": Deflate=" << cyclesPerByte << " cycles/byte (" << bytesCompressed/theIterations << " bytes)")
+#else
+	_TIMEVAL startTime=Timer::timeExt();
+	for(unsigned i=0; i < theIterations; i++)
+		bytesCompressed+=theCompression.deflate(original).size();
+	_TIMEVAL endTime=Timer::timeExt();
+	long deltaTime=Timer::subtractMillisecs(&startTime,&endTime);
+	float nsPerByte=(float)deltaTime*1000000.0/((float)theSize*(float)theIterations);
+	DISPLAY(thePayloadName << " " << theCodecName << ": Deflate=" << nsPerByte << " ns/byte (" << bytesCompressed/theIterations << " bytes)")
+#endif
+}
+
+// Mixed traffic: control messages, records and already compressed blocks
+bool mixedTraffic(Compression& theCompression,const char* theCodecName,unsigned theIterations)
+{
+	vector<string> originals;
+	for(unsigned i=0; i < theIterations; i++)
+	{
+		if(i%3==0)
+			originals.push_back(recordPayload(24));
+		else if(i%3==1)
+			originals.push_back(recordPayload(4096));
+		else
+			originals.push_back(noisePayload(4096));
+	}
+
+	unsigned long bytesIn=0;
+	unsigned long bytesOut=0;
+	_TIMEVAL startTime=Timer::timeExt();
+	for(unsigned i=0; i < theIterations; i++)
+	{
+		string compressed=theCompression.deflate(originals[i]);	
+		if(theCompression.inflate(compressed).compare(originals[i])!=0)
+		{
+			DISPLAY("Test NOK " << i)
+			return false;
+		}
+		bytesIn+=originals[i].size();
+		bytesOut+=compressed.size();
+	}
+	_TIMEVAL endTime=Timer::timeExt();
+	long deltaTime=Timer::subtractMillisecs(&startTime,&endTime);
+	DISPLAY("Mixed " << theCodecName << ": Compression=" << (1-(float)bytesOut/(float)bytesIn)*100.0 
+			<< "% Time=" << deltaTime << " ms")
+	return true;
+}
+
+// Senders streaming to a receiver that never answers, more than its dictionary caches
+bool oneWayFlows(unsigned theIterations)
+{
+	PacketCompression receiver(CACHE,RECEIVER_PEERS,LEASE);
+	vector<PacketCompression*> senders;
+	for(unsigned s=0; s < 2*SENDERS; s++)
+		senders.push_back(new PacketCompression(CACHE,RECEIVER_PEERS,LEASE));
+
+	unsigned long lost=0;
+	for(unsigned phase=0; phase < 2; phase++)
+	{
+		// Second phase: new senders take the caches of the expired ones, which are back later
+		if(phase > 0)
+			Thread::sleep((LEASE+1)*1000);
+		unsigned active=(phase+1)*SENDERS;
+		for(unsigned i=0; i < theIterations; i++)
+		{
+			for(unsigned s=0; s < active; s++)
+			{
+				string original=(i%2==0) ? benchmarkPayload(BENCHMARK_PCKSIZE) : recordPayload(BENCHMARK_PCKSIZE);
+				string compressed=senders[s]->deflate(original,1,100);
+				if(receiver.inflate(compressed,2,200+s).compare(original)!=0)
+					lost++;
+			}
+		}
+		DISPLAY("One-way PacketCompression: Senders=" << active << " Receiver caches=" << receiver.getPeerCount() << " Lost=" << lost)
+	}
+
+	for(unsigned s=0; s < senders.size(); s++)
+		delete senders[s];
+	return lost==0;
+}
+
+int main(int argv,char* argc[])
+{
+	DISPLAY("MQ4CPP compr.cpp")
+	DISPLAY("This example shows how packet compression works")
+
+	PacketCompression packet(CACHE);
+	LZCompression lz;
+	bool ok=true;
+
+	ok=ok && test(packet,"PacketCompression","Random",randomPayload,PCKSIZE,ITERATIONS/10);
+	ok=ok && test(lz,"LZCompression","Random",randomPayload,PCKSIZE,ITERATIONS/10);
+	ok=ok && test(packet,"PacketCompression","Benchmark",benchmarkPayload,BENCHMARK_PCKSIZE,ITERATIONS*10);
+	ok=ok && test(lz,"LZCompression","Benchmark",benchmarkPayload,BENCHMARK_PCKSIZE,ITERATIONS*10);
+	ok=ok && test(packet,"PacketCompression","Records",recordPayload,PCKSIZE,ITERATIONS/10);
+	ok=ok && test(lz,"LZCompression","Records",recordPayload,PCKSIZE,ITERATIONS/10);
+
+	DictionaryTrainer trainer;
+	for(unsigned i=0; i < ITERATIONS; i++)
+		trainer.add(storerPayload(64));
+	DictionaryCompression dictionary(trainer.train());
+	ok=ok && test(packet,"PacketCompression","Storer",storerPayload,64,ITERATIONS*10);
+	ok=ok && test(lz,"LZCompression","Storer",storerPayload,64,ITERATIONS*10);
+	ok=ok && test(dictionary,"DictionaryCompression","Storer",storerPayload,64,ITERATIONS*10);
+
+	ok=ok && mixedTraffic(packet,"PacketCompression",ITERATIONS*3);
+	ok=ok && oneWayFlows(ITERATIONS/10);
+	AdaptiveCompression adaptive(new PacketCompression(CACHE));
+	ok=ok && mixedTraffic(adaptive,"AdaptiveCompression(PacketCompression)",ITERATIONS*3);
+	DISPLAY("Deflated=" << adaptive.getDeflatedCount() << " Bypassed=" << adaptive.getBypassedCount()
+			<< " Saved=" << adaptive.getSavedBytes() << " bytes Deflate=" << adaptive.getDeflateTime()/1000.0 
+			<< " ms Inflate=" << adaptive.getInflateTime()/1000.0 << " ms")
+
+	deflateSpeed(packet,"PacketCompression","Benchmark",benchmarkPayload,BENCHMARK_PCKSIZE,ITERATIONS*100);
+	deflateSpeed(packet,"PacketCompression","Records",recordPayload,BENCHMARK_PCKSIZE,ITERATIONS*100);
+	deflateSpeed(packet,"PacketCompression","Records",recordPayload,PCKSIZE,ITERATIONS);
+	deflateSpeed(lz,"LZCompression","Benchmark",benchmarkPayload,BENCHMARK_PCKSIZE,ITERATIONS*100);
+	deflateSpeed(lz,"LZCompression","Records",recordPayload,PCKSIZE,ITERATIONS);
+	return (ok) ? 0 : -1;
 }
@@ -0,0 +1,222 @@
+///////////////////////////////////////////////////////////////////////////////
+// MQ4CPP - Message queuing for C++
+// Copyright (C) 2004-2007  Riccardo Pompeo (Italy)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+#include "Logger.h"
+#include "Timer.h"
+#include "Encription.h"
+#include <vector>
+#define ITERATIONS 1000
+#define MAXSIZE 4096
+#define BENCHMARK_PCKSIZE 256	// PACKETSIZE of benchmark.cpp
+
+string randomPayload(unsigned theSize)
+{
+	string original;
+	original.reserve(theSize);
+	for(unsigned cnt=0; cnt < theSize ; cnt++)
+		original += (unsigned char)(rand() & 0xFF);
+	return original;
+}
+
+string toHex(string theBuffer)
+{
+	static const char* digits="0123456789abcdef";
+	string ret;
+	for(unsigned cnt=0; cnt < theBuffer.size(); cnt++)
+	{
+		ret+=digits[((unsigned char)theBuffer[cnt]) >> 4];
+		ret+=digits[((unsigned char)theBuffer[cnt]) & 0x0F];
+	}
+	return ret;
+}
+
+// FIPS-197 appendix C.1 
+bool knownAnswer(bool theAccelerated)
+{
+	string aKey,aPlain;
+	for(unsigned cnt=0; cnt < 16; cnt++)
+	{
+		aKey+=(char)cnt;
+		aPlain+=(char)(cnt*0x11);
+	}
+
+	Rijndael128 aCipher(aKey);
+	aCipher.setAccelerated(theAccelerated);
+	string aCoded=aCipher.code(aPlain);
+	bool ok=(toHex(aCoded)=="69c4e0d86a7b0430d8cdb78070b4c55a" && aCipher.decode(aCoded)==aPlain);
+	DISPLAY("Rijndael128 " << (aCipher.isAccelerated() ? "AES-NI" : "portable") << " known answer: " << (ok ? "OK" : "NOK"))
+	return ok;
+}
+
+// The accelerated path must give the same bytes of the portable one
+bool compare(unsigned theIterations)
+{
+	for(unsigned i=0; i < theIterations; i++)
+	{
+		string aKey=randomPayload(16);
+		Rijndael128 aPortable(aKey);
+		Rijndael128 anAccelerated(aKey);
+		aPortable.setAccelerated(false);
+		
+		string aPlain=randomPayload(rand() % MAXSIZE);
+		string aCoded=aPortable.code(aPlain);
+		string anInPlace(aPlain);
+		anAccelerated.codeInPlace(anInPlace);
+		if(aCoded!=anAccelerated.code(aPlain) || aCoded!=anInPlace || aPortable.decode(aCoded)!=anAccelerated.decode(aCoded))
+		{
+			DISPLAY("Test NOK " << i << " Size=" << aPlain.size())
+			return false;
+		}
+	}
+	DISPLAY("Rijndael128 AES-NI/portable comparison: OK (" << theIterations << " random keys and buffers)")
+	return true;
+}
+
+// The T-table kernels of Rijndael256 must give the same bytes of the reference ones
+bool compare256(unsigned theIterations)
+{
+	for(unsigned i=0; i < theIterations; i++)
+	{
+		string aKey=randomPayload(32);
+		Rijndael256 aReference(aKey);
+		Rijndael256 aFast(aKey);
+		aReference.setAccelerated(false);
+
+		string aPlain=randomPayload(rand() % MAXSIZE);
+		string aCoded=aReference.code(aPlain);
+		if(aCoded!=aFast.code(aPlain) || aReference.decode(aCoded)!=aFast.decode(aCoded) || aFast.decode(aCoded).substr(0,aPlain.size())!=aPlain)
+		{
+			DISPLAY("Test NOK " << i << " Size=" << aPlain.size())
+			return false;
+		}
+	}
+	DISPLAY("Rijndael256 T-table/reference comparison: OK (" << theIterations << " random keys and buffers)")
+	return true;
+}
+
+// Cycles per byte of codeBlocks() and decodeBlocks(), best of theIterations runs
+void cyclesPerByte(Encription& theEncription,const char* theName,unsigned theSize,unsigned theIterations)
+{
+#ifdef CYCLES
+	string aBuffer=randomPayload(theSize);
+	unsigned long long aBestCode=~0ULL,aBestDecode=~0ULL;
+	for(unsigned i=0; i < theIterations; i++)
+	{
+		unsigned long long aStart=CYCLES();
+		theEncription.codeBlocks(&aBuffer[0],theSize);
+		unsigned long long aMiddle=CYCLES();
+		theEncription.decodeBlocks(&aBuffer[0],theSize);
+		unsigned long long anEnd=CYCLES();
+		if(aMiddle-aStart < aBestCode)
+			aBestCode=aMiddle-aStart;
+		if(anEnd-aMiddle < aBestDecode)
+			aBestDecode=anEnd-aMiddle;
+	}
+	DISPLAY(theName << " " << theSize << " bytes: Code=" << (double)aBestCode/theSize 
+	        << " cycles/byte Decode=" << (double)aBestDecode/theSize << " cycles/byte")
+#else
+	DISPLAY(theName << ": no cycle counter on this platform")
+#endif
+}
+
+void speed(Encription& theEncription,const char* theName,unsigned theSize,unsigned theIterations)
+{
+	string aPlain=randomPayload(theSize);
+	_TIMEVAL startTime=Timer::timeExt();
+	for(unsigned i=0; i < theIterations; i++)
+	{
+		string aCoded=theEncription.code(aPlain);
+		theEncription.decode(aCoded);
+	}
+	_TIMEVAL endTime=Timer::timeExt();
+	long deltaTime=Timer::subtractMicrosecs(&startTime,&endTime);
+	if(deltaTime==0)
+		deltaTime=1;
+	float rate=(float)theSize*(float)theIterations/1048576.0/((float)deltaTime/1000000.0);
+	DISPLAY(theName << " " << theSize << " bytes: Code+decode=" << rate << " MB/s")
+}
+
+// Same as speed() on one buffer coded and decoded in place
+void speedInPlace(Encription& theEncription,const char* theName,unsigned theSize,unsigned theIterations)
+{
+	string aBuffer=randomPayload(theSize);
+	_TIMEVAL startTime=Timer::timeExt();
+	for(unsigned i=0; i < theIterations; i++)
+	{
+		theEncription.codeInPlace(aBuffer);
+		theEncription.decodeInPlace(aBuffer);
+	}
+	_TIMEVAL endTime=Timer::timeExt();
+	long deltaTime=Timer::subtractMicrosecs(&startTime,&endTime);
+	if(deltaTime==0)
+		deltaTime=1;
+	float rate=(float)theSize*(float)theIterations/1048576.0/((float)deltaTime/1000000.0);
+	DISPLAY(theName << " " << theSize << " bytes: In place code+decode=" << rate << " MB/s")
+}
+
+int main(int argv,char* argc[])
+{
+	DISPLAY("MQ4CPP crypt.cpp")
+	DISPLAY("This example checks and measures the Rijndael encryption")
+
+	Rijndael128 accelerated;
+	Rijndael128 portable;
+	portable.setAccelerated(false);
+	if(!accelerated.isAccelerated())
+		DISPLAY("AES-NI not available: only the portable Rijndael128 is used")
+
+	bool ok=knownAnswer(false);
+	ok=knownAnswer(true) && ok;
+	ok=ok && compare(ITERATIONS);
+
+	speed(portable,"Rijndael128 portable",BENCHMARK_PCKSIZE,ITERATIONS*100);
+	speed(accelerated,"Rijndael128 accelerated",BENCHMARK_PCKSIZE,ITERATIONS*100);
+	speedInPlace(accelerated,"Rijndael128 accelerated",BENCHMARK_PCKSIZE,ITERATIONS*100);
+	speed(portable,"Rijndael128 portable",65536,ITERATIONS/10);
+	speed(accelerated,"Rijndael128 accelerated",65536,ITERATIONS/10);
+	speedInPlace(accelerated,"Rijndael128 accelerated",65536,ITERATIONS/10);
+	Rijndael256 r256;
+	Rijndael256 r256reference;
+	r256reference.setAccelerated(false);
+	ok=ok && compare256(ITERATIONS);
+	speed(r256reference,"Rijndael256 reference",BENCHMARK_PCKSIZE,ITERATIONS*100);
+	speed(r256,"Rijndael256 T-table",BENCHMARK_PCKSIZE,ITERATIONS*100);
+	speedInPlace(r256,"Rijndael256 T-table",BENCHMARK_PCKSIZE,ITERATIONS*100);
+	cyclesPerByte(r256reference,"Rijndael256 reference",BENCHMARK_PCKSIZE,ITERATIONS*10);
+	cyclesPerByte(r256,"Rijndael256 T-table",BENCHMARK_PCKSIZE,ITERATIONS*10);
+	cyclesPerByte(r256reference,"Rijndael256 reference",65536,ITERATIONS/10);
+	cyclesPerByte(r256,"Rijndael256 T-table",65536,ITERATIONS/10);
+
+	// Counter mode: one thread, then CTR_THREADS above CTR_PARALLEL_SIZE
+	CounterMode ctr(new Rijndael128(),1);
+	CounterMode parallel(new Rijndael128(),CTR_THREADS);
+	string aPlain=randomPayload(MAXSIZE);
+	string aCoded=ctr.code(aPlain);
+	string aParallelCoded=parallel.code(aPlain);
+	ok=ok && parallel.decode(aCoded)==aPlain && ctr.decode(aParallelCoded)==aPlain;
+	DISPLAY("CounterMode threads=" << parallel.getThreads() << ": " << (ok ? "OK" : "NOK"))
+	unsigned sizes[]={ 1024, 65536, 1048576 };
+	for(unsigned cnt=0; cnt < 3; cnt++)
+	{
+		unsigned anIterations=(ITERATIONS*100*1024)/sizes[cnt];
+		speedInPlace(accelerated,"Rijndael128 ECB",sizes[cnt],anIterations);
+		speedInPlace(ctr,"Rijndael128 CTR 1 thread",sizes[cnt],anIterations);
+		speedInPlace(parallel,"Rijndael128 CTR 4 threads",sizes[cnt],anIterations);
+	}
+	return (ok) ? 0 : -1;
+}
@@ -0,0 +1,101 @@
+///////////////////////////////////////////////////////////////////////////////
+// MQ4CPP - Message queuing for C++
+// Copyright (C) 2004-2007  Riccardo Pompeo (Italy)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "Logger.h"
+#include "Compression.h"
+#include <fstream>
+using namespace std;
+
+bool readFile(const char* theName,string& theBuffer)
+{
+	ifstream aFile(theName,ios::in | ios::binary);
+	if(!aFile)
+		return false;
+
+	char aBuffer[4096];
+	theBuffer="";
+	while(aFile.read(aBuffer,sizeof(aBuffer)) || aFile.gcount() > 0)
+		theBuffer.append(aBuffer,aFile.gcount());
+	return true;
+}
+
+int main(int argv,char* argc[])
+{
+	DISPLAY("MQ4CPP dictrain.cpp")
+	DISPLAY("This example trains a dictionary for DictionaryCompression")
+
+	if(argv < 3)
+	{
+		DISPLAY("Usage: dictrain <dictionary file> <sample file> [<sample file>...]")
+		DISPLAY("Every sample file is a message, e.g. the *.tlog files of MessageStorer")
+		return 0;
+	}
+
+	DictionaryTrainer aTrainer;
+	for(int i=2; i < argv; i++)
+	{
+		string aSample;
+		if(!readFile(argc[i],aSample))
+		{
+			DISPLAY("Can't read " << argc[i])
+			continue;
+		}
+
+		if(!aTrainer.add(aSample))
+		{
+			DISPLAY("Enough samples: " << argc[i] << " and the next ones are ignored")
+			break;
+		}
+	}
+
+	CompressionDictionary* aDictionary=aTrainer.train();
+	if(aDictionary==NULL)
+	{
+		DISPLAY("No dictionary: samples too small or without anything in common")
+		return -1;
+	}
+
+	DictionaryCompression aCompression(aDictionary);
+	unsigned long bytesIn=0;
+	unsigned long bytesOut=0;
+	for(int i=2; i < argv; i++)
+	{
+		string aSample;
+		if(readFile(argc[i],aSample))
+		{
+			bytesIn+=aSample.size();
+			bytesOut+=aCompression.deflate(aSample).size();
+		}
+	}
+
+	ofstream aFile(argc[1],ios::out | ios::binary);
+	string aBuffer=aDictionary->toString();
+	aFile.write(aBuffer.data(),aBuffer.size());
+	if(!aFile)
+	{
+		DISPLAY("Can't write " << argc[1])
+		return -1;
+	}
+
+	DISPLAY("Dictionary " << aDictionary->getID() << " (" << aDictionary->getContent().size() 
+			<< " bytes) from " << aTrainer.getSampleCount() << " samples written to " << argc[1])
+	if(bytesIn > 0)
+		DISPLAY("Compression of the samples=" << (1-(float)bytesOut/(float)bytesIn)*100.0 << "%")
+	return 0;
+}
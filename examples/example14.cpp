@@ -178,6 +178,22 @@ int main(int argv,char* argc[])
 		aClient=new MyClient("MyClientR2",LOCALHOST,LOCALPORT,"MyServerB");
 		main_sleep(2);			
 		aClient->signal();
+		DISPLAY("Request/Reply balanced round robin between MyServerC and MyServerD")
+		LOG("----------------------------- TEST 7 --------------------------")
+		aSwitch2->addRouting("MyPool",anHandleC);
+		aSwitch2->addRouting("MyPool",anHandleD);
+		aSwitch2->setBalancing("MyPool",RoundRobin);
+		aClient=new MyClient("MyClientP1","MySwitch2");
+		aClient->setTopic("MyPool");
+		main_sleep(2);			
+		aClient->signal();
+		DISPLAY("Request/Reply balanced by consistent hashing: one server for each client")
+		LOG("----------------------------- TEST 8 --------------------------")
+		aSwitch2->setBalancing("MyPool",ConsistentHash);
+		aClient=new MyClient("MyClientP2","MySwitch2");
+		aClient->setTopic("MyPool");
+		main_sleep(2);			
+		aClient->signal();
 
 		DISPLAY("Remove routing from Switch1")
 		aSwitch1->removeRouting(anHandleA);
@@ -0,0 +1,205 @@
+///////////////////////////////////////////////////////////////////////////////
+// MQ4CPP - Message queuing for C++
+// Copyright (C) 2004-2007  Riccardo Pompeo (Italy)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "Multicast.h"
+#include "Logger.h"
+#include <string>
+#include <strstream>
+#include <set>
+using namespace std;
+
+#define GROUP "239.255.0.1"
+#define PORT 9100
+#define TCP_PORT 9101	// Publish/subscribe over the proxies too
+#define MESSAGES 1000
+
+class MyPublisher : public Observer
+{
+private:
+	unsigned itsCnt;
+	bool itsMulticastOnly;
+
+public:
+	MyPublisher(const char* theName,bool theMulticastOnly) : Observer(theName)
+	{
+		itsCnt=0;
+		itsMulticastOnly=theMulticastOnly;
+		SCHEDULE(this,5);
+	};
+
+	virtual ~MyPublisher() {};
+
+protected:
+	virtual void onWakeup(Wakeup* theMessage)
+	{
+		if(itsCnt >= MESSAGES)
+			return;
+
+		ostrstream aStream;
+		aStream << "MyPublisher(" << getName() << ") message n." << ++itsCnt << ends;
+		char* aString=aStream.str();
+		publish("News",aString,itsMulticastOnly);
+		delete [] aString;
+	};
+};
+
+class MySubscriber : public Observer
+{
+private:
+	unsigned itsCnt;
+	unsigned itsDuplicateCnt;
+	set<string> itsReceived;
+
+public:
+	MySubscriber(const char* theName) : Observer(theName)
+	{
+		itsCnt=0;
+		itsDuplicateCnt=0;
+		subscribe("News");
+	};
+
+	~MySubscriber() {};
+	unsigned getCount() { return itsCnt; };
+	unsigned getDuplicateCount() { return itsDuplicateCnt; }; // Got both by multicast and by a proxy
+
+protected:
+	virtual void onBroadcast(NetworkMessage* theMessage)
+	{
+		if(theMessage->getRemoteSender()==0) // Published by this process
+			return;
+
+		itsCnt++;
+		if(!itsReceived.insert(theMessage->get()).second)
+			itsDuplicateCnt++;
+
+		ostrstream aRxStream;
+		theMessage->toStream(aRxStream);
+		aRxStream << ends;
+		char* aRxString=aRxStream.str();
+		LOG(aRxString)
+		delete [] aRxString;
+	};
+};
+
+// Drops one datagram every ten on first reception to show NACK recovery
+class LossySubscriber : public MulticastSubscriber
+{
+private:
+	unsigned itsCnt;
+
+public:
+	LossySubscriber(const char* theName) : MulticastSubscriber(theName,GROUP,PORT), itsCnt(0) {};
+	virtual ~LossySubscriber() {};
+
+protected:
+	virtual bool onDatagram(MulticastHeader* theHeader)
+	{
+		return !(theHeader->type==MQ_MCAST_DATA && (++itsCnt % 10)==0);
+	};
+};
+
+void main_sleep(int val)
+{
+	DISPLAY("...wait " << val << " secs...")
+	Thread::sleep(val*1000);
+}
+
+int main(int argv,char* argc[])
+{
+	DISPLAY("MQ4CPP example15.cpp")
+	DISPLAY("This example shows how to publish over UDP multicast")
+
+	string mode="loopback";
+	if(argv>=2)
+		mode=argc[1];
+
+	if(mode!="loopback" && mode!="pub" && mode!="sub")
+	{
+		DISPLAY("Usage: example15 [loopback|pub [tcp]|sub [publisher host]]")
+		DISPLAY("pub tcp publishes over the proxies too: a subscriber connected to the publisher gets duplicates")
+		return 0;
+	}
+
+	try
+	{
+		STARTLOGGER("example15.log")
+		if(mode=="loopback")
+		{
+	    	DISPLAY("Publisher and lossy subscriber on loopback group " << GROUP << ":" << PORT)
+			MulticastPublisher* aPublisher=new MulticastPublisher("MyMulticastPublisher",GROUP,PORT);
+			LossySubscriber* aReceiver=new LossySubscriber("MyMulticastSubscriber");
+			MySubscriber* aSubscriber=new MySubscriber("MySubscriber");
+			MyPublisher* aSender=new MyPublisher("MyPublisher",true);
+			main_sleep(10);
+			DISPLAY("Published=" << aPublisher->getSentCount()
+			        << " Retransmitted=" << aPublisher->getRetransmittedCount())
+			DISPLAY("Delivered=" << aReceiver->getDeliveredCount()
+			        << " Received=" << aSubscriber->getCount()
+			        << " NACK=" << aReceiver->getNackCount()
+			        << " Lost=" << aReceiver->getLostCount())
+			delete aReceiver;
+		}
+		else if(mode=="pub")
+		{
+			bool aMulticastOnly=!(argv==3 && string(argc[2])=="tcp");
+	    	DISPLAY("Publishing on " << GROUP << ":" << PORT << ((aMulticastOnly) ? " only" : " and on the proxies"))
+			MessageProxyFactory aFactory("MyFactory",TCP_PORT);
+			MulticastPublisher* aPublisher=new MulticastPublisher("MyMulticastPublisher",GROUP,PORT);
+			main_sleep(10); // Subscribers connect
+			MyPublisher* aSender=new MyPublisher("MyPublisher",aMulticastOnly);
+			main_sleep(100);
+		}
+		else
+		{
+	    	DISPLAY("Subscribing to " << GROUP << ":" << PORT)
+			MulticastSubscriber* aReceiver=new MulticastSubscriber("MyMulticastSubscriber",GROUP,PORT);
+			MySubscriber* aSubscriber=new MySubscriber("MySubscriber");
+			if(argv==3)
+			{
+				DISPLAY("Connected to the publisher on " << argc[2] << ":" << TCP_PORT)
+				MessageProxyFactory::ping(argc[2],TCP_PORT,aSubscriber);
+			}
+			main_sleep(100);
+			DISPLAY("Delivered=" << aReceiver->getDeliveredCount()
+			        << " Received=" << aSubscriber->getCount()
+			        << " Duplicates=" << aSubscriber->getDuplicateCount()
+			        << " NACK=" << aReceiver->getNackCount()
+			        << " Lost=" << aReceiver->getLostCount())
+			delete aReceiver;
+		}
+
+	    DISPLAY("...stopping threads...")
+	    Thread::shutdownInProgress();
+		STOPLOGGER()
+		STOPREGISTRY()
+		STOPTIMER()
+	}
+	catch(Exception& ex)
+	{
+		DISPLAY(ex.getMessage().c_str())
+	}
+	catch(...)
+	{
+		TRACE("Unhandled exception")
+	}
+
+    DISPLAY("...done!")
+   	DISPLAY("See example15.log for details")
+	return 0;
+}
@@ -0,0 +1,214 @@
+///////////////////////////////////////////////////////////////////////////////
+// MQ4CPP - Message queuing for C++
+// Copyright (C) 2004-2007  Riccardo Pompeo (Italy)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#define SILENT
+#include "MessageProxy.h"
+#include "Logger.h"
+#include <string>
+using namespace std;
+
+#define EXAMPLE_HOST "localhost"
+#define EXAMPLE_PORT 9016
+
+// Counts the unsolicited messages reaching it
+class MyTarget : public Observer
+{
+public:
+	unsigned long volatile itsReceived;
+
+	MyTarget(const char* theName) : Observer(theName) { itsReceived=0; };
+	virtual ~MyTarget() {};
+
+protected:
+	virtual void onUnsolicited(NetworkMessage* theMessage) { itsReceived++; };
+};
+
+// Looks up MyTarget through the network and sends it unsolicited messages
+class MyProbe : public Observer
+{
+public:
+	MQHANDLE volatile itsProxy;
+	MQHANDLE volatile itsHandle;
+	bool volatile itsReplyFlag;
+
+	MyProbe(const char* theName) : Observer(theName)
+	{
+		itsProxy=0;
+		itsHandle=0;
+		itsReplyFlag=false;
+	};
+	virtual ~MyProbe() {};
+
+	MQHANDLE lookup()
+	{
+		itsReplyFlag=false;
+		MessageProxyFactory::lookupAt(EXAMPLE_HOST,EXAMPLE_PORT,"MyTarget",this);
+		for(int cnt=0; !itsReplyFlag && cnt < 50; cnt++)
+			Thread::sleep(100);
+		return itsHandle;
+	};
+
+	void send(MQHANDLE theTarget)
+	{
+		NetworkMessage* aMessage=new NetworkMessage("Hello MyTarget");
+		aMessage->setUnsolicited();
+		aMessage->setTarget(theTarget);
+		aMessage->setSender(getID());
+		post(itsProxy,aMessage);
+	};
+
+protected:
+	virtual void onLookup(LookupReplyMessage* theMessage)
+	{
+		itsProxy=theMessage->getSender();
+		itsHandle=(theMessage->isFailed()) ? 0 : theMessage->getHandle();
+		itsReplyFlag=true;
+	};
+};
+
+// Frame of a peer still on the 16 bits protocol: it never sends a hello
+typedef struct OldHeaderStruct
+{
+	unsigned short sync;
+	unsigned short type;
+	unsigned short target;
+	unsigned short msglen;
+} OldHeader;
+
+#define OLD_SYNCVAL 0xbeef
+
+void display(const char* theLabel,MQHANDLE theHandle)
+{
+	DISPLAY(theLabel << " handle=0x" << hex << theHandle << " slot=0x" << MQ_SLOT(theHandle)
+			<< " generation=" << dec << (theHandle >> MQ_SLOT_BITS))
+}
+
+bool check(const char* theTest,bool theResult)
+{
+	DISPLAY(theTest << ((theResult) ? ": ok" : ": FAILED"))
+	return theResult;
+}
+
+int main(int argv,char* argc[])
+{
+	DISPLAY("MQ4CPP example16.cpp")
+	DISPLAY("This example shows the protocol version negotiation and the generation of the handles")
+
+	bool ret=true;
+	try
+	{
+		DISPLAY("Starting threads...")
+		LOG("!!!!!!! example16.cpp !!!!!!!")
+		MessageProxyFactory aFactory("MyFactory",EXAMPLE_PORT);
+		MyTarget* aTarget=new MyTarget("MyTarget");
+		MyProbe* aProbe=new MyProbe("MyProbe");
+
+		DISPLAY("Lookup from a peer of the same version")
+		MQHANDLE anHandle=aProbe->lookup();
+		display("Remote",anHandle);
+		ret&=check("Lookup reply received",anHandle!=0);
+		MessageProxy* aProxy=(MessageProxy*)MessageQueue::lookup(aProbe->itsProxy);
+		ret&=check("Protocol version negotiated",aProxy!=NULL && aProxy->getPeerVersion()==MQ_PROTOCOL_VERSION);
+		aProbe->send(anHandle);
+		Thread::sleep(500);
+		ret&=check("Message delivered",aTarget->itsReceived==1);
+
+		DISPLAY("MyTarget replaced by a new queue in the same slot")
+		MQHANDLE aStaleHandle=anHandle;
+		delete aTarget;
+		aTarget=NULL;
+		while(aTarget==NULL)
+		{
+			MyTarget* aQueue=new MyTarget("MyTarget");
+			while(!aQueue->isRunning()) // Stopped before it runs, the thread would not see it
+				Thread::sleep(0);
+			if(MQ_SLOT(aQueue->getID())==MQ_SLOT(aStaleHandle))
+				aTarget=aQueue;
+			else
+				delete aQueue;
+		}
+		display("Local",aTarget->getID());
+		ret&=check("New generation in the slot",aTarget->getID()!=aStaleHandle);
+		aProbe->send(aStaleHandle);
+		Thread::sleep(500);
+		ret&=check("Message to the stale handle dropped",aTarget->itsReceived==0);
+
+		MessageProxyFactory::invalidateLookup(EXAMPLE_HOST,EXAMPLE_PORT,"MyTarget");
+		anHandle=aProbe->lookup();
+		display("Remote",anHandle);
+		aProbe->send(anHandle);
+		Thread::sleep(500);
+		ret&=check("Message to the new handle delivered",aTarget->itsReceived==1);
+
+		DISPLAY("Lookup from a peer on the 16 bits protocol")
+		SocketClient aSocket(EXAMPLE_HOST,EXAMPLE_PORT);
+		LookupRequestMessage::LookupRequest1 aRequest;
+		aRequest.sender=1;
+		aRequest.namelen=sizeof("MyTarget")-1;
+		OldHeader anHeader;
+		anHeader.sync=OLD_SYNCVAL;
+		anHeader.type=MQ_PROXY_LOOKUP_REQUEST;
+		anHeader.target=0;
+		anHeader.msglen=sizeof(aRequest)+aRequest.namelen;
+		aSocket.SendBytes(string((char*)&anHeader,sizeof(anHeader)),
+						  string((char*)&aRequest,sizeof(aRequest))+"MyTarget");
+
+		// The hello of the server is skipped: an old peer just ignores it
+		bool aReplyFlag=false;
+		LookupReplyMessage::LookupReply1 aReply;
+		while(!aReplyFlag && aSocket.ReceiveBuffer(&anHeader,sizeof(anHeader)))
+		{
+			string aBody;
+			aBody.resize(anHeader.msglen);
+			if(anHeader.msglen>0 && !aSocket.ReceiveBuffer((char*)aBody.data(),anHeader.msglen))
+				break;
+			if(anHeader.type==MQ_PROXY_LOOKUP_REPLY)
+			{
+				ret&=check("Reply sent with the 16 bits frame",anHeader.sync==OLD_SYNCVAL && anHeader.msglen==sizeof(aReply));
+				memcpy(&aReply,aBody.data(),sizeof(aReply));
+				aReplyFlag=true;
+			}
+		}
+		ret&=check("Lookup reply received",aReplyFlag && !aReply.fail);
+		display("Remote",aReply.handle);
+		ret&=check("16 bits handle widened to the current queue of the slot",
+				   MessageQueue::widen(aReply.handle)==aTarget->getID());
+		aSocket.Close();
+
+		DISPLAY("...stopping threads...")
+		Thread::shutdownInProgress();
+		STOPLOGGER()
+		STOPREGISTRY()
+		STOPTIMER()
+	}
+	catch(Exception& ex)
+	{
+		DISPLAY(ex.getMessage().c_str())
+		ret=false;
+	}
+	catch(...)
+	{
+		DISPLAY("Unhandled exception")
+		ret=false;
+	}
+
+	DISPLAY(((ret) ? "...done!" : "...done with failures!"))
+	DISPLAY("See messages.log for details")
+	return (ret) ? 0 : 1;
+}
@@ -0,0 +1,183 @@
+///////////////////////////////////////////////////////////////////////////////
+// MQ4CPP - Message queuing for C++
+// Copyright (C) 2004-2007  Riccardo Pompeo (Italy)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#define SILENT
+#include "RequestReply.h"
+#include "Router.h"
+#include "Logger.h"
+#include <string>
+using namespace std;
+
+#define EXAMPLE_HOST "localhost"
+#define EXAMPLE_PORT 9017
+#define REQUESTS 10
+#define HOP_TIME 50		// ms spent by the congested router on each request
+#define SERVICE_TIME 20	// ms spent by the server on each request
+#define DEADLINE 250	// ms given to each request
+
+// Server that records the time left to the requests it receives
+class MyServer : public Server
+{
+public:
+	unsigned long volatile itsServed;
+	long volatile itsMinTimeLeft;
+
+	MyServer(const char* theName) : Server(theName) { reset(); };
+	virtual ~MyServer() {};
+
+	void reset()
+	{
+		itsServed=0;
+		itsMinTimeLeft=DEADLINE;
+		itsExpiredCnt=0;
+	};
+
+protected:
+	virtual NetworkMessage* onRequest(NetworkMessage* theMessage)
+	{
+		if(theMessage->hasDeadline() && theMessage->getTimeLeft() < itsMinTimeLeft)
+			itsMinTimeLeft=theMessage->getTimeLeft();
+		return Server::onRequest(theMessage);
+	};
+
+	string service(string theBuffer)
+	{
+		Thread::sleep(SERVICE_TIME);
+		itsServed++;
+		return "Done";
+	};
+};
+
+// Router in front of a congested link: each request waits HOP_TIME
+class MySlowRouter : public LocalRouter
+{
+public:
+	MySlowRouter(const char* theName, const char* theTarget) : LocalRouter(theName,theTarget) {};
+	virtual ~MySlowRouter() {};
+
+protected:
+	virtual void onMessage(Message* theMessage)
+	{
+		if(theMessage->is("NetworkMessage") && ((NetworkMessage*)theMessage)->getSender()!=itsServer)
+			Thread::sleep(HOP_TIME);
+		LocalRouter::onMessage(theMessage);
+	};
+};
+
+// Sends a burst of requests, each with the same deadline, and counts the replies
+class MyProbe : public Observer
+{
+public:
+	unsigned long volatile itsReplies;
+
+	MyProbe(const char* theName) : Observer(theName) { itsReplies=0; };
+	virtual ~MyProbe() {};
+
+	void burst(MQHANDLE theRouter,long theDeadline)
+	{
+		itsReplies=0;
+		for(unsigned i=0; i < REQUESTS; i++)
+		{
+			NetworkMessage* aMessage=new NetworkMessage("Request");
+			aMessage->setSender(getID());
+			aMessage->setSequenceNumber(i);
+			aMessage->setDeadline(theDeadline);
+			MessageQueue::post(theRouter,aMessage);
+		}
+	};
+
+protected:
+	virtual NetworkMessage* onRequest(NetworkMessage* theMessage)
+	{
+		itsReplies++;
+		return NULL;
+	};
+};
+
+bool check(const char* theTest,bool theResult)
+{
+	DISPLAY(theTest << ((theResult) ? ": ok" : ": FAILED"))
+	return theResult;
+}
+
+void display(MyServer* theServer,MyProbe* theProbe)
+{
+	DISPLAY("Sent=" << REQUESTS << " served=" << theServer->itsServed
+			<< " expired at the server=" << theServer->getExpiredCount()
+			<< " dropped by the routers=" << REQUESTS - theServer->itsServed - theServer->getExpiredCount()
+			<< " replies=" << theProbe->itsReplies)
+}
+
+int main(int argv,char* argc[])
+{
+	DISPLAY("MQ4CPP example17.cpp")
+	DISPLAY("This example shows request deadlines along a chain of routers")
+
+	bool ret=true;
+	try
+	{
+		DISPLAY("Starting threads...")
+		LOG("!!!!!!! example17.cpp !!!!!!!")
+		MessageProxyFactory aFactory("MyFactory",EXAMPLE_PORT);
+		MyServer* aServer=new MyServer("MyServer");
+
+		// MyProbe -> MySlowRouter -> RemoteRouter -> network -> MyServer
+		new RemoteRouter("MyRemoteRouter",EXAMPLE_HOST,EXAMPLE_PORT,"MyServer");
+		Thread::sleep(1000); // Remote lookup
+		MySlowRouter* aRouter=new MySlowRouter("MySlowRouter","MyRemoteRouter");
+		MyProbe* aProbe=new MyProbe("MyProbe");
+
+		DISPLAY("Burst of " << REQUESTS << " requests without deadline")
+		aProbe->burst(aRouter->getID(),0);
+		Thread::sleep(2000);
+		display(aServer,aProbe);
+		ret&=check("All the requests served",aServer->itsServed==REQUESTS && aProbe->itsReplies==REQUESTS);
+
+		DISPLAY("Burst of " << REQUESTS << " requests with a deadline of " << DEADLINE << " ms")
+		aServer->reset();
+		aProbe->burst(aRouter->getID(),DEADLINE);
+		Thread::sleep(2000);
+		display(aServer,aProbe);
+		DISPLAY("Minimum time left at the server=" << aServer->itsMinTimeLeft << " ms")
+		ret&=check("Requests served within their deadline",aServer->itsServed > 0 && aServer->itsServed < REQUESTS);
+		ret&=check("Expired requests dropped by the routers",aServer->itsServed + aServer->getExpiredCount() < REQUESTS);
+		ret&=check("Time left carried across the network",aServer->itsMinTimeLeft < DEADLINE - HOP_TIME);
+		ret&=check("Only the served requests replied",aProbe->itsReplies==aServer->itsServed);
+
+		DISPLAY("...stopping threads...")
+		Thread::shutdownInProgress();
+		STOPLOGGER()
+		STOPREGISTRY()
+		STOPTIMER()
+	}
+	catch(Exception& ex)
+	{
+		DISPLAY(ex.getMessage().c_str())
+		ret=false;
+	}
+	catch(...)
+	{
+		DISPLAY("Unhandled exception")
+		ret=false;
+	}
+
+	DISPLAY(((ret) ? "...done!" : "...done with failures!"))
+	DISPLAY("See messages.log for details")
+	return (ret) ? 0 : 1;
+}
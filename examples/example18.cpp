@@ -0,0 +1,199 @@
+///////////////////////////////////////////////////////////////////////////////
+// MQ4CPP - Message queuing for C++
+// Copyright (C) 2004-2007  Riccardo Pompeo (Italy)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "RequestReply.h"
+#include "Logger.h"
+#include <string>
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+#define REQUESTS 300
+#define STALL_EVERY 5		// The slow server stalls on every fifth request
+#define STALL_TIME 400		// ms
+
+class MyServer : public Server
+{
+protected:
+	bool itsSlowFlag;
+	unsigned long itsCnt;
+
+public:
+	MyServer(const char* theName,bool theSlowFlag) : Server(theName)
+	{
+		itsSlowFlag=theSlowFlag;
+		itsCnt=0;
+	};
+
+	virtual ~MyServer() {};
+
+protected:
+	string service(string theBuffer)
+	{
+		if(itsSlowFlag && ++itsCnt % STALL_EVERY==0)
+			Thread::sleep(STALL_TIME);
+		return (itsSlowFlag) ? "slow" : "fast";
+	};
+};
+
+// Sends REQUESTS requests one after the other and records their round trip
+class MyClient : public Client
+{
+public:
+	vector<long> itsLatency;
+	unsigned long itsSlowCnt;
+	unsigned long itsFastCnt;
+	_TIMEVAL itsStart;
+
+	MyClient(const char* theName,char* theHost,int thePort,const char* theTarget,
+			 char* theFailoverHost,int theFailoverPort,bool theHedgingFlag)
+		: Client(theName,theHost,thePort,theTarget)
+	{
+		itsSlowCnt=0;
+		itsFastCnt=0;
+		addFailoverHost(theFailoverHost,theFailoverPort);
+		setHedging(theHedgingFlag);
+		itsStart=Timer::timeExt();
+		send("Request");
+	};
+
+	virtual ~MyClient() {};
+
+	bool isDone() { return itsLatency.size() >= REQUESTS; };
+
+	long getPercentile(unsigned thePercent)
+	{
+		vector<long> aSorted(itsLatency);
+		sort(aSorted.begin(),aSorted.end());
+		return (aSorted.empty()) ? 0 : aSorted[(aSorted.size()-1)*thePercent/100];
+	};
+
+protected:
+	void success(string theBuffer)
+	{
+		_TIMEVAL aNow=Timer::timeExt();
+		itsLatency.push_back(Timer::subtractMillisecs(&itsStart,&aNow));
+		if(theBuffer=="slow")
+			itsSlowCnt++;
+		else
+			itsFastCnt++;
+
+		if(!isDone())
+		{
+			itsStart=Timer::timeExt();
+			send("Request");
+		}
+	};
+
+	void fail(string theError)
+	{
+		LOG("MyClient - Service failed")
+		itsStart=Timer::timeExt();
+		send("Request");
+	};
+};
+
+int main(int argv,char* argc[])
+{
+	DISPLAY("MQ4CPP example18.cpp")
+	DISPLAY("This example shows hedged requests against a server that stalls")
+
+	bool client=true;
+	bool hedging=false;
+	bool slow=false;
+	char* host=NULL;
+	int hport=0;
+	char* fhost=NULL;
+	int fport=0;
+
+	if(argv==6 && (string(argc[1]).compare("-c")==0 || string(argc[1]).compare("-h")==0))
+	{
+		hedging=(string(argc[1]).compare("-h")==0);
+		DISPLAY("Slow host name=" << argc[2])
+		host=argc[2];
+		DISPLAY("Slow host port=" << argc[3])
+		hport=atoi(argc[3]);
+		DISPLAY("Fast host name=" << argc[4])
+		fhost=argc[4];
+		DISPLAY("Fast host port=" << argc[5])
+		fport=atoi(argc[5]);
+	}
+	else if(argv==3 && (string(argc[1]).compare("-s")==0 || string(argc[1]).compare("-f")==0))
+	{
+		client=false;
+		slow=(string(argc[1]).compare("-s")==0);
+		DISPLAY("Server port=" << argc[2])
+		hport=atoi(argc[2]);
+	}
+	else
+	{
+		DISPLAY("Client usage: example18 -c|-h slow_hostip port fast_hostip port")
+		DISPLAY("Server usage: example18 -s|-f port")
+		DISPLAY("-s starts a server that stalls " << STALL_TIME << " ms on every " << STALL_EVERY << "th request, -f a fast one")
+		DISPLAY("-c sends " << REQUESTS << " requests to the slow server, -h also hedges them on the fast one")
+		return 0;
+	}
+
+	try
+	{
+		if(client==true)
+		{
+			DISPLAY("Starting client threads...")
+			STARTLOGGER("client.log")
+			LOG("!!!!!!! example18.cpp - client !!!!!!!")
+			MyClient* aClient=new MyClient("MyClient",host,hport,"MyServer",fhost,fport,hedging);
+			for(int cnt=0; !aClient->isDone() && cnt < 600; cnt++)
+				Thread::sleep(100);
+
+			DISPLAY("Requests=" << aClient->itsLatency.size() << " replied by the slow server=" << aClient->itsSlowCnt
+					<< " by the fast server=" << aClient->itsFastCnt)
+			DISPLAY("Latency p50=" << aClient->getPercentile(50) << " ms p95=" << aClient->getPercentile(95)
+					<< " ms max=" << aClient->getPercentile(100) << " ms")
+			DISPLAY("Hedged requests=" << aClient->getHedgeCount() << " won by the hedge=" << aClient->getHedgeWinCount()
+					<< " endpoint in use=" << ((aClient->getEndpoint()==0) ? "slow" : "fast"))
+		}
+		else
+		{
+			DISPLAY("Starting server threads...")
+			STARTLOGGER("server.log")
+			LOG("!!!!!!! example18.cpp - server !!!!!!!")
+			MessageProxyFactory aFactory("MyFactory",hport);
+			new MyServer("MyServer",slow);
+			DISPLAY("...wait 100 secs...")
+			Thread::sleep(100000);
+		}
+
+		DISPLAY("...stopping threads...")
+		Thread::shutdownInProgress();
+		STOPLOGGER()
+		STOPREGISTRY()
+		STOPTIMER()
+	}
+	catch(Exception& ex)
+	{
+		DISPLAY(ex.getMessage().c_str())
+	}
+	catch(...)
+	{
+		DISPLAY("Unhandled exception")
+	}
+
+	DISPLAY("...done!")
+	return 0;
+}
@@ -0,0 +1,180 @@
+///////////////////////////////////////////////////////////////////////////////
+// MQ4CPP - Message queuing for C++
+// Copyright (C) 2004-2007  Riccardo Pompeo (Italy)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#define SILENT
+#include "MessageProxy.h"
+#include "Logger.h"
+#include <string>
+using namespace std;
+
+#define EXAMPLE_HOST "localhost"
+#define EXAMPLE_PORT 9019	// Connection without flow control, the next port with it
+#define MESSAGES 3000
+#define WINDOW 16
+
+// Slow consumer: 1 ms for each message
+class MyConsumer : public Observer
+{
+public:
+	unsigned long volatile itsReceived;
+	int volatile itsPeakQueue;
+	MQHANDLE volatile itsProxy;
+
+	MyConsumer(const char* theName) : Observer(theName) { reset(); };
+	virtual ~MyConsumer() {};
+
+	void reset()
+	{
+		itsReceived=0;
+		itsPeakQueue=0;
+		itsProxy=0;
+	};
+
+protected:
+	virtual void onUnsolicited(NetworkMessage* theMessage)
+	{
+		itsProxy=theMessage->getSender();
+		if(getQueueSize() > itsPeakQueue)
+			itsPeakQueue=getQueueSize();
+		itsReceived++;
+		Thread::sleep(1);
+	};
+};
+
+// Looks up MyConsumer through the network and blasts messages at it
+class MyProducer : public Observer
+{
+public:
+	MQHANDLE volatile itsProxy;
+	MQHANDLE volatile itsHandle;
+
+	MyProducer(const char* theName) : Observer(theName)
+	{
+		itsProxy=0;
+		itsHandle=0;
+	};
+	virtual ~MyProducer() {};
+
+	bool connect(int thePort)
+	{
+		itsHandle=0;
+		MessageProxyFactory::lookupAt(EXAMPLE_HOST,thePort,"MyConsumer",this);
+		for(int cnt=0; itsHandle==0 && cnt < 50; cnt++)
+			Thread::sleep(100);
+		return itsHandle!=0;
+	};
+
+	void blast()
+	{
+		string aBuffer(200,'x');
+		for(unsigned i=0; i < MESSAGES; i++)
+		{
+			NetworkMessage* aMessage=new NetworkMessage(aBuffer);
+			aMessage->setUnsolicited();
+			aMessage->setSender(getID());
+			aMessage->setTarget(itsHandle);
+			post(itsProxy,aMessage);
+		}
+	};
+
+protected:
+	virtual void onLookup(LookupReplyMessage* theMessage)
+	{
+		itsProxy=theMessage->getSender();
+		itsHandle=(theMessage->isFailed()) ? 0 : theMessage->getHandle();
+	};
+};
+
+bool check(const char* theTest,bool theResult)
+{
+	DISPLAY(theTest << ((theResult) ? ": ok" : ": FAILED"))
+	return theResult;
+}
+
+void waitForConsumer(MyConsumer* theConsumer)
+{
+	for(int cnt=0; theConsumer->itsReceived < MESSAGES && cnt < 200; cnt++)
+		Thread::sleep(100);
+}
+
+int main(int argv,char* argc[])
+{
+	DISPLAY("MQ4CPP example19.cpp")
+	DISPLAY("This example shows credit based flow control towards a slow consumer")
+
+	bool ret=true;
+	try
+	{
+		DISPLAY("Starting threads...")
+		LOG("!!!!!!! example19.cpp !!!!!!!")
+		MyConsumer* aConsumer=new MyConsumer("MyConsumer");
+		MyProducer* aProducer=new MyProducer("MyProducer");
+
+		DISPLAY(MESSAGES << " messages without flow control")
+		MessageProxyFactory aFactory("MyFactory",EXAMPLE_PORT);
+		ret&=check("Consumer found",aProducer->connect(EXAMPLE_PORT));
+		aProducer->blast();
+		waitForConsumer(aConsumer);
+		DISPLAY("Received=" << aConsumer->itsReceived << " peak consumer queue=" << aConsumer->itsPeakQueue)
+		ret&=check("All the messages received",aConsumer->itsReceived==MESSAGES);
+
+		// The window is read when a connection starts: both peers of the new one
+		// are in this process, so both grant credits
+		DISPLAY(MESSAGES << " messages with a window of " << WINDOW)
+		MessageProxy::setFlowControl(WINDOW);
+		MessageProxyFactory aFlowFactory("MyFlowFactory",EXAMPLE_PORT+1);
+		aConsumer->reset();
+		ret&=check("Consumer found",aProducer->connect(EXAMPLE_PORT+1));
+		MessageProxy* aSender=(MessageProxy*)MessageQueue::lookup(aProducer->itsProxy);
+		ret&=check("Credits granted by the receiver",aSender!=NULL && aSender->isFlowControlled());
+		aProducer->blast();
+		Thread::sleep(500);
+		DISPLAY("While the consumer works: received=" << aConsumer->itsReceived << " credits=" << aSender->getCredits()
+				<< " sender stalls=" << aSender->getStallCount() << " held=" << aSender->getHeldCount())
+		ret&=check("Messages held by the sender",aSender->getStallCount() > 0 && aSender->getHeldCount() > 0);
+
+		waitForConsumer(aConsumer);
+		MessageProxy* aReceiver=(MessageProxy*)MessageQueue::lookup(aConsumer->itsProxy);
+		DISPLAY("Received=" << aConsumer->itsReceived << " peak consumer queue=" << aConsumer->itsPeakQueue
+				<< " receiver withheld=" << ((aReceiver!=NULL) ? aReceiver->getWithheldCount() : 0))
+		ret&=check("Credits withheld by the receiver",aReceiver!=NULL && aReceiver->getWithheldCount() > 0);
+		ret&=check("Held messages released",aConsumer->itsReceived==MESSAGES);
+		ret&=check("Consumer queue bounded by the window",aConsumer->itsPeakQueue <= 2*WINDOW);
+
+		DISPLAY("...stopping threads...")
+		Thread::shutdownInProgress();
+		STOPLOGGER()
+		STOPREGISTRY()
+		STOPTIMER()
+	}
+	catch(Exception& ex)
+	{
+		DISPLAY(ex.getMessage().c_str())
+		ret=false;
+	}
+	catch(...)
+	{
+		DISPLAY("Unhandled exception")
+		ret=false;
+	}
+
+	DISPLAY(((ret) ? "...done!" : "...done with failures!"))
+	DISPLAY("See messages.log for details")
+	return (ret) ? 0 : 1;
+}
@@ -0,0 +1,157 @@
+///////////////////////////////////////////////////////////////////////////////
+// MQ4CPP - Message queuing for C++
+// Copyright (C) 2004-2007  Riccardo Pompeo (Italy)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#define SILENT
+#include "MessageProxy.h"
+#include "Logger.h"
+#include <string>
+using namespace std;
+
+#define EXAMPLE_HOST "localhost"
+#define EXAMPLE_PORT 9021
+#define PROBES 5
+
+// Counts the lookups by name that reach it: one for each request sent to the server
+class MyTarget : public Observer
+{
+public:
+	unsigned long volatile itsLookupCnt;
+
+	MyTarget(const char* theName) : Observer(theName) { itsLookupCnt=0; };
+	virtual ~MyTarget() {};
+
+	virtual bool is(const char* theName,MQHANDLE& theID)
+	{
+		bool ret=MessageQueue::is(theName,theID);
+		if(ret)
+			itsLookupCnt++;
+		return ret;
+	};
+};
+
+// Looks up MyTarget through the network
+class MyProbe : public Observer
+{
+public:
+	MQHANDLE volatile itsHandle;
+	bool volatile itsReplyFlag;
+
+	MyProbe(const char* theName) : Observer(theName)
+	{
+		itsHandle=0;
+		itsReplyFlag=false;
+	};
+	virtual ~MyProbe() {};
+
+	void lookup()
+	{
+		itsReplyFlag=false;
+		itsHandle=0;
+		MessageProxyFactory::lookupAt(EXAMPLE_HOST,EXAMPLE_PORT,"MyTarget",this);
+	};
+
+	bool waitForReply()
+	{
+		for(int cnt=0; !itsReplyFlag && cnt < 50; cnt++)
+			Thread::sleep(100);
+		return itsReplyFlag;
+	};
+
+protected:
+	virtual void onLookup(LookupReplyMessage* theMessage)
+	{
+		itsHandle=(theMessage->isFailed()) ? 0 : theMessage->getHandle();
+		itsReplyFlag=true;
+	};
+};
+
+bool check(const char* theTest,bool theResult)
+{
+	DISPLAY(theTest << ((theResult) ? ": ok" : ": FAILED"))
+	return theResult;
+}
+
+int main(int argv,char* argc[])
+{
+	DISPLAY("MQ4CPP example20.cpp")
+	DISPLAY("This example shows the cache of the remote lookups")
+
+	bool ret=true;
+	try
+	{
+		DISPLAY("Starting threads...")
+		LOG("!!!!!!! example20.cpp !!!!!!!")
+		MessageProxyFactory aFactory("MyFactory",EXAMPLE_PORT);
+		MyTarget* aTarget=new MyTarget("MyTarget");
+		MyProbe* aProbe[PROBES];
+		for(unsigned i=0; i < PROBES; i++)
+		{
+			char aName[32];
+			sprintf(aName,"MyProbe%u",i);
+			aProbe[i]=new MyProbe(aName);
+		}
+
+		DISPLAY(PROBES << " concurrent lookups of MyTarget")
+		for(unsigned i=0; i < PROBES; i++)
+			aProbe[i]->lookup();
+		bool aReplyFlag=true;
+		bool aSameFlag=true;
+		for(unsigned i=0; i < PROBES; i++)
+		{
+			aReplyFlag&=aProbe[i]->waitForReply();
+			aSameFlag&=(aProbe[i]->itsHandle==aProbe[0]->itsHandle);
+		}
+		DISPLAY("Lookups sent to the server=" << aTarget->itsLookupCnt)
+		ret&=check("All the waiters answered with the same handle",aReplyFlag && aSameFlag && aProbe[0]->itsHandle!=0);
+		ret&=check("Concurrent lookups coalesced in one request",aTarget->itsLookupCnt==1);
+
+		DISPLAY("Lookup of MyTarget again")
+		aProbe[0]->lookup();
+		ret&=check("Reply received",aProbe[0]->waitForReply() && aProbe[0]->itsHandle==aProbe[1]->itsHandle);
+		DISPLAY("Lookups sent to the server=" << aTarget->itsLookupCnt)
+		ret&=check("Lookup answered by the cache",aTarget->itsLookupCnt==1);
+
+		DISPLAY("Lookup of MyTarget after invalidateLookup")
+		MessageProxyFactory::invalidateLookup(EXAMPLE_HOST,EXAMPLE_PORT,"MyTarget");
+		aProbe[0]->lookup();
+		ret&=check("Reply received",aProbe[0]->waitForReply() && aProbe[0]->itsHandle==aProbe[1]->itsHandle);
+		DISPLAY("Lookups sent to the server=" << aTarget->itsLookupCnt)
+		ret&=check("Invalidated entry looked up again",aTarget->itsLookupCnt==2);
+
+		DISPLAY("...stopping threads...")
+		Thread::shutdownInProgress();
+		STOPLOGGER()
+		STOPREGISTRY()
+		STOPTIMER()
+	}
+	catch(Exception& ex)
+	{
+		DISPLAY(ex.getMessage().c_str())
+		ret=false;
+	}
+	catch(...)
+	{
+		DISPLAY("Unhandled exception")
+		ret=false;
+	}
+
+	DISPLAY(((ret) ? "...done!" : "...done with failures!"))
+	DISPLAY("See messages.log for details")
+	return (ret) ? 0 : 1;
+}
@@ -0,0 +1,188 @@
+///////////////////////////////////////////////////////////////////////////////
+// MQ4CPP - Message queuing for C++
+// Copyright (C) 2004-2007  Riccardo Pompeo (Italy)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#define SILENT
+#include "RequestReply.h"
+#include "Logger.h"
+#include <string>
+#include <stdio.h>
+using namespace std;
+
+#define EXAMPLE_HOST "localhost"
+#define EXAMPLE_PORT 9022
+#define CLIENTS 5
+#define SERVICE_TIME 200	// ms
+#define CACHE_TTL 1			// secs
+#define CACHE_SIZE 60		// Bytes: two requests and their replies
+
+class MyServer : public Server
+{
+public:
+	unsigned long volatile itsServed;
+
+	MyServer(const char* theName) : Server(theName) { itsServed=0; };
+	virtual ~MyServer() {};
+
+protected:
+	string service(string theBuffer)
+	{
+		Thread::sleep(SERVICE_TIME);
+		itsServed++;
+		return "Reply to " + theBuffer;
+	};
+};
+
+class MyClient : public Client
+{
+public:
+	bool volatile itsDoneFlag;
+	string itsReply;
+
+	MyClient(const char* theName,char* theHost,int thePort,const char* theTarget)
+		: Client(theName,theHost,thePort,theTarget) { itsDoneFlag=false; };
+	virtual ~MyClient() {};
+
+	void request(string theBuffer)
+	{
+		itsDoneFlag=false;
+		itsReply="";
+		send(theBuffer);
+	};
+
+	bool waitForReply()
+	{
+		for(int cnt=0; !itsDoneFlag && cnt < 100; cnt++)
+			Thread::sleep(100);
+		return itsDoneFlag && itsReply.size() > 0;
+	};
+
+protected:
+	void success(string theBuffer)
+	{
+		itsReply=theBuffer;
+		itsDoneFlag=true;
+	};
+
+	void fail(string theError)
+	{
+		LOG("MyClient - Service failed")
+		itsDoneFlag=true;
+	};
+};
+
+bool check(const char* theTest,bool theResult)
+{
+	DISPLAY(theTest << ((theResult) ? ": ok" : ": FAILED"))
+	return theResult;
+}
+
+// Request of theClient and number of times the server ran the service for it
+unsigned long served(MyServer* theServer,MyClient* theClient,const char* theRequest)
+{
+	unsigned long aServed=theServer->itsServed;
+	theClient->request(theRequest);
+	if(!theClient->waitForReply())
+		DISPLAY("No reply to " << theRequest)
+	return theServer->itsServed - aServed;
+}
+
+// Identical requests sent at the same time by all the clients
+bool burst(MyClient** theClients)
+{
+	for(unsigned i=0; i < CLIENTS; i++)
+		theClients[i]->request("Request X");
+	bool ret=true;
+	for(unsigned i=0; i < CLIENTS; i++)
+		ret&=theClients[i]->waitForReply() && theClients[i]->itsReply==theClients[0]->itsReply;
+	return ret;
+}
+
+int main(int argv,char* argc[])
+{
+	DISPLAY("MQ4CPP example21.cpp")
+	DISPLAY("This example shows the reply cache of a server and single-flight clients")
+
+	bool ret=true;
+	try
+	{
+		DISPLAY("Starting threads...")
+		LOG("!!!!!!! example21.cpp !!!!!!!")
+		MessageProxyFactory aFactory("MyFactory",EXAMPLE_PORT);
+		MyServer* aServer=new MyServer("MyServer");
+		aServer->setReplyCache(CACHE_TTL,CACHE_SIZE);
+		MyClient* aClients[CLIENTS];
+		for(unsigned i=0; i < CLIENTS; i++)
+		{
+			char aName[32];
+			sprintf(aName,"MyClient%u",i);
+			aClients[i]=new MyClient(aName,EXAMPLE_HOST,EXAMPLE_PORT,"MyServer");
+		}
+		for(int cnt=0; !aClients[CLIENTS-1]->isConnected() && cnt < 50; cnt++)
+			Thread::sleep(100);
+		MyClient* aClient=aClients[0];
+
+		DISPLAY("Reply cache with a TTL of " << CACHE_TTL << " secs and room for two replies")
+		ret&=check("First request served",served(aServer,aClient,"Request A")==1);
+		ret&=check("Same request answered by the cache",served(aServer,aClient,"Request A")==0 && aServer->getCacheHitCount()==1);
+		Thread::sleep((CACHE_TTL+1)*1000+100);
+		ret&=check("Same request served again after the TTL",served(aServer,aClient,"Request A")==1);
+
+		ret&=check("Request B served",served(aServer,aClient,"Request B")==1);
+		ret&=check("Request A answered by the cache",served(aServer,aClient,"Request A")==0);
+		ret&=check("Request C served, least recently used B evicted",served(aServer,aClient,"Request C")==1);
+		ret&=check("Request A answered by the cache",served(aServer,aClient,"Request A")==0);
+		ret&=check("Request B served again",served(aServer,aClient,"Request B")==1);
+		DISPLAY("Cache hits=" << aServer->getCacheHitCount())
+
+		DISPLAY(CLIENTS << " identical requests at the same time, without the reply cache")
+		aServer->setReplyCache(0);
+		unsigned long aServed=aServer->itsServed;
+		ret&=check("All the clients replied",burst(aClients));
+		DISPLAY("Served=" << aServer->itsServed - aServed)
+		ret&=check("Each request served",aServer->itsServed - aServed==CLIENTS);
+
+		DISPLAY(CLIENTS << " identical requests at the same time, single-flight clients")
+		for(unsigned i=0; i < CLIENTS; i++)
+			aClients[i]->setSingleFlight(true);
+		aServed=aServer->itsServed;
+		ret&=check("All the clients replied",burst(aClients));
+		DISPLAY("Served=" << aServer->itsServed - aServed)
+		ret&=check("One request served for all the clients",aServer->itsServed - aServed==1);
+
+		DISPLAY("...stopping threads...")
+		Thread::shutdownInProgress();
+		STOPLOGGER()
+		STOPREGISTRY()
+		STOPTIMER()
+	}
+	catch(Exception& ex)
+	{
+		DISPLAY(ex.getMessage().c_str())
+		ret=false;
+	}
+	catch(...)
+	{
+		DISPLAY("Unhandled exception")
+		ret=false;
+	}
+
+	DISPLAY(((ret) ? "...done!" : "...done with failures!"))
+	DISPLAY("See messages.log for details")
+	return (ret) ? 0 : 1;
+}
@@ -24,6 +24,8 @@
 #include <strstream>
 using namespace std;
 
+#define ASYNC_REQUESTS 10
+
 class MyClient : public Client
 {
 protected:
@@ -88,6 +90,30 @@ protected:
 	};
 };
 
+// Same service run by a pool of workers, replies in order for each client
+class MyParallelServer : public ParallelServer
+{
+public:
+	MyParallelServer(const char* theName) : ParallelServer(theName,0,PARALLEL_MAX_QUEUE,true) 
+	{
+		setEncription(new Rijndael256(Encription::generateKey256("MyVerySecretPassword"))); 
+		setCompression(new PacketCompression());
+	};	
+	
+	virtual ~MyParallelServer() {};
+
+protected:
+	string service(string theBuffer)
+	{
+		ostrstream aStream;
+		aStream << "MyParallelServer(" << getName() << ") receive='" << theBuffer.c_str() << "'" << ends; 
+		char* aString=aStream.str();
+		LOG(aString)
+		delete [] aString;
+		return "Message received";
+	};
+};
+
 void main_sleep(int val)
 {
 	DISPLAY("...wait " << val << " secs...")	
@@ -100,6 +126,8 @@ int main(int argv,char* argc[])
 	DISPLAY("This example shows how to send request/reply network messages")	
 	
 	bool client=false;
+	bool parallel=false;
+	bool async=false;
 	char* host=NULL;
 	int hport=0;
 	char* fhost=NULL;
@@ -107,13 +135,14 @@ int main(int argv,char* argc[])
 	
 	if(argv < 3)
 	{
-		DISPLAY("Client usage: example7 -c hostip port [failover_hostip] [port]")
-		DISPLAY("Server usage: example7 -s port")
+		DISPLAY("Client usage: example7 -c|-a hostip port [failover_hostip] [port]")
+		DISPLAY("Server usage: example7 -s|-p port")
 		return 0;	
 	}
-	else if(string(argc[1]).compare("-c")==0 && argv==4)
+	else if((string(argc[1]).compare("-c")==0 || string(argc[1]).compare("-a")==0) && argv==4)
 	{
 		client=true;
+		async=(string(argc[1]).compare("-a")==0);
 		DISPLAY("Default host name=" << argc[2])
 		host=argc[2];
 		DISPLAY("Default host port=" << argc[3])
@@ -131,16 +160,17 @@ int main(int argv,char* argc[])
 		DISPLAY("Failover host port=" << argc[5])
 		fport=atoi(argc[5]);
 	}	
-	else if(string(argc[1]).compare("-s")==0 && argv==3)
+	else if((string(argc[1]).compare("-s")==0 || string(argc[1]).compare("-p")==0) && argv==3)
 	{
 		client=false;
+		parallel=(string(argc[1]).compare("-p")==0);
 		DISPLAY("Server port=" << argc[2])
 		hport=atoi(argc[2]);
 	}	
 	else
 	{
-		DISPLAY("Client usage: example7 -c hostip port [failover_hostip] [port]")
-		DISPLAY("Server usage: example7 -s port")
+		DISPLAY("Client usage: example7 -c|-a hostip port [failover_hostip] [port]")
+		DISPLAY("Server usage: example7 -s|-p port")
 		return 0;	
 	}
 
@@ -151,11 +181,42 @@ int main(int argv,char* argc[])
 	    	DISPLAY("Starting client threads...")
 			STARTLOGGER("client.log")
 			LOG("!!!!!!! example7.cpp - client !!!!!!!")
-			MyClient* aClientA=new MyClient("MyClientA",host,hport,"MyServerA");
-			if(fhost!=NULL)
-				aClientA->addFailoverHost(fhost,fport);
-				
-			main_sleep(20);			
+			if(async)
+			{
+				// Scatter ASYNC_REQUESTS requests and gather the replies
+				AsyncClient* aClientA=new AsyncClient("MyClientA",host,hport,"MyServerA");
+				aClientA->setEncription(new Rijndael256(Encription::generateKey256("MyVerySecretPassword"))); 
+				aClientA->setCompression(new PacketCompression(false));
+				for(int n=0; n < 20; n++)
+				{
+					AsyncGather aGather(ASYNC_REQUESTS);
+					for(unsigned i=0; i < ASYNC_REQUESTS; i++)
+					{
+						char buffer[64];
+						ostrstream aStream(buffer,sizeof(buffer));
+						aStream << "MyClientA request n." << n << "." << i << ends;
+						aClientA->request(buffer,&aGather,i);
+					}
+
+					try
+					{
+						for(unsigned i=0; i < ASYNC_REQUESTS; i++)
+							LOG(aGather.get(i).c_str())
+					}
+					catch(Exception& ex)
+					{
+						DISPLAY("Request failed: " << ex.getMessage().c_str())
+					}
+				}
+			}
+			else
+			{
+				MyClient* aClientA=new MyClient("MyClientA",host,hport,"MyServerA");
+				if(fhost!=NULL)
+					aClientA->addFailoverHost(fhost,fport);
+					
+				main_sleep(20);
+			}			
 		}
 		else
 		{			
@@ -163,7 +224,10 @@ int main(int argv,char* argc[])
 			STARTLOGGER("server.log")
 			LOG("!!!!!!! example7.cpp - server !!!!!!!")
 			MessageProxyFactory aFactory("MyFactory",hport);
-			MyServer* aServerA=new MyServer("MyServerA");
+			if(parallel)
+				new MyParallelServer("MyServerA");
+			else
+				new MyServer("MyServerA");
 			main_sleep(100);			
 		}
 
@@ -26,6 +26,8 @@
 #define _mcrypt_set_key rijndael_256_LTX__mcrypt_set_key
 #define _mcrypt_encrypt rijndael_256_LTX__mcrypt_encrypt
 #define _mcrypt_decrypt rijndael_256_LTX__mcrypt_decrypt
+#define _mcrypt_encrypt_blocks rijndael_256_LTX__mcrypt_encrypt_blocks
+#define _mcrypt_decrypt_blocks rijndael_256_LTX__mcrypt_decrypt_blocks
 #define _mcrypt_get_size rijndael_256_LTX__mcrypt_get_size
 #define _mcrypt_get_block_size rijndael_256_LTX__mcrypt_get_block_size
 #define _is_block_algorithm rijndael_256_LTX__is_block_algorithm
@@ -56,6 +58,8 @@ static word32 rtable[256];
 static word32 rco[30];
 static int tables_ok = 0;
 
+static void _mcrypt_rijndael_genfasttables(void);
+
 /* Parameter-dependent data */
 
 /* in "rijndael.h" */
@@ -213,6 +217,7 @@ int _mcrypt_set_key(RI * rinst, byte * key, int nk)
 
 	if (tables_ok == 0) {
 		_mcrypt_rijndael_gentables();
+		_mcrypt_rijndael_genfasttables();
 		tables_ok = 1;
 	}
 
@@ -398,6 +403,117 @@ void _mcrypt_decrypt(RI * rinst, byte * buff)
 }
 
 
+/* T-table kernels for whole buffers: same keys and same output of the
+   functions above, with the four pre-rotated tables the comment before
+   _mcrypt_encrypt() talks about and the fixed 256 bits block unrolled
+   (forward increments 1, 3, 4 and reverse 7, 5, 4). */
+
+static word32 ft[4][256];	/* built with the other tables by _mcrypt_set_key() */
+static word32 rt[4][256];
+
+static void _mcrypt_rijndael_genfasttables(void)
+{
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		ft[0][i] = ftable[i];
+		ft[1][i] = ROTL8(ftable[i]);
+		ft[2][i] = ROTL16(ftable[i]);
+		ft[3][i] = ROTL24(ftable[i]);
+		rt[0][i] = rtable[i];
+		rt[1][i] = ROTL8(rtable[i]);
+		rt[2][i] = ROTL16(rtable[i]);
+		rt[3][i] = ROTL24(rtable[i]);
+	}
+}
+
+#define B0(x) ((byte) (x))
+#define B1(x) ((byte) ((x) >> 8))
+#define B2(x) ((byte) ((x) >> 16))
+#define B3(x) ((byte) ((x) >> 24))
+
+#define FCOL(y, k, a, b, c, d) \
+	y = (k) ^ ft[0][B0(a)] ^ ft[1][B1(b)] ^ ft[2][B2(c)] ^ ft[3][B3(d)];
+#define FROUND(k) \
+	FCOL(y0, k[0], x0, x1, x3, x4) FCOL(y1, k[1], x1, x2, x4, x5) \
+	FCOL(y2, k[2], x2, x3, x5, x6) FCOL(y3, k[3], x3, x4, x6, x7) \
+	FCOL(y4, k[4], x4, x5, x7, x0) FCOL(y5, k[5], x5, x6, x0, x1) \
+	FCOL(y6, k[6], x6, x7, x1, x2) FCOL(y7, k[7], x7, x0, x2, x3)
+#define FLCOL(y, k, a, b, c, d) \
+	y = (k) ^ (word32) fbsub[B0(a)] ^ ((word32) fbsub[B1(b)] << 8) ^ \
+	    ((word32) fbsub[B2(c)] << 16) ^ ((word32) fbsub[B3(d)] << 24);
+#define FLROUND(k) \
+	FLCOL(y0, k[0], x0, x1, x3, x4) FLCOL(y1, k[1], x1, x2, x4, x5) \
+	FLCOL(y2, k[2], x2, x3, x5, x6) FLCOL(y3, k[3], x3, x4, x6, x7) \
+	FLCOL(y4, k[4], x4, x5, x7, x0) FLCOL(y5, k[5], x5, x6, x0, x1) \
+	FLCOL(y6, k[6], x6, x7, x1, x2) FLCOL(y7, k[7], x7, x0, x2, x3)
+
+#define RCOL(y, k, a, b, c, d) \
+	y = (k) ^ rt[0][B0(a)] ^ rt[1][B1(b)] ^ rt[2][B2(c)] ^ rt[3][B3(d)];
+#define RROUND(k) \
+	RCOL(y0, k[0], x0, x7, x5, x4) RCOL(y1, k[1], x1, x0, x6, x5) \
+	RCOL(y2, k[2], x2, x1, x7, x6) RCOL(y3, k[3], x3, x2, x0, x7) \
+	RCOL(y4, k[4], x4, x3, x1, x0) RCOL(y5, k[5], x5, x4, x2, x1) \
+	RCOL(y6, k[6], x6, x5, x3, x2) RCOL(y7, k[7], x7, x6, x4, x3)
+#define RLCOL(y, k, a, b, c, d) \
+	y = (k) ^ (word32) rbsub[B0(a)] ^ ((word32) rbsub[B1(b)] << 8) ^ \
+	    ((word32) rbsub[B2(c)] << 16) ^ ((word32) rbsub[B3(d)] << 24);
+#define RLROUND(k) \
+	RLCOL(y0, k[0], x0, x7, x5, x4) RLCOL(y1, k[1], x1, x0, x6, x5) \
+	RLCOL(y2, k[2], x2, x1, x7, x6) RLCOL(y3, k[3], x3, x2, x0, x7) \
+	RLCOL(y4, k[4], x4, x3, x1, x0) RLCOL(y5, k[5], x5, x4, x2, x1) \
+	RLCOL(y6, k[6], x6, x5, x3, x2) RLCOL(y7, k[7], x7, x6, x4, x3)
+
+#define LOAD(key) \
+	x0 = pack(&buff[0]) ^ key[0]; x1 = pack(&buff[4]) ^ key[1]; \
+	x2 = pack(&buff[8]) ^ key[2]; x3 = pack(&buff[12]) ^ key[3]; \
+	x4 = pack(&buff[16]) ^ key[4]; x5 = pack(&buff[20]) ^ key[5]; \
+	x6 = pack(&buff[24]) ^ key[6]; x7 = pack(&buff[28]) ^ key[7];
+#define NEXT \
+	x0 = y0; x1 = y1; x2 = y2; x3 = y3; x4 = y4; x5 = y5; x6 = y6; x7 = y7;
+#define STORE \
+	unpack(y0, &buff[0]); unpack(y1, &buff[4]); unpack(y2, &buff[8]); \
+	unpack(y3, &buff[12]); unpack(y4, &buff[16]); unpack(y5, &buff[20]); \
+	unpack(y6, &buff[24]); unpack(y7, &buff[28]);
+
+void _mcrypt_encrypt_blocks(RI * rinst, byte * buff, int blocks)
+{
+	word32 x0, x1, x2, x3, x4, x5, x6, x7;
+	word32 y0, y1, y2, y3, y4, y5, y6, y7;
+	const word32 *k;
+	int i;
+
+	for (; blocks > 0; blocks--, buff += 32) {
+		k = rinst->fkey;
+		LOAD(k)
+		for (i = 1, k += 8; i < rinst->Nr; i++, k += 8) {
+			FROUND(k)
+			NEXT
+		}
+		FLROUND(k)
+		STORE
+	}
+}
+
+void _mcrypt_decrypt_blocks(RI * rinst, byte * buff, int blocks)
+{
+	word32 x0, x1, x2, x3, x4, x5, x6, x7;
+	word32 y0, y1, y2, y3, y4, y5, y6, y7;
+	const word32 *k;
+	int i;
+
+	for (; blocks > 0; blocks--, buff += 32) {
+		k = rinst->rkey;
+		LOAD(k)
+		for (i = 1, k += 8; i < rinst->Nr; i++, k += 8) {
+			RROUND(k)
+			NEXT
+		}
+		RLROUND(k)
+		STORE
+	}
+}
+
 int _mcrypt_get_size()
 {
 	return sizeof(RI);
@@ -0,0 +1,229 @@
+/* Rijndael-128 with the AES-NI instructions
+
+   Same cipher as rijndael-128.c restricted to 16 bytes keys (AES-128),
+   so the output is byte-identical to rijndael_128_LTX__mcrypt_encrypt().
+   Blocks are processed eight at a time: the AES units are pipelined and
+   a single block leaves most of their slots empty.
+   The code is compiled only when the compiler knows the intrinsics and
+   used only when CPUID reports the instructions, otherwise
+   rijndael_128_aesni_supported() returns 0 and the caller must fall back
+   to the portable implementation.
+*/
+
+#include "rijndael.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+#define AESNI
+#define AESNI_TARGET __attribute__((target("aes,ssse3")))
+#elif (defined(_M_X64) || defined(_M_IX86)) && defined(_MSC_VER) && _MSC_VER >= 1500
+#include <intrin.h>
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+#define AESNI
+#define AESNI_TARGET
+#endif
+
+#define AESNI_ROUNDS 10
+#define AESNI_LANES 8	/* must match LANES() */
+
+#ifdef AESNI
+
+int rijndael_128_aesni_supported(void)
+{
+	static int supported = -1;
+
+	if (supported < 0) {
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 1);
+		supported = (info[2] >> 25) & (info[2] >> 9) & 1;	/* AES and SSSE3 */
+#else
+		unsigned int a, b, c, d;
+		supported = __get_cpuid(1, &a, &b, &c, &d) ? (c >> 25) & (c >> 9) & 1 : 0;	/* AES and SSSE3 */
+#endif
+	}
+	return supported;
+}
+
+#define EXPAND(k, rcon) \
+	t = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k, rcon), 0xff); \
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4)); \
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4)); \
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4)); \
+	k = _mm_xor_si128(k, t); \
+	_mm_storeu_si128((__m128i *) &rinst->ekey[16 * i++], k);
+
+AESNI_TARGET int rijndael_128_aesni_set_key(RI_AESNI * rinst, byte * key, int nk)
+{
+	__m128i k, t;
+	int i = 0;
+
+	if (nk != 16)
+		return -1;
+
+	k = _mm_loadu_si128((const __m128i *) key);
+	_mm_storeu_si128((__m128i *) &rinst->ekey[16 * i++], k);
+	EXPAND(k, 0x01) EXPAND(k, 0x02) EXPAND(k, 0x04) EXPAND(k, 0x08)
+	EXPAND(k, 0x10) EXPAND(k, 0x20) EXPAND(k, 0x40) EXPAND(k, 0x80)
+	EXPAND(k, 0x1b) EXPAND(k, 0x36)
+
+	/* equivalent inverse cipher: reversed keys, InvMixColumns on the inner ones */
+	memcpy(&rinst->dkey[0], &rinst->ekey[16 * AESNI_ROUNDS], 16);
+	for (i = 1; i < AESNI_ROUNDS; i++) {
+		k = _mm_loadu_si128((const __m128i *) &rinst->ekey[16 * (AESNI_ROUNDS - i)]);
+		_mm_storeu_si128((__m128i *) &rinst->dkey[16 * i], _mm_aesimc_si128(k));
+	}
+	memcpy(&rinst->dkey[16 * AESNI_ROUNDS], &rinst->ekey[0], 16);
+	return 0;
+}
+
+/* eight independent blocks per round keep the AES unit busy */
+#define LANES(op, k) \
+	b0 = op(b0, k); b1 = op(b1, k); b2 = op(b2, k); b3 = op(b3, k); \
+	b4 = op(b4, k); b5 = op(b5, k); b6 = op(b6, k); b7 = op(b7, k);
+
+#define PROCESS(round, last) \
+	for (i = 0; i <= AESNI_ROUNDS; i++) \
+		k[i] = _mm_loadu_si128((const __m128i *) &keys[16 * i]); \
+	for (; blocks >= AESNI_LANES; blocks -= AESNI_LANES, buff += 16 * AESNI_LANES) { \
+		b0 = _mm_loadu_si128((const __m128i *) &buff[0]); \
+		b1 = _mm_loadu_si128((const __m128i *) &buff[16]); \
+		b2 = _mm_loadu_si128((const __m128i *) &buff[32]); \
+		b3 = _mm_loadu_si128((const __m128i *) &buff[48]); \
+		b4 = _mm_loadu_si128((const __m128i *) &buff[64]); \
+		b5 = _mm_loadu_si128((const __m128i *) &buff[80]); \
+		b6 = _mm_loadu_si128((const __m128i *) &buff[96]); \
+		b7 = _mm_loadu_si128((const __m128i *) &buff[112]); \
+		LANES(_mm_xor_si128, k[0]) \
+		for (i = 1; i < AESNI_ROUNDS; i++) { \
+			LANES(round, k[i]) \
+		} \
+		LANES(last, k[AESNI_ROUNDS]) \
+		_mm_storeu_si128((__m128i *) &buff[0], b0); \
+		_mm_storeu_si128((__m128i *) &buff[16], b1); \
+		_mm_storeu_si128((__m128i *) &buff[32], b2); \
+		_mm_storeu_si128((__m128i *) &buff[48], b3); \
+		_mm_storeu_si128((__m128i *) &buff[64], b4); \
+		_mm_storeu_si128((__m128i *) &buff[80], b5); \
+		_mm_storeu_si128((__m128i *) &buff[96], b6); \
+		_mm_storeu_si128((__m128i *) &buff[112], b7); \
+	} \
+	for (; blocks > 0; blocks--, buff += 16) { \
+		b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) buff), k[0]); \
+		for (i = 1; i < AESNI_ROUNDS; i++) \
+			b0 = round(b0, k[i]); \
+		_mm_storeu_si128((__m128i *) buff, last(b0, k[AESNI_ROUNDS])); \
+	}
+
+AESNI_TARGET void rijndael_128_aesni_encrypt(RI_AESNI * rinst, byte * buff, int blocks)
+{
+	__m128i k[AESNI_ROUNDS + 1], b0, b1, b2, b3, b4, b5, b6, b7;
+	const byte *keys = rinst->ekey;
+	int i;
+
+	PROCESS(_mm_aesenc_si128, _mm_aesenclast_si128)
+}
+
+AESNI_TARGET void rijndael_128_aesni_decrypt(RI_AESNI * rinst, byte * buff, int blocks)
+{
+	__m128i k[AESNI_ROUNDS + 1], b0, b1, b2, b3, b4, b5, b6, b7;
+	const byte *keys = rinst->dkey;
+	int i;
+
+	PROCESS(_mm_aesdec_si128, _mm_aesdeclast_si128)
+}
+
+/* counter mode: buff is XORed with the keystream of the counter blocks made of
+   nonce[0..11] and the big endian counter. The counters live in registers,
+   byte swapped, and never go through memory */
+#define XORLOAD(b, n) \
+	b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i *) &buff[16 * n]));
+
+AESNI_TARGET void rijndael_128_aesni_ctr(RI_AESNI * rinst, const byte * nonce, word32 counter, byte * buff, int len)
+{
+	__m128i k[AESNI_ROUNDS + 1], b0, b1, b2, b3, b4, b5, b6, b7;
+	const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i ctr;
+	const byte *keys = rinst->ekey;
+	byte last[16];
+	int i;
+
+	for (i = 0; i <= AESNI_ROUNDS; i++)
+		k[i] = _mm_loadu_si128((const __m128i *) &keys[16 * i]);
+
+	ctr = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) nonce), swap);
+	ctr = _mm_insert_epi16(ctr, (int) (counter & 0xffff), 0);
+	ctr = _mm_insert_epi16(ctr, (int) (counter >> 16), 1);
+
+	for (; len >= 16 * AESNI_LANES; len -= 16 * AESNI_LANES, buff += 16 * AESNI_LANES) {
+		b0 = _mm_shuffle_epi8(ctr, swap);
+		b1 = _mm_shuffle_epi8(_mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 1)), swap);
+		b2 = _mm_shuffle_epi8(_mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 2)), swap);
+		b3 = _mm_shuffle_epi8(_mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 3)), swap);
+		b4 = _mm_shuffle_epi8(_mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 4)), swap);
+		b5 = _mm_shuffle_epi8(_mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 5)), swap);
+		b6 = _mm_shuffle_epi8(_mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 6)), swap);
+		b7 = _mm_shuffle_epi8(_mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 7)), swap);
+		ctr = _mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, AESNI_LANES));
+		LANES(_mm_xor_si128, k[0])
+		for (i = 1; i < AESNI_ROUNDS; i++) {
+			LANES(_mm_aesenc_si128, k[i])
+		}
+		LANES(_mm_aesenclast_si128, k[AESNI_ROUNDS])
+		XORLOAD(b0, 0) XORLOAD(b1, 1) XORLOAD(b2, 2) XORLOAD(b3, 3)
+		XORLOAD(b4, 4) XORLOAD(b5, 5) XORLOAD(b6, 6) XORLOAD(b7, 7)
+		_mm_storeu_si128((__m128i *) &buff[0], b0);
+		_mm_storeu_si128((__m128i *) &buff[16], b1);
+		_mm_storeu_si128((__m128i *) &buff[32], b2);
+		_mm_storeu_si128((__m128i *) &buff[48], b3);
+		_mm_storeu_si128((__m128i *) &buff[64], b4);
+		_mm_storeu_si128((__m128i *) &buff[80], b5);
+		_mm_storeu_si128((__m128i *) &buff[96], b6);
+		_mm_storeu_si128((__m128i *) &buff[112], b7);
+	}
+
+	for (; len > 0; len -= 16, buff += 16) {
+		b0 = _mm_xor_si128(_mm_shuffle_epi8(ctr, swap), k[0]);
+		ctr = _mm_add_epi32(ctr, _mm_set_epi32(0, 0, 0, 1));
+		for (i = 1; i < AESNI_ROUNDS; i++)
+			b0 = _mm_aesenc_si128(b0, k[i]);
+		b0 = _mm_aesenclast_si128(b0, k[AESNI_ROUNDS]);
+		if (len >= 16) {
+			XORLOAD(b0, 0)
+			_mm_storeu_si128((__m128i *) buff, b0);
+		} else {
+			_mm_storeu_si128((__m128i *) last, b0);
+			for (i = 0; i < len; i++)
+				buff[i] ^= last[i];
+		}
+	}
+}
+
+#else
+
+int rijndael_128_aesni_supported(void)
+{
+	return 0;
+}
+
+int rijndael_128_aesni_set_key(RI_AESNI * rinst, byte * key, int nk)
+{
+	return -1;
+}
+
+void rijndael_128_aesni_encrypt(RI_AESNI * rinst, byte * buff, int blocks)
+{
+}
+
+void rijndael_128_aesni_decrypt(RI_AESNI * rinst, byte * buff, int blocks)
+{
+}
+
+void rijndael_128_aesni_ctr(RI_AESNI * rinst, const byte * nonce, word32 counter, byte * buff, int len)
+{
+}
+
+#endif
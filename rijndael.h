@@ -48,6 +48,12 @@ typedef struct rijndael_instance
 	word32 rkey[120];
 } RI;
 
+typedef struct rijndael_aesni_instance 
+{
+	byte ekey[176];
+	byte dkey[176];
+} RI_AESNI;
+
 #ifndef WIN32
 #ifdef __cplusplus
 extern "C" 
@@ -59,6 +65,13 @@ extern "C"
         int rijndael_256_LTX__mcrypt_set_key(RI * rinst, byte * key, int nk);
         void rijndael_256_LTX__mcrypt_encrypt(RI * rinst, byte * buff);
         void rijndael_256_LTX__mcrypt_decrypt(RI * rinst, byte * buff);
+        void rijndael_256_LTX__mcrypt_encrypt_blocks(RI * rinst, byte * buff, int blocks);
+        void rijndael_256_LTX__mcrypt_decrypt_blocks(RI * rinst, byte * buff, int blocks);
+        int rijndael_128_aesni_supported(void);
+        int rijndael_128_aesni_set_key(RI_AESNI * rinst, byte * key, int nk);
+        void rijndael_128_aesni_encrypt(RI_AESNI * rinst, byte * buff, int blocks);
+        void rijndael_128_aesni_decrypt(RI_AESNI * rinst, byte * buff, int blocks);
+        void rijndael_128_aesni_ctr(RI_AESNI * rinst, const byte * nonce, word32 counter, byte * buff, int len);
 #ifdef __cplusplus
 }
 #endif